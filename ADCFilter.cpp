@@ -0,0 +1,154 @@
+/*
+ * ADCFilter.cpp
+ *
+ * Configurable smoothing stage for one analog channel
+ *
+Copyright (c) 2013 Collin Kidder, Michael Neuweiler, Charles Galpin
+
+Permission is hereby granted, free of charge, to any person obtaining
+a copy of this software and associated documentation files (the
+"Software"), to deal in the Software without restriction, including
+without limitation the rights to use, copy, modify, merge, publish,
+distribute, sublicense, and/or sell copies of the Software, and to
+permit persons to whom the Software is furnished to do so, subject to
+the following conditions:
+
+The above copyright notice and this permission notice shall be included
+in all copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.
+IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY
+CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT,
+TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE
+SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+
+ */
+
+#include "ADCFilter.h"
+
+ADCFilter::ADCFilter() {
+	setup(ADC_FILTER_NONE, 0, 0);
+}
+
+/*
+ * Select the filter. Out of range parameters are clamped to the nearest valid value,
+ * an even median size is rounded down to the next odd one.
+ */
+void ADCFilter::setup(uint8_t type, uint8_t param, uint8_t medianSize) {
+	switch (type) {
+	case ADC_FILTER_BOXCAR:
+		if (param < 1)
+			param = 1;
+		if (param > ADC_BOXCAR_MAX)
+			param = ADC_BOXCAR_MAX;
+		break;
+	case ADC_FILTER_IIR:
+		if (param < 1)
+			param = 1;
+		if (param > 15)
+			param = 15;
+		break;
+	default:
+		type = ADC_FILTER_NONE;
+		param = 0;
+		break;
+	}
+	if (medianSize > ADC_MEDIAN_MAX)
+		medianSize = ADC_MEDIAN_MAX;
+	if (medianSize < 3)
+		medianSize = 0;
+	else if ((medianSize & 1) == 0)
+		medianSize--;
+
+	this->type = type;
+	this->param = param;
+	this->medianSize = medianSize;
+	reset();
+}
+
+/*
+ * Forget all history, the next value primes the filter.
+ */
+void ADCFilter::reset() {
+	value = 0;
+	medianPos = medianFill = 0;
+	boxcarSum = 0;
+	boxcarPos = boxcarFill = 0;
+	iirState = 0;
+	primed = false;
+}
+
+/*
+ * Feed a new (offset and gain corrected) value into the filter and return the filtered value.
+ */
+uint16_t ADCFilter::process(uint16_t input) {
+	if (medianSize > 0)
+		input = rejectSpikes(input);
+
+	switch (type) {
+	case ADC_FILTER_BOXCAR:
+		// until the window is filled up, average over what we have
+		if (boxcarFill < param)
+			boxcarFill++;
+		else
+			boxcarSum -= boxcar[boxcarPos];
+		boxcar[boxcarPos] = input;
+		boxcarSum += input;
+		boxcarPos = (boxcarPos + 1) % param;
+		value = boxcarSum / boxcarFill;
+		break;
+	case ADC_FILTER_IIR:
+		if (!primed)
+			iirState = (int32_t) input << ADC_IIR_FRACTION; // don't ramp up from zero
+		else
+			iirState += (((int32_t) input << ADC_IIR_FRACTION) - iirState) >> param;
+		value = (iirState + (1 << (ADC_IIR_FRACTION - 1))) >> ADC_IIR_FRACTION;
+		break;
+	default:
+		value = input;
+		break;
+	}
+	primed = true;
+	return value;
+}
+
+/*
+ * Return the median of the last medianSize inputs (fewer while starting up).
+ * The window is tiny so a straight insertion sort of a copy is cheapest.
+ */
+uint16_t ADCFilter::rejectSpikes(uint16_t input) {
+	uint16_t sorted[ADC_MEDIAN_MAX];
+	uint16_t v;
+	int i, j;
+
+	median[medianPos] = input;
+	medianPos = (medianPos + 1) % medianSize;
+	if (medianFill < medianSize)
+		medianFill++;
+
+	for (i = 0; i < medianFill; i++) {
+		v = median[i];
+		for (j = i; j > 0 && sorted[j - 1] > v; j--)
+			sorted[j] = sorted[j - 1];
+		sorted[j] = v;
+	}
+	return sorted[medianFill / 2];
+}
+
+uint16_t ADCFilter::getValue() {
+	return value;
+}
+
+uint8_t ADCFilter::getType() {
+	return type;
+}
+
+uint8_t ADCFilter::getParam() {
+	return param;
+}
+
+uint8_t ADCFilter::getMedianSize() {
+	return medianSize;
+}
@@ -0,0 +1,80 @@
+/*
+ * ADCFilter.h
+ *
+ * Configurable smoothing stage for one analog channel
+ *
+Copyright (c) 2013 Collin Kidder, Michael Neuweiler, Charles Galpin
+
+Permission is hereby granted, free of charge, to any person obtaining
+a copy of this software and associated documentation files (the
+"Software"), to deal in the Software without restriction, including
+without limitation the rights to use, copy, modify, merge, publish,
+distribute, sublicense, and/or sell copies of the Software, and to
+permit persons to whom the Software is furnished to do so, subject to
+the following conditions:
+
+The above copyright notice and this permission notice shall be included
+in all copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.
+IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY
+CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT,
+TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE
+SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+
+ */
+
+#ifndef ADCFILTER_H_
+#define ADCFILTER_H_
+
+#include <Arduino.h>
+#include "config.h"
+
+// filter types as stored in EESYS_ADCx_FILTER
+enum ADCFilterType {
+	ADC_FILTER_NONE = 0, // pass values through
+	ADC_FILTER_BOXCAR = 1, // moving average over "param" values (1 - ADC_BOXCAR_MAX)
+	ADC_FILTER_IIR = 2 // first order low pass, y += (x - y) / 2^param (param 1 - 15)
+};
+
+#define ADC_BOXCAR_MAX	64
+#define ADC_MEDIAN_MAX	7
+#define ADC_IIR_FRACTION	8 // fractional bits of the IIR state
+
+/*
+ * Every new value first passes an optional median-of-N spike rejector (N odd, up to
+ * ADC_MEDIAN_MAX, 0 or 1 disables it) and then the selected filter. The boxcar keeps
+ * a running sum so an update is O(1) regardless of its length.
+ */
+class ADCFilter {
+public:
+	ADCFilter();
+	void setup(uint8_t type, uint8_t param, uint8_t medianSize);
+	void reset();
+	uint16_t process(uint16_t input);
+	uint16_t getValue();
+	uint8_t getType();
+	uint8_t getParam();
+	uint8_t getMedianSize();
+
+private:
+	uint8_t type;
+	uint8_t param;
+	uint16_t value; // last output
+
+	uint16_t median[ADC_MEDIAN_MAX]; // last inputs in arrival order
+	uint8_t medianSize, medianPos, medianFill;
+
+	uint16_t boxcar[ADC_BOXCAR_MAX];
+	uint32_t boxcarSum;
+	uint8_t boxcarPos, boxcarFill;
+
+	int32_t iirState; // output scaled by 2^ADC_IIR_FRACTION
+	boolean primed; // false until the first value was processed
+
+	uint16_t rejectSpikes(uint16_t input);
+};
+
+#endif /* ADCFILTER_H_ */
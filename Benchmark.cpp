@@ -0,0 +1,126 @@
+/*
+ * Benchmark.cpp
+ *
+ * Micro benchmarks of the hot paths, run on the target from the console
+ *
+Copyright (c) 2013 Collin Kidder, Michael Neuweiler, Charles Galpin
+
+Permission is hereby granted, free of charge, to any person obtaining
+a copy of this software and associated documentation files (the
+"Software"), to deal in the Software without restriction, including
+without limitation the rights to use, copy, modify, merge, publish,
+distribute, sublicense, and/or sell copies of the Software, and to
+permit persons to whom the Software is furnished to do so, subject to
+the following conditions:
+
+The above copyright notice and this permission notice shall be included
+in all copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.
+IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY
+CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT,
+TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE
+SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+
+ */
+
+#include "Benchmark.h"
+#include "MemCache.h"
+#include "TickHandler.h"
+#include "Logger.h"
+#include "sys_io.h"
+
+extern MemCache *memCache;
+
+struct BenchmarkResult {
+	uint32_t best;
+	uint32_t total;
+	uint16_t runs;
+};
+
+static void benchmarkStart(BenchmarkResult *result) {
+	result->best = 0xFFFFFFFF;
+	result->total = 0;
+	result->runs = 0;
+}
+
+static void benchmarkAdd(BenchmarkResult *result, uint32_t cycles) {
+	if (cycles < result->best) result->best = cycles;
+	result->total += cycles;
+	result->runs++;
+}
+
+static void benchmarkPrint(const char *name, BenchmarkResult *result) {
+	Logger::console("%s: best %l mean %l cycles (%l runs)", name, result->best, result->total / result->runs, result->runs);
+}
+
+/*
+ * Run all benchmarks, this blocks the main loop for about a second.
+ */
+void runBenchmarks() {
+	BenchmarkResult result;
+	uint8_t page[256];
+	uint32_t value, start;
+	uint16_t i;
+
+	Logger::console("Benchmarks (cycles, 84 per us):");
+
+	benchmarkStart(&result);
+	memCache->Read(EE_LKG_OFFSET + EE_SYSTEM_START, &value); // make sure the page is cached
+	for (i = 0; i < BENCHMARK_RUNS; i++) {
+		start = DWT->CYCCNT;
+		memCache->Read(EE_LKG_OFFSET + EE_SYSTEM_START, &value);
+		benchmarkAdd(&result, DWT->CYCCNT - start);
+	}
+	benchmarkPrint("cache hit, 4 bytes", &result);
+
+	benchmarkStart(&result);
+	for (i = 0; i < BENCHMARK_RUNS; i++) {
+		start = DWT->CYCCNT;
+		memCache->Read(EE_LKG_OFFSET + EE_SYSTEM_START, page, sizeof(page));
+		benchmarkAdd(&result, DWT->CYCCNT - start);
+	}
+	benchmarkPrint("cache hit, 256 bytes", &result);
+
+	benchmarkStart(&result);
+	for (i = 0; i < BENCHMARK_SLOW_RUNS; i++) {
+		uint32_t address = EE_LKG_OFFSET + EE_SYSTEM_START + 256 * (i % 2);
+		memCache->InvalidateAddress(address);
+		start = DWT->CYCCNT;
+		memCache->Read(address, &value);
+		benchmarkAdd(&result, DWT->CYCCNT - start);
+	}
+	benchmarkPrint("cache miss (page read over TWI)", &result);
+
+	benchmarkStart(&result);
+	for (i = 0; i < BENCHMARK_RUNS; i++) {
+		start = DWT->CYCCNT;
+		TickHandler::getInstance()->process();
+		benchmarkAdd(&result, DWT->CYCCNT - start);
+	}
+	benchmarkPrint("tick queue process() (best = empty queue)", &result);
+
+	benchmarkStart(&result);
+	for (i = 0; i < BENCHMARK_RUNS; i++)
+		benchmarkAdd(&result, measureADCBlock());
+	benchmarkPrint("ADC block (sum + filter)", &result);
+
+	benchmarkStart(&result);
+	for (i = 0; i < BENCHMARK_RUNS; i++) {
+		start = DWT->CYCCNT;
+		Logger::debug("benchmark %i %X %s", i, value, "filtered");
+		benchmarkAdd(&result, DWT->CYCCNT - start);
+	}
+	benchmarkPrint(Logger::isDebug() ? "log line (debug is on, formatted)" : "log call below the log level", &result);
+
+	benchmarkStart(&result);
+	for (i = 0; i < BENCHMARK_SLOW_RUNS; i++) {
+		start = DWT->CYCCNT;
+		Logger::console("benchmark %i %X %s", i, value, "formatted");
+		benchmarkAdd(&result, DWT->CYCCNT - start);
+	}
+	benchmarkPrint("log line (format + queue)", &result);
+	Logger::console("see 'T' for the tick latency per observer and 'C' for the cache timing of real traffic");
+}
@@ -0,0 +1,50 @@
+/*
+ * Benchmark.h
+ *
+ * Micro benchmarks of the hot paths, run on the target from the console
+ *
+Copyright (c) 2013 Collin Kidder, Michael Neuweiler, Charles Galpin
+
+Permission is hereby granted, free of charge, to any person obtaining
+a copy of this software and associated documentation files (the
+"Software"), to deal in the Software without restriction, including
+without limitation the rights to use, copy, modify, merge, publish,
+distribute, sublicense, and/or sell copies of the Software, and to
+permit persons to whom the Software is furnished to do so, subject to
+the following conditions:
+
+The above copyright notice and this permission notice shall be included
+in all copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.
+IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY
+CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT,
+TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE
+SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+
+ */
+
+#ifndef BENCHMARK_H_
+#define BENCHMARK_H_
+
+#include <Arduino.h>
+#include "config.h"
+
+/*
+ * Every benchmark repeats one operation and reports the cycles it took (DWT cycle counter,
+ * 84 per microsecond), the best run and the mean. Interrupts stay on, so the mean includes
+ * what the rest of the system costs meanwhile. Run it before and after a change to the
+ * cache, the tick queue, the ADC processing or the Logger to catch regressions.
+ * The cache misses read the last known good system section, which nothing writes while
+ * running, so invalidating its pages can't lose data.
+ * "make -C host run" runs the same suite on the simulated HAL, plus what needs the
+ * simulation (EEPROM wear, tick latency under load), see host/HostBenchmark.cpp.
+ */
+#define BENCHMARK_RUNS		100 // repetitions of the cheap operations
+#define BENCHMARK_SLOW_RUNS	8 // repetitions of the ones which go to the EEPROM
+
+void runBenchmarks();
+
+#endif /* BENCHMARK_H_ */
@@ -56,6 +56,17 @@ bool Device::isEnabled() {
 	return prefsHandler->isEnabled();
 }
 
+//change the enabled state, stored in EEPROM and applied to message dispatch right away.
+//A device which was disabled at start up never got MSG_STARTUP, so it is set up now.
+void Device::setEnabled(bool enabled) {
+	bool wasEnabled = isEnabled();
+
+	prefsHandler->setEnabledStatus(enabled);
+	DeviceManager::getInstance()->deviceChanged(this);
+	if (enabled && !wasEnabled)
+		setup();
+}
+
 void Device::handleMessage(uint32_t msgType, void* message) {
 	switch (msgType) {
 	case MSG_STARTUP:
@@ -56,6 +56,7 @@ public:
 	virtual DeviceId getId();
 	void handleTick();
 	bool isEnabled();
+	void setEnabled(bool enabled);
 	virtual uint32_t getTickInterval();
 	char* getCommonName();
 
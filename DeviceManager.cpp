@@ -36,6 +36,7 @@
  */
 
 #include "DeviceManager.h"
+#include "SensirionSensor.h"
 
 DeviceManager *DeviceManager::deviceManager = NULL;
 
@@ -45,6 +46,8 @@ DeviceManager::DeviceManager() {
 	//motorController = NULL;
 	for (int i = 0; i < CFG_DEV_MGR_MAX_DEVICES; i++)
 		devices[i] = NULL;
+	numIndexed = 0;
+	indexValid = false;
 }
 
 /*
@@ -68,6 +71,7 @@ void DeviceManager::addDevice(Device *device) {
 		int8_t i = findDevice(NULL);
 		if (i != -1) {
 			devices[i] = device;
+			indexValid = false;
 		} else {
 			Logger::error("unable to register device, max number of devices reached.");
 		}
@@ -91,18 +95,17 @@ void DeviceManager::addDevice(Device *device) {
  * Remove the specified device from the list of registered devices
  */
 void DeviceManager::removeDevice(Device *device) {
-	int8_t i = findDevice(NULL);
+	int8_t i = findDevice(device);
 	if (i != -1)
 		devices[i] = NULL;
+	indexValid = false;
 	switch (device->getType()) {
 	case DEVICE_HUMIDITY:
-		
-		break;
 	case DEVICE_DIFF_PRES:
-		
-		break;
 	case DEVICE_MASS_FLOW:
-		
+		SensorScheduler::getInstance()->remove((SensirionSensor *)device);
+		break;
+	default:
 		break;
 	}
 }
@@ -134,22 +137,39 @@ void DeviceManager::removeDevice(Device *device) {
  */
 void DeviceManager::sendMessage(DeviceType devType, DeviceId devId, uint32_t msgType, void* message)
 {
-	for (int i = 0; i < CFG_DEV_MGR_MAX_DEVICES; i++)
-	{
-		if (devices[i] && devices[i]->isEnabled()) //does this object exist and is it enabled?
-		{
-			if (devType == DEVICE_ANY || devType == devices[i]->getType())
-			{
-				if (devId == INVALID || devId == devices[i]->getId())
-				{
-					Logger::debug("Sending msg to device with ID %X", devices[i]->getId());
-					devices[i]->handleMessage(msgType, message);
-				}
-			}
-		}
+	uint8_t first, last;
+	int8_t i;
+
+	if (!indexValid) buildIndex();
+	if (devType > DEVICE_NONE) return;
+
+	if (devId != INVALID) { //targetted, look the device up by id
+		i = findIndexedId(devId);
+		if (i != -1 && typeEnabled[i] && (devType == DEVICE_ANY || (i >= typeStart[devType] && i < typeStart[devType + 1])))
+			typeDevices[i]->handleMessage(msgType, message);
+		return;
+	}
+
+	if (devType == DEVICE_ANY) {
+		first = 0;
+		last = numIndexed;
+	} else {
+		first = typeStart[devType];
+		last = typeStart[devType + 1];
+	}
+	for (i = first; i < last; i++) {
+		if (typeEnabled[i]) typeDevices[i]->handleMessage(msgType, message);
 	}
 }
 
+/*
+ To be called after a device's enabled state (or type/id) changed, so the index is rebuilt.
+ */
+void DeviceManager::deviceChanged(Device *device)
+{
+	indexValid = false;
+}
+
 void DeviceManager::setParameter(DeviceType deviceType, DeviceId deviceId, uint32_t msgType, char *key, char *value) {
 	char *params[] = { key, value };
 	sendMessage(deviceType, deviceId, msgType, params);
@@ -157,7 +177,7 @@ void DeviceManager::setParameter(DeviceType deviceType, DeviceId deviceId, uint3
 
 void DeviceManager::setParameter(DeviceType deviceType, DeviceId deviceId, uint32_t msgType, char *key, uint32_t value) {
 	char buffer[15];
-	sprintf(buffer, "%lu", value);
+	sprintf(buffer, "%lu", (unsigned long) value);
 	setParameter(deviceType, deviceId, msgType, key, buffer);
 }
 
@@ -180,15 +200,26 @@ device. Normally this would be a bad idea because it sort of breaks the OOP desi
 but sometimes you can't help it. 
 */
 Device *DeviceManager::getDeviceByID(DeviceId id)
+{
+	int8_t i;
+
+	if (!indexValid) buildIndex();
+	i = findIndexedId(id);
+	if (i != -1) return typeDevices[i];
+	Logger::debug("getDeviceByID - No device with ID: %X", (int)id);
+	return 0; //NULL!
+}
+
+/*
+Find the device behind a TickObserver (e.g. for the TickHandler profile), NULL
+if the observer isn't a registered device.
+*/
+Device *DeviceManager::getDeviceByObserver(TickObserver *observer)
 {
 	for (int i = 0; i < CFG_DEV_MGR_MAX_DEVICES; i++)
 	{
-		if (devices[i]) 
-		{
-			if (devices[i]->getId() == id) return devices[i];
-		}
+		if (devices[i] && (TickObserver *)devices[i] == observer) return devices[i];
 	}
-	Logger::debug("getDeviceByID - No device with ID: %X", (int)id);
 	return 0; //NULL!
 }
 
@@ -198,11 +229,10 @@ a given type.
 */
 Device *DeviceManager::getDeviceByType(DeviceType type)
 {
-	for (int i = 0; i < CFG_DEV_MGR_MAX_DEVICES; i++)
-	{
-		if (devices[i] && devices[i]->isEnabled()) 
-		{
-			if (devices[i]->getType() == type) return devices[i];
+	if (!indexValid) buildIndex();
+	if (type <= DEVICE_NONE) {
+		for (int i = typeStart[type]; i < typeStart[type + 1]; i++) {
+			if (typeEnabled[i]) return typeDevices[i];
 		}
 	}
 	Logger::debug("getDeviceByType - No devices of type: %X", (int)type);
@@ -225,12 +255,63 @@ int8_t DeviceManager::findDevice(Device *device) {
  * Count the number of registered devices of a certain type.
  */
 uint8_t DeviceManager::countDeviceType(DeviceType deviceType) {
-	uint8_t count = 0;
-	for (int i = 0; i < CFG_DEV_MGR_MAX_DEVICES; i++) {
-		if (devices[i]->getType() == deviceType)
-			count++;
+	if (!indexValid) buildIndex();
+	if (deviceType > DEVICE_NONE) return 0;
+	return typeStart[deviceType + 1] - typeStart[deviceType];
+}
+
+/*
+ * Sort the registered devices by type (counting sort, types are small numbers) and
+ * their positions by id, caching type, id and enabled state so lookups and dispatch
+ * don't need any virtual calls. Unknown types are filed under DEVICE_NONE.
+ */
+void DeviceManager::buildIndex() {
+	uint8_t type[CFG_DEV_MGR_MAX_DEVICES];
+	uint8_t pos[DEVICE_NONE + 1];
+	uint8_t i, j, t;
+	DeviceId id;
+
+	memset(typeStart, 0, sizeof(typeStart));
+	for (i = 0; i < CFG_DEV_MGR_MAX_DEVICES; i++) {
+		if (!devices[i]) continue;
+		t = devices[i]->getType();
+		type[i] = (t > DEVICE_NONE ? DEVICE_NONE : t);
+		typeStart[type[i] + 1]++;
+	}
+	for (t = 1; t <= DEVICE_NONE + 1; t++) typeStart[t] += typeStart[t - 1];
+	numIndexed = typeStart[DEVICE_NONE + 1];
+
+	memcpy(pos, typeStart, sizeof(pos));
+	for (i = 0; i < CFG_DEV_MGR_MAX_DEVICES; i++) {
+		if (!devices[i]) continue;
+		j = pos[type[i]]++;
+		typeDevices[j] = devices[i];
+		typeIds[j] = devices[i]->getId();
+		typeEnabled[j] = devices[i]->isEnabled();
 	}
-	return count;
+
+	//insertion sort, there are only a handful of devices
+	for (i = 0; i < numIndexed; i++) {
+		id = typeIds[i];
+		for (j = i; j > 0 && typeIds[idOrder[j - 1]] > id; j--) idOrder[j] = idOrder[j - 1];
+		idOrder[j] = i;
+	}
+	indexValid = true;
+}
+
+/*
+ * Binary search for an id, returns its position in typeDevices or -1.
+ */
+int8_t DeviceManager::findIndexedId(DeviceId id) {
+	int8_t low = 0, high = numIndexed - 1, mid;
+
+	while (low <= high) {
+		mid = (low + high) / 2;
+		if (typeIds[idOrder[mid]] == id) return idOrder[mid];
+		if (typeIds[idOrder[mid]] < id) low = mid + 1;
+		else high = mid - 1;
+	}
+	return -1;
 }
 
 void DeviceManager::printDeviceList() {
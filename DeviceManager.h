@@ -41,6 +41,7 @@ public:
 	void removeDevice(Device *device);
 
 	void sendMessage(DeviceType deviceType, DeviceId deviceId, uint32_t msgType, void* message);
+	void deviceChanged(Device *device);
 	void setParameter(DeviceType deviceType, DeviceId deviceId, uint32_t msgType, char *key, char *value);
 	void setParameter(DeviceType deviceType, DeviceId deviceId, uint32_t msgType, char *key, uint32_t value);
 	uint8_t getNumBMS();
@@ -49,6 +50,7 @@ public:
 
 	Device *getDeviceByID(DeviceId);
 	Device *getDeviceByType(DeviceType);
+	Device *getDeviceByObserver(TickObserver *);
 	void printDeviceList();
         void updateWifi();
        Device *updateWifiByID(DeviceId);
@@ -61,9 +63,23 @@ private:
 
 	Device *devices[CFG_DEV_MGR_MAX_DEVICES];
 
+	/*
+	 * Lookup index, rebuilt on the first access after a device was added, removed,
+	 * enabled or disabled. Devices can't be indexed in addDevice() as it is called
+	 * from the Device constructor, before getType() and getId() work.
+	 */
+	Device *typeDevices[CFG_DEV_MGR_MAX_DEVICES]; //all devices, grouped by type
+	DeviceId typeIds[CFG_DEV_MGR_MAX_DEVICES]; //their ids
+	bool typeEnabled[CFG_DEV_MGR_MAX_DEVICES]; //and enabled state
+	uint8_t typeStart[DEVICE_NONE + 2]; //devices of type t are at typeStart[t] .. typeStart[t + 1] - 1
+	uint8_t idOrder[CFG_DEV_MGR_MAX_DEVICES]; //positions in typeDevices sorted by id
+	uint8_t numIndexed;
+	bool indexValid;
 
 	int8_t findDevice(Device *device);
 	uint8_t countDeviceType(DeviceType deviceType);
+	void buildIndex();
+	int8_t findIndexedId(DeviceId id);
 };
 
 #endif
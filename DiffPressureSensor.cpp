@@ -0,0 +1,60 @@
+/*
+ * DiffPressureSensor.cpp
+ *
+ * Driver for the Sensirion SDP3x differential pressure sensors
+ *
+Copyright (c) 2013 Collin Kidder, Michael Neuweiler, Charles Galpin
+
+Permission is hereby granted, free of charge, to any person obtaining
+a copy of this software and associated documentation files (the
+"Software"), to deal in the Software without restriction, including
+without limitation the rights to use, copy, modify, merge, publish,
+distribute, sublicense, and/or sell copies of the Software, and to
+permit persons to whom the Software is furnished to do so, subject to
+the following conditions:
+
+The above copyright notice and this permission notice shall be included
+in all copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.
+IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY
+CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT,
+TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE
+SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+
+ */
+
+#include "DiffPressureSensor.h"
+
+DiffPressureSensor::DiffPressureSensor() : SensirionSensor() {
+	prefsHandler = new PrefHandler(DIFF_PRES, true); //the sensors are what this board is for
+	commonName = "Differential pressure (SDP3x)";
+	address = SDP3X_ADDRESS;
+	words = 3; //pressure, temperature, pressure scale
+}
+
+//A start is refused while the continuous mode is running, so stop it first (e.g. after a restart of ours).
+bool DiffPressureSensor::startMeasurement() {
+	sendCommand(SDP3X_STOP);
+	delayMicroseconds(500); //the part needs this before it takes the next command
+	return sendCommand(SDP3X_START_DIFF_PRES_AVG);
+}
+
+void DiffPressureSensor::publish(const uint16_t *data, uint32_t timestamp) {
+	if (data[2] == 0) return; //no scale, can't be a real measurement
+	Sample *sample = SampleBus::getInstance()->claim(TOPIC_DIFF_PRES);
+	sample->value[0] = (int32_t)(int16_t)data[0] * 100 / data[2];
+	sample->value[1] = (int32_t)(int16_t)data[1] * 100 / SDP3X_TEMP_SCALE;
+	sample->count = 2;
+	SampleBus::getInstance()->publish(TOPIC_DIFF_PRES, DIFF_PRES, timestamp);
+}
+
+DeviceType DiffPressureSensor::getType() {
+	return DEVICE_DIFF_PRES;
+}
+
+DeviceId DiffPressureSensor::getId() {
+	return DIFF_PRES;
+}
@@ -0,0 +1,56 @@
+/*
+ * DiffPressureSensor.h
+ *
+ * Driver for the Sensirion SDP3x differential pressure sensors
+ *
+Copyright (c) 2013 Collin Kidder, Michael Neuweiler, Charles Galpin
+
+Permission is hereby granted, free of charge, to any person obtaining
+a copy of this software and associated documentation files (the
+"Software"), to deal in the Software without restriction, including
+without limitation the rights to use, copy, modify, merge, publish,
+distribute, sublicense, and/or sell copies of the Software, and to
+permit persons to whom the Software is furnished to do so, subject to
+the following conditions:
+
+The above copyright notice and this permission notice shall be included
+in all copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.
+IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY
+CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT,
+TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE
+SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+
+ */
+
+#ifndef DIFFPRESSURESENSOR_H_
+#define DIFFPRESSURESENSOR_H_
+
+#include <Arduino.h>
+#include "config.h"
+#include "SensirionSensor.h"
+
+#define SDP3X_ADDRESS		0x21 // 0x22 and 0x23 depending on the ADDR pin
+#define SDP3X_START_DIFF_PRES_AVG	0x3615 // continuous mode, compensated for differential pressure, averaged between reads
+#define SDP3X_STOP			0x3FF9
+#define SDP3X_TEMP_SCALE	200 // per deg C. The pressure scale (per Pa) comes with every measurement
+
+/*
+ * The part measures continuously every 0.5ms and averages until it is read, so it is
+ * read every cycle. Publishes TOPIC_DIFF_PRES.
+ */
+class DiffPressureSensor : public SensirionSensor {
+public:
+	DiffPressureSensor();
+	DeviceType getType();
+	DeviceId getId();
+
+protected:
+	bool startMeasurement();
+	void publish(const uint16_t *data, uint32_t timestamp);
+};
+
+#endif /* DIFFPRESSURESENSOR_H_ */
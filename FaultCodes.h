@@ -87,6 +87,9 @@ enum FAULTCODE {
 
 	//There was a problem communicating with an external brake module
 	FAULT_BRAKE_COMM = 0x0B60, //P0B60
+
+	//A sensor doesn't answer or keeps sending data with bad CRCs
+	FAULT_SENSOR_COMM = 0x0E60, //P0E60
 	
 	//The +12V battery or DC/DC system seems to have excessively high voltage
 	FAULT_12V_BATT_HIGH = 0x0A01, //P0A01
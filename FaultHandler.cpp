@@ -26,9 +26,14 @@ SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
 
 #include "FaultHandler.h"
 #include "eeprom_layout.h"
+#include "TimeBase.h"
 
-  FaultHandler::FaultHandler()
+  FaultHandler::FaultHandler() : runtime(EE_FAULT_LOG + EEFAULT_RUNTIME_SLOTS, CFG_FAULT_RUNTIME_SLOTS, WEAR_COUNTER_PAGE_STRIDE, CFG_FAULT_RUNTIME_INTERVAL)
   {
+	  faultReadPointer = faultWritePointer = faultCursor = 0;
+	  unackedMask = ongoingMask = dirtyMask = 0;
+	  unackedCount = ongoingCount = 0;
+	  headerDirty = staged = false;
   }
 
   void FaultHandler::setup() 
@@ -45,17 +50,23 @@ SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
   }
 
 
-  //Every tick update the global time and save it to EEPROM (delayed saving)
+  //Every tick update the global time, the counter saves it to EEPROM every CFG_FAULT_RUNTIME_INTERVAL.
+  //Staged fault changes are committed once the oldest is CFG_FAULT_COMMIT_LATENCY old.
   void FaultHandler::handleTick() 
   {
-	  globalTime = baseTime + (millis() / 100);
-	  memCache->Write(EE_FAULT_LOG + EEFAULT_RUNTIME, globalTime);
+	  globalTime = baseTime + (TimeBase::getInstance()->getMillis() / 100);
+	  runtime.set(globalTime);
+	  runtime.poll();
+	  if (staged && (millis() - stagedTime) >= CFG_FAULT_COMMIT_LATENCY) commit();
   }
 
+  //Look for the previous fault record. If it's the same fault the record is just updated,
+  //otherwise a new one is appended at the write pointer (overwriting the oldest).
+  //Nothing is written to EEPROM here, the change is staged and committed by handleTick().
   uint16_t FaultHandler::raiseFault(uint16_t device, uint16_t code) 
   {
-	  bool incPtr = false;
-	  globalTime = baseTime + (millis() / 100);
+	  uint16_t idx;
+	  globalTime = baseTime + (TimeBase::getInstance()->getMillis() / 100);
 
 	  uint16_t tempIdx = faultWritePointer;
 	  if (tempIdx > 0) tempIdx--;
@@ -64,40 +75,45 @@ SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
 	  //if this is the same as the previously registered fault then just update the time
 	  if (faultList[tempIdx].device == device && faultList[tempIdx].faultCode == code) 
 	  {
-		  faultList[tempIdx].timeStamp = globalTime;
+		  idx = tempIdx;
+		  faultList[idx].timeStamp = globalTime;
 	  } 
 	  else 
 	  {
-		  faultList[faultWritePointer].timeStamp = globalTime;
-		  faultList[faultWritePointer].ack = false;
-		  faultList[faultWritePointer].device = device;
-		  faultList[faultWritePointer].faultCode = code;
-		  faultList[faultWritePointer].ongoing = false;
-		  incPtr = true;
+		  idx = faultWritePointer;
+		  forget(idx); //the record being overwritten no longer counts
+		  faultList[idx].timeStamp = globalTime;
+		  faultList[idx].device = device;
+		  faultList[idx].faultCode = code;
+		  faultList[idx].ack = false;
+		  unackedMask |= FAULT_BIT(idx);
+		  unackedCount++;
+		  faultWritePointer = (faultWritePointer + 1) % CFG_FAULT_HISTORY_SIZE;
+		  updateReadPointer();
+		  headerDirty = true;
 	  }
+	  stage(idx);
 
-	  memCache->Write(EE_FAULT_LOG + EEFAULT_FAULTS_START + sizeof(FAULT) * faultWritePointer, &faultList[faultWritePointer], sizeof(FAULT));
-	  //Cause the memory caching system to immediately write the page
-	  memCache->InvalidateAddress(EE_FAULT_LOG + EEFAULT_FAULTS_START + sizeof(FAULT)* faultWritePointer);
-
-	  if (incPtr) faultWritePointer = (faultWritePointer + 1) % CFG_FAULT_HISTORY_SIZE;
-
-	  memCache->Write(EE_FAULT_LOG + EEFAULT_WRITEPTR , faultWritePointer);
-	  //Cause the page to be immediately fully aged so that it is written very soon.
-	  memCache->AgeFullyAddress(EE_FAULT_LOG + EEFAULT_WRITEPTR);	  
+	  Sample *sample = SampleBus::getInstance()->claim(TOPIC_FAULT);
+	  sample->value[0] = device;
+	  sample->value[1] = code;
+	  sample->value[2] = idx;
+	  sample->value[3] = globalTime;
+	  sample->count = 4;
+	  SampleBus::getInstance()->publish(TOPIC_FAULT, (DeviceId)device);
+	  return idx;
   }
 
+  //number of faults which haven't been acknowledged yet
   uint16_t FaultHandler::getFaultCount() 
   {
-	  int count = 0;
-	  for (int i = 0; i < CFG_FAULT_HISTORY_SIZE; i++) 
-	  {
-		  if (faultList[i].ack == false) 
-		  {
-			  count++;
-		  }
-	  }
-	  return count;
+	  return unackedCount;
+  }
+
+  //number of faults which are flagged as still going on
+  uint16_t FaultHandler::getOngoingCount() 
+  {
+	  return ongoingCount;
   }
 
   //the fault handler isn't a device per se and uses more memory than a device would normally be allocated so
@@ -110,21 +126,20 @@ SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
 	  {
 		  memCache->Read(EE_FAULT_LOG + EEFAULT_READPTR, &faultReadPointer);
 		  memCache->Read(EE_FAULT_LOG + EEFAULT_WRITEPTR, &faultWritePointer);
-		  memCache->Read(EE_FAULT_LOG + EEFAULT_RUNTIME, &globalTime);
+		  if (runtime.load()) globalTime = runtime.get();
+		  else memCache->Read(EE_FAULT_LOG + EEFAULT_RUNTIME, &globalTime); //not converted to the wear levelled counter yet
 		  baseTime = globalTime;
-		  for (int i = 0; i < CFG_FAULT_HISTORY_SIZE; i++) 
-		  {
-			  memCache->Read(EE_FAULT_LOG + EEFAULT_FAULTS_START + sizeof(FAULT) * i, &faultList[i], sizeof(FAULT));
-		  }
+		  //the records are stored back to back exactly like faultList so it is one bulk read
+		  memCache->Read(EE_FAULT_LOG + EEFAULT_FAULTS_START, faultList, sizeof(faultList));
+		  if (faultWritePointer >= CFG_FAULT_HISTORY_SIZE) faultWritePointer = 0;
 	  }
 	  else //reinitialize the fault cache storage
 	  {
 		  validByte = 0xB2;
 		  memCache->Write(EE_FAULT_LOG, validByte);
-		  memCache->Write(EE_FAULT_LOG + EEFAULT_READPTR, (uint16_t)0);
-		  memCache->Write(EE_FAULT_LOG + EEFAULT_WRITEPTR, (uint16_t)0);
-		  globalTime = baseTime = millis() / 100;
-		  memCache->Write(EE_FAULT_LOG + EEFAULT_RUNTIME, globalTime);
+		  faultReadPointer = faultWritePointer = 0;
+		  globalTime = baseTime = TimeBase::getInstance()->getMillis() / 100;
+		  runtime.load();
 
 		  FAULT tempFault;
 		  tempFault.ack = true;
@@ -138,38 +153,90 @@ SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
 		  }
 		  saveToEEPROM();
 	  }
+
+	  //rebuild the index and counters, from here on they are kept up to date with every change
+	  unackedMask = ongoingMask = 0;
+	  unackedCount = ongoingCount = 0;
+	  for (int i = 0; i < CFG_FAULT_HISTORY_SIZE; i++) 
+	  {
+		  if (!faultList[i].ack) {
+			  unackedMask |= FAULT_BIT(i);
+			  unackedCount++;
+		  }
+		  if (faultList[i].ongoing) {
+			  ongoingMask |= FAULT_BIT(i);
+			  ongoingCount++;
+		  }
+	  }
+	  updateReadPointer();
+	  faultCursor = faultReadPointer;
+	  dirtyMask = 0;
+	  headerDirty = false;
+	  staged = false;
   }
 
+  //write everything, not just the staged changes
   void FaultHandler::saveToEEPROM() 
   {
 	memCache->Write(EE_FAULT_LOG + EEFAULT_READPTR, faultReadPointer);
 	memCache->Write(EE_FAULT_LOG + EEFAULT_WRITEPTR, faultWritePointer);
 	memCache->Write(EE_FAULT_LOG + EEFAULT_RUNTIME, globalTime);
-	for (int i = 0; i < CFG_FAULT_HISTORY_SIZE; i++) 
-	{
-		memCache->Write(EE_FAULT_LOG + EEFAULT_FAULTS_START + sizeof(FAULT) * i, &faultList[i], sizeof(FAULT));
-	}
+	runtime.set(globalTime);
+	runtime.commit();
+	memCache->Write(EE_FAULT_LOG + EEFAULT_FAULTS_START, faultList, sizeof(faultList));
+	memCache->FlushAddress(EE_FAULT_LOG);
+	memCache->FlushAddress(EE_FAULT_LOG + EEFAULT_FAULTS_START + sizeof(faultList) - 1);
   }
 
+  //Write the staged changes to the cache and queue the pages for writing. Runs of
+  //neighbouring records go out with one Write.
+  void FaultHandler::commit() 
+  {
+	  uint16_t start, end;
 
+	  for (start = 0; start < CFG_FAULT_HISTORY_SIZE; start = end) 
+	  {
+		  if (!(dirtyMask & FAULT_BIT(start))) {
+			  end = start + 1;
+			  continue;
+		  }
+		  for (end = start + 1; end < CFG_FAULT_HISTORY_SIZE && (dirtyMask & FAULT_BIT(end)); end++);
+		  memCache->Write(recordAddress(start), &faultList[start], sizeof(FAULT) * (end - start));
+		  memCache->FlushAddress(recordAddress(start));
+		  memCache->FlushAddress(recordAddress(end) - 1);
+	  }
+	  if (headerDirty) 
+	  {
+		  memCache->Write(EE_FAULT_LOG + EEFAULT_READPTR, faultReadPointer);
+		  memCache->Write(EE_FAULT_LOG + EEFAULT_WRITEPTR, faultWritePointer);
+		  memCache->FlushAddress(EE_FAULT_LOG);
+	  }
+	  dirtyMask = 0;
+	  headerDirty = false;
+	  staged = false;
+  }
+
+  //start over with the oldest unacknowledged fault, false if there is none
+  bool FaultHandler::getFirstFault(FAULT *fault)
+  {
+	  faultCursor = faultReadPointer;
+	  return getNextFault(fault);
+  }
+
+  //get the next unacknowledged fault after the one returned last (wrapping around)
   bool FaultHandler::getNextFault(FAULT *fault)
   {
-	uint16_t j;
-	for (int i = 0; i < CFG_FAULT_HISTORY_SIZE; i++) 
-	{
-		j = faultReadPointer + i;
-		if (faultList[j].ack == false) {
-			fault = &faultList[j];
-			return true;
-		}
-	}
-	return false;
+	  uint16_t idx = nextUnacked(faultCursor);
+	  if (idx == 0xFFFF) return false;
+	  *fault = faultList[idx];
+	  faultCursor = (idx + 1) % CFG_FAULT_HISTORY_SIZE;
+	  return true;
   }
 
   bool FaultHandler::getFault(uint16_t fault, FAULT *outFault)
   {
-	  if (fault > 0 && fault < CFG_FAULT_HISTORY_SIZE) {
-		  outFault = &faultList[fault];
+	  if (fault < CFG_FAULT_HISTORY_SIZE) {
+		  *outFault = faultList[fault];
 		  return true;
 	  }
 	  return false;
@@ -177,18 +244,87 @@ SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
   
   uint16_t FaultHandler::setFaultACK(uint16_t fault)
   {
-	  if (fault > 0 && fault < CFG_FAULT_HISTORY_SIZE) 
+	  if (fault < CFG_FAULT_HISTORY_SIZE) 
 	  {
-		  faultList[fault].ack = 1;
+		  if (!faultList[fault].ack) {
+			  faultList[fault].ack = 1;
+			  unackedMask &= ~FAULT_BIT(fault);
+			  unackedCount--;
+			  updateReadPointer();
+			  headerDirty = true;
+			  stage(fault);
+		  }
+		  return fault;
 	  }
+	  return 0xFFFF;
   }
 
   uint16_t FaultHandler::setFaultOngoing(uint16_t fault, bool ongoing)
   {
-	  if (fault > 0 && fault < CFG_FAULT_HISTORY_SIZE) 
+	  if (fault < CFG_FAULT_HISTORY_SIZE) 
 	  {
-		  faultList[fault].ongoing = ongoing;
+		  if (faultList[fault].ongoing != ongoing) {
+			  faultList[fault].ongoing = ongoing;
+			  if (ongoing) {
+				  ongoingMask |= FAULT_BIT(fault);
+				  ongoingCount++;
+			  } else {
+				  ongoingMask &= ~FAULT_BIT(fault);
+				  ongoingCount--;
+			  }
+			  stage(fault);
+		  }
+		  return fault;
 	  }
+	  return 0xFFFF;
+  }
+
+  //remember a changed record, the commit follows within CFG_FAULT_COMMIT_LATENCY
+  void FaultHandler::stage(uint16_t fault)
+  {
+	  dirtyMask |= FAULT_BIT(fault);
+	  if (!staged) {
+		  staged = true;
+		  stagedTime = millis();
+	  }
+  }
+
+  //the read pointer always points at the oldest unacknowledged fault (or the write pointer if there is none)
+  void FaultHandler::updateReadPointer()
+  {
+	  uint16_t idx = nextUnacked(faultWritePointer); //searching from the write pointer finds the oldest
+	  faultReadPointer = (idx == 0xFFFF ? faultWritePointer : idx);
+  }
+
+  //first unacknowledged fault at or after the given one (wrapping around), 0xFFFF if there is none
+  uint16_t FaultHandler::nextUnacked(uint16_t from)
+  {
+	  uint64_t upper;
+
+	  if (unackedMask == 0) return 0xFFFF;
+	  upper = unackedMask & (~(uint64_t)0 << from);
+	  if (upper) return __builtin_ctzll(upper);
+	  return __builtin_ctzll(unackedMask);
+  }
+
+  //take a record which is about to be reused out of the index and counters
+  void FaultHandler::forget(uint16_t fault)
+  {
+	  if (!faultList[fault].ack) {
+		  unackedMask &= ~FAULT_BIT(fault);
+		  unackedCount--;
+	  }
+	  if (faultList[fault].ongoing) {
+		  ongoingMask &= ~FAULT_BIT(fault);
+		  ongoingCount--;
+	  }
+	  faultList[fault].ack = true;
+	  faultList[fault].ongoing = false;
+  }
+
+  uint32_t FaultHandler::recordAddress(uint16_t fault)
+  {
+	  return EE_FAULT_LOG + EEFAULT_FAULTS_START + sizeof(FAULT) * fault;
   }
 
   FaultHandler faultHandler;
@@ -37,6 +37,8 @@ SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
 #include "Logger.h"
 #include "FaultCodes.h"
 #include "MemCache.h"
+#include "WearCounter.h"
+#include "SampleBus.h"
 
 extern MemCache *memCache;
 
@@ -48,21 +50,37 @@ typedef struct {
   uint16_t faultCode; //set by the device itself. There is a universal list of codes
   uint8_t ack : 1; ////whether this fault has been acknowledged or not 1 = ack'd 
   uint8_t ongoing : 1; //whether fault still seems to be happening currently 1 = still going on
-} FAULT; //should be 9 bytes because the bottom two are bit fields in a single byte
+} FAULT; //9 bytes of data because the bottom two are bit fields in a single byte (padded to 12)
+
+//the unacknowledged/ongoing indexes are bit masks with one bit per fault record
+#define FAULT_BIT(fault)	((uint64_t)1 << (fault))
+#if CFG_FAULT_HISTORY_SIZE > 64
+#error "CFG_FAULT_HISTORY_SIZE must not be above 64"
+#endif
+
+/*
+ * All faults live in faultList, which is the RAM image of the records in EEPROM. New faults
+ * are appended at the write pointer. Changes are only staged in RAM (one dirty bit
+ * per record) and committed through the cache in one batch at most CFG_FAULT_COMMIT_LATENCY
+ * after the first change, so a burst of faults doesn't turn into a burst of EEPROM writes.
+ */
 
 
 class FaultHandler : public TickObserver {
   public:
   FaultHandler(); //constructor
   uint16_t raiseFault(uint16_t device, uint16_t code); //raise a new fault. Returns the fault # where this was stored
+  bool getFirstFault(FAULT*); //get the oldest un-ack'd fault
   bool getNextFault(FAULT*); //get the next un-ack'd fault. Will also get first fault if the first call and you forgot to call getFirstFault
   bool getFault(uint16_t fault, FAULT*);
-  uint16_t getFaultCount();
+  uint16_t getFaultCount(); //number of un-ack'd faults
+  uint16_t getOngoingCount();
   void handleTick();
   void setup();
 
   void loadFromEEPROM();
   void saveToEEPROM();
+  void commit(); //write staged changes now
   
   uint16_t setFaultACK(uint16_t fault); //acknowledge the fault # - returns fault # if successful (0xFFFF otherwise)
   uint16_t setFaultOngoing(uint16_t fault, bool ongoing); //set value of ongoing flag - returns fault # on success
@@ -73,6 +91,22 @@ class FaultHandler : public TickObserver {
   FAULT faultList[CFG_FAULT_HISTORY_SIZE]; //store up to 50 faults for a long history. 50*9 = 450 bytes of EEPROM
   uint32_t globalTime; //how long the unit has been running in total (across all start ups).
   uint32_t baseTime; //the time loaded at system start up. millis() / 100 is added to this to get the above time
+  WearCounter runtime; //globalTime as stored in EEPROM
+
+  uint64_t unackedMask; //records which are not acknowledged
+  uint64_t ongoingMask; //records which are still going on
+  uint16_t unackedCount, ongoingCount;
+  uint16_t faultCursor; //where getNextFault continues
+  uint64_t dirtyMask; //records changed since the last commit
+  bool headerDirty; //read or write pointer changed since the last commit
+  bool staged; //there are changes waiting for a commit
+  uint32_t stagedTime; //millis() of the first change since the last commit
+
+  void stage(uint16_t fault);
+  void updateReadPointer();
+  uint16_t nextUnacked(uint16_t from);
+  void forget(uint16_t fault);
+  uint32_t recordAddress(uint16_t fault);
 };
 
 extern FaultHandler faultHandler;
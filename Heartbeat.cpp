@@ -25,10 +25,13 @@
  */
 
 #include "Heartbeat.h"
+#include "TimeBase.h"
+#include "SystemLoad.h"
 
 Heartbeat::Heartbeat() {
 	led = false;
 	throttleDebug = false;
+	lastReport = 0;
 }
 
 void Heartbeat::setup() {
@@ -46,14 +49,20 @@ bool Heartbeat::getThrottleDebug() {
 }
 
 void Heartbeat::handleTick() {
-	// Print a dot if no other output has been made since the last tick
-	if (Logger::getLastLogTime() < lastTickTime) {
-		SerialUSB.print('.');
-		if ((++dotCount % 80) == 0) {
-			SerialUSB.println();
-		}
+	uint32_t now = TimeBase::getInstance()->getMillis();
+
+	// report how much headroom is left, the load is the average since the previous report
+	if (now - lastReport >= CFG_HEARTBEAT_REPORT_INTERVAL) {
+		SystemLoad *load = SystemLoad::getInstance();
+		uint16_t permille = load->takeLoad();
+		uint16_t depth = 0;
+#ifdef CFG_TIMER_USE_QUEUING
+		depth = TickHandler::getInstance()->getMaxQueueDepth();
+#endif
+		Logger::info(HEARTBEAT, "load: %d.%d%% tick queue max: %d stack: %l of %l bytes heap free: %l bytes", permille / 10,
+				permille % 10, depth, load->getStackUsed(), load->getStackSize(), load->getFreeHeap());
+		lastReport = now;
 	}
-	lastTickTime = millis();
 
 	if (led) {
 		digitalWrite(13, HIGH);
@@ -45,8 +45,7 @@ protected:
 private:
 	bool led;
         bool throttleDebug;
-        int dotCount;
-        uint32_t lastTickTime;
+        uint32_t lastReport; // millis of the last load report
 };
 
 #endif /* HEARTBEAT_H_ */
@@ -0,0 +1,61 @@
+/*
+ * HumiditySensor.cpp
+ *
+ * Driver for the Sensirion SHT3x humidity and temperature sensors
+ *
+Copyright (c) 2013 Collin Kidder, Michael Neuweiler, Charles Galpin
+
+Permission is hereby granted, free of charge, to any person obtaining
+a copy of this software and associated documentation files (the
+"Software"), to deal in the Software without restriction, including
+without limitation the rights to use, copy, modify, merge, publish,
+distribute, sublicense, and/or sell copies of the Software, and to
+permit persons to whom the Software is furnished to do so, subject to
+the following conditions:
+
+The above copyright notice and this permission notice shall be included
+in all copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.
+IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY
+CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT,
+TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE
+SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+
+ */
+
+#include "HumiditySensor.h"
+
+HumiditySensor::HumiditySensor() : SensirionSensor() {
+	prefsHandler = new PrefHandler(HUMIDITY, true); //the sensors are what this board is for
+	commonName = "Humidity (SHT3x)";
+	address = SHT3X_ADDRESS;
+	words = 2; //temperature, humidity
+	readCommand = SHT3X_FETCH;
+	divider = SHT3X_INTERVAL / CFG_TICK_INTERVAL_SENSORS;
+	if (divider == 0) divider = 1;
+}
+
+bool HumiditySensor::startMeasurement() {
+	sendCommand(SHT3X_BREAK); //in case it's still in periodic mode
+	delay(1);
+	return sendCommand(SHT3X_PERIODIC_10MPS);
+}
+
+void HumiditySensor::publish(const uint16_t *data, uint32_t timestamp) {
+	Sample *sample = SampleBus::getInstance()->claim(TOPIC_HUMIDITY);
+	sample->value[0] = (int32_t)data[1] * 10000 / 65535; //RH = 100 * raw / (2^16 - 1)
+	sample->value[1] = (int32_t)data[0] * 17500 / 65535 - 4500; //T = -45 + 175 * raw / (2^16 - 1)
+	sample->count = 2;
+	SampleBus::getInstance()->publish(TOPIC_HUMIDITY, HUMIDITY, timestamp);
+}
+
+DeviceType HumiditySensor::getType() {
+	return DEVICE_HUMIDITY;
+}
+
+DeviceId HumiditySensor::getId() {
+	return HUMIDITY;
+}
@@ -0,0 +1,58 @@
+/*
+ * HumiditySensor.h
+ *
+ * Driver for the Sensirion SHT3x humidity and temperature sensors
+ *
+Copyright (c) 2013 Collin Kidder, Michael Neuweiler, Charles Galpin
+
+Permission is hereby granted, free of charge, to any person obtaining
+a copy of this software and associated documentation files (the
+"Software"), to deal in the Software without restriction, including
+without limitation the rights to use, copy, modify, merge, publish,
+distribute, sublicense, and/or sell copies of the Software, and to
+permit persons to whom the Software is furnished to do so, subject to
+the following conditions:
+
+The above copyright notice and this permission notice shall be included
+in all copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.
+IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY
+CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT,
+TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE
+SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+
+ */
+
+#ifndef HUMIDITYSENSOR_H_
+#define HUMIDITYSENSOR_H_
+
+#include <Arduino.h>
+#include "config.h"
+#include "SensirionSensor.h"
+
+#define SHT3X_ADDRESS		0x44 // 0x45 with ADDR high
+#define SHT3X_PERIODIC_10MPS	0x2737 // periodic mode, 10 measurements per second, high repeatability
+#define SHT3X_FETCH			0xE000 // read the latest periodic measurement
+#define SHT3X_BREAK			0x3093 // stop the periodic mode
+#define SHT3X_INTERVAL		100000 // microseconds between two measurements at 10 mps
+
+/*
+ * The part runs in its periodic mode and is read every SHT3X_INTERVAL. It doesn't answer a
+ * fetch before it has a new measurement, a read that comes a little early now and then is
+ * simply taken next cycle. Publishes TOPIC_HUMIDITY.
+ */
+class HumiditySensor : public SensirionSensor {
+public:
+	HumiditySensor();
+	DeviceType getType();
+	DeviceId getId();
+
+protected:
+	bool startMeasurement();
+	void publish(const uint16_t *data, uint32_t timestamp);
+};
+
+#endif /* HUMIDITYSENSOR_H_ */
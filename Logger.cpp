@@ -25,10 +25,70 @@
  */
 
 #include "Logger.h"
+#include "SysLog.h"
+#include "TimeBase.h"
 
 Logger::LogLevel Logger::logLevel = Logger::Info;
 uint32_t Logger::lastLogTime = 0;
 
+boolean Logger::binary = false;
+SysLog *Logger::sysLog = NULL;
+
+#ifdef CFG_LOG_BUFFERED
+char Logger::buffer[CFG_LOG_BUFFER_SIZE];
+volatile uint16_t Logger::bufferHead = 0;
+volatile uint16_t Logger::bufferTail = 0;
+volatile uint32_t Logger::droppedCount = 0;
+uint32_t Logger::droppedReported = 0;
+#endif
+
+/*
+ * A message is first formatted into a LogLine on the stack and then copied into the
+ * ring in one go. So formatting doesn't need to lock anything and a message which is
+ * interrupted by another one (logged from an interrupt) doesn't get mixed up with it.
+ * Binary records are assembled in one as well.
+ */
+class LogLine: public Print {
+public:
+	char data[CFG_LOG_LINE_SIZE];
+	uint16_t length;
+	bool truncated;
+
+	LogLine() {
+		length = 0;
+		truncated = false;
+	}
+
+	size_t write(uint8_t c) {
+		if (length < CFG_LOG_LINE_SIZE) {
+			data[length++] = c;
+		} else
+			truncated = true;
+		return 1;
+	}
+
+	// make sure a truncated message still ends with a line break
+	void finish() {
+		if (truncated) {
+			data[CFG_LOG_LINE_SIZE - 2] = '\r';
+			data[CFG_LOG_LINE_SIZE - 1] = '\n';
+		}
+	}
+
+	uint16_t room() {
+		return CFG_LOG_LINE_SIZE - length;
+	}
+
+	void writeBytes(const void *value, uint8_t size) {
+		memcpy(data + length, value, size);
+		length += size;
+	}
+};
+
+#if CFG_LOG_LINE_SIZE > 255
+#error "CFG_LOG_LINE_SIZE must fit into the one byte length prefix of the log ring"
+#endif
+
 /*
  * Output a debug message with a variable amount of parameters.
  * printf() style, see Logger::log()
@@ -140,8 +200,11 @@ void Logger::error(DeviceId deviceId, char *message, ...) {
  */
 void Logger::console(char *message, ...) {
 	va_list args;
+#ifdef CFG_LOG_BUFFERED
+	flush(); // keep the order with buffered log messages
+#endif
 	va_start(args, message);
-	Logger::logMessage(message, args);
+	Logger::logMessage(SerialUSB, message, args);
 	va_end(args);
 }
 
@@ -199,30 +262,56 @@ boolean Logger::isDebug() {
  * %T - prints the next parameter as boolean ('true' or 'false')
  */
 void Logger::log(DeviceId deviceId, LogLevel level, char *format, va_list args) {
-	lastLogTime = millis();
-	SerialUSB.print(lastLogTime);
-	SerialUSB.print(" - ");
+	lastLogTime = TimeBase::getInstance()->getMillis();
+
+	if (level >= Warn && sysLog != NULL) {
+		va_list copy;
+		va_copy(copy, args);
+		persist(deviceId, level, format, copy);
+		va_end(copy);
+	}
+
+	// formats which aren't in flash (e.g. built at run time) have no ID, they're sent as text
+	if (binary && (uintptr_t) format < LOG_BINARY_FLASH_END) {
+		logBinary(deviceId, level, format, args);
+		return;
+	}
+
+#ifdef CFG_LOG_BUFFERED
+	LogLine line;
+	Print &out = line;
+#else
+	Print &out = SerialUSB;
+#endif
+	out.print(lastLogTime);
+	out.print(" - ");
 
 	switch (level) {
 	case Debug:
-		SerialUSB.print("DEBUG");
+		out.print("DEBUG");
 		break;
 	case Info:
-		SerialUSB.print("INFO");
+		out.print("INFO");
 		break;
 	case Warn:
-		SerialUSB.print("WARNING");
+		out.print("WARNING");
 		break;
 	case Error:
-		SerialUSB.print("ERROR");
+		out.print("ERROR");
+		break;
+	case Off:
 		break;
 	}
-	SerialUSB.print(": ");
+	out.print(": ");
 
 	if (deviceId)
-		printDeviceName(deviceId);
+		printDeviceName(out, deviceId);
 
-	logMessage(format, args);
+	logMessage(out, format, args);
+#ifdef CFG_LOG_BUFFERED
+	line.finish();
+	commit(line.data, line.length);
+#endif
 }
 
 /*
@@ -243,77 +332,77 @@ void Logger::log(DeviceId deviceId, LogLevel level, char *format, va_list args)
  * %t - prints the next parameter as boolean ('T' or 'F')
  * %T - prints the next parameter as boolean ('true' or 'false')
  */
-void Logger::logMessage(char *format, va_list args) {
+void Logger::logMessage(Print &out, char *format, va_list args) {
 	for (; *format != 0; ++format) {
 		if (*format == '%') {
 			++format;
 			if (*format == '\0')
 				break;
 			if (*format == '%') {
-				SerialUSB.print(*format);
+				out.print(*format);
 				continue;
 			}
 			if (*format == 's') {
-				register char *s = (char *) va_arg( args, int );
-				SerialUSB.print(s);
+				register char *s = va_arg( args, char * );
+				out.print(s);
 				continue;
 			}
 			if (*format == 'd' || *format == 'i') {
-				SerialUSB.print(va_arg( args, int ), DEC);
+				out.print(va_arg( args, int ), DEC);
 				continue;
 			}
 			if (*format == 'f') {
-				SerialUSB.print(va_arg( args, double ), 2);
+				out.print(va_arg( args, double ), 2);
 				continue;
 			}
 			if (*format == 'x') {
-				SerialUSB.print(va_arg( args, int ), HEX);
+				out.print(va_arg( args, int ), HEX);
 				continue;
 			}
 			if (*format == 'X') {
-				SerialUSB.print("0x");
-				SerialUSB.print(va_arg( args, int ), HEX);
+				out.print("0x");
+				out.print(va_arg( args, int ), HEX);
 				continue;
 			}
 			if (*format == 'b') {
-				SerialUSB.print(va_arg( args, int ), BIN);
+				out.print(va_arg( args, int ), BIN);
 				continue;
 			}
 			if (*format == 'B') {
-				SerialUSB.print("0b");
-				SerialUSB.print(va_arg( args, int ), BIN);
+				out.print("0b");
+				out.print(va_arg( args, int ), BIN);
 				continue;
 			}
 			if (*format == 'l') {
-				SerialUSB.print(va_arg( args, long ), DEC);
+				out.print(va_arg( args, long ), DEC);
 				continue;
 			}
 
 			if (*format == 'c') {
-				SerialUSB.print(va_arg( args, int ));
+				out.print(va_arg( args, int ));
 				continue;
 			}
 			if (*format == 't') {
 				if (va_arg( args, int ) == 1) {
-					SerialUSB.print("T");
+					out.print("T");
 				} else {
-					SerialUSB.print("F");
+					out.print("F");
 				}
 				continue;
 			}
 			if (*format == 'T') {
 				if (va_arg( args, int ) == 1) {
-					SerialUSB.print(Constants::trueStr);
+					out.print(Constants::trueStr);
 				} else {
-					SerialUSB.print(Constants::falseStr);
+					out.print(Constants::falseStr);
 				}
 				continue;
 			}
 
 		}
-		SerialUSB.print(*format);
+		out.print(*format);
 	}
-	SerialUSB.println();
+	out.println();
 }
 
 /*
@@ -322,52 +411,260 @@ void Logger::logMessage(char *format, va_list args) {
  * source of the logged message.
  * NOTE: Should be kept in synch with the defined devices.
  */
-void Logger::printDeviceName(DeviceId deviceId) {
+void Logger::printDeviceName(Print &out, DeviceId deviceId) {
 	switch (deviceId) {
 	/*case DMOC645:
-		SerialUSB.print("DMOC645");
+		out.print("DMOC645");
 		break;
 	case BRUSA_DMC5:
-		SerialUSB.print("DMC5");
+		out.print("DMC5");
 		break;
 	case BRUSACHARGE:
-		SerialUSB.print("NLG5");
+		out.print("NLG5");
 		break;
 	case TCCHCHARGE:
-		SerialUSB.print("TCCH");
+		out.print("TCCH");
 		break;
 	case THROTTLE:
-		SerialUSB.print("THROTTLE");
+		out.print("THROTTLE");
 		break;
 	case POTACCELPEDAL:
-		SerialUSB.print("POTACCEL");
+		out.print("POTACCEL");
 		break;
 	case POTBRAKEPEDAL:
-		SerialUSB.print("POTBRAKE");
+		out.print("POTBRAKE");
 		break;
 	case CANACCELPEDAL:
-		SerialUSB.print("CANACCEL");
+		out.print("CANACCEL");
 		break;
 	case CANBRAKEPEDAL:
-		SerialUSB.print("CANBRAKE");
+		out.print("CANBRAKE");
 		break;
     */
 	case ICHIP2128:
-		SerialUSB.print("ICHIP");
+		out.print("ICHIP");
 		break;
 	//case THINKBMS:
-//		SerialUSB.print("THINKBMS");
+//		out.print("THINKBMS");
 //		break;
 	case SYSTEM:
-		SerialUSB.print("SYSTEM");
+		out.print("SYSTEM");
 		break;
 	case HEARTBEAT:
-		SerialUSB.print("HEARTBEAT");
+		out.print("HEARTBEAT");
 		break;
 	case MEMCACHE:
-		SerialUSB.print("MEMCACHE");
+		out.print("MEMCACHE");
+		break;
+	case DIFF_PRES:
+		out.print("DIFF_PRES");
+		break;
+	case HUMIDITY:
+		out.print("HUMIDITY");
+		break;
+	case MASS_FLOW:
+		out.print("MASS_FLOW");
+		break;
+	default:
 		break;
 	}
-	SerialUSB.print(" - ");
+	out.print(" - ");
+
+}
+
+/*
+ * Set the persistent log which gets a copy of every warning and error, NULL to stop.
+ */
+void Logger::setSysLog(SysLog *log) {
+	sysLog = log;
+}
+
+/*
+ * Format a warning or error (without time stamp and level, these are stored separately)
+ * and hand it to the persistent log.
+ */
+void Logger::persist(DeviceId deviceId, LogLevel level, char *format, va_list args) {
+	LogLine line;
+
+	logMessage(line, format, args);
+	while (line.length > 0 && (line.data[line.length - 1] == '\n' || line.data[line.length - 1] == '\r'))
+		line.length--;
+	sysLog->append(level, deviceId, line.data, line.length);
+}
+
+/*
+ * Switch between text and binary log records (see Logger.h for the record format).
+ * Console output is always text.
+ */
+void Logger::setBinary(boolean enable) {
+	binary = enable;
+}
+
+boolean Logger::isBinary() {
+	return binary;
+}
 
-}
+/*
+ * Send a log message as a binary record: instead of formatting it, only the address
+ * of the format string and the raw arguments are sent. The format string tells how
+ * many arguments there are and how big they are, a host tool formats the message with
+ * the strings from the firmware's ELF file. If the arguments don't fit into one record
+ * the rest is left out and LOG_BINARY_TRUNCATED is set.
+ */
+void Logger::logBinary(DeviceId deviceId, LogLevel level, char *format, va_list args) {
+	LogLine line;
+	uint8_t flags = level;
+	uint16_t id = deviceId;
+	uint32_t value, address = (uint32_t) (uintptr_t) format; // the format's flash address
+	float number;
+	char *s;
+	uint8_t len;
+
+	line.write(LOG_BINARY_MARKER);
+	line.write(0); // length, filled in below
+	line.write(0); // level and flags, filled in below
+	line.writeBytes(&id, 2);
+	line.writeBytes(&lastLogTime, 4);
+	line.writeBytes(&address, 4);
+
+	for (; *format != 0; ++format) {
+		if (*format != '%')
+			continue;
+		++format;
+		if (*format == '\0')
+			break;
+		if (strchr("dixXbBlctT", *format) != NULL) {
+			value = (*format == 'l' ? va_arg(args, long) : va_arg(args, int));
+			if (line.room() < 4) {
+				flags |= LOG_BINARY_TRUNCATED;
+				break;
+			}
+			line.writeBytes(&value, 4);
+		} else if (*format == 'f') {
+			number = va_arg(args, double);
+			if (line.room() < 4) {
+				flags |= LOG_BINARY_TRUNCATED;
+				break;
+			}
+			line.writeBytes(&number, 4);
+		} else if (*format == 's') {
+			s = va_arg(args, char *);
+			len = min(strlen(s), (size_t) LOG_BINARY_STRING_MAX);
+			if (line.room() < len + 1) {
+				flags |= LOG_BINARY_TRUNCATED;
+				break;
+			}
+			line.write(len);
+			line.writeBytes(s, len);
+		}
+	}
+	line.data[1] = line.length - 2;
+	line.data[2] = flags;
+
+#ifdef CFG_LOG_BUFFERED
+	commit(line.data, line.length);
+#else
+	SerialUSB.write((uint8_t *) line.data, line.length);
+#endif
+}
+
+#ifdef CFG_LOG_BUFFERED
+/*
+ * Copy a formatted message into the ring. Each message is stored with a one byte length
+ * prefix. If there's not enough room, whole messages are dropped from the tail until it fits.
+ */
+void Logger::commit(const char *data, uint16_t length) {
+	uint16_t head, tail, used, part;
+
+	if (length == 0)
+		return;
+	noInterrupts();
+	head = bufferHead;
+	tail = bufferTail;
+	used = (head + CFG_LOG_BUFFER_SIZE - tail) % CFG_LOG_BUFFER_SIZE;
+	while (CFG_LOG_BUFFER_SIZE - 1 - used < length + 1) {
+		// skip over the oldest message
+		part = (uint8_t) buffer[tail] + 1;
+		tail = (tail + part) % CFG_LOG_BUFFER_SIZE;
+		used -= part;
+		droppedCount++;
+	}
+	buffer[head] = length;
+	head = (head + 1) % CFG_LOG_BUFFER_SIZE;
+	part = min((uint16_t) (CFG_LOG_BUFFER_SIZE - head), length);
+	memcpy(buffer + head, data, part);
+	memcpy(buffer, data + part, length - part);
+	bufferHead = (head + length) % CFG_LOG_BUFFER_SIZE;
+	bufferTail = tail;
+	interrupts();
+}
+
+/*
+ * Write buffered messages to SerialUSB, at most CFG_LOG_DRAIN_CHUNKS chunks of
+ * CFG_LOG_DRAIN_CHUNK bytes per call. To be called from loop().
+ * If messages were dropped since the last call, a note about it is queued.
+ */
+void Logger::process() {
+	char chunk[CFG_LOG_DRAIN_CHUNK];
+	uint16_t tail, length, remaining, part;
+
+	for (int i = 0; i < CFG_LOG_DRAIN_CHUNKS; i++) {
+		length = 0;
+		noInterrupts();
+		tail = bufferTail;
+		// gather whole messages (or the start of one) up to one chunk, without the length prefixes
+		while (tail != bufferHead && length < CFG_LOG_DRAIN_CHUNK) {
+			remaining = (uint8_t) buffer[tail];
+			part = min(remaining, (uint16_t) (CFG_LOG_DRAIN_CHUNK - length));
+			for (uint16_t j = 1; j <= part; j++)
+				chunk[length++] = buffer[(tail + j) % CFG_LOG_BUFFER_SIZE];
+			if (part < remaining) {
+				// message only partly taken, the last byte taken becomes the prefix of the rest
+				tail = (tail + part) % CFG_LOG_BUFFER_SIZE;
+				buffer[tail] = remaining - part;
+			} else
+				tail = (tail + part + 1) % CFG_LOG_BUFFER_SIZE;
+		}
+		bufferTail = tail;
+		interrupts();
+
+		if (length == 0)
+			break;
+		SerialUSB.write((uint8_t *) chunk, length);
+	}
+
+	// queued after what was just written so it doesn't push out another message right away
+	if (droppedCount != droppedReported) {
+		LogLine line;
+		uint32_t dropped = droppedCount;
+		line.print(TimeBase::getInstance()->getMillis());
+		line.print(" - WARNING: ");
+		line.print(dropped - droppedReported);
+		line.println(" log messages dropped");
+		droppedReported = dropped;
+		commit(line.data, line.length);
+	}
+}
+
+/*
+ * Write all buffered messages (blocking).
+ */
+void Logger::flush() {
+	while (bufferTail != bufferHead)
+		process();
+}
+
+/*
+ * Messages are waiting for process().
+ */
+boolean Logger::hasPending() {
+	return bufferTail != bufferHead;
+}
+
+/*
+ * Number of messages which were dropped because the ring was full.
+ */
+uint32_t Logger::getDroppedCount() {
+	return droppedCount;
+}
+#endif
@@ -32,6 +32,36 @@
 #include "DeviceTypes.h"
 #include "constants.h"
 
+/*
+ * Binary log records (Logger::setBinary(true)), all values little endian:
+ *
+ * 0      LOG_BINARY_MARKER
+ * 1      number of bytes following this one
+ * 2      log level (bits 0-2), LOG_BINARY_TRUNCATED if not all arguments fit
+ * 3-4    DeviceId (0 if none)
+ * 5-8    time stamp (milliseconds of the TimeBase)
+ * 9-12   address of the format string in flash, it serves as the ID of the message
+ * 13-    the arguments in the order of the format: 4 bytes for %d %i %x %X %b %B %l %c %t %T,
+ *        a float (4 bytes) for %f and a length byte followed by up to LOG_BINARY_STRING_MAX
+ *        characters for %s
+ *
+ * Argument rules: %d %i %l and %c are signed (%c is printed as a number like in text mode),
+ * %x %X %b %B are the unsigned 32 bit value, %t %T are true only for 1, doubles are narrowed
+ * to float and %s is cut at LOG_BINARY_STRING_MAX characters. Arguments which don't fit are
+ * left out, the host shows what's there and marks the line truncated.
+ *
+ * tools/log_decode.py looks the format string up in the .rodata of the firmware's ELF file
+ * (the Due linker script places it in the .text output section) and formats the message
+ * itself. Messages whose format isn't in flash and console output stay text, the tool tells
+ * them apart by the marker which never shows up in text output.
+ */
+#define LOG_BINARY_MARKER		0xB5
+#define LOG_BINARY_TRUNCATED	0x80
+#define LOG_BINARY_STRING_MAX	32
+#define LOG_BINARY_FLASH_END	0x20000000 // SRAM starts here on the SAM3X
+
+class SysLog;
+
 class Logger {
 public:
 	enum LogLevel {
@@ -50,13 +80,33 @@ public:
 	static LogLevel getLogLevel();
 	static uint32_t getLastLogTime();
 	static boolean isDebug();
+	static void setBinary(boolean);
+	static boolean isBinary();
+	static void setSysLog(SysLog *);
+#ifdef CFG_LOG_BUFFERED
+	static void process();
+	static void flush();
+	static boolean hasPending();
+	static uint32_t getDroppedCount();
+#endif
 private:
 	static LogLevel logLevel;
 	static uint32_t lastLogTime;
+	static boolean binary;
+	static SysLog *sysLog; // gets a copy of all warnings and errors (if set)
+#ifdef CFG_LOG_BUFFERED
+	static char buffer[CFG_LOG_BUFFER_SIZE];
+	static volatile uint16_t bufferHead, bufferTail; // messages are added at the head and written from the tail
+	static volatile uint32_t droppedCount; // messages dropped to make room for new ones
+	static uint32_t droppedReported; // droppedCount when process() last reported it
+	static void commit(const char *data, uint16_t length);
+#endif
 
 	static void log(DeviceId, LogLevel, char *format, va_list);
-	static void logMessage(char *format, va_list args);
-	static void printDeviceName(DeviceId);
+	static void logBinary(DeviceId, LogLevel, char *format, va_list);
+	static void persist(DeviceId, LogLevel, char *format, va_list);
+	static void logMessage(Print &out, char *format, va_list args);
+	static void printDeviceName(Print &out, DeviceId);
 };
 
 #endif /* LOGGER_H_ */
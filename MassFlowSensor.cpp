@@ -0,0 +1,62 @@
+/*
+ * MassFlowSensor.cpp
+ *
+ * Driver for the Sensirion SFM3000 mass flow meter
+ *
+Copyright (c) 2013 Collin Kidder, Michael Neuweiler, Charles Galpin
+
+Permission is hereby granted, free of charge, to any person obtaining
+a copy of this software and associated documentation files (the
+"Software"), to deal in the Software without restriction, including
+without limitation the rights to use, copy, modify, merge, publish,
+distribute, sublicense, and/or sell copies of the Software, and to
+permit persons to whom the Software is furnished to do so, subject to
+the following conditions:
+
+The above copyright notice and this permission notice shall be included
+in all copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.
+IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY
+CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT,
+TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE
+SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+
+ */
+
+#include "MassFlowSensor.h"
+
+MassFlowSensor::MassFlowSensor() : SensirionSensor() {
+	prefsHandler = new PrefHandler(MASS_FLOW, true); //the sensors are what this board is for
+	commonName = "Mass flow (SFM3000)";
+	address = SFM3000_ADDRESS;
+	words = 1;
+	crcInit = 0x00; //unlike the other parts
+	discard = true;
+}
+
+bool MassFlowSensor::startMeasurement() {
+	discard = true;
+	return sendCommand(SFM3000_START_CONTINUOUS);
+}
+
+void MassFlowSensor::publish(const uint16_t *data, uint32_t timestamp) {
+	if (discard) {
+		discard = false;
+		return;
+	}
+	Sample *sample = SampleBus::getInstance()->claim(TOPIC_MASS_FLOW);
+	sample->value[0] = ((int32_t)data[0] - SFM3000_OFFSET) * 1000 / SFM3000_SCALE;
+	sample->count = 1;
+	SampleBus::getInstance()->publish(TOPIC_MASS_FLOW, MASS_FLOW, timestamp);
+}
+
+DeviceType MassFlowSensor::getType() {
+	return DEVICE_MASS_FLOW;
+}
+
+DeviceId MassFlowSensor::getId() {
+	return MASS_FLOW;
+}
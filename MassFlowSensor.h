@@ -0,0 +1,59 @@
+/*
+ * MassFlowSensor.h
+ *
+ * Driver for the Sensirion SFM3000 mass flow meter
+ *
+Copyright (c) 2013 Collin Kidder, Michael Neuweiler, Charles Galpin
+
+Permission is hereby granted, free of charge, to any person obtaining
+a copy of this software and associated documentation files (the
+"Software"), to deal in the Software without restriction, including
+without limitation the rights to use, copy, modify, merge, publish,
+distribute, sublicense, and/or sell copies of the Software, and to
+permit persons to whom the Software is furnished to do so, subject to
+the following conditions:
+
+The above copyright notice and this permission notice shall be included
+in all copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.
+IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY
+CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT,
+TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE
+SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+
+ */
+
+#ifndef MASSFLOWSENSOR_H_
+#define MASSFLOWSENSOR_H_
+
+#include <Arduino.h>
+#include "config.h"
+#include "SensirionSensor.h"
+
+#define SFM3000_ADDRESS		0x40
+#define SFM3000_START_CONTINUOUS	0x1000 // the part answers every read with the latest flow from then on
+#define SFM3000_OFFSET		32000 // raw value at zero flow
+#define SFM3000_SCALE		140 // raw counts per slm (air, N2, O2)
+
+/*
+ * The part measures continuously (up to 2kHz) and is read every cycle. The first result
+ * after a start is invalid and dropped. Publishes TOPIC_MASS_FLOW.
+ */
+class MassFlowSensor : public SensirionSensor {
+public:
+	MassFlowSensor();
+	DeviceType getType();
+	DeviceId getId();
+
+protected:
+	bool startMeasurement();
+	void publish(const uint16_t *data, uint32_t timestamp);
+
+private:
+	bool discard; // next result is the invalid first one
+};
+
+#endif /* MASSFLOWSENSOR_H_ */
@@ -28,6 +28,14 @@ SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
 
 MemCache::MemCache()
 {
+  queueHead = queueTail = queueCount = 0;
+  writeState = WB_IDLE;
+  writePage = 0xFF;
+  writeCallback = NULL;
+  memset(&readTransaction, 0, sizeof(readTransaction));
+  memset(&writeTransaction, 0, sizeof(writeTransaction));
+  memset(&probeTransaction, 0, sizeof(probeTransaction));
+  resetStats();
 }
 
 void MemCache::setup() {
@@ -36,8 +44,12 @@ void MemCache::setup() {
 		pages[c].address = 0xFFFFFF; //maximum number. This is way over what our chip will actually support so it signals unused
 		pages[c].age = 0;
 		pages[c].dirty = false;
+		pages[c].queued = false;
 	}
-	//WriteTimer = 0;
+	for (U16 p = 0; p < EEPROM_PAGES; p++) pageIndex[p] = 0xFF;
+	queueHead = queueTail = queueCount = 0;
+	writeState = WB_IDLE;
+	writePage = 0xFF;
 
 	//digital pin 19 is connected to the write protect function of the EEPROM. It is active high so set it low to enable writes
 	pinMode(19, OUTPUT);
@@ -46,54 +58,60 @@ void MemCache::setup() {
 }
 
 
-//Handle aging of dirty pages and flushing of aged out dirty pages
+//Handle aging of dirty pages and hand aged out dirty pages to the write-back engine.
+//The engine then gets a chance to finish the page in flight and start the next one.
 void MemCache::handleTick()
 {
   U8 c;
   cache_age();
   for (c=0;c<NUM_CACHED_PAGES;c++) {
     if ((pages[c].age == MAX_AGE) && (pages[c].dirty)) {
-      FlushPage(c);
-      return;
+      cache_queuepage(c);
     }
   }
+  writeback_step();
 }
 
-//this function flushes the first dirty page it finds. It should try to wait until enough time as elapsed since
-//a previous page has been written. Remember that page writes take about 7ms.
+//this function flushes the first dirty page it finds right now. Used when the cache is full of dirty
+//pages and one has to be freed up. It only blocks for the writes still running from a previous page
+//(one per burst), the bursts are copied and go out in the background.
 void MemCache::FlushSinglePage() 
 {
   U8 c;
   for (c=0;c<NUM_CACHED_PAGES;c++) {
     if (pages[c].dirty) {
-      cache_writepage(c);
-      pages[c].dirty = false;
-      pages[c].age = 0; //freshly flushed!
+      cache_flushnow(c);
       return;
     }
   }
 }
 
-//Flush every dirty page. It will block for 7ms per page so maybe things will be blocked for a long, long time
-//DO NOT USE THIS FUNCTION UNLESS YOU CAN ACCEPT THAT!
+//Queue every dirty page for writing. This does not block, the pages go out one per tick.
+//Use WaitForWrites() afterward if the data really has to be in EEPROM before continuing.
 void MemCache::FlushAllPages()
 {
   U8 c;
   for (c = 0; c < NUM_CACHED_PAGES;c++) {
-    if (pages[c].dirty) { //found a dirty page so flush it
-      cache_writepage(c);
-      pages[c].dirty = false;
-      delay(10); //10ms is longest it would take to write a page according to datasheet
-    }
+    if (pages[c].dirty) cache_queuepage(c);
+  }
+}
+
+//Block until the write-back queue is empty and the EEPROM has finished its last write cycle.
+//This can take 25ms or more per queued page so DO NOT USE THIS FUNCTION UNLESS YOU CAN ACCEPT THAT!
+void MemCache::WaitForWrites()
+{
+  while (queueCount > 0 || writeState != WB_IDLE) {
+    cache_waitready();
+    writeback_step();
   }
 }
 
 //Flush a given page by the page ID. This is NOT by address so act accordingly. Likely no external code should ever use this
+//The page is queued for the write-back engine rather than written on the spot.
 void MemCache::FlushPage(uint8_t page) {
+  if (page > NUM_CACHED_PAGES - 1) return;
   if (pages[page].dirty) {
-    cache_writepage(page);
-    pages[page].dirty = false;
-    pages[page].age = 0; //freshly flushed!
+    cache_queuepage(page);
   }	
 }
 
@@ -112,10 +130,10 @@ void MemCache::InvalidatePage(uint8_t page)
 {
   if (page > NUM_CACHED_PAGES - 1) return; //invalid page, buddy!
   if (pages[page].dirty) {
-    cache_writepage(page);
+    cache_flushnow(page);
   }
   pages[page].dirty = false;
-  pages[page].address = 0xFFFFFF;
+  cache_setaddress(page, 0xFFFFFF);
   pages[page].age = 0;
 }
 
@@ -165,21 +183,15 @@ void MemCache::AgeFullyAddress(uint32_t address)
 //There are lots of versions of this
 boolean MemCache::Write(uint32_t address, uint8_t valu)
 {
-  uint32_t addr;
   uint8_t c;
 
-  addr = address >> 8; //kick it down to the page we're talking about
-  c = cache_hit(addr);
-  if (c == 0xFF) 	{
-    c = cache_findpage(); //try to free up a page
-    if (c != 0xFF) c = cache_readpage(addr); //and populate it with the existing data
-  }		
+  c = cache_getpage(address >> 8);
   if (c != 0xFF) {
     pages[c].data[(uint16_t)(address & 0x00FF)] = valu;
-    pages[c].dirty = true;
-    pages[c].address = addr; //set this in case we actually are setting up a new cache page
+    cache_markdirty(c, (uint8_t)(address & 0x00FF), 1);
     return true;
   }
+  stats.failedAllocs++;
   return false;
 }
 
@@ -197,43 +209,36 @@ boolean MemCache::Write(uint32_t address, uint32_t valu)
   return result;
 }
 
+//The request is split at page boundaries and each span within a page is copied in one go
 boolean MemCache::Write(uint32_t address, void* data, uint16_t len)
 {
-  uint32_t addr;
   uint8_t c;
-  uint16_t count;
-
-  for (count = 0; count < len; count++) {
-    addr = (address+count) >> 8; //kick it down to the page we're talking about
-    c = cache_hit(addr);
-    if (c == 0xFF) {
-      c = cache_findpage(); //try to find a page that either isn't loaded or isn't dirty
-      if (c != 0xFF) c = cache_readpage(addr); //and populate it with the existing data
-    }
-    if (c != 0xFF) { //could we find a suitable cache page to write to?
-      pages[c].data[(uint16_t)((address+count) & 0x00FF)] = *(uint8_t *)(data + count);
-      pages[c].dirty = true;
-      pages[c].address = addr; //set this in case we actually are setting up a new cache page	
+  uint16_t offset, span;
+  uint8_t *src = (uint8_t *)data;
+
+  while (len > 0) {
+    offset = (uint16_t)(address & 0x00FF);
+    span = 256 - offset;
+    if (span > len) span = len;
+    c = cache_getpage(address >> 8); //try to find a page that either isn't loaded or isn't dirty
+    if (c == 0xFF) { //couldn't find a suitable cache page to write to
+      stats.failedAllocs++;
+      return false;
     }
-    else break;
-  }		
-
-  if (c != 0xFF) return true; //all ok!
-  return false;
+    memcpy(&pages[c].data[offset], src, span);
+    cache_markdirty(c, (uint8_t)offset, span);
+    address += span;
+    src += span;
+    len -= span;
+  }
+  return true; //all ok!
 }
 
 boolean MemCache::Read(uint32_t address, uint8_t* valu)
 {
-  uint32_t addr;
   uint8_t c;
 
-  addr = address >> 8; //kick it down to the page we're talking about
-  c = cache_hit(addr);
-
-  if (c == 0xFF) { //page isn't cached. Search the cache, potentially dump a page and bring this one in
-    c = cache_readpage(addr);
-  }
-
+  c = cache_getpage(address >> 8);
   if (c != 0xFF) {
     *valu = pages[c].data[(uint16_t)(address & 0x00FF)];
     if (!pages[c].dirty) pages[c].age = 0; //reset age since we just used it
@@ -258,44 +263,80 @@ boolean MemCache::Read(uint32_t address, uint32_t* valu)
   return result;
 }
 
+//Same span by span copying as the bulk Write
 boolean MemCache::Read(uint32_t address, void* data, uint16_t len)
 {
-  uint32_t addr;
   uint8_t c;
-  uint16_t count;
-
-  for (count = 0; count < len; count++) {
-    addr = (address + count) >> 8;
-    c = cache_hit(addr);
-    if (c == 0xFF) { //page isn't cached. Search the cache, potentially dump a page and bring this one in
-      c = cache_readpage(addr);
-    }		
-    if (c != 0xFF) {
-      *(uint8_t *)(data + count) = pages[c].data[(uint16_t)((address+count) & 0x00FF)];
-      if (!pages[c].dirty) pages[c].age = 0; //reset age since we just used it
-    }
-    else break; //bust the for loop if we run into trouble
+  uint16_t offset, span;
+  uint8_t *dest = (uint8_t *)data;
+
+  while (len > 0) {
+    offset = (uint16_t)(address & 0x00FF);
+    span = 256 - offset;
+    if (span > len) span = len;
+    c = cache_getpage(address >> 8);
+    if (c == 0xFF) return false; //bust out of the loop if we run into trouble
+    memcpy(dest, &pages[c].data[offset], span);
+    if (!pages[c].dirty) pages[c].age = 0; //reset age since we just used it
+    address += span;
+    dest += span;
+    len -= span;
   }
-
-  if (c != 0xFF) return true; //all ok!
-  return false;
+  return true; //all ok!
 }
 
+//true while pages are queued for writing or the EEPROM is still busy with a write cycle
 boolean MemCache::isWriting()
 {
-  //if (WriteTimer) return true;
-  return false;
+  return (queueCount > 0 || writeState != WB_IDLE);
+}
+
+//Cache statistics. Counted from boot or the last resetStats()
+MemCacheStats *MemCache::getStats()
+{
+  return &stats;
+}
+
+void MemCache::resetStats()
+{
+  memset(&stats, 0, sizeof(stats));
+  stats.readPage.min = 0xFFFFFFFF;
+  stats.writePage.min = 0xFFFFFFFF;
 }
 
+//register a function that gets called each time the write-back engine finishes a page
+void MemCache::setWriteCallback(MemCacheWriteCallback callback)
+{
+  writeCallback = callback;
+}
+
+//pageIndex maps every EEPROM page straight to the cache page holding it so this is a single lookup
 uint8_t MemCache::cache_hit(uint32_t address)
+{
+  if (address >= EEPROM_PAGES) return 0xFF;
+  return pageIndex[address];
+}
+
+//Return the cache page holding the given EEPROM page, reading it in first if it isn't cached yet
+uint8_t MemCache::cache_getpage(uint32_t addr)
 {
   uint8_t c;
-  for (c = 0; c < NUM_CACHED_PAGES; c++) {
-    if (pages[c].address == address) {
-      return c;
-    }			
+  c = cache_hit(addr);
+  if (c == 0xFF) { //page isn't cached. Search the cache, potentially dump a page and bring this one in
+    if (addr >= EEPROM_PAGES) return 0xFF;
+    stats.misses++;
+    c = cache_readpage(addr);
   }
-  return 0xFF;
+  else stats.hits++;
+  return c;
+}
+
+//Change which EEPROM page a cache page holds, keeping pageIndex in sync. 0xFFFFFF marks it unused
+void MemCache::cache_setaddress(uint8_t page, uint32_t addr)
+{
+  if (pages[page].address < EEPROM_PAGES) pageIndex[pages[page].address] = 0xFF;
+  pages[page].address = addr;
+  if (addr < EEPROM_PAGES) pageIndex[addr] = page;
 }
 
 void MemCache::cache_age()
@@ -330,6 +371,7 @@ uint8_t MemCache::cache_findpage()
     }		
   }
   if (old_c == 0xFF) { //no pages were not dirty - try to free one up
+    stats.forcedFlushes++;
     FlushSinglePage(); //try to free up a page
     //now try to find the free page (if one was freed)
     old_v = 0;
@@ -343,62 +385,222 @@ uint8_t MemCache::cache_findpage()
   }		
 
   //If we got to this point then we have a page to use
+  stats.evictions++;
   pages[old_c].age = 0;
   pages[old_c].dirty = false;
-  pages[old_c].address = 0xFFFFFF; //mark it unused
+  cache_setaddress(old_c, 0xFFFFFF); //mark it unused
 
   return old_c;	
 }
 
+//Read a page from EEPROM. The caller needs the data so this waits for it but the read goes over the
+//bus in CFG_TWI_CHUNK_SIZE pieces and sensor transfers get in between.
 uint8_t MemCache::cache_readpage(uint32_t addr)
 {
-  uint16_t c,d,e;
-  uint32_t address = addr << 8;
-  uint8_t buffer[3];
-  uint8_t i2c_id;
+  uint8_t c;
+  TwiBus *twi = TwiBus::getInstance();
   c = cache_findpage();
 //  Logger::debug("r");
   if (c != 0xFF) {
-    buffer[0] = ((address & 0xFF00) >> 8);
-    //buffer[1] = (address & 0x00FF);
-    buffer[1] = 0; //the pages are 256 bytes so the start of a page is always 00 for the LSB
-    i2c_id = 0b01010000 + ((address >> 16) & 0x03); //10100 is the chip ID then the two upper bits of the address
-    Wire.beginTransmission(i2c_id);  
-    Wire.write(buffer, 2);
-    Wire.endTransmission(false); //do NOT generate stop
-    //delayMicroseconds(50); //give TWI some time to send and chip some time to get page
-    Wire.requestFrom(i2c_id, 256); //this will generate stop though.
-    for (e = 0; e < 256; e++)
-    {
-      if(Wire.available())    
-      { 
-        d = Wire.read(); // receive a byte as character
-        pages[c].data[e] = d;
-      }
-    }    
-    pages[c].address = addr;
+    cache_waitready(); //the EEPROM won't answer while it is still busy with a write cycle
+    cache_transaction(&readTransaction, addr << 8, true, pages[c].data, 256);
+    readTransaction.chunkSize = CFG_TWI_CHUNK_SIZE;
+    readTransaction.priority = TWI_PRIORITY_READ;
+    if (!twi->submit(&readTransaction) || !twi->wait(&readTransaction)) {
+      Logger::error(MEMCACHE, "could not read page %X", addr << 8);
+      return 0xFF; //the cache page stays unused
+    }
+    stats_time(&stats.readPage, readTransaction.duration);
+    cache_setaddress(c, addr);
     pages[c].age = 0;
     pages[c].dirty = false;
   }
   return c;
 }
 
-boolean MemCache::cache_writepage(uint8_t page)
+//Queue len bytes of a cached page starting at offset for writing. The burst must stay within the page, the
+//EEPROM would otherwise wrap around to the start of the page. The data is copied so the page may change
+//or be evicted as soon as this returns, writeback_poll() picks up the result.
+boolean MemCache::cache_writepage(uint8_t page, uint8_t offset, uint16_t len)
 {
-  uint16_t d;
-  uint32_t addr;
-  uint8_t buffer[258];
-  uint8_t i2c_id;
-  addr = pages[page].address << 8;
-  buffer[0] = ((addr & 0xFF00) >> 8);
-  //buffer[1] = (addr & 0x00FF);
-  buffer[1] = 0; //pages are 256 bytes so LSB is always 0 for the start of a page
-  i2c_id = 0b01010000 + ((addr >> 16) & 0x03); //10100 is the chip ID then the two upper bits of the address
-  for (d = 0; d < 256; d++) {  
-    buffer[d + 2] = pages[page].data[d];
+  memcpy(writeBuffer, &pages[page].data[offset], len);
+  cache_transaction(&writeTransaction, (pages[page].address << 8) + offset, false, writeBuffer, len);
+  writeTransaction.priority = TWI_PRIORITY_BACKGROUND;
+  return TwiBus::getInstance()->submit(&writeTransaction);
+}
+
+//Set up a transfer to or from the EEPROM at the given byte address
+void MemCache::cache_transaction(TwiTransaction *transaction, uint32_t address, boolean read, uint8_t *data, uint16_t len)
+{
+  transaction->device = 0b01010000 + ((address >> 16) & 0x03); //10100 is the chip ID then the two upper bits of the address
+  transaction->read = read;
+  transaction->commandSize = 2;
+  transaction->command = address & 0xFFFF;
+  transaction->data = data;
+  transaction->length = len;
+  transaction->chunkSize = 0;
+  transaction->callback = NULL;
+}
+
+//Set the dirty bits for every chunk touched by len bytes starting at offset
+void MemCache::cache_markdirty(uint8_t page, uint8_t offset, uint16_t len)
+{
+  uint8_t first, last;
+  if (len == 0) return;
+  first = offset / DIRTY_CHUNK_SIZE;
+  last = (offset + len - 1) / DIRTY_CHUNK_SIZE;
+  pages[page].dirty |= (uint16_t)(((0xFFFFu << first) & (0xFFFFu >> (15 - last))));
+}
+
+//Write out every dirty burst of a page right now. Needed before a page can be dropped from the cache.
+void MemCache::cache_flushnow(uint8_t page)
+{
+  while (pages[page].dirty) {
+    if (!cache_startwrite(page)) return;
   }
-  Wire.beginTransmission(i2c_id);
-  Wire.write(buffer, 258);
-  Wire.endTransmission(true);
+}
+
+//Put a page into the write-back queue unless it is already waiting there
+void MemCache::cache_queuepage(uint8_t page)
+{
+  if (pages[page].queued) return;
+  pages[page].queued = true;
+  writeQueue[queueHead] = page;
+  queueHead = (queueHead + 1) % NUM_CACHED_PAGES;
+  queueCount++;
+}
+
+//Send the first dirty burst of a page to the EEPROM. The burst runs from the first dirty chunk and
+//swallows any clean gaps of less than DIRTY_MERGE_GAP chunks, up to MAX_BURST_CHUNKS. If dirty chunks remain
+//after that the page goes back into the queue for another burst. The burst is copied once this returns so
+//those chunks are clean again (and may be changed or evicted) while it goes out and the chip does its write cycle.
+boolean MemCache::cache_startwrite(uint8_t page)
+{
+  uint8_t first, last, gap, c;
+  uint16_t mask;
+
+  cache_waitready();
+  if (!pages[page].dirty) return true;
+
+  first = 0;
+  while (!(pages[page].dirty & (1 << first))) first++;
+  last = first;
+  gap = 0;
+  for (c = first + 1; c < 16 && gap < DIRTY_MERGE_GAP && c - first < MAX_BURST_CHUNKS; c++) {
+    if (pages[page].dirty & (1 << c)) {
+      last = c;
+      gap = 0;
+    }
+    else gap++;
+  }
+  mask = (uint16_t)((0xFFFFu << first) & (0xFFFFu >> (15 - last)));
+
+  pages[page].dirty &= ~mask;
+  pages[page].age = 0; //freshly flushed!
+  if (!cache_writepage(page, first * DIRTY_CHUNK_SIZE, (last - first + 1) * DIRTY_CHUNK_SIZE)) {
+    Logger::error(MEMCACHE, "could not queue page %X", pages[page].address << 8);
+    pages[page].dirty |= mask; //try again later
+    if (writeCallback) writeCallback(pages[page].address << 8, false);
+    return false;
+  }
+  writeState = WB_SENDING;
+  writePage = page;
+  writeAddress = pages[page].address;
+  writeMask = mask;
+  if (pages[page].dirty) cache_queuepage(page); //more bursts to go
   return true;
+}
+
+//Block until any write in progress has finished. Required before talking to the EEPROM again.
+void MemCache::cache_waitready()
+{
+  while (!writeback_poll());
+}
+
+//Move the write in progress along, true once the EEPROM is free. Never waits.
+//Acknowledge polling: the EEPROM does not ACK its address while it's busy writing. A dummy write of
+//just the address bytes (no data, so nothing gets programmed) tells us whether it is done.
+boolean MemCache::writeback_poll()
+{
+  TwiBus *twi = TwiBus::getInstance();
+
+  if (writeState == WB_SENDING) {
+    if (!twi->isFinished(&writeTransaction)) return false;
+    stats_time(&stats.writePage, writeTransaction.duration);
+    if (writeTransaction.status != TWI_DONE) {
+      Logger::error(MEMCACHE, "EEPROM did not accept page %X", writeAddress << 8);
+      writeback_complete(false);
+      return true;
+    }
+    writeState = WB_WAIT_ACK;
+    writeStarted = probeSent = millis();
+    probeByte = 0;
+    cache_transaction(&probeTransaction, writeAddress << 8, false, &probeByte, 1);
+    probeTransaction.commandSize = 1; //high address byte, the low one is the "data"
+    probeTransaction.command = (writeAddress & 0xFF);
+    probeTransaction.priority = TWI_PRIORITY_BACKGROUND;
+    twi->submit(&probeTransaction);
+    return false;
+  }
+  if (writeState == WB_WAIT_ACK) {
+    if (!twi->isFinished(&probeTransaction)) return false;
+    if (probeTransaction.status == TWI_DONE) {
+      writeback_complete(true);
+      return true;
+    }
+    //only a poll sent after the timeout counts, the tick may come around later than that
+    if ((probeSent - writeStarted) > WRITE_CYCLE_TIMEOUT) {
+      Logger::error(MEMCACHE, "EEPROM write cycle timed out for page %X", writeAddress << 8);
+      writeback_complete(false);
+      return true;
+    }
+    probeSent = millis();
+    twi->submit(&probeTransaction); //still busy, ask again
+    return false;
+  }
+  return true;
+}
+
+//One step of the write-back engine. Never waits on the EEPROM: if the last page is still on its
+//way or being programmed it just tries again next time. Otherwise the next queued page gets sent.
+void MemCache::writeback_step()
+{
+  uint8_t c;
+
+  if (!writeback_poll()) return; //still busy, check back next tick
+
+  while (queueCount > 0) {
+    c = writeQueue[queueTail];
+    queueTail = (queueTail + 1) % NUM_CACHED_PAGES;
+    queueCount--;
+    pages[c].queued = false;
+    //the page might have been flushed or invalidated since it was queued
+    if (pages[c].dirty && pages[c].address != 0xFFFFFF) {
+      cache_startwrite(c);
+      return;
+    }
+  }
+}
+
+//The write in progress is over one way or the other. If it failed we can't know whether the page
+//made it so mark it dirty again (if it is still cached) to have it rewritten.
+void MemCache::writeback_complete(boolean success)
+{
+  writeState = WB_IDLE;
+  if (!success) {
+    if (writePage < NUM_CACHED_PAGES && pages[writePage].address == writeAddress) {
+      pages[writePage].dirty |= writeMask;
+    }
+  }
+  writePage = 0xFF;
+  if (writeCallback) writeCallback(writeAddress << 8, success);
+}
+
+//add the duration (microseconds) of one transfer to its timing stats
+void MemCache::stats_time(MemCacheTiming *timing, uint32_t elapsed)
+{
+  timing->count++;
+  timing->total += elapsed;
+  if (elapsed < timing->min) timing->min = elapsed;
+  if (elapsed > timing->max) timing->max = elapsed;
 }
@@ -32,11 +32,14 @@ SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
 #include <Arduino.h>
 #include "config.h"
 #include "TickHandler.h"
-#include <due_wire.h>
+#include "TwiBus.h"
 
 //Total # of allowable pages to cache. Limits RAM usage
 #define NUM_CACHED_PAGES   16
 
+//# of 256 byte pages in the EEPROM (256KB chip, two block select bits in the I2C address)
+#define EEPROM_PAGES       1024
+
 //maximum allowable age of a cache
 #define MAX_AGE  128
 
@@ -53,12 +56,49 @@ SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
 
 //Current parameters as of Sept 7 2014 = 128 * 40ms * 60 = 307.2 seconds to flush = about 10 years EEPROM life
 
+//longest the EEPROM may take to finish an internal write cycle before we give up acknowledge polling (ms).
+//The datasheet says 5ms typical, 10ms max so this leaves plenty of margin.
+#define WRITE_CYCLE_TIMEOUT 20
+
+//Dirty tracking granularity. Each page keeps one dirty bit per chunk of this many bytes and only the
+//chunks that changed get written. Dirty runs closer together than DIRTY_MERGE_GAP chunks are sent as a
+//single burst since every separate burst costs an EEPROM write cycle (5ms, about 55 bytes of bus time)
+#define DIRTY_CHUNK_SIZE   16
+#define DIRTY_MERGE_GAP    3
+
+//Longest write burst in chunks. A burst can't be split (the STOP starts the write cycle) so it holds the
+//TWI bus for its whole length, 4 chunks are about 6ms at 100kHz.
+#define MAX_BURST_CHUNKS   4
+
+//min/max/total duration (microseconds) of one kind of EEPROM transfer. Mean is total / count
+typedef struct {
+  uint32_t count;
+  uint32_t min;
+  uint32_t max;
+  uint32_t total;
+} MemCacheTiming;
+
+//Counters to size the cache (NUM_CACHED_PAGES, MAX_AGE, AGING_PERIOD) against real access patterns
+typedef struct {
+  uint32_t hits; //page was already cached
+  uint32_t misses; //page had to be read from EEPROM
+  uint32_t evictions; //a cached page had to be dropped to make room
+  uint32_t forcedFlushes; //every page was dirty so one was written synchronously to make room
+  uint32_t failedAllocs; //no cache page could be had so a Write returned false
+  MemCacheTiming readPage; //cache_readpage I2C transfers (including the wait for other bus users)
+  MemCacheTiming writePage; //cache_writepage I2C transfers (one per burst, including the wait for other bus users)
+} MemCacheStats;
+
+//called once the EEPROM has acknowledged (or failed) a page written by the write-back engine
+typedef void (*MemCacheWriteCallback)(uint32_t address, boolean success);
+
 class MemCache: public TickObserver {
   public:
   void setup();
   void handleTick();
   void FlushSinglePage();
   void FlushAllPages();
+  void WaitForWrites();
   void FlushPage(uint8_t page);
   void FlushAddress(uint32_t address);
   void InvalidatePage(uint8_t page);
@@ -77,6 +117,11 @@ class MemCache: public TickObserver {
   boolean Read(uint32_t address, uint16_t* valu);
   boolean Read(uint32_t address, uint32_t* valu);
   boolean Read(uint32_t address, void* data, uint16_t len);
+
+  boolean isWriting();
+  void setWriteCallback(MemCacheWriteCallback callback);
+  MemCacheStats *getStats();
+  void resetStats();
   
   MemCache();
   
@@ -85,16 +130,51 @@ class MemCache: public TickObserver {
     uint8_t data[256];
     uint32_t address; //address of start of page
     uint8_t age; //
-    boolean dirty;
+    uint16_t dirty; //one bit per DIRTY_CHUNK_SIZE bytes that have not been written yet
+    boolean queued; //sitting in the write-back queue
   } PageCache;
 
+  enum WriteBackState {
+    WB_IDLE, //EEPROM is free
+    WB_SENDING, //a burst is queued or on the bus
+    WB_WAIT_ACK //a burst went out and the EEPROM is busy with its write cycle
+  };
+
   PageCache pages[NUM_CACHED_PAGES];
-  boolean isWriting();
+  uint8_t pageIndex[EEPROM_PAGES]; //cache page holding each EEPROM page or 0xFF if it isn't cached
+  uint8_t writeQueue[NUM_CACHED_PAGES]; //pages waiting to be written. A page is only ever queued once
+  uint8_t queueHead, queueTail, queueCount;
+  WriteBackState writeState;
+  uint8_t writePage; //cache page of the write currently in progress
+  uint32_t writeAddress; //page address of the write in progress (the cache page could be reused meanwhile)
+  uint16_t writeMask; //dirty chunks covered by the write in progress
+  uint32_t writeStarted; //millis() when the page went out
+  uint32_t probeSent; //millis() when the last acknowledge poll went out
+  uint8_t writeBuffer[256]; //copy of the burst on its way so the page may change meanwhile
+  uint8_t probeByte; //low address byte of the acknowledge polling
+  TwiTransaction readTransaction;
+  TwiTransaction writeTransaction;
+  TwiTransaction probeTransaction; //acknowledge polling
+  MemCacheWriteCallback writeCallback;
+  MemCacheStats stats;
+
   uint8_t cache_hit(uint32_t address);
+  uint8_t cache_getpage(uint32_t addr);
+  void cache_setaddress(uint8_t page, uint32_t addr);
   void cache_age();
   uint8_t cache_findpage();
   uint8_t cache_readpage(uint32_t addr);
-  boolean cache_writepage(uint8_t page);
+  boolean cache_writepage(uint8_t page, uint8_t offset, uint16_t len);
+  void cache_markdirty(uint8_t page, uint8_t offset, uint16_t len);
+  void cache_flushnow(uint8_t page);
+  void cache_queuepage(uint8_t page);
+  boolean cache_startwrite(uint8_t page);
+  void cache_transaction(TwiTransaction *transaction, uint32_t address, boolean read, uint8_t *data, uint16_t len);
+  void cache_waitready();
+  boolean writeback_poll();
+  void writeback_step();
+  void writeback_complete(boolean success);
+  void stats_time(MemCacheTiming *timing, uint32_t elapsed);
   uint8_t agingTimer;
 };
 
@@ -28,10 +28,49 @@ SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
  */ 
 
 #include "PrefHandler.h"
+#include "DeviceManager.h"
+
+#define PREF_CRC_POLY	0x1021 //CRC-16/XMODEM, zero init so the CRC is linear in the data
+
+//feed one byte into the CRC
+static uint16_t crcUpdate(uint16_t crc, uint8_t data) {
+  crc ^= (uint16_t)data << 8;
+  for (uint8_t i = 0; i < 8; i++) {
+    crc = (crc & 0x8000) ? (crc << 1) ^ PREF_CRC_POLY : (crc << 1);
+  }
+  return crc;
+}
+
+//multiply two polynomials modulo the CRC polynomial
+static uint16_t crcMultiply(uint16_t a, uint16_t b) {
+  uint32_t product = 0;
+  int8_t i;
+  for (i = 0; i < 16; i++) {
+    if (b & (1 << i)) product ^= (uint32_t)a << i;
+  }
+  for (i = 30; i >= 16; i--) {
+    if (product & (1UL << i)) product ^= (0x10000UL | PREF_CRC_POLY) << (i - 16);
+  }
+  return product;
+}
+
+//the CRC after appending "bytes" zero bytes, i.e. crc * x^(8 * bytes)
+static uint16_t crcShift(uint16_t crc, uint16_t bytes) {
+  uint16_t power = 0x0100; //x^8
+  while (bytes) {
+    if (bytes & 1) crc = crcMultiply(crc, power);
+    power = crcMultiply(power, power);
+    bytes >>= 1;
+  }
+  return crc;
+}
 
 PrefHandler::PrefHandler() {
   lkg_address = EE_MAIN_OFFSET; //default to normal mode
   base_address = 0;
+#ifdef CFG_PREFS_RAM_IMAGE
+  loadImage();
+#endif
 }
 
 bool PrefHandler::isEnabled() 
@@ -39,12 +78,19 @@ bool PrefHandler::isEnabled()
 	return enabled;
 }
 
+//EEPROM address of offset 0 of the section (in the current LKG mode)
+uint32_t PrefHandler::getEEPROMAddress()
+{
+	return base_address + lkg_address;
+}
+
 void PrefHandler::setEnabledStatus(bool en) 
 {
 	uint16_t id;
 
 	enabled = en;
 
+	memCache->Read(EE_DEVICE_TABLE + (2 * position), &id);
 	if (enabled) {
 		id |= 0x8000; //set enabled bit
 	}
@@ -77,8 +123,8 @@ void PrefHandler::initDevTable()
 }
 
 //Given a device ID we must search the 64 entry table found in EEPROM to see if the device
-//has a spot in EEPROM. If it does not then 
-PrefHandler::PrefHandler(DeviceId id_in) {
+//has a spot in EEPROM. If it does not then one is allocated, enabled if enabledByDefault is set.
+PrefHandler::PrefHandler(DeviceId id_in, bool enabledByDefault) {
 	uint16_t id;
 
 	enabled = false; 
@@ -93,6 +139,9 @@ PrefHandler::PrefHandler(DeviceId id_in) {
 			if (id & 0x8000) enabled = true;
 			position = x;
 			Logger::info("Device ID: %X was found in device table at entry: %i", (int)id_in, x);
+#ifdef CFG_PREFS_RAM_IMAGE
+			loadImage();
+#endif
 			return;
 		}
 	}
@@ -104,11 +153,14 @@ PrefHandler::PrefHandler(DeviceId id_in) {
 		if (id == 0) {
 			base_address = EE_DEVICES_BASE + (EE_DEVICE_SIZE * x);
 			lkg_address = EE_MAIN_OFFSET;
-			enabled = false; //default to devices being off until the user says otherwise
-			id = (int)id_in;
+			enabled = enabledByDefault; //most devices are off until the user says otherwise
+			id = (int)id_in | (enabled ? 0x8000 : 0);
 			memCache->Write(EE_DEVICE_TABLE + (2*x), id);
 			position = x;
 			Logger::info("Device ID: %X was placed into device table at entry: %i", (int)id, x);
+#ifdef CFG_PREFS_RAM_IMAGE
+			loadImage();
+#endif
 			return;
 		}
 	}
@@ -117,14 +169,24 @@ PrefHandler::PrefHandler(DeviceId id_in) {
 	base_address = 0xF0F0;
 	lkg_address = EE_MAIN_OFFSET;
 	Logger::error("PrefManager - Device Table Full!!!");
+#ifdef CFG_PREFS_RAM_IMAGE
+	loadImage();
+#endif
 }
 
-//A special static function that can be called whenever, wherever to turn a specific device on/off. Does not
-//attempt to do so at runtime so the user will still have to power cycle to change the device status.
+//A special static function that can be called whenever, wherever to turn a specific device on/off. A device
+//which exists is switched through Device::setEnabled() so its cached state and the DeviceManager's index
+//follow right away, others only change in the device table.
 //returns true if it could make the change, false if it could not.
 bool PrefHandler::setDeviceStatus(uint16_t device, bool enabled) 
 {
 	uint16_t id;
+	Device *registered = DeviceManager::getInstance()->getDeviceByID((DeviceId) (device & 0x7FFF));
+
+	if (registered != NULL) {
+		registered->setEnabled(enabled);
+		return true;
+	}
 	for (int x = 1; x < 64; x++) {
 		memCache->Read(EE_DEVICE_TABLE + (2 * x), &id);
 		if ((id & 0x7FFF) == (device & 0x7FFF)) {
@@ -147,67 +209,176 @@ PrefHandler::~PrefHandler() {
 }
 
 void PrefHandler::LKG_mode(bool mode) {
+  uint32_t old_address = lkg_address;
   if (mode) lkg_address = EE_LKG_OFFSET;
   else lkg_address = EE_MAIN_OFFSET;
+#ifdef CFG_PREFS_RAM_IMAGE
+  if (lkg_address != old_address) loadImage();
+#endif
 }
 
+#ifdef CFG_PREFS_RAM_IMAGE
+//pull the whole section into RAM with one bulk read and compute its CRC once
+void PrefHandler::loadImage() {
+  memCache->Read(base_address + lkg_address, image, EE_DEVICE_SIZE);
+  crc = 0;
+  for (uint16_t i = EE_CRC_START; i < EE_DEVICE_SIZE; i++) crc = crcUpdate(crc, image[i]);
+}
+
+bool PrefHandler::readImage(uint16_t address, void *val, uint16_t len) {
+  if (address + len > EE_DEVICE_SIZE) return false;
+  memcpy(val, image + address, len);
+  return true;
+}
+
+/*
+ * Store new data in the image and fold the change into the CRC. As the CRC is linear,
+ * the CRC of the xor between old and new bytes, shifted past the rest of the section,
+ * is exactly what the CRC of the whole section changes by.
+ */
+bool PrefHandler::writeImage(uint16_t address, const void *val, uint16_t len) {
+  const uint8_t *data = (const uint8_t *)val;
+  uint16_t delta = 0, end = address + len;
+
+  if (end > EE_DEVICE_SIZE) return false;
+  for (uint16_t i = address; i < end; i++, data++) {
+    if (i >= EE_CRC_START) delta = crcUpdate(delta, image[i] ^ *data);
+    image[i] = *data;
+  }
+  if (delta) crc ^= crcShift(delta, EE_DEVICE_SIZE - end);
+  return true;
+}
+#endif
+
 bool PrefHandler::write(uint16_t address, uint8_t val) {
   if (address >= EE_DEVICE_SIZE) return false;
+#ifdef CFG_PREFS_RAM_IMAGE
+  if (!writeImage(address, &val, sizeof(val))) return false;
+#endif
   return memCache->Write((uint32_t)address + base_address + lkg_address, val);
 }
 
 bool PrefHandler::write(uint16_t address, uint16_t val) {
   if (address >= EE_DEVICE_SIZE) return false;
+#ifdef CFG_PREFS_RAM_IMAGE
+  if (!writeImage(address, &val, sizeof(val))) return false;
+#endif
   return memCache->Write((uint32_t)address + base_address + lkg_address, val);
 }
 
 bool PrefHandler::write(uint16_t address, uint32_t val) {
   if (address >= EE_DEVICE_SIZE) return false;
+#ifdef CFG_PREFS_RAM_IMAGE
+  if (!writeImage(address, &val, sizeof(val))) return false;
+#endif
   return memCache->Write((uint32_t)address + base_address + lkg_address, val);
 }
 
+//write a block of bytes, e.g. a string or a whole page of defaults
+bool PrefHandler::write(uint16_t address, const void *data, uint16_t len) {
+  if (address + len > EE_DEVICE_SIZE) return false;
+#ifdef CFG_PREFS_RAM_IMAGE
+  writeImage(address, data, len);
+#endif
+  return memCache->Write((uint32_t)address + base_address + lkg_address, (void *)data, len);
+}
+
 bool PrefHandler::read(uint16_t address, uint8_t *val) {
   if (address >= EE_DEVICE_SIZE) return false;
+#ifdef CFG_PREFS_RAM_IMAGE
+  return readImage(address, val, sizeof(*val));
+#else
   return memCache->Read((uint32_t)address + base_address + lkg_address, val);
+#endif
 }
 
 bool PrefHandler::read(uint16_t address, uint16_t *val) {
   if (address >= EE_DEVICE_SIZE) return false;
+#ifdef CFG_PREFS_RAM_IMAGE
+  return readImage(address, val, sizeof(*val));
+#else
   return memCache->Read((uint32_t)address + base_address + lkg_address, val);
+#endif
 }
 
 bool PrefHandler::read(uint16_t address, uint32_t *val) {
   if (address >= EE_DEVICE_SIZE) return false;
+#ifdef CFG_PREFS_RAM_IMAGE
+  return readImage(address, val, sizeof(*val));
+#else
   return memCache->Read((uint32_t)address + base_address + lkg_address, val);
+#endif
+}
+
+bool PrefHandler::read(uint16_t address, void *data, uint16_t len) {
+  if (address + len > EE_DEVICE_SIZE) return false;
+#ifdef CFG_PREFS_RAM_IMAGE
+  return readImage(address, data, len);
+#else
+  return memCache->Read((uint32_t)address + base_address + lkg_address, data, len);
+#endif
 }
 
-uint8_t PrefHandler::calcChecksum() {
-  uint16_t counter;
-  uint8_t accum = 0;
-  uint8_t temp;
-  for (counter = 1; counter < EE_DEVICE_SIZE; counter++) {
-    memCache->Read((uint32_t)counter + base_address + lkg_address, &temp);
-    accum += temp;
+//run the CRC (from EE_CRC_START) and the old 8 bit sum (from byte 1) over the section
+void PrefHandler::scanSection(uint16_t *crcOut, uint8_t *sumOut) {
+  uint16_t counter, i, len;
+  const uint8_t *data;
+#ifndef CFG_PREFS_RAM_IMAGE
+  uint8_t temp[64];
+#endif
+
+  *crcOut = 0;
+  *sumOut = 0;
+  //pull the section through the cache in chunks rather than a lookup per byte
+  for (counter = 1; counter < EE_DEVICE_SIZE; counter += len) {
+    len = EE_DEVICE_SIZE - counter;
+    if (len > 64) len = 64;
+#ifdef CFG_PREFS_RAM_IMAGE
+    data = image + counter;
+#else
+    memCache->Read((uint32_t)counter + base_address + lkg_address, temp, len);
+    data = temp;
+#endif
+    for (i = 0; i < len; i++) {
+      if (counter + i >= EE_CRC_START) *crcOut = crcUpdate(*crcOut, data[i]);
+      *sumOut += data[i];
+    }
   }
-  return accum;
-} 
+}
+
+uint16_t PrefHandler::calcChecksum() {
+#ifdef CFG_PREFS_RAM_IMAGE
+  return crc;
+#else
+  uint16_t calc;
+  uint8_t sum;
+  scanSection(&calc, &sum);
+  return calc;
+#endif
+}
 
 //calculate the current checksum and save it to the proper place
 void PrefHandler::saveChecksum() {
-  uint8_t csum;
-  csum = calcChecksum();
-  memCache->Write(EE_CHECKSUM + base_address + lkg_address, csum);
+  write(EE_CRC, calcChecksum());
 }
 
 bool PrefHandler::checksumValid() {
   //get checksum from EEPROM and calculate the current checksum to see if they match
-  uint8_t stored_chk, calc_chk;
-  
-  memCache->Read(EE_CHECKSUM + base_address + lkg_address, &stored_chk);
-  calc_chk = calcChecksum();
-  Logger::info("Stored Checksum: %X Calc: %X", stored_chk, calc_chk);
-  
-  return (stored_chk == calc_chk);
+  uint16_t stored_crc, calc_crc;
+  uint8_t stored_sum, calc_sum;
+
+  read(EE_CRC, &stored_crc);
+  calc_crc = calcChecksum();
+  Logger::info("Stored CRC: %X Calc: %X", stored_crc, calc_crc);
+  if (stored_crc == calc_crc) return true;
+
+  //sections written by older firmware only carry the 8 bit sum in EE_CHECKSUM
+  read(EE_CHECKSUM, &stored_sum);
+  scanSection(&calc_crc, &calc_sum);
+  if (stored_sum != calc_sum) return false;
+  Logger::info("Converting checksum %X to CRC", stored_sum);
+  saveChecksum();
+  return true;
 }
 
 void PrefHandler::forceCacheWrite()
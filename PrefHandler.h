@@ -46,21 +46,24 @@ class PrefHandler {
 public:
 
 	PrefHandler();
-	PrefHandler(DeviceId id);
+	PrefHandler(DeviceId id, bool enabledByDefault = false);
         ~PrefHandler();
 	void LKG_mode(bool mode);
 	bool write(uint16_t address, uint8_t val);
 	bool write(uint16_t address, uint16_t val);
 	bool write(uint16_t address, uint32_t val);
+	bool write(uint16_t address, const void *data, uint16_t len);
 	bool read(uint16_t address, uint8_t *val);
 	bool read(uint16_t address, uint16_t *val);
 	bool read(uint16_t address, uint32_t *val);
-	uint8_t calcChecksum();
+	bool read(uint16_t address, void *data, uint16_t len);
+	uint16_t calcChecksum();
 	void saveChecksum();
 	bool checksumValid();
     void forceCacheWrite();
 	bool isEnabled();
 	void setEnabledStatus(bool en);
+	uint32_t getEEPROMAddress();
 	static bool setDeviceStatus(uint16_t device, bool enabled);
 
 private:
@@ -70,6 +73,14 @@ private:
 	bool enabled;
 	int position; //position within the device table
 	void initDevTable();
+	void scanSection(uint16_t *crcOut, uint8_t *sumOut);
+#ifdef CFG_PREFS_RAM_IMAGE
+	uint8_t image[EE_DEVICE_SIZE]; //RAM copy of the section, kept in step with every write()
+	uint16_t crc; //CRC of the image, updated incrementally
+	void loadImage();
+	bool readImage(uint16_t address, void *val, uint16_t len);
+	bool writeImage(uint16_t address, const void *val, uint16_t len);
+#endif
 };
 
 #endif
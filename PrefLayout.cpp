@@ -0,0 +1,60 @@
+/*
+ * PrefLayout.cpp
+ *
+ * Compile time description of the fields stored in the system EEPROM section
+ *
+Copyright (c) 2013 Collin Kidder, Michael Neuweiler, Charles Galpin
+
+Permission is hereby granted, free of charge, to any person obtaining
+a copy of this software and associated documentation files (the
+"Software"), to deal in the Software without restriction, including
+without limitation the rights to use, copy, modify, merge, publish,
+distribute, sublicense, and/or sell copies of the Software, and to
+permit persons to whom the Software is furnished to do so, subject to
+the following conditions:
+
+The above copyright notice and this permission notice shall be included
+in all copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.
+IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY
+CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT,
+TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE
+SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+
+ */
+
+#include "PrefLayout.h"
+
+/*
+ * Write the default of every field listed in the table. The section is assembled one
+ * EEPROM page at a time and handed over with a single write per page, bytes not covered
+ * by the table keep their current content. The chunks follow the page boundaries of the
+ * EEPROM, not of the section, so a section which isn't page aligned doesn't make every
+ * write span two pages. The caller saves the checksum afterwards.
+ */
+void prefLoadDefaults(PrefHandler *prefs, const PrefField *table, uint8_t count) {
+	uint8_t page[256];
+	uint32_t base = prefs->getEEPROMAddress();
+	uint16_t start, end, pos, len;
+	uint8_t i;
+
+	for (start = 0; start < EE_DEVICE_SIZE; start += len) {
+		len = sizeof(page) - ((base + start) & (sizeof(page) - 1)); //up to the end of this EEPROM page
+		if (len > EE_DEVICE_SIZE - start) len = EE_DEVICE_SIZE - start;
+		end = start + len;
+		if (!prefs->read(start, page, len)) memset(page, 0, len);
+
+		for (i = 0; i < count; i++) {
+			const PrefField &field = table[i];
+			for (pos = field.offset; pos < field.offset + field.size; pos++) {
+				if (pos < start || pos >= end) continue;
+				if (field.type == PREF_TYPE_BLOB) page[pos - start] = field.def;
+				else page[pos - start] = field.def >> (8 * (pos - field.offset)); //little endian like the other writes
+			}
+		}
+		prefs->write(start, page, len);
+	}
+}
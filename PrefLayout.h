@@ -0,0 +1,243 @@
+/*
+ * PrefLayout.h
+ *
+ * Compile time description of the fields stored in the system EEPROM section
+ *
+Copyright (c) 2013 Collin Kidder, Michael Neuweiler, Charles Galpin
+
+Permission is hereby granted, free of charge, to any person obtaining
+a copy of this software and associated documentation files (the
+"Software"), to deal in the Software without restriction, including
+without limitation the rights to use, copy, modify, merge, publish,
+distribute, sublicense, and/or sell copies of the Software, and to
+permit persons to whom the Software is furnished to do so, subject to
+the following conditions:
+
+The above copyright notice and this permission notice shall be included
+in all copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.
+IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY
+CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT,
+TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE
+SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+
+ */
+
+#ifndef PREFLAYOUT_H_
+#define PREFLAYOUT_H_
+
+#include <Arduino.h>
+#include "config.h"
+#include "eeprom_layout.h"
+#include "PrefHandler.h"
+#include "ADCFilter.h"
+
+enum PrefType {
+	PREF_TYPE_U8,
+	PREF_TYPE_U16,
+	PREF_TYPE_U32,
+	PREF_TYPE_BLOB // string or byte array, the default is the fill byte
+};
+
+typedef struct {
+	uint8_t id; //must match the entry's index in the table
+	uint16_t offset; //offset within the section (EESYS_xxx etc)
+	uint8_t size; //bytes
+	uint8_t type; //PrefType
+	uint32_t def; //value written by prefLoadDefaults()
+	uint32_t min; //valid range, checked by prefGet()/prefSet()
+	uint32_t max;
+} PrefField;
+
+#define PREF_U8(id, offset, def, min, max)	{ id, offset, 1, PREF_TYPE_U8, def, min, max }
+#define PREF_U16(id, offset, def, min, max)	{ id, offset, 2, PREF_TYPE_U16, def, min, max }
+#define PREF_U32(id, offset, def, min, max)	{ id, offset, 4, PREF_TYPE_U32, def, min, max }
+#define PREF_BLOB(id, offset, size)			{ id, offset, size, PREF_TYPE_BLOB, 0, 0, 0 }
+
+enum SysPref {
+	SYSPREF_SYSTEM_TYPE,
+	SYSPREF_RAWADC,
+	SYSPREF_ADC0_GAIN,
+	SYSPREF_ADC0_OFFSET,
+	SYSPREF_ADC1_GAIN,
+	SYSPREF_ADC1_OFFSET,
+	SYSPREF_ADC2_GAIN,
+	SYSPREF_ADC2_OFFSET,
+	SYSPREF_ADC3_GAIN,
+	SYSPREF_ADC3_OFFSET,
+	SYSPREF_ADC0_FILTER,
+	SYSPREF_ADC0_FILTPARAM,
+	SYSPREF_ADC0_MEDIAN,
+	SYSPREF_ADC1_FILTER,
+	SYSPREF_ADC1_FILTPARAM,
+	SYSPREF_ADC1_MEDIAN,
+	SYSPREF_ADC2_FILTER,
+	SYSPREF_ADC2_FILTPARAM,
+	SYSPREF_ADC2_MEDIAN,
+	SYSPREF_ADC3_FILTER,
+	SYSPREF_ADC3_FILTPARAM,
+	SYSPREF_ADC3_MEDIAN,
+	SYSPREF_LOG_LEVEL,
+	SYSPREF_AMPHOURS,
+	SYSPREF_BRAKELIGHT,
+	SYSPREF_CAN0_BAUD,
+	SYSPREF_CAN1_BAUD,
+	SYSPREF_SERUSB_BAUD,
+	SYSPREF_TWI_BAUD,
+	SYSPREF_TICK_RATE,
+	SYSPREF_WIFIX_KEY,
+	SYSPREF_RTC_TIME,
+	SYSPREF_RTC_DATE,
+	SYSPREF_CAN_RX_COUNT,
+	SYSPREF_CAN_MASK0,
+	SYSPREF_CAN_FILTER0,
+	SYSPREF_CAN_MASK1,
+	SYSPREF_CAN_FILTER1,
+	SYSPREF_CAN_MASK2,
+	SYSPREF_CAN_FILTER2,
+	SYSPREF_CAN_MASK3,
+	SYSPREF_CAN_FILTER3,
+	SYSPREF_CAN_MASK4,
+	SYSPREF_CAN_FILTER4,
+	SYSPREF_CAN_MASK5,
+	SYSPREF_CAN_FILTER5,
+	SYSPREF_CAN_MASK6,
+	SYSPREF_CAN_FILTER6,
+	SYSPREF_WIFIX_SSID,
+	SYSPREF_WIFIX_CHAN,
+	SYSPREF_WIFIX_DHCP,
+	SYSPREF_WIFIX_MODE,
+	SYSPREF_WIFIX_IPADDR,
+	SYSPREF_WIFI0_SSID,
+	SYSPREF_WIFI0_CHAN,
+	SYSPREF_WIFI0_DHCP,
+	SYSPREF_WIFI0_MODE,
+	SYSPREF_WIFI0_IPADDR,
+	SYSPREF_WIFI0_KEY,
+	SYSPREF_WIFI1_SSID,
+	SYSPREF_WIFI1_CHAN,
+	SYSPREF_WIFI1_DHCP,
+	SYSPREF_WIFI1_MODE,
+	SYSPREF_WIFI1_IPADDR,
+	SYSPREF_WIFI1_KEY,
+	SYSPREF_COUNT
+};
+
+/*
+ * The system section, sorted by offset. Gaps are fine, overlaps are not (see the
+ * static_asserts below). New fields need an entry here and in SysPref.
+ */
+constexpr PrefField sysPrefLayout[SYSPREF_COUNT] = {
+	PREF_U8(SYSPREF_SYSTEM_TYPE, EESYS_SYSTEM_TYPE, 4, 1, 5), //GEVCU4 or GEVCU5 boards
+	PREF_U8(SYSPREF_RAWADC, EESYS_RAWADC, 0, 0, 255),
+	PREF_U16(SYSPREF_ADC0_GAIN, EESYS_ADC0_GAIN, 1024, 0, 65535), //no gain
+	PREF_U16(SYSPREF_ADC0_OFFSET, EESYS_ADC0_OFFSET, 0, 0, 4095), //no offset
+	PREF_U16(SYSPREF_ADC1_GAIN, EESYS_ADC1_GAIN, 1024, 0, 65535),
+	PREF_U16(SYSPREF_ADC1_OFFSET, EESYS_ADC1_OFFSET, 0, 0, 4095),
+	PREF_U16(SYSPREF_ADC2_GAIN, EESYS_ADC2_GAIN, 1024, 0, 65535),
+	PREF_U16(SYSPREF_ADC2_OFFSET, EESYS_ADC2_OFFSET, 0, 0, 4095),
+	PREF_U16(SYSPREF_ADC3_GAIN, EESYS_ADC3_GAIN, 1024, 0, 65535),
+	PREF_U16(SYSPREF_ADC3_OFFSET, EESYS_ADC3_OFFSET, 0, 0, 4095),
+	//average every new reading with the previous output, no spike filter
+	PREF_U8(SYSPREF_ADC0_FILTER, EESYS_ADC0_FILTER, ADC_FILTER_IIR, ADC_FILTER_NONE, ADC_FILTER_IIR),
+	PREF_U8(SYSPREF_ADC0_FILTPARAM, EESYS_ADC0_FILTPARAM, 1, 1, 64),
+	PREF_U8(SYSPREF_ADC0_MEDIAN, EESYS_ADC0_MEDIAN, 0, 0, ADC_MEDIAN_MAX),
+	PREF_U8(SYSPREF_ADC1_FILTER, EESYS_ADC1_FILTER, ADC_FILTER_IIR, ADC_FILTER_NONE, ADC_FILTER_IIR),
+	PREF_U8(SYSPREF_ADC1_FILTPARAM, EESYS_ADC1_FILTPARAM, 1, 1, 64),
+	PREF_U8(SYSPREF_ADC1_MEDIAN, EESYS_ADC1_MEDIAN, 0, 0, ADC_MEDIAN_MAX),
+	PREF_U8(SYSPREF_ADC2_FILTER, EESYS_ADC2_FILTER, ADC_FILTER_IIR, ADC_FILTER_NONE, ADC_FILTER_IIR),
+	PREF_U8(SYSPREF_ADC2_FILTPARAM, EESYS_ADC2_FILTPARAM, 1, 1, 64),
+	PREF_U8(SYSPREF_ADC2_MEDIAN, EESYS_ADC2_MEDIAN, 0, 0, ADC_MEDIAN_MAX),
+	PREF_U8(SYSPREF_ADC3_FILTER, EESYS_ADC3_FILTER, ADC_FILTER_IIR, ADC_FILTER_NONE, ADC_FILTER_IIR),
+	PREF_U8(SYSPREF_ADC3_FILTPARAM, EESYS_ADC3_FILTPARAM, 1, 1, 64),
+	PREF_U8(SYSPREF_ADC3_MEDIAN, EESYS_ADC3_MEDIAN, 0, 0, ADC_MEDIAN_MAX),
+	PREF_U8(SYSPREF_LOG_LEVEL, EESYS_LOG_LEVEL, 1, 0, 4), //info
+	PREF_U8(SYSPREF_AMPHOURS, EESYS_AMPHOURS, 0, 0, 255),
+	PREF_U8(SYSPREF_BRAKELIGHT, EESYS_BRAKELIGHT, 0, 0, 255),
+	PREF_U16(SYSPREF_CAN0_BAUD, EESYS_CAN0_BAUD, 500, 0, 1000), //multiplied by 1000 so 500k baud
+	PREF_U16(SYSPREF_CAN1_BAUD, EESYS_CAN1_BAUD, 500, 0, 1000),
+	PREF_U16(SYSPREF_SERUSB_BAUD, EESYS_SERUSB_BAUD, 11520, 0, 65535), //multiplied by 10
+	PREF_U16(SYSPREF_TWI_BAUD, EESYS_TWI_BAUD, 100, 0, 1000), //multiplied by 1000
+	PREF_U16(SYSPREF_TICK_RATE, EESYS_TICK_RATE, 100, 1, 65535), //number of ticks per second
+	PREF_BLOB(SYSPREF_WIFIX_KEY, EESYS_WIFIX_KEY, 40),
+	PREF_U32(SYSPREF_RTC_TIME, EESYS_RTC_TIME, 0, 0, 0xFFFFFFFF),
+	PREF_U32(SYSPREF_RTC_DATE, EESYS_RTC_DATE, 0, 0, 0xFFFFFFFF),
+	PREF_U8(SYSPREF_CAN_RX_COUNT, EESYS_CAN_RX_COUNT, 5, 1, 7), //how many RX mailboxes
+	PREF_U32(SYSPREF_CAN_MASK0, EESYS_CAN_MASK0, 0x7f0, 0, 0xFFFFFFFF), //standard frame, ignore bottom 4 bits
+	PREF_U32(SYSPREF_CAN_FILTER0, EESYS_CAN_FILTER0, 0x230, 0, 0xFFFFFFFF),
+	PREF_U32(SYSPREF_CAN_MASK1, EESYS_CAN_MASK1, 0x7f0, 0, 0xFFFFFFFF),
+	PREF_U32(SYSPREF_CAN_FILTER1, EESYS_CAN_FILTER1, 0x230, 0, 0xFFFFFFFF),
+	PREF_U32(SYSPREF_CAN_MASK2, EESYS_CAN_MASK2, 0x7f0, 0, 0xFFFFFFFF),
+	PREF_U32(SYSPREF_CAN_FILTER2, EESYS_CAN_FILTER2, 0x230, 0, 0xFFFFFFFF),
+	PREF_U32(SYSPREF_CAN_MASK3, EESYS_CAN_MASK3, 0x7f0, 0, 0xFFFFFFFF),
+	PREF_U32(SYSPREF_CAN_FILTER3, EESYS_CAN_FILTER3, 0x650, 0, 0xFFFFFFFF),
+	PREF_U32(SYSPREF_CAN_MASK4, EESYS_CAN_MASK4, 0x7f0, 0, 0xFFFFFFFF),
+	PREF_U32(SYSPREF_CAN_FILTER4, EESYS_CAN_FILTER4, 0x650, 0, 0xFFFFFFFF),
+	PREF_U32(SYSPREF_CAN_MASK5, EESYS_CAN_MASK5, 0, 0, 0xFFFFFFFF),
+	PREF_U32(SYSPREF_CAN_FILTER5, EESYS_CAN_FILTER5, 0, 0, 0xFFFFFFFF),
+	PREF_U32(SYSPREF_CAN_MASK6, EESYS_CAN_MASK6, 0, 0, 0xFFFFFFFF),
+	PREF_U32(SYSPREF_CAN_FILTER6, EESYS_CAN_FILTER6, 0, 0, 0xFFFFFFFF),
+	//no SSID, no channel, DHCP off, B mode
+	PREF_BLOB(SYSPREF_WIFIX_SSID, EESYS_WIFIX_SSID, 32),
+	PREF_U8(SYSPREF_WIFIX_CHAN, EESYS_WIFIX_CHAN, 0, 0, 11),
+	PREF_U8(SYSPREF_WIFIX_DHCP, EESYS_WIFIX_DHCP, 0, 0, 2),
+	PREF_U8(SYSPREF_WIFIX_MODE, EESYS_WIFIX_MODE, 0, 0, 1),
+	PREF_U32(SYSPREF_WIFIX_IPADDR, EESYS_WIFIX_IPADDR, 0, 0, 0xFFFFFFFF),
+	PREF_BLOB(SYSPREF_WIFI0_SSID, EESYS_WIFI0_SSID, 32),
+	PREF_U8(SYSPREF_WIFI0_CHAN, EESYS_WIFI0_CHAN, 0, 0, 11),
+	PREF_U8(SYSPREF_WIFI0_DHCP, EESYS_WIFI0_DHCP, 0, 0, 2),
+	PREF_U8(SYSPREF_WIFI0_MODE, EESYS_WIFI0_MODE, 0, 0, 1),
+	PREF_U32(SYSPREF_WIFI0_IPADDR, EESYS_WIFI0_IPADDR, 0, 0, 0xFFFFFFFF),
+	PREF_BLOB(SYSPREF_WIFI0_KEY, EESYS_WIFI0_KEY, 40),
+	PREF_BLOB(SYSPREF_WIFI1_SSID, EESYS_WIFI1_SSID, 32),
+	PREF_U8(SYSPREF_WIFI1_CHAN, EESYS_WIFI1_CHAN, 0, 0, 11),
+	PREF_U8(SYSPREF_WIFI1_DHCP, EESYS_WIFI1_DHCP, 0, 0, 2),
+	PREF_U8(SYSPREF_WIFI1_MODE, EESYS_WIFI1_MODE, 0, 0, 1),
+	PREF_U32(SYSPREF_WIFI1_IPADDR, EESYS_WIFI1_IPADDR, 0, 0, 0xFFFFFFFF),
+	PREF_BLOB(SYSPREF_WIFI1_KEY, EESYS_WIFI1_KEY, 40)
+};
+
+//every entry sits at its own index, has a size matching its type and a default within its range
+constexpr bool prefFieldsConsistent(const PrefField *table, uint8_t count, uint8_t index = 0) {
+	return index >= count || (table[index].id == index
+		&& (table[index].type == PREF_TYPE_BLOB || table[index].size == (1 << table[index].type))
+		&& table[index].def >= table[index].min && table[index].def <= table[index].max
+		&& prefFieldsConsistent(table, count, index + 1));
+}
+
+//sorted, no field runs into the next one and all lie behind the common header within the section
+constexpr bool prefFieldsFit(const PrefField *table, uint8_t count, uint8_t index = 0) {
+	return index >= count || (table[index].offset >= EE_CRC_START
+		&& table[index].offset + table[index].size <= (index + 1 < count ? table[index + 1].offset : EE_DEVICE_SIZE)
+		&& prefFieldsFit(table, count, index + 1));
+}
+
+static_assert(prefFieldsConsistent(sysPrefLayout, SYSPREF_COUNT), "sysPrefLayout: entry out of order or bad size/default");
+static_assert(prefFieldsFit(sysPrefLayout, SYSPREF_COUNT), "sysPrefLayout: fields overlap or exceed EE_DEVICE_SIZE");
+
+/*
+ * Typed access to a system field. The value's type has to match the field's width, anything
+ * else doesn't compile. prefGet() falls back to the default (and returns false) if the stored
+ * value is out of range, prefSet() refuses values out of range.
+ */
+template<SysPref ID, typename T> bool prefGet(PrefHandler *prefs, T *val) {
+	static_assert(sysPrefLayout[ID].type != PREF_TYPE_BLOB && sizeof(T) == sysPrefLayout[ID].size, "type doesn't match the width of this EEPROM field");
+	if (prefs->read(sysPrefLayout[ID].offset, val) && *val >= sysPrefLayout[ID].min && *val <= sysPrefLayout[ID].max)
+		return true;
+	*val = sysPrefLayout[ID].def;
+	return false;
+}
+
+template<SysPref ID, typename T> bool prefSet(PrefHandler *prefs, T val) {
+	static_assert(sysPrefLayout[ID].type != PREF_TYPE_BLOB && sizeof(T) == sysPrefLayout[ID].size, "type doesn't match the width of this EEPROM field");
+	if (val < sysPrefLayout[ID].min || val > sysPrefLayout[ID].max)
+		return false;
+	return prefs->write(sysPrefLayout[ID].offset, val);
+}
+
+void prefLoadDefaults(PrefHandler *prefs, const PrefField *table, uint8_t count);
+
+#endif
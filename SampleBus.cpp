@@ -0,0 +1,150 @@
+/*
+ * SampleBus.cpp
+ *
+ * Publish/subscribe of timestamped sensor samples
+ *
+Copyright (c) 2013 Collin Kidder, Michael Neuweiler, Charles Galpin
+
+Permission is hereby granted, free of charge, to any person obtaining
+a copy of this software and associated documentation files (the
+"Software"), to deal in the Software without restriction, including
+without limitation the rights to use, copy, modify, merge, publish,
+distribute, sublicense, and/or sell copies of the Software, and to
+permit persons to whom the Software is furnished to do so, subject to
+the following conditions:
+
+The above copyright notice and this permission notice shall be included
+in all copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.
+IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY
+CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT,
+TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE
+SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+
+ */
+
+#include "SampleBus.h"
+#include "TimeBase.h"
+
+SampleBus *SampleBus::sampleBus = NULL;
+
+SampleBus::SampleBus() {
+	memset(topics, 0, sizeof(topics));
+}
+
+/*
+ * Get the instance of the SampleBus (singleton pattern)
+ */
+SampleBus *SampleBus::getInstance() {
+	if (sampleBus == NULL)
+		sampleBus = new SampleBus();
+	return sampleBus;
+}
+
+/*
+ * Slot for the next sample of a topic, it holds the oldest sample until then. The slot is
+ * marked invalid so consumers still looking at the old sample notice.
+ */
+Sample *SampleBus::claim(SampleTopic topic) {
+	Sample *sample = &topics[topic].slots[(topics[topic].sequence + 1) % CFG_SAMPLE_BUS_DEPTH];
+	sample->sequence = 0;
+	__DMB();
+	return sample;
+}
+
+/*
+ * Release the sample filled in after claim() and hand it to the observers
+ */
+void SampleBus::publish(SampleTopic topic, DeviceId source) {
+	publish(topic, source, TimeBase::getInstance()->getStamp());
+}
+
+//Same for a sample which was taken some time before it could be published
+void SampleBus::publish(SampleTopic topic, DeviceId source, uint32_t timestamp) {
+	uint32_t sequence = topics[topic].sequence + 1;
+	Sample *sample = &topics[topic].slots[sequence % CFG_SAMPLE_BUS_DEPTH];
+
+	sample->timestamp = timestamp;
+	sample->source = source;
+	if (sample->count > SAMPLE_MAX_VALUES) sample->count = SAMPLE_MAX_VALUES;
+	sample->sequence = sequence;
+	__DMB(); // the sample has to be complete before it shows up as the latest one
+	topics[topic].sequence = sequence;
+
+	for (int i = 0; i < CFG_SAMPLE_BUS_OBSERVERS; i++) {
+		if (topics[topic].observers[i]) topics[topic].observers[i]->handleSample(topic, sample);
+	}
+}
+
+/*
+ * Have an observer called for every sample published on a topic.
+ * Returns false if the topic has no free observer entry.
+ */
+bool SampleBus::subscribe(SampleTopic topic, SampleObserver *observer) {
+	int free = -1;
+	for (int i = 0; i < CFG_SAMPLE_BUS_OBSERVERS; i++) {
+		if (topics[topic].observers[i] == observer) return true;
+		if (free == -1 && topics[topic].observers[i] == NULL) free = i;
+	}
+	if (free == -1) {
+		Logger::error("SampleBus - no free observer entry for topic %d", topic);
+		return false;
+	}
+	topics[topic].observers[free] = observer;
+	return true;
+}
+
+void SampleBus::unsubscribe(SampleTopic topic, SampleObserver *observer) {
+	for (int i = 0; i < CFG_SAMPLE_BUS_OBSERVERS; i++) {
+		if (topics[topic].observers[i] == observer) topics[topic].observers[i] = NULL;
+	}
+}
+
+/*
+ * The newest sample of a topic or NULL if nothing was published yet
+ */
+const Sample *SampleBus::getLatest(SampleTopic topic) {
+	uint32_t sequence = topics[topic].sequence;
+	if (sequence == 0) return NULL;
+	return &topics[topic].slots[sequence % CFG_SAMPLE_BUS_DEPTH];
+}
+
+/*
+ * The sample following the one with sequence number *cursor (start with 0), NULL if there
+ * is none yet. If samples were overwritten in between it skips to the oldest one left and
+ * adds the number of lost ones to *missed. *cursor is advanced to the returned sample.
+ */
+const Sample *SampleBus::getNext(SampleTopic topic, uint32_t *cursor, uint32_t *missed) {
+	uint32_t latest = topics[topic].sequence;
+	uint32_t next = *cursor + 1;
+
+	if (latest == 0 || *cursor == latest) return NULL;
+	//the oldest slot may be claimed for the next sample already, so only DEPTH - 1 are safe
+	if (latest - *cursor > CFG_SAMPLE_BUS_DEPTH - 1) {
+		next = latest - (CFG_SAMPLE_BUS_DEPTH - 2);
+		if (missed) *missed += next - *cursor - 1;
+	}
+	*cursor = next;
+	return &topics[topic].slots[next % CFG_SAMPLE_BUS_DEPTH];
+}
+
+/*
+ * Whether a sample obtained earlier with the given sequence number is still intact.
+ */
+bool SampleBus::isCurrent(const Sample *sample, uint32_t sequence) {
+	__DMB();
+	return sample->sequence == sequence;
+}
+
+/*
+ * Sequence number of the latest sample of a topic (0 = none yet)
+ */
+uint32_t SampleBus::getSequence(SampleTopic topic) {
+	return topics[topic].sequence;
+}
+
+void SampleObserver::handleSample(SampleTopic topic, const Sample *sample) {
+}
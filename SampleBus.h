@@ -0,0 +1,101 @@
+/*
+ * SampleBus.h
+ *
+ * Publish/subscribe of timestamped sensor samples
+ *
+Copyright (c) 2013 Collin Kidder, Michael Neuweiler, Charles Galpin
+
+Permission is hereby granted, free of charge, to any person obtaining
+a copy of this software and associated documentation files (the
+"Software"), to deal in the Software without restriction, including
+without limitation the rights to use, copy, modify, merge, publish,
+distribute, sublicense, and/or sell copies of the Software, and to
+permit persons to whom the Software is furnished to do so, subject to
+the following conditions:
+
+The above copyright notice and this permission notice shall be included
+in all copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.
+IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY
+CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT,
+TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE
+SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+
+ */
+
+#ifndef SAMPLEBUS_H_
+#define SAMPLEBUS_H_
+
+#include <Arduino.h>
+#include "config.h"
+#include "DeviceTypes.h"
+#include "Logger.h"
+
+#define SAMPLE_MAX_VALUES	4
+
+/*
+ * Topics and the meaning of the values published under them
+ */
+enum SampleTopic {
+	TOPIC_ADC, // value[0..3] = filtered analog inputs 0 - 3 (sys_io)
+	TOPIC_HUMIDITY, // value[0] = relative humidity in 0.01%, value[1] = temperature in 0.01 deg C
+	TOPIC_DIFF_PRES, // value[0] = differential pressure in 0.01 Pa, value[1] = temperature in 0.01 deg C
+	TOPIC_MASS_FLOW, // value[0] = flow in 0.001 slm
+	TOPIC_FAULT, // value[0] = device, value[1] = fault code, value[2] = fault # (see FaultHandler.h), value[3] = time in 0.1s
+	TOPIC_COUNT
+};
+
+typedef struct {
+	uint32_t sequence; // per topic, 1 for the first sample. 0 while the slot is being written
+	uint32_t timestamp; // TimeBase stamp (microseconds) when the sample was taken, the publish time unless the producer passes it
+	DeviceId source; // device which published it
+	uint8_t count; // number of valid entries in value
+	int32_t value[SAMPLE_MAX_VALUES];
+} Sample;
+
+class SampleObserver {
+public:
+	virtual void handleSample(SampleTopic topic, const Sample *sample);
+};
+
+/*
+ * Every topic has a ring of CFG_SAMPLE_BUS_DEPTH preallocated samples. A producer gets the
+ * next slot with claim(), fills in the values and calls publish() which stamps and releases
+ * it and calls the topic's observers. Nothing is copied or allocated.
+ *
+ * Consumers either subscribe() or poll: getLatest() returns the newest sample, getNext()
+ * walks the ring with a cursor and reports samples which were overwritten before the
+ * consumer got to them. The returned pointers reference the ring itself, a slot is reused
+ * after CFG_SAMPLE_BUS_DEPTH - 1 newer samples. Consumers which hold on to a sample across
+ * publishes check isCurrent() before trusting its values.
+ *
+ * A topic must only have one producer at a time. Observers run in the producer's context.
+ */
+class SampleBus {
+public:
+	static SampleBus *getInstance();
+	Sample *claim(SampleTopic topic);
+	void publish(SampleTopic topic, DeviceId source);
+	void publish(SampleTopic topic, DeviceId source, uint32_t timestamp);
+	bool subscribe(SampleTopic topic, SampleObserver *observer);
+	void unsubscribe(SampleTopic topic, SampleObserver *observer);
+	const Sample *getLatest(SampleTopic topic);
+	const Sample *getNext(SampleTopic topic, uint32_t *cursor, uint32_t *missed);
+	bool isCurrent(const Sample *sample, uint32_t sequence);
+	uint32_t getSequence(SampleTopic topic);
+
+private:
+	SampleBus();
+	static SampleBus *sampleBus;
+
+	struct {
+		Sample slots[CFG_SAMPLE_BUS_DEPTH];
+		volatile uint32_t sequence; // of the latest published sample
+		SampleObserver *observers[CFG_SAMPLE_BUS_OBSERVERS];
+	} topics[TOPIC_COUNT];
+};
+
+#endif
@@ -0,0 +1,501 @@
+/*
+ * SampleStore.cpp
+ *
+ * Compressed history of the published samples in the EE_SAMPLE_STORE area of the EEPROM
+ *
+Copyright (c) 2013 Collin Kidder, Michael Neuweiler, Charles Galpin
+
+Permission is hereby granted, free of charge, to any person obtaining
+a copy of this software and associated documentation files (the
+"Software"), to deal in the Software without restriction, including
+without limitation the rights to use, copy, modify, merge, publish,
+distribute, sublicense, and/or sell copies of the Software, and to
+permit persons to whom the Software is furnished to do so, subject to
+the following conditions:
+
+The above copyright notice and this permission notice shall be included
+in all copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.
+IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY
+CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT,
+TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE
+SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+
+ */
+
+#include "SampleStore.h"
+#include "TimeBase.h"
+
+static_assert(sizeof(SampleBlock) == 256, "a SampleBlock must fill one EEPROM page");
+
+SampleStore *SampleStore::sampleStore = NULL;
+
+static uint8_t putVarint(uint8_t *out, int32_t value) {
+	uint32_t zigzag = ((uint32_t) value << 1) ^ (uint32_t) (value >> 31);
+	uint8_t length = 0;
+
+	while (zigzag >= 0x80) {
+		out[length++] = (zigzag & 0x7F) | 0x80;
+		zigzag >>= 7;
+	}
+	out[length++] = zigzag;
+	return length;
+}
+
+//returns the bytes used, 0 if the varint doesn't end within length bytes
+static uint8_t getVarint(const uint8_t *in, uint16_t length, int32_t *value) {
+	uint32_t zigzag = 0;
+
+	for (uint8_t i = 0; i < 5 && i < length; i++) {
+		zigzag |= (uint32_t) (in[i] & 0x7F) << (7 * i);
+		if ((in[i] & 0x80) == 0) {
+			*value = (int32_t) (zigzag >> 1) ^ -(int32_t) (zigzag & 1);
+			return i + 1;
+		}
+	}
+	return 0;
+}
+
+//boot and time in one comparable number
+static uint64_t storeTime(uint16_t boot, uint32_t time) {
+	return ((uint64_t) boot << 32) | time;
+}
+
+SampleStore::SampleStore() {
+	for (int i = 0; i < TOPIC_COUNT; i++) {
+		streams[i].page = 0;
+		streams[i].dirty = false;
+		streams[i].lastStored = 0;
+	}
+	nextPage = 1;
+	nextSequence = 1;
+	bootCount = 0;
+	generation = 0;
+	lastCommit = 0;
+	linkLostBoot = 0;
+	linkLostTime = 0;
+	replaying = false;
+	replayQuery.block.sequence = 0;
+	memset(&stats, 0, sizeof(stats));
+	ready = false;
+}
+
+/*
+ * Get a singleton instance of the SampleStore
+ */
+SampleStore *SampleStore::getInstance() {
+	if (sampleStore == NULL) {
+		sampleStore = new SampleStore();
+	}
+	return sampleStore;
+}
+
+/*
+ * Load the header (formatting the area if it isn't valid), find the newest block and
+ * subscribe to the topics to keep.
+ */
+void SampleStore::setup() {
+	SampleStoreHeader header;
+
+	TickHandler::getInstance()->detach(this);
+
+	memCache->Read(EE_SAMPLE_STORE, &header, sizeof(header));
+	if (header.magic != SAMPLESTORE_MAGIC || header.version != SAMPLESTORE_VERSION || header.blocks != SAMPLESTORE_BLOCKS) {
+		Logger::info("Initializing sample store");
+		format(&header);
+	}
+	header.bootCount++;
+	bootCount = header.bootCount;
+	generation = header.generation;
+	memCache->Write(EE_SAMPLE_STORE, &header, sizeof(header));
+	memCache->FlushAddress(EE_SAMPLE_STORE);
+
+	findHead();
+	linkLostBoot = bootCount; // nobody has seen anything of this boot yet
+	linkLostTime = 0;
+	ready = true;
+	Logger::info("Sample store boot %d, next block %l on page %d", bootCount, nextSequence, nextPage);
+
+	for (int i = 0; i < TOPIC_COUNT; i++) {
+		if (CFG_SAMPLESTORE_TOPICS & (1 << i))
+			SampleBus::getInstance()->subscribe((SampleTopic) i, this);
+	}
+	TickHandler::getInstance()->attach(this, CFG_TICK_INTERVAL_SAMPLESTORE);
+}
+
+//write the open blocks every CFG_SAMPLESTORE_COMMIT_INTERVAL so a power loss costs little history
+void SampleStore::handleTick() {
+	if (TimeBase::getInstance()->getMillis() - lastCommit >= CFG_SAMPLESTORE_COMMIT_INTERVAL)
+		commit();
+}
+
+/*
+ * Add a sample to its topic's block, one per CFG_SAMPLESTORE_INTERVAL. Samples are published
+ * from the main loop, so this runs there too and may use the cache.
+ */
+void SampleStore::handleSample(SampleTopic topic, const Sample *sample) {
+	TimeBase *timeBase = TimeBase::getInstance();
+	uint32_t time = timeBase->getMillis() - (timeBase->getStamp() - sample->timestamp) / 1000;
+	uint8_t count = (sample->count > SAMPLE_MAX_VALUES ? SAMPLE_MAX_VALUES : sample->count);
+
+	if (!ready)
+		return;
+	if (streams[topic].page != 0) {
+		if (time - streams[topic].lastStored < CFG_SAMPLESTORE_INTERVAL)
+			return;
+		if (streams[topic].block.channels != count || streams[topic].block.used + SAMPLESTORE_MAX_SAMPLE > SAMPLESTORE_DATA_SIZE)
+			closeBlock(topic);
+	}
+	if (streams[topic].page == 0 && !openBlock(topic, time, count))
+		return;
+
+	SampleBlock *block = &streams[topic].block;
+	uint16_t used = block->used;
+	if (!encode(block, &streams[topic].cursor, time, sample->value))
+		return;
+	streams[topic].lastStored = time;
+	streams[topic].dirty = true;
+	stats.samples++;
+	stats.bytes += block->used - used;
+	stats.rawBytes += 4 + 2 * count;
+}
+
+/*
+ * Write all open blocks to the cache.
+ */
+void SampleStore::commit() {
+	for (int i = 0; i < TOPIC_COUNT; i++) {
+		if (streams[i].page != 0 && streams[i].dirty && writeBlock(streams[i].page, &streams[i].block))
+			streams[i].dirty = false;
+	}
+	lastCommit = TimeBase::getInstance()->getMillis();
+}
+
+/*
+ * The last telemetry client is gone, the next startReplay() sends everything from now on.
+ * An interrupted replay starts over from where it started before.
+ */
+void SampleStore::linkDown() {
+	if (!replaying) {
+		linkLostBoot = bootCount;
+		linkLostTime = TimeBase::getInstance()->getMillis();
+	}
+	replaying = false;
+}
+
+/*
+ * Start handing out the samples stored since linkDown() (or since boot) through replayNext().
+ */
+void SampleStore::startReplay() {
+	if (!ready)
+		return;
+	replaying = startQuery(&replayQuery, linkLostBoot, linkLostTime, bootCount, TimeBase::getInstance()->getMillis());
+	if (replaying)
+		Logger::info("replaying sample history from block %l to %l", replayQuery.sequence, replayQuery.end - 1);
+}
+
+/*
+ * Get the next sample of the replay, false when it's done. time is in TimeBase milliseconds
+ * of the given boot.
+ */
+bool SampleStore::replayNext(SampleTopic *topic, uint16_t *boot, uint32_t *time, Sample *sample) {
+	if (replaying && queryNext(&replayQuery, topic, boot, time, sample))
+		return true;
+	if (replaying) {
+		linkLostBoot = replayQuery.untilBoot; // all sent up to the start of the replay
+		linkLostTime = replayQuery.untilTime;
+	}
+	replaying = false;
+	return false;
+}
+
+/*
+ * Start a query for the stored samples of all topics after fromBoot/fromTime up to and
+ * including untilBoot/untilTime (TimeBase milliseconds of the given boot). The first block
+ * is found with a binary search over the block headers, see findBlock().
+ * Returns false if no block can hold such samples.
+ */
+bool SampleStore::startQuery(SampleStoreQuery *query, uint16_t fromBoot, uint32_t fromTime, uint16_t untilBoot, uint32_t untilTime) {
+	query->fromBoot = fromBoot;
+	query->fromTime = fromTime;
+	query->untilBoot = untilBoot;
+	query->untilTime = untilTime;
+	query->block.sequence = 0;
+	if (!ready) {
+		query->sequence = query->end = 0;
+		return false;
+	}
+	commit(); // so the open blocks can be read back through the cache
+	query->sequence = findBlock(fromBoot, fromTime);
+	query->end = nextSequence;
+	return query->sequence != query->end;
+}
+
+/*
+ * Get the next sample of a query, false when it's done. Samples come in block order, which
+ * is only by time within each topic. Blocks are read through the cache, each one when the
+ * previous is done, blocks overwritten in the meantime are skipped.
+ */
+bool SampleStore::queryNext(SampleStoreQuery *query, SampleTopic *topic, uint16_t *boot, uint32_t *time, Sample *sample) {
+	uint64_t from = storeTime(query->fromBoot, query->fromTime);
+	uint64_t until = storeTime(query->untilBoot, query->untilTime);
+
+	while (query->sequence != query->end) {
+		if (query->block.sequence != query->sequence) {
+			if (nextSequence - query->sequence > SAMPLESTORE_BLOCKS) { // overwritten in the meantime
+				query->sequence = nextSequence - SAMPLESTORE_BLOCKS;
+				if (query->end - query->sequence > SAMPLESTORE_BLOCKS) // the whole range is gone
+					query->sequence = query->end;
+				continue;
+			}
+			if (!readBlock(query->sequence, &query->block)) {
+				query->block.sequence = 0;
+				query->sequence++;
+				continue;
+			}
+			startCursor(&query->block, &query->cursor);
+		}
+		if (!decode(&query->block, &query->cursor)) {
+			query->sequence++;
+			continue;
+		}
+		uint64_t sampleTime = storeTime(query->block.boot, query->cursor.time);
+		if (sampleTime <= from || sampleTime > until)
+			continue;
+
+		*topic = (SampleTopic) query->block.topic;
+		*boot = query->block.boot;
+		*time = query->cursor.time;
+		sample->sequence = 0;
+		sample->timestamp = 0;
+		sample->source = INVALID; // not kept
+		sample->count = query->block.channels;
+		for (int i = 0; i < SAMPLE_MAX_VALUES; i++)
+			sample->value[i] = (i < query->block.channels ? query->cursor.value[i] : 0);
+		return true;
+	}
+	return false;
+}
+
+bool SampleStore::isReplaying() {
+	return replaying;
+}
+
+SampleStoreStats *SampleStore::getStats() {
+	return &stats;
+}
+
+/*
+ * Start a new block for a topic on the next page and write its header, which keeps the
+ * sequence numbers consecutive in page order even if the block never gets a sample more.
+ */
+bool SampleStore::openBlock(SampleTopic topic, uint32_t time, uint8_t channels) {
+	SampleBlock *block = &streams[topic].block;
+
+	block->sequence = nextSequence++;
+	block->boot = bootCount;
+	block->topic = topic;
+	block->channels = channels;
+	block->time = block->lastTime = time;
+	block->samples = 0;
+	block->used = 0;
+	streams[topic].page = nextPage;
+	nextPage = (nextPage % SAMPLESTORE_BLOCKS) + 1;
+	startCursor(block, &streams[topic].cursor);
+	stats.blocks++;
+	if (!writeBlock(streams[topic].page, block)) {
+		stats.failed++;
+		streams[topic].page = 0;
+		return false;
+	}
+	streams[topic].dirty = false;
+	return true;
+}
+
+void SampleStore::closeBlock(SampleTopic topic) {
+	if (streams[topic].dirty && !writeBlock(streams[topic].page, &streams[topic].block))
+		stats.failed++;
+	streams[topic].dirty = false;
+	streams[topic].page = 0;
+}
+
+void SampleStore::startCursor(SampleBlock *block, SampleCursor *cursor) {
+	cursor->samples = 0;
+	cursor->offset = 0;
+	cursor->time = block->time;
+	cursor->delta = 0;
+	for (int i = 0; i < SAMPLE_MAX_VALUES; i++)
+		cursor->value[i] = 0;
+}
+
+/*
+ * Append a sample to the block, false if it doesn't fit.
+ */
+bool SampleStore::encode(SampleBlock *block, SampleCursor *cursor, uint32_t time, const int32_t *value) {
+	uint8_t *out = block->data + block->used;
+	int32_t delta = time - cursor->time;
+
+	if (block->used + SAMPLESTORE_MAX_SAMPLE > SAMPLESTORE_DATA_SIZE)
+		return false;
+	out += putVarint(out, delta - cursor->delta);
+	for (int i = 0; i < block->channels; i++) {
+		out += putVarint(out, value[i] - cursor->value[i]);
+		cursor->value[i] = value[i];
+	}
+	cursor->time = time;
+	cursor->delta = delta;
+	cursor->samples++;
+	cursor->offset = block->used = out - block->data;
+	block->samples = cursor->samples;
+	block->lastTime = time;
+	return true;
+}
+
+/*
+ * Decode the next sample into the cursor, false at the end of the block (or if it's garbled).
+ */
+bool SampleStore::decode(SampleBlock *block, SampleCursor *cursor) {
+	int32_t change;
+	uint8_t length;
+
+	if (cursor->samples >= block->samples)
+		return false;
+	length = getVarint(block->data + cursor->offset, block->used - cursor->offset, &change);
+	if (length == 0)
+		return false;
+	cursor->offset += length;
+	cursor->delta += change;
+	cursor->time += cursor->delta;
+	for (int i = 0; i < block->channels; i++) {
+		length = getVarint(block->data + cursor->offset, block->used - cursor->offset, &change);
+		if (length == 0)
+			return false;
+		cursor->offset += length;
+		cursor->value[i] += change;
+	}
+	cursor->samples++;
+	return true;
+}
+
+/*
+ * Binary search for the first block started after the given time. The blocks of the other
+ * topics which were open at that time started earlier, so the result steps back as many
+ * blocks as there are topics (the replay skips samples which are too old).
+ */
+uint32_t SampleStore::findBlock(uint16_t boot, uint32_t time) {
+	SampleBlock block;
+	uint64_t from = storeTime(boot, time);
+	uint32_t oldest = (nextSequence > SAMPLESTORE_BLOCKS ? nextSequence - SAMPLESTORE_BLOCKS : 1);
+	uint32_t low = oldest, high = nextSequence, mid;
+
+	while (low < high) {
+		mid = low + (high - low) / 2;
+		//pages which were never written (or are corrupt) only show up at the old end
+		if (readBlock(mid, &block) && storeTime(block.boot, block.time) > from)
+			high = mid;
+		else
+			low = mid + 1;
+	}
+	return (low - oldest > TOPIC_COUNT ? low - TOPIC_COUNT : oldest);
+}
+
+//page of a block which is still in the ring
+uint16_t SampleStore::pageOf(uint32_t sequence) {
+	uint32_t back = nextSequence - sequence; // 1 for the newest block
+
+	return ((nextPage - 1 + SAMPLESTORE_BLOCKS - (back % SAMPLESTORE_BLOCKS)) % SAMPLESTORE_BLOCKS) + 1;
+}
+
+uint32_t SampleStore::pageAddress(uint16_t page) {
+	return EE_SAMPLE_STORE + 256 * (uint32_t) page;
+}
+
+/*
+ * Fletcher-16 over the block header and the used data.
+ */
+uint16_t SampleStore::checksum(SampleBlock *block) {
+	uint16_t sum1 = 0, sum2 = 0;
+	uint8_t *bytes = (uint8_t *) block;
+	int i;
+
+	for (i = 0; i < 22; i++) { // header up to the checksum
+		sum1 = (sum1 + bytes[i]) % 255;
+		sum2 = (sum2 + sum1) % 255;
+	}
+	for (i = 0; i < block->used && i < SAMPLESTORE_DATA_SIZE; i++) {
+		sum1 = (sum1 + block->data[i]) % 255;
+		sum2 = (sum2 + sum1) % 255;
+	}
+	return (sum2 << 8) | sum1;
+}
+
+//read the block with the given sequence number, false if it was overwritten or is corrupt
+bool SampleStore::readBlock(uint32_t sequence, SampleBlock *block) {
+	if (nextSequence - sequence > SAMPLESTORE_BLOCKS || sequence >= nextSequence)
+		return false;
+	return readPage(pageOf(sequence), block) && block->sequence == sequence;
+}
+
+bool SampleStore::readPage(uint16_t page, SampleBlock *block) {
+	if (!memCache->Read(pageAddress(page), block, sizeof(SampleBlock)))
+		return false;
+	if (block->sequence == 0 || block->used > SAMPLESTORE_DATA_SIZE || block->channels > SAMPLE_MAX_VALUES
+			|| block->generation != generation)
+		return false;
+	return block->checksum == checksum(block);
+}
+
+/*
+ * Hand the used part of a block to the cache and queue it for writing.
+ */
+bool SampleStore::writeBlock(uint16_t page, SampleBlock *block) {
+	block->generation = generation;
+	block->checksum = checksum(block);
+	if (!memCache->Write(pageAddress(page), block, sizeof(SampleBlock) - SAMPLESTORE_DATA_SIZE + block->used))
+		return false;
+	memCache->FlushAddress(pageAddress(page));
+	return true;
+}
+
+/*
+ * Start a new, empty generation of the store, same as SysLog::format(). The blocks aren't
+ * touched, they belong to an older generation now and read as unused.
+ */
+void SampleStore::format(SampleStoreHeader *header) {
+	header->magic = SAMPLESTORE_MAGIC;
+	header->version = SAMPLESTORE_VERSION;
+	header->reserved = 0;
+	header->blocks = SAMPLESTORE_BLOCKS;
+	header->bootCount = 0;
+	header->generation++;
+}
+
+/*
+ * Same as SysLog::findHead(): pages 1 to head carry consecutive sequence numbers starting
+ * with the one of page 1, the pages after it are older or unused.
+ */
+void SampleStore::findHead() {
+	SampleBlock block;
+	uint32_t first;
+	uint16_t low = 1, high = SAMPLESTORE_BLOCKS, mid;
+
+	if (!readPage(1, &block)) { // empty store
+		nextPage = 1;
+		nextSequence = 1;
+		return;
+	}
+	first = block.sequence;
+	while (low < high) {
+		mid = (low + high + 1) / 2;
+		if (readPage(mid, &block) && block.sequence >= first)
+			low = mid;
+		else
+			high = mid - 1;
+	}
+	readPage(low, &block);
+	nextPage = (low % SAMPLESTORE_BLOCKS) + 1;
+	nextSequence = block.sequence + 1;
+}
@@ -0,0 +1,174 @@
+/*
+ * SampleStore.h
+ *
+ * Compressed history of the published samples in the EE_SAMPLE_STORE area of the EEPROM
+ *
+Copyright (c) 2013 Collin Kidder, Michael Neuweiler, Charles Galpin
+
+Permission is hereby granted, free of charge, to any person obtaining
+a copy of this software and associated documentation files (the
+"Software"), to deal in the Software without restriction, including
+without limitation the rights to use, copy, modify, merge, publish,
+distribute, sublicense, and/or sell copies of the Software, and to
+permit persons to whom the Software is furnished to do so, subject to
+the following conditions:
+
+The above copyright notice and this permission notice shall be included
+in all copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.
+IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY
+CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT,
+TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE
+SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+
+ */
+
+#ifndef SAMPLESTORE_H_
+#define SAMPLESTORE_H_
+
+#include <Arduino.h>
+#include "config.h"
+#include "Logger.h"
+#include "MemCache.h"
+#include "TickHandler.h"
+#include "SampleBus.h"
+#include "eeprom_layout.h"
+
+extern MemCache *memCache;
+
+/*
+ * The first EEPROM page of the area holds a SampleStoreHeader, the remaining pages form a
+ * ring of blocks of one page each. Every topic in CFG_SAMPLESTORE_TOPICS keeps one sample
+ * per CFG_SAMPLESTORE_INTERVAL in the block it is filling. A block gets the next page and
+ * sequence number when it is started and is written right away, so the sequence grows by
+ * one per page like in the SysLog and the head is found the same way. The block headers
+ * double as the index: blocks are ordered by the time of their first sample, a range
+ * query is a binary search over the ring (a few page reads).
+ * Formatting only bumps the generation in the header, blocks written in an older
+ * generation count as unused.
+ *
+ * Samples are packed one after the other into the block data as zigzag varints (7 bits per
+ * byte, lowest first, bit 7 set if another byte follows):
+ * time: change of the distance to the previous sample (ms), then for every value: change
+ * to the previous value (to 0 for the first sample). Regularly spaced, slowly moving
+ * samples take 1 byte for the time and 1-2 per value instead of 4 + 2 per value.
+ *
+ * All EEPROM access goes through readBlock() / writeBlock(), another backend (SD card, flash)
+ * only has to replace those.
+ */
+#define SAMPLESTORE_MAGIC		0x53535452 // "SSTR"
+#define SAMPLESTORE_VERSION		2
+#define SAMPLESTORE_BLOCKS		((EE_SAMPLE_STORE_SIZE / 256) - 1) // blocks, without the header
+#define SAMPLESTORE_DATA_SIZE	232 // 256 bytes page minus block header
+#define SAMPLESTORE_MAX_SAMPLE	(5 * (1 + SAMPLE_MAX_VALUES)) // worst case size of an encoded sample
+
+struct SampleStoreHeader {
+	uint32_t magic;
+	uint8_t version;
+	uint8_t reserved;
+	uint16_t blocks;
+	uint16_t bootCount; // incremented at every boot, stored with every block
+	uint16_t generation; // incremented at every format, stored with every block
+};
+
+struct SampleBlock {
+	uint32_t sequence; // 0 if the page was never written
+	uint16_t boot; // boot count when the block was started
+	uint8_t topic; // SampleTopic
+	uint8_t channels; // values per sample
+	uint32_t time; // TimeBase milliseconds of the first sample
+	uint32_t lastTime; // of the last sample
+	uint16_t samples;
+	uint16_t used; // bytes of data in use
+	uint16_t generation; // generation of the store the block was written in
+	uint16_t checksum; // Fletcher-16 over the header and the used data
+	uint8_t data[SAMPLESTORE_DATA_SIZE];
+};
+
+//where en- or decoding of a block stands, the values of the previous sample
+struct SampleCursor {
+	uint16_t samples;
+	uint16_t offset;
+	uint32_t time;
+	int32_t delta; // ms between the previous two samples
+	int32_t value[SAMPLE_MAX_VALUES];
+};
+
+//a range query in progress (see SampleStore::startQuery()), the caller provides the storage
+struct SampleStoreQuery {
+	uint16_t fromBoot; // samples after this time...
+	uint32_t fromTime;
+	uint16_t untilBoot; // ...up to and including this one
+	uint32_t untilTime;
+	uint32_t sequence; // block being read
+	uint32_t end; // first block started after the query
+	SampleBlock block;
+	SampleCursor cursor;
+};
+
+struct SampleStoreStats {
+	uint32_t samples; // stored since boot
+	uint32_t bytes; // they took encoded
+	uint32_t rawBytes; // they would have taken as 32 bit time and 16 bit values
+	uint32_t blocks; // blocks started
+	uint32_t failed; // blocks which couldn't be handed to the cache
+};
+
+class SampleStore: public TickObserver, public SampleObserver {
+public:
+	static SampleStore *getInstance();
+	void setup();
+	void handleTick();
+	void handleSample(SampleTopic topic, const Sample *sample);
+	void commit();
+	void linkDown();
+	void startReplay();
+	bool replayNext(SampleTopic *topic, uint16_t *boot, uint32_t *time, Sample *sample);
+	bool isReplaying();
+	bool startQuery(SampleStoreQuery *query, uint16_t fromBoot, uint32_t fromTime, uint16_t untilBoot, uint32_t untilTime);
+	bool queryNext(SampleStoreQuery *query, SampleTopic *topic, uint16_t *boot, uint32_t *time, Sample *sample);
+	SampleStoreStats *getStats();
+
+private:
+	SampleStore();
+	static SampleStore *sampleStore;
+
+	struct {
+		SampleBlock block;
+		SampleCursor cursor;
+		uint16_t page; // 0 while no block is open
+		bool dirty; // samples which weren't written yet
+		uint32_t lastStored; // time of the newest sample in the block
+	} streams[TOPIC_COUNT];
+	uint16_t nextPage; // page the next block goes to
+	uint32_t nextSequence;
+	uint16_t bootCount;
+	uint16_t generation; // blocks of other generations are left over from before the last format
+	uint32_t lastCommit; // TimeBase milliseconds of the last write of the open blocks
+	uint16_t linkLostBoot; // history after this time is replayed at the next startReplay()
+	uint32_t linkLostTime;
+	bool replaying;
+	SampleStoreQuery replayQuery; // up to the start of the replay, samples after that went out live
+	SampleStoreStats stats;
+	bool ready;
+
+	bool openBlock(SampleTopic topic, uint32_t time, uint8_t channels);
+	void closeBlock(SampleTopic topic);
+	bool encode(SampleBlock *block, SampleCursor *cursor, uint32_t time, const int32_t *value);
+	bool decode(SampleBlock *block, SampleCursor *cursor);
+	void startCursor(SampleBlock *block, SampleCursor *cursor);
+	uint32_t findBlock(uint16_t boot, uint32_t time);
+	uint16_t pageOf(uint32_t sequence);
+	uint32_t pageAddress(uint16_t page);
+	uint16_t checksum(SampleBlock *block);
+	bool readBlock(uint32_t sequence, SampleBlock *block);
+	bool readPage(uint16_t page, SampleBlock *block);
+	bool writeBlock(uint16_t page, SampleBlock *block);
+	void format(SampleStoreHeader *header);
+	void findHead();
+};
+
+#endif /* SAMPLESTORE_H_ */
@@ -44,11 +44,18 @@ SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
 #include "sys_io.h"
 //#include "CanHandler.h"
 #include "MemCache.h"
+#include "SysLog.h"
+#include "TimeBase.h"
+#include "SampleStore.h"
+#include "SystemLoad.h"
 //#include "ThrottleDetector.h"
 #include "DeviceManager.h"
 #include "SerialConsole.h"
 //#include "ELM327_Emu.h"
 #include "ichip_2128.h"
+#include "DiffPressureSensor.h"
+#include "HumiditySensor.h"
+#include "MassFlowSensor.h"
 #include "Sys_Messages.h"
 //#include "CodaMotorController.h"
 
@@ -55,7 +55,6 @@ Random comments on things that should be coded up soon:
 // identify the required libraries for the build.
 #include <due_rtc.h>
 #include <due_can.h>
-#include <due_wire.h>
 #include <DueTimer.h>
 
 //RTC_clock rtc_clock(XTAL); //init RTC with the external 32k crystal as a reference
@@ -117,104 +116,16 @@ SerialUSB.println("WiReach Wireless Module Initialized....");
 //there is only one checksum check for all of them so it's simple to do it all here.
 
 void initSysEEPROM() {
-	//three temporary storage places to make saving to EEPROM easy
-	uint8_t eight;
-	uint16_t sixteen;
-	uint32_t thirtytwo;
-
-	eight = 4; //GEVCU4 or GEVCU5 boards
-	sysPrefs->write(EESYS_SYSTEM_TYPE, eight);
-
-	sixteen = 1024; //no gain
-	sysPrefs->write(EESYS_ADC0_GAIN, sixteen);
-	sysPrefs->write(EESYS_ADC1_GAIN, sixteen);
-	sysPrefs->write(EESYS_ADC2_GAIN, sixteen);
-	sysPrefs->write(EESYS_ADC3_GAIN, sixteen);
-
-	sixteen = 0; //no offset
-	sysPrefs->write(EESYS_ADC0_OFFSET, sixteen);
-	sysPrefs->write(EESYS_ADC1_OFFSET, sixteen);
-	sysPrefs->write(EESYS_ADC2_OFFSET, sixteen);
-	sysPrefs->write(EESYS_ADC3_OFFSET, sixteen);
-
-	sixteen = 500; //multiplied by 1000 so 500k baud
-	sysPrefs->write(EESYS_CAN0_BAUD, sixteen);
-	sysPrefs->write(EESYS_CAN1_BAUD, sixteen);
-
-	sixteen = 11520; //multiplied by 10
-	sysPrefs->write(EESYS_SERUSB_BAUD, sixteen);
-
-	sixteen = 100; //multiplied by 1000
-	sysPrefs->write(EESYS_TWI_BAUD, sixteen);
-
-	sixteen = 100; //number of ticks per second
-	sysPrefs->write(EESYS_TICK_RATE, sixteen);
-
-	thirtytwo = 0;
-	sysPrefs->write(EESYS_RTC_TIME, thirtytwo);
-	sysPrefs->write(EESYS_RTC_DATE, thirtytwo);
-
-	eight = 5; //how many RX mailboxes
-	sysPrefs->write(EESYS_CAN_RX_COUNT, eight);
-
-	thirtytwo = 0x7f0; //standard frame, ignore bottom 4 bits
-	sysPrefs->write(EESYS_CAN_MASK0, thirtytwo);
-	sysPrefs->write(EESYS_CAN_MASK1, thirtytwo);
-	sysPrefs->write(EESYS_CAN_MASK2, thirtytwo);
-	sysPrefs->write(EESYS_CAN_MASK3, thirtytwo);
-	sysPrefs->write(EESYS_CAN_MASK4, thirtytwo);
-
-	thirtytwo = 0x230;
-	sysPrefs->write(EESYS_CAN_FILTER0, thirtytwo);
-	sysPrefs->write(EESYS_CAN_FILTER1, thirtytwo);
-	sysPrefs->write(EESYS_CAN_FILTER2, thirtytwo);
-
-	thirtytwo = 0x650;
-	sysPrefs->write(EESYS_CAN_FILTER3, thirtytwo);
-	sysPrefs->write(EESYS_CAN_FILTER4, thirtytwo);
-
-	thirtytwo = 0; //ok, not technically 32 bytes but the four zeros still shows it is unused.
-	sysPrefs->write(EESYS_WIFI0_SSID, thirtytwo);
-	sysPrefs->write(EESYS_WIFI1_SSID, thirtytwo);
-	sysPrefs->write(EESYS_WIFI2_SSID, thirtytwo);
-	sysPrefs->write(EESYS_WIFIX_SSID, thirtytwo);
-
-	eight = 0; //no channel, DHCP off, B mode
-	sysPrefs->write(EESYS_WIFI0_CHAN, eight);
-	sysPrefs->write(EESYS_WIFI0_DHCP, eight);
-	sysPrefs->write(EESYS_WIFI0_MODE, eight);
-
-	sysPrefs->write(EESYS_WIFI1_CHAN, eight);
-	sysPrefs->write(EESYS_WIFI1_DHCP, eight);
-	sysPrefs->write(EESYS_WIFI1_MODE, eight);
-
-	sysPrefs->write(EESYS_WIFI2_CHAN, eight);
-	sysPrefs->write(EESYS_WIFI2_DHCP, eight);
-	sysPrefs->write(EESYS_WIFI2_MODE, eight);
-
-	sysPrefs->write(EESYS_WIFIX_CHAN, eight);
-	sysPrefs->write(EESYS_WIFIX_DHCP, eight);
-	sysPrefs->write(EESYS_WIFIX_MODE, eight);
-
-	thirtytwo = 0;
-	sysPrefs->write(EESYS_WIFI0_IPADDR, thirtytwo);
-	sysPrefs->write(EESYS_WIFI1_IPADDR, thirtytwo);
-	sysPrefs->write(EESYS_WIFI2_IPADDR, thirtytwo);
-	sysPrefs->write(EESYS_WIFIX_IPADDR, thirtytwo);
-
-	sysPrefs->write(EESYS_WIFI0_KEY, thirtytwo);
-	sysPrefs->write(EESYS_WIFI1_KEY, thirtytwo);
-	sysPrefs->write(EESYS_WIFI2_KEY, thirtytwo);
-	sysPrefs->write(EESYS_WIFIX_KEY, thirtytwo);
-
-	eight = 1;
-	sysPrefs->write(EESYS_LOG_LEVEL, eight);
-
+	//every field listed in PrefLayout.h gets its default, one EEPROM page at a time
+	prefLoadDefaults(sysPrefs, sysPrefLayout, SYSPREF_COUNT);
 	sysPrefs->saveChecksum();
 }
 
 void createObjects() {
-	
+	new ICHIPWIFI();
+	new DiffPressureSensor();
+	new HumiditySensor();
+	new MassFlowSensor();
 }
 
 void initializeDevices() {
@@ -238,11 +149,12 @@ void initializeDevices() {
 	 *	out there as they initialize. For instance, a motor controller could see if a BMS
 	 *	exists and supports a function that the motor controller wants to access.
 	 */
-	//deviceManager->sendMessage(DEVICE_ANY, INVALID, MSG_STARTUP, NULL);
+	deviceManager->sendMessage(DEVICE_ANY, INVALID, MSG_STARTUP, NULL);
 
 }
 
 void setup() {
+	SystemLoad::getInstance()->setup();
   delay(1000);  //This delay lets you see startup.      
   //SerialUSB.begin(CFG_SERIAL_SPEED);
   SerialUSB.begin(9600);
@@ -256,34 +168,36 @@ void setup() {
   digitalWrite(13, LOW);
   delay(1000);
   
-	Wire.begin();
+	TwiBus::getInstance()->setup(CFG_TWI_CLOCK);
 	Logger::info("TWI init ok");
 	memCache = new MemCache();
 	Logger::info("add MemCache (id: %X, %X)", MEMCACHE, memCache);
 	memCache->setup();
-	//sysPrefs = new PrefHandler(SYSTEM);
-	//if (!sysPrefs->checksumValid()) 
-  //   {
-	//      Logger::info("Initializing EEPROM");
-	//      initSysEEPROM();
-  //      initWiReach();
-	//   } 
-  //      else {Logger::info("Using existing EEPROM values");}//checksum is good, read in the values stored in EEPROM
-
-//	uint8_t loglevel;
-//	sysPrefs->read(EESYS_LOG_LEVEL, &loglevel);
-//	Logger::setLoglevel((Logger::LogLevel)loglevel);
-//	Logger::setLoglevel((Logger::LogLevel)1);
-//	sys_early_setup();     
+	SysLog::getInstance()->setup();
+	sysPrefs = new PrefHandler(SYSTEM);
+	if (!sysPrefs->checksumValid()) 
+	{
+		Logger::info("Initializing EEPROM");
+		initSysEEPROM();
+	} 
+	else {Logger::info("Using existing EEPROM values");}//checksum is good, read in the values stored in EEPROM
+
+	uint8_t loglevel;
+	prefGet<SYSPREF_LOG_LEVEL>(sysPrefs, &loglevel);
+	Logger::setLoglevel((Logger::LogLevel)loglevel);
+	sys_early_setup(); //pin tables and raw ADC mode, needs sysPrefs
   tickHandler = TickHandler::getInstance();
+	TimeBase::getInstance()->setup();
+	faultHandler.setup(); //run time counter and fault log, the sensors raise faults from their first read on
+	SampleStore::getInstance()->setup();
 	
 	setup_sys_io(); //get calibration data for system IO
 	Logger::info("SYSIO init ok");
 
 	initializeDevices();
-//    serialConsole = new SerialConsole(memCache, heartbeat);
-//	serialConsole->printMenu();
-	//wifiDevice = DeviceManager::getInstance()->getDeviceByID(ICHIP2128);
+	serialConsole = new SerialConsole(memCache, heartbeat);
+	serialConsole->printMenu();
+	wifiDevice = DeviceManager::getInstance()->getDeviceByID(ICHIP2128);
 //	btDevice = DeviceManager::getInstance()->getDeviceByID(ELM327EMU);
     //DeviceManager::getInstance()->sendMessage(DEVICE_WIFI, ICHIP2128, MSG_CONFIG_CHANGE, NULL); //Load configuration variables into WiFi Web Configuration screen
 	//Logger::info("System Ready");
@@ -294,20 +208,25 @@ void loop() {
 //#ifdef CFG_TIMER_USE_QUEUING
 	tickHandler->process();
 //#endif
+#ifdef CFG_LOG_BUFFERED
+	Logger::process();
+#endif
 
-	//serialConsole->loop();
+	if (serialConsole != NULL) serialConsole->loop();
 	//TODO: this is dumb... shouldn't have to manually do this. Devices should be able to register loop functions
-	//if ( wifiDevice != NULL ) {
-	//	((ICHIPWIFI*)wifiDevice)->loop();
-	//}
+	if ( wifiDevice != NULL && wifiDevice->isEnabled() ) { //a disabled one wasn't set up, nothing to poll
+		((ICHIPWIFI*)wifiDevice)->loop();
+	}
 
 	//digitalWrite(13, HIGH);
   //delay(1000);
   //digitalWrite(13, LOW);
   //delay(1000);
 
-	//this should still be here. It checks for a flag set during an interrupt
-	//sys_io_adc_poll();
+	//this should still be here. It processes the DMA buffers the ADC interrupt completed
+	sys_io_adc_poll();
+
+	SystemLoad::getInstance()->idle(); //sleep until the next interrupt if nothing is left to do
 }
 
 
@@ -0,0 +1,232 @@
+/*
+ * SensirionSensor.cpp
+ *
+ * Common part of the Sensirion sensor drivers and the scheduler which reads them
+ *
+Copyright (c) 2013 Collin Kidder, Michael Neuweiler, Charles Galpin
+
+Permission is hereby granted, free of charge, to any person obtaining
+a copy of this software and associated documentation files (the
+"Software"), to deal in the Software without restriction, including
+without limitation the rights to use, copy, modify, merge, publish,
+distribute, sublicense, and/or sell copies of the Software, and to
+permit persons to whom the Software is furnished to do so, subject to
+the following conditions:
+
+The above copyright notice and this permission notice shall be included
+in all copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.
+IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY
+CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT,
+TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE
+SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+
+ */
+
+#include "SensirionSensor.h"
+
+SensirionSensor::SensirionSensor() : Device() {
+	address = 0;
+	words = 1;
+	crcInit = 0xFF;
+	divider = 1;
+	readCommand = 0;
+	triggerCommand = 0;
+	pending = false;
+	failures = 0;
+	fault = 0xFFFF;
+	memset(&readTransaction, 0, sizeof(readTransaction));
+	memset(&triggerTransaction, 0, sizeof(triggerTransaction));
+	memset(&stats, 0, sizeof(stats));
+}
+
+/*
+ * Put the part into its measurement mode and hand it to the scheduler
+ */
+void SensirionSensor::setup() {
+	Logger::info("add device: %s (id: %X, %X)", commonName, getId(), this);
+
+	readTransaction.device = address;
+	readTransaction.read = true;
+	readTransaction.commandSize = (readCommand ? 2 : 0);
+	readTransaction.command = readCommand;
+	readTransaction.data = readBuffer;
+	readTransaction.length = words * 3;
+	readTransaction.priority = TWI_PRIORITY_SENSOR;
+
+	triggerBuffer[0] = triggerCommand >> 8;
+	triggerBuffer[1] = triggerCommand & 0xFF;
+	triggerTransaction.device = address;
+	triggerTransaction.data = triggerBuffer;
+	triggerTransaction.length = 2;
+	triggerTransaction.priority = TWI_PRIORITY_SENSOR;
+
+	if (!startMeasurement()) Logger::error(getId(), "no answer from the sensor at %X", address);
+	if (!SensorScheduler::getInstance()->add(this)) Logger::error(getId(), "too many sensors, increase CFG_SENSOR_MAX");
+}
+
+//queue the read of the latest measurement
+void SensirionSensor::collect() {
+	if (pending) { //still on the bus since the last cycle
+		stats.overruns++;
+		return;
+	}
+	pending = TwiBus::getInstance()->submit(&readTransaction);
+}
+
+//queue the start of the next measurement, if the part needs one
+void SensirionSensor::trigger() {
+	if (triggerCommand == 0 || !TwiBus::isFinished(&triggerTransaction)) return;
+	TwiBus::getInstance()->submit(&triggerTransaction);
+}
+
+/*
+ * Check the CRC of every word of the measurement read by collect() and publish it with the
+ * time the read finished. Does nothing while the read is still on the bus.
+ */
+void SensirionSensor::process() {
+	uint16_t data[SENSOR_MAX_WORDS];
+
+	if (!pending || !TwiBus::isFinished(&readTransaction)) return;
+	pending = false;
+	if (readTransaction.status != TWI_DONE) {
+		stats.nacks++;
+		failed();
+		return;
+	}
+	for (uint8_t i = 0; i < words; i++) {
+		if (crc8(readBuffer + i * 3, 2, crcInit) != readBuffer[i * 3 + 2]) {
+			stats.crcErrors++;
+			failed();
+			return;
+		}
+		data[i] = (readBuffer[i * 3] << 8) | readBuffer[i * 3 + 1];
+	}
+	stats.reads++;
+	failures = 0;
+	if (fault != 0xFFFF) {
+		Logger::info(getId(), "sensor at %X is back", address);
+		faultHandler.setFaultOngoing(fault, false);
+		fault = 0xFFFF;
+	}
+	publish(data, readTransaction.started + readTransaction.duration);
+}
+
+//A read failed. A sensor which keeps failing gets a fault and is restarted now and then.
+void SensirionSensor::failed() {
+	if (++failures < CFG_SENSOR_MAX_FAILURES) return;
+	if (fault == 0xFFFF) {
+		Logger::error(getId(), "sensor at %X doesn't answer", address);
+		fault = faultHandler.raiseFault(getId(), FAULT_SENSOR_COMM);
+		faultHandler.setFaultOngoing(fault, true);
+	}
+	failures = 0;
+	startMeasurement(); //it might have been reset
+}
+
+uint8_t SensirionSensor::getDivider() {
+	return divider;
+}
+
+SensorStats *SensirionSensor::getStats() {
+	return &stats;
+}
+
+/*
+ * Send a command and wait for it to go out. Only for setup and restarts, the bus keeps
+ * serving others meanwhile.
+ */
+bool SensirionSensor::sendCommand(uint16_t command) {
+	TwiTransaction transaction;
+	uint8_t data[2];
+
+	data[0] = command >> 8;
+	data[1] = command & 0xFF;
+	memset(&transaction, 0, sizeof(transaction));
+	transaction.device = address;
+	transaction.data = data;
+	transaction.length = 2;
+	transaction.priority = TWI_PRIORITY_SENSOR;
+	if (!TwiBus::getInstance()->submit(&transaction)) return false;
+	return TwiBus::getInstance()->wait(&transaction);
+}
+
+//Empty functions for parts without a measurement mode or nothing to publish
+bool SensirionSensor::startMeasurement() {
+	return true;
+}
+
+void SensirionSensor::publish(const uint16_t *data, uint32_t timestamp) {
+}
+
+//CRC-8 with polynomial x^8 + x^5 + x^4 + 1 (0x31) as used by all Sensirion parts
+uint8_t SensirionSensor::crc8(const uint8_t *data, uint8_t length, uint8_t init) {
+	uint8_t crc = init;
+
+	for (uint8_t i = 0; i < length; i++) {
+		crc ^= data[i];
+		for (uint8_t bit = 0; bit < 8; bit++) crc = (crc & 0x80) ? (crc << 1) ^ 0x31 : (crc << 1);
+	}
+	return crc;
+}
+
+SensorScheduler *SensorScheduler::sensorScheduler = NULL;
+
+SensorScheduler::SensorScheduler() {
+	for (int i = 0; i < CFG_SENSOR_MAX; i++) sensors[i] = NULL;
+	cycle = 0;
+}
+
+/*
+ * Get the instance of the SensorScheduler (singleton pattern)
+ */
+SensorScheduler *SensorScheduler::getInstance() {
+	if (sensorScheduler == NULL)
+		sensorScheduler = new SensorScheduler();
+	return sensorScheduler;
+}
+
+//Schedule a sensor (again), the cycle starts over
+bool SensorScheduler::add(SensirionSensor *sensor) {
+	int free = -1;
+
+	for (int i = 0; i < CFG_SENSOR_MAX; i++) {
+		if (sensors[i] == sensor) return true;
+		if (free == -1 && sensors[i] == NULL) free = i;
+	}
+	if (free == -1) return false;
+	sensors[free] = sensor;
+	TickHandler::getInstance()->detach(this);
+	TickHandler::getInstance()->attach(this, CFG_TICK_INTERVAL_SENSORS);
+	return true;
+}
+
+void SensorScheduler::remove(SensirionSensor *sensor) {
+	for (int i = 0; i < CFG_SENSOR_MAX; i++) {
+		if (sensors[i] == sensor) sensors[i] = NULL;
+	}
+}
+
+//the sensor at the given position, NULL if there is none
+SensirionSensor *SensorScheduler::getSensor(uint8_t index) {
+	if (index >= CFG_SENSOR_MAX) return NULL;
+	return sensors[index];
+}
+
+void SensorScheduler::handleTick() {
+	int i;
+
+	cycle++;
+	for (i = 0; i < CFG_SENSOR_MAX; i++) { //what the last reads brought
+		if (sensors[i]) sensors[i]->process();
+	}
+	for (i = 0; i < CFG_SENSOR_MAX; i++) { //collect phase
+		if (sensors[i] && cycle % sensors[i]->getDivider() == 0) sensors[i]->collect();
+	}
+	for (i = 0; i < CFG_SENSOR_MAX; i++) { //trigger phase
+		if (sensors[i] && cycle % sensors[i]->getDivider() == 0) sensors[i]->trigger();
+	}
+}
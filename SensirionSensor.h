@@ -0,0 +1,111 @@
+/*
+ * SensirionSensor.h
+ *
+ * Common part of the Sensirion sensor drivers and the scheduler which reads them
+ *
+Copyright (c) 2013 Collin Kidder, Michael Neuweiler, Charles Galpin
+
+Permission is hereby granted, free of charge, to any person obtaining
+a copy of this software and associated documentation files (the
+"Software"), to deal in the Software without restriction, including
+without limitation the rights to use, copy, modify, merge, publish,
+distribute, sublicense, and/or sell copies of the Software, and to
+permit persons to whom the Software is furnished to do so, subject to
+the following conditions:
+
+The above copyright notice and this permission notice shall be included
+in all copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.
+IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY
+CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT,
+TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE
+SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+
+ */
+
+#ifndef SENSIRIONSENSOR_H_
+#define SENSIRIONSENSOR_H_
+
+#include <Arduino.h>
+#include "config.h"
+#include "Device.h"
+#include "TwiBus.h"
+#include "SampleBus.h"
+
+#define SENSOR_MAX_WORDS	3 // data words of one measurement, each is followed by its CRC
+
+typedef struct {
+	uint32_t reads; // measurements which passed the CRC check
+	uint32_t crcErrors;
+	uint32_t nacks; // no answer (or no new data yet)
+	uint32_t overruns; // the previous read was still waiting for the bus
+} SensorStats;
+
+/*
+ * The parts are run in their continuous measurement modes where they have one, a read then
+ * just picks up the latest result. Parts without one get triggerCommand sent right after
+ * each read for the next measurement. All transfers are queued on the TwiBus and polled by
+ * the SensorScheduler, nothing waits for the bus.
+ */
+class SensirionSensor : public Device {
+public:
+	SensirionSensor();
+	void setup();
+	void collect();
+	void trigger();
+	void process();
+	uint8_t getDivider();
+	SensorStats *getStats();
+
+protected:
+	uint8_t address; // 7 bit I2C address
+	uint8_t words; // data words per measurement
+	uint8_t crcInit; // start value of the CRC-8 (polynomial 0x31)
+	uint8_t divider; // scheduler cycles per measurement
+	uint16_t readCommand; // sent before the read, 0 if the part just answers with its data
+	uint16_t triggerCommand; // starts a measurement, 0 for parts in a continuous mode
+
+	bool sendCommand(uint16_t command);
+	virtual bool startMeasurement();
+	virtual void publish(const uint16_t *data, uint32_t timestamp);
+	static uint8_t crc8(const uint8_t *data, uint8_t length, uint8_t init);
+
+private:
+	TwiTransaction readTransaction;
+	TwiTransaction triggerTransaction;
+	uint8_t readBuffer[SENSOR_MAX_WORDS * 3];
+	uint8_t triggerBuffer[2];
+	bool pending; // read queued but not processed yet
+	uint8_t failures; // consecutive failed reads
+	uint16_t fault; // fault # of FAULT_SENSOR_COMM while it is ongoing, 0xFFFF otherwise
+	SensorStats stats;
+
+	void failed();
+};
+
+/*
+ * Runs every CFG_TICK_INTERVAL_SENSORS. First the results of the last cycle are checked and
+ * published, then the reads of all sensors due in this cycle are queued in one go followed
+ * by their triggers, so the transfers run back to back. A sensor measuring slower than the
+ * cycle rate is only read every divider cycles.
+ */
+class SensorScheduler : public TickObserver {
+public:
+	static SensorScheduler *getInstance();
+	bool add(SensirionSensor *sensor);
+	void remove(SensirionSensor *sensor);
+	SensirionSensor *getSensor(uint8_t index);
+	void handleTick();
+
+private:
+	SensorScheduler();
+	static SensorScheduler *sensorScheduler;
+
+	SensirionSensor *sensors[CFG_SENSOR_MAX];
+	uint32_t cycle;
+};
+
+#endif /* SENSIRIONSENSOR_H_ */
@@ -28,6 +28,16 @@
 
 extern PrefHandler *sysPrefs;
 
+//CRC-16/XMODEM like the preferences, over the frame without the start byte
+static uint16_t frameCrc(uint16_t crc, const uint8_t *data, uint16_t length) {
+	while (length-- > 0) {
+		crc ^= (uint16_t) *data++ << 8;
+		for (int i = 0; i < 8; i++)
+			crc = (crc & 0x8000) ? (crc << 1) ^ 0x1021 : (crc << 1);
+	}
+	return crc;
+}
+
 SerialConsole::SerialConsole(MemCache* memCache) :
 		memCache(memCache), heartbeat(NULL) {
 	init();
@@ -44,6 +54,8 @@ void SerialConsole::init() {
 	//State variables for serial console
 	ptrBuffer = 0;
 	state = STATE_ROOT_MENU;
+	framePos = 0;
+	frameStarted = 0;
         loopcount=0;
         cancel=false;
       
@@ -63,6 +75,12 @@ void SerialConsole::loop() {
         	serialEvent();
 		}
 	}
+	//a frame which stopped half way must not swallow the text commands after it
+	if (state == STATE_FRAME && TimeBase::getInstance()->getMillis() - frameStarted > CFG_CONSOLE_FRAME_TIMEOUT) {
+		uint8_t status = CONSOLE_BAD_FRAME;
+		sendFrame(framePos > 0 ? frame[0] : 0, &status, 1);
+		state = STATE_ROOT_MENU;
+	}
 }
 
 void SerialConsole::printMenu() {
@@ -87,22 +105,37 @@ void SerialConsole::printMenu() {
 	SerialUSB.println("J = set all outputs low");
 	//SerialUSB.println("U,I = test EEPROM routines");
 	SerialUSB.println("E = dump system eeprom values");
+	SerialUSB.println("D = dump persistent system log (warnings and errors)");
+	SerialUSB.println("M = show sample store statistics");
+	SerialUSB.println("Q = run the micro benchmarks (stalls everything for about a second)");
+	SerialUSB.println("A = show ADC DMA buffer statistics");
+	SerialUSB.println("a = toggle binary capture of the raw ADC stream (format see sys_io.h)");
+	SerialUSB.println("B = show the latest sample of every SampleBus topic and the sensor statistics");
+	SerialUSB.println("C = show EEPROM cache statistics");
+	SerialUSB.println("c = reset EEPROM cache statistics");
+#ifdef CFG_TIMER_PROFILING
+	SerialUSB.println("T = show tick observer latency/execution profile");
+	SerialUSB.println("t = reset tick observer profile");
+#endif
 	SerialUSB.println("z = detect throttle min/max, num throttles and subtype");
 	SerialUSB.println("Z = save throttle values");
 	SerialUSB.println("b = detect brake min/max");
-	SerialUSB.println("B = save brake values");
 	SerialUSB.println("p = enable wifi passthrough (reboot required to resume normal operation)");
 	SerialUSB.println("S = show possible device IDs");
 	SerialUSB.println("w = GEVCU 4.2 reset wifi to factory defaults, setup GEVCU ad-hoc network");
 	SerialUSB.println("W = GEVCU 5.2 reset wifi to factory defaults, setup GEVCU as 10.0.0.1 Access Point");
 	SerialUSB.println("s = Scan WiFi for nearby access points");
+	SerialUSB.println("Binary frames starting with 0xC5 get/set the system settings in bulk (format see SerialConsole.h)");
 	SerialUSB.println();
 	SerialUSB.println("Config Commands (enter command=newvalue). Current values shown in parenthesis:");
     SerialUSB.println();
     Logger::console("LOGLEVEL=%i - set log level (0=debug, 1=info, 2=warn, 3=error, 4=off)", Logger::getLogLevel());
+    Logger::console("LOGBINARY=%i - log binary records instead of text (0=text, 1=binary, see Logger.h)", Logger::isBinary());
+    Logger::console("TIME=%l - set the wall clock (unix seconds, 0 if not set)", (uint32_t)(TimeBase::getInstance()->getUnixMicros() / 1000000));
+    Logger::console("ENABLE=<id> / DISABLE=<id> - switch a device on or off (e.g. ENABLE=0x5005), takes effect after a power cycle");
    
 	uint8_t systype;
-	sysPrefs->read(EESYS_SYSTEM_TYPE, &systype);
+	prefGet<SYSPREF_SYSTEM_TYPE>(sysPrefs, &systype);
 	Logger::console("SYSTYPE=%i - Set board revision (Dued=2, GEVCU3=3, GEVCU4=4)", systype);
 
 	DeviceManager::getInstance()->printDeviceList();
@@ -132,6 +165,19 @@ void SerialConsole::serialEvent() {
 		return;
 	}
 
+	if (state == STATE_FRAME) {
+		receiveFrame(incoming);
+		while (state == STATE_FRAME && (incoming = SerialUSB.read()) != -1)
+			receiveFrame(incoming); //frames come in a burst, don't wait for the next loop() for every byte
+		return;
+	}
+	if (incoming == CONSOLE_FRAME_START && ptrBuffer == 0) {
+		state = STATE_FRAME;
+		framePos = 0;
+		frameStarted = TimeBase::getInstance()->getMillis();
+		return;
+	}
+
 	if (incoming == 10 || incoming == 13) { //command done. Parse it.
 		handleConsoleCmd();
 		ptrBuffer = 0; //reset line counter once the line has been processed
@@ -212,9 +258,18 @@ void SerialConsole::handleConfigCmd() {
 			Logger::setLoglevel(Logger::Off);
 			break;
 		}
-		sysPrefs->write(EESYS_LOG_LEVEL, (uint8_t)newValue);
+		prefSet<SYSPREF_LOG_LEVEL>(sysPrefs, (uint8_t)newValue);
 		sysPrefs->saveChecksum();
 
+	} else if (cmdString == String("TIME")) {
+		//unix time in seconds, e.g. from the host or an NTP client
+		TimeBase::getInstance()->discipline((uint64_t)strtoul((char *) (cmdBuffer + i), NULL, 0) * 1000000);
+		Logger::console("wall clock set, drift correction %i ppb", TimeBase::getInstance()->getDrift());
+		updateWifi = false;
+	} else if (cmdString == String("LOGBINARY")) {
+		Logger::setBinary(newValue != 0);
+		Logger::console("log output is now %s", (newValue != 0 ? "binary" : "text"));
+		updateWifi = false;
 	} else if (cmdString == String("WIREACH")) {
 		DeviceManager::getInstance()->sendMessage(DEVICE_WIFI, ICHIP2128, MSG_COMMAND, (void *)(cmdBuffer + i));
 		Logger::info("sent \"AT+i%s\" to WiReach wireless LAN device", (cmdBuffer + i));
@@ -283,6 +338,20 @@ void SerialConsole::handleConfigCmd() {
                   
              
         Logger::console("DOUT0:%d, DOUT1:%d, DOUT2:%d, DOUT3:%d, DOUT4:%d, DOUT5:%d, DOUT6:%d, DOUT7:%d", getOutput(0), getOutput(1), getOutput(2), getOutput(3), getOutput(4), getOutput(5), getOutput(6), getOutput(7));
+	} else if (cmdString == String("ENABLE")) {
+		if (PrefHandler::setDeviceStatus(newValue, true)) {
+			memCache->FlushAllPages();
+			Logger::console("Successfully enabled device %X.", newValue);
+		}
+		else Logger::console("Invalid device ID (%X)", newValue);
+		updateWifi = false;
+	} else if (cmdString == String("DISABLE")) {
+		if (PrefHandler::setDeviceStatus(newValue, false)) {
+			memCache->FlushAllPages();
+			Logger::console("Successfully disabled device %X, it gets no more messages. Power cycle to stop it.", newValue);
+		}
+		else Logger::console("Invalid device ID (%X)", newValue);
+		updateWifi = false;
 	} else if (cmdString == String("NUKE")) {
 		if (newValue == 1) 
 		{   //write zero to the checksum location of every device in the table.
@@ -293,6 +362,7 @@ void SerialConsole::handleConfigCmd() {
 				memCache->Write(EE_DEVICES_BASE + (EE_DEVICE_SIZE * j), zeroVal);
 				memCache->FlushAllPages();
 			}			
+			memCache->WaitForWrites(); //make sure it all hit the EEPROM before anyone reboots
 			Logger::console("Device settings have been nuked. Reboot to reload default settings");
 		}
 	} else {
@@ -342,6 +412,110 @@ void SerialConsole::handleShortCmd() {
 			Logger::console("%d: %d", i, val);
 		}
 		break;
+	case 'D':
+		SysLog::getInstance()->dump();
+		break;
+	case 'Q':
+		runBenchmarks();
+		break;
+	case 'M': {
+		SampleStoreStats *stats = SampleStore::getInstance()->getStats();
+		Logger::console("sample store: %l samples in %l bytes (%l raw), %l blocks started, %l failed", stats->samples, stats->bytes,
+				stats->rawBytes, stats->blocks, stats->failed);
+		break;
+	}
+	case 'B':
+		for (int i = 0; i < TOPIC_COUNT; i++) {
+			const Sample *sample = SampleBus::getInstance()->getLatest((SampleTopic)i);
+			if (sample == NULL) {
+				Logger::console("topic %d: no samples", i);
+				continue;
+			}
+			Logger::console("topic %d: #%l at %lus from %X: %l %l %l %l", i, sample->sequence, sample->timestamp, sample->source,
+					sample->value[0], sample->value[1], sample->value[2], sample->value[3]);
+		}
+		for (int i = 0; i < CFG_SENSOR_MAX; i++) {
+			SensirionSensor *sensor = SensorScheduler::getInstance()->getSensor(i);
+			if (sensor == NULL) continue;
+			SensorStats *stats = sensor->getStats();
+			Logger::console("%s: reads: %l CRC errors: %l no answer: %l overruns: %l", sensor->getCommonName(), stats->reads,
+					stats->crcErrors, stats->nacks, stats->overruns);
+		}
+		break;
+	case 'A':
+		Logger::console("ADC buffers completed: %l dropped: %l", getADCBlockCount(), getADCDroppedBuffers());
+		break;
+	case 'a':
+		if (isADCCapturing()) {
+			setADCCapture(false);
+			Logger::console("ADC capture stopped, %l blocks not streamed (%l for lack of USB buffer)", getADCCaptureDropped(),
+					getADCCaptureFull());
+		} else {
+			Logger::console("ADC capture started");
+			setADCCapture(true);
+		}
+		break;
+	case 'C': {
+		MemCacheStats *stats = memCache->getStats();
+		Logger::console("EEPROM cache statistics:");
+		Logger::console("hits: %l misses: %l evictions: %l", stats->hits, stats->misses, stats->evictions);
+		Logger::console("forced flushes: %l failed allocations: %l", stats->forcedFlushes, stats->failedAllocs);
+		if (stats->readPage.count > 0) {
+			Logger::console("page reads: %l min: %lus max: %lus mean: %lus", stats->readPage.count, stats->readPage.min,
+					stats->readPage.max, stats->readPage.total / stats->readPage.count);
+		}
+		else Logger::console("page reads: 0");
+		if (stats->writePage.count > 0) {
+			Logger::console("page writes: %l min: %lus max: %lus mean: %lus", stats->writePage.count, stats->writePage.min,
+					stats->writePage.max, stats->writePage.total / stats->writePage.count);
+		}
+		else Logger::console("page writes: 0");
+		Logger::console("write-back pending: %T", memCache->isWriting());
+		TwiStats *twiStats = TwiBus::getInstance()->getStats();
+		Logger::console("TWI transactions: %l NACKs: %l resets: %l preempted chunks: %l", twiStats->transactions,
+				twiStats->nacks, twiStats->errors, twiStats->preemptions);
+		break;
+	}
+	case 'c':
+		memCache->resetStats();
+		Logger::console("EEPROM cache statistics reset");
+		break;
+#ifdef CFG_TIMER_PROFILING
+	case 'T': {
+		TickHandler *tickHandler = TickHandler::getInstance();
+		Logger::console("Tick observer profile (buckets <10us <100us <1ms <10ms <100ms >=100ms):");
+#ifdef CFG_TIMER_USE_QUEUING
+		Logger::console("queue overruns: %l coalesced: %l max depth: %d", tickHandler->getOverrunCount(), tickHandler->getCoalesceCount(),
+				tickHandler->getMaxQueueDepth());
+#endif
+		for (uint8_t i = 0; i < CFG_TIMER_NUM_OBSERVERS; i++) {
+			TickObserver *observer = tickHandler->getObserver(i);
+			if (observer == NULL)
+				continue;
+			TickProfile *profile = tickHandler->getProfile(i);
+			Device *device = DeviceManager::getInstance()->getDeviceByObserver(observer);
+			if (device != NULL)
+				Logger::console("#%d %s (%X) every %lus, %l runs", i, device->getCommonName(), device->getId(),
+						tickHandler->getInterval(i), profile->count);
+			else
+				Logger::console("#%d observer %X every %lus, %l runs", i, observer, tickHandler->getInterval(i), profile->count);
+			Logger::console("  latency %l %l %l %l %l %l max: %lus", profile->latency[0], profile->latency[1],
+					profile->latency[2], profile->latency[3], profile->latency[4], profile->latency[5],
+					TickHandler::cyclesToMicros(profile->latencyMax));
+			Logger::console("  exec    %l %l %l %l %l %l max: %lus", profile->exec[0], profile->exec[1],
+					profile->exec[2], profile->exec[3], profile->exec[4], profile->exec[5],
+					TickHandler::cyclesToMicros(profile->execMax));
+		}
+		break;
+	}
+	case 't':
+		TickHandler::getInstance()->resetProfile();
+#ifdef CFG_TIMER_USE_QUEUING
+		TickHandler::getInstance()->resetCounters();
+#endif
+		Logger::console("Tick observer profile reset");
+		break;
+#endif //CFG_TIMER_PROFILING
 	case 'K': //set all outputs high
 		for (int tout = 0; tout < NUM_OUTPUT; tout++) setOutput(tout, true);
 		Logger::console("all outputs: ON");
@@ -427,4 +601,172 @@ void SerialConsole::handleShortCmd() {
 		setup(); //this is probably a bad idea. Do not do this while connected to anything you care about - only for debugging in safety!
 		break;
 	}
+}
+
+/*
+ * Collect the bytes of a binary frame (see SerialConsole.h), handle it once it is complete.
+ */
+void SerialConsole::receiveFrame(uint8_t data) {
+	uint16_t length;
+
+	frame[framePos++] = data;
+	if (framePos < 3)
+		return;
+	length = frame[1] | (frame[2] << 8);
+	if (length > CONSOLE_MAX_PAYLOAD) {
+		uint8_t status = CONSOLE_BAD_FRAME;
+		sendFrame(frame[0], &status, 1);
+		state = STATE_ROOT_MENU;
+		return;
+	}
+	if (framePos == length + CONSOLE_FRAME_OVERHEAD) {
+		handleFrame();
+		state = STATE_ROOT_MENU;
+	}
+}
+
+void SerialConsole::handleFrame() {
+	uint8_t reply[CONSOLE_MAX_PAYLOAD];
+	uint16_t length = frame[1] | (frame[2] << 8);
+	uint16_t replyLength = 1;
+	const uint8_t *payload = frame + 3;
+	uint16_t offset, size, crc;
+
+	memcpy(&crc, payload + length, 2);
+	if (crc != frameCrc(0, frame, length + 3)) {
+		reply[0] = CONSOLE_BAD_FRAME;
+		sendFrame(frame[0], reply, 1);
+		return;
+	}
+
+	switch (frame[0]) {
+	case CONSOLE_GET:
+		if (length == 0) { // all fields
+			uint8_t ids[SYSPREF_COUNT];
+			for (uint8_t i = 0; i < SYSPREF_COUNT; i++)
+				ids[i] = i;
+			reply[0] = getFields(ids, SYSPREF_COUNT, reply + 1, &replyLength);
+		}
+		else
+			reply[0] = getFields(payload, length, reply + 1, &replyLength);
+		replyLength++;
+		break;
+	case CONSOLE_SET:
+		reply[0] = setFields(payload, length, reply + 1);
+		replyLength = 2;
+		break;
+	case CONSOLE_DUMP:
+		memcpy(&offset, payload, 2);
+		memcpy(&size, payload + 2, 2);
+		if (length != 4 || size > CONSOLE_MAX_PAYLOAD - 1 || offset + size > EE_DEVICE_SIZE)
+			reply[0] = CONSOLE_BAD_FIELD;
+		else if (!sysPrefs->read(offset, reply + 1, size))
+			reply[0] = CONSOLE_WRITE_FAILED;
+		else {
+			reply[0] = CONSOLE_OK;
+			replyLength += size;
+		}
+		break;
+	case CONSOLE_RESTORE:
+		memcpy(&offset, payload, 2);
+		size = length - 2;
+		//the header (checksum, device id, CRC) belongs to the PrefHandler
+		if (length < 2 || offset < EE_CRC_START || offset + size > EE_DEVICE_SIZE)
+			reply[0] = CONSOLE_BAD_FIELD;
+		else
+			reply[0] = (sysPrefs->write(offset, payload + 2, size) ? CONSOLE_OK : CONSOLE_WRITE_FAILED);
+		break;
+	case CONSOLE_COMMIT:
+		sysPrefs->saveChecksum();
+		memCache->FlushAllPages();
+		crc = sysPrefs->calcChecksum();
+		reply[0] = CONSOLE_OK;
+		memcpy(reply + 1, &crc, 2);
+		replyLength = 3;
+		break;
+	default:
+		reply[0] = CONSOLE_UNKNOWN_COMMAND;
+		break;
+	}
+	sendFrame(frame[0], reply, replyLength);
+}
+
+void SerialConsole::sendFrame(uint8_t command, const uint8_t *payload, uint16_t length) {
+	uint8_t header[4];
+	uint16_t crc;
+
+	header[0] = CONSOLE_FRAME_START;
+	header[1] = command | CONSOLE_REPLY;
+	header[2] = length & 0xFF;
+	header[3] = length >> 8;
+	crc = frameCrc(frameCrc(0, header + 1, 3), payload, length);
+	SerialUSB.write(header, 4);
+	SerialUSB.write(payload, length);
+	SerialUSB.write((const uint8_t *) &crc, 2);
+}
+
+/*
+ * Put id, size and value of the requested fields into the reply. If they don't all fit the
+ * ones that do are sent with CONSOLE_TRUNCATED, the host asks again for the rest.
+ */
+uint8_t SerialConsole::getFields(const uint8_t *ids, uint16_t count, uint8_t *reply, uint16_t *length) {
+	uint16_t used = 0;
+
+	for (uint16_t i = 0; i < count; i++) {
+		if (ids[i] >= SYSPREF_COUNT)
+			return CONSOLE_BAD_FIELD;
+		const PrefField &field = sysPrefLayout[ids[i]];
+		if (used + 2 + field.size > CONSOLE_MAX_PAYLOAD - 1) {
+			*length = used;
+			return CONSOLE_TRUNCATED;
+		}
+		reply[used] = field.id;
+		reply[used + 1] = field.size;
+		if (!sysPrefs->read(field.offset, reply + used + 2, field.size))
+			return CONSOLE_WRITE_FAILED;
+		used += 2 + field.size;
+	}
+	*length = used;
+	return CONSOLE_OK;
+}
+
+/*
+ * Check every entry against sysPrefLayout first, then write them all. Nothing is written if
+ * one of them is bad, bad gets its index. Blobs may be shorter than the field, the rest is
+ * cleared.
+ */
+uint8_t SerialConsole::setFields(const uint8_t *entries, uint16_t length, uint8_t *bad) {
+	uint16_t pos;
+	uint8_t index, pass;
+
+	for (pass = 0; pass < 2; pass++) {
+		for (pos = 0, index = 0; pos < length; pos += 2 + entries[pos + 1], index++) {
+			*bad = index;
+			if (pos + 2 > length || entries[pos] >= SYSPREF_COUNT || pos + 2 + entries[pos + 1] > length)
+				return CONSOLE_BAD_FIELD;
+			const PrefField &field = sysPrefLayout[entries[pos]];
+			const uint8_t *value = entries + pos + 2;
+			uint8_t size = entries[pos + 1];
+
+			if (pass == 0) {
+				if (field.type == PREF_TYPE_BLOB ? size > field.size : size != field.size)
+					return CONSOLE_BAD_FIELD;
+				if (field.type != PREF_TYPE_BLOB) {
+					uint32_t val = 0;
+					memcpy(&val, value, size);
+					if (val < field.min || val > field.max)
+						return CONSOLE_OUT_OF_RANGE;
+				}
+				continue;
+			}
+			if (!sysPrefs->write(field.offset, value, size))
+				return CONSOLE_WRITE_FAILED;
+			for (; size < field.size; size++) {
+				if (!sysPrefs->write(field.offset + size, (uint8_t) 0))
+					return CONSOLE_WRITE_FAILED;
+			}
+		}
+	}
+	*bad = 0xFF;
+	return CONSOLE_OK;
 }
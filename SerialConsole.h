@@ -30,6 +30,7 @@ SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
 #include "config.h"
 #include "Heartbeat.h"
 #include "MemCache.h"
+#include "SysLog.h"
 #include "config.h"
 #include "sys_io.h"
 
@@ -37,6 +38,51 @@ SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
 
 
 #include "ichip_2128.h"
+#include "SensirionSensor.h"
+#include "TimeBase.h"
+#include "Benchmark.h"
+
+/*
+ * Besides text lines the console takes binary frames for provisioning. A frame starts with
+ * CONSOLE_FRAME_START, which no text command does, all values are little endian:
+ * 	uint8_t		CONSOLE_FRAME_START
+ * 	uint8_t		command (ConsoleCommand), the reply has CONSOLE_REPLY set
+ * 	uint16_t	payload length (max CONSOLE_MAX_PAYLOAD)
+ * 	payload
+ * 	uint16_t	CRC-16/XMODEM over command, length and payload
+ * Every reply payload starts with a ConsoleStatus byte. The commands work on the system
+ * section (sysPrefLayout in PrefLayout.h) and only change the RAM image and the cache:
+ * GET		request: field ids (none = all), reply: id, size, value per field. If they
+ * 			don't all fit the first ones are sent with CONSOLE_TRUNCATED
+ * SET		request: id, size, value per field. All are checked before any is written,
+ * 			reply: status, index of the first bad entry
+ * DUMP		request: uint16_t offset, uint16_t length, reply: the bytes of the section
+ * RESTORE	request: uint16_t offset, bytes (not below EE_CRC_START)
+ * COMMIT	saves the checksum once and writes the cache out, reply: the uint16_t CRC
+ * Log output may come between two frames, a host skips everything up to the next start byte.
+ */
+#define CONSOLE_FRAME_START		0xC5
+#define CONSOLE_REPLY			0x80
+#define CONSOLE_MAX_PAYLOAD		256
+#define CONSOLE_FRAME_OVERHEAD	5 // command, length and CRC
+
+enum ConsoleCommand {
+	CONSOLE_GET = 1,
+	CONSOLE_SET = 2,
+	CONSOLE_DUMP = 3,
+	CONSOLE_RESTORE = 4,
+	CONSOLE_COMMIT = 5
+};
+
+enum ConsoleStatus {
+	CONSOLE_OK,
+	CONSOLE_BAD_FRAME, // CRC mismatch, too long or incomplete within CFG_CONSOLE_FRAME_TIMEOUT
+	CONSOLE_UNKNOWN_COMMAND,
+	CONSOLE_BAD_FIELD, // unknown id, wrong size or outside the section
+	CONSOLE_OUT_OF_RANGE,
+	CONSOLE_WRITE_FAILED,
+	CONSOLE_TRUNCATED // GET reply holds only the fields that fit
+};
 
 class SerialConsole {
 public:
@@ -48,7 +94,8 @@ public:
 protected:
 	enum CONSOLE_STATE
 	{
-		STATE_ROOT_MENU
+		STATE_ROOT_MENU,
+		STATE_FRAME // receiving a binary frame
 	};
 
 private:
@@ -58,6 +105,9 @@ private:
 	char cmdBuffer[80];
 	int ptrBuffer;
 	int state;
+	uint8_t frame[CONSOLE_MAX_PAYLOAD + CONSOLE_FRAME_OVERHEAD]; // binary frame without the start byte
+	uint16_t framePos;
+	uint32_t frameStarted; // TimeBase millis when the start byte came in
         int loopcount;
         bool cancel;
         
@@ -67,6 +117,11 @@ private:
 	void handleConsoleCmd();
 	void handleShortCmd();
     void handleConfigCmd();
+	void receiveFrame(uint8_t data);
+	void handleFrame();
+	void sendFrame(uint8_t command, const uint8_t *payload, uint16_t length);
+	uint8_t getFields(const uint8_t *ids, uint16_t count, uint8_t *reply, uint16_t *length);
+	uint8_t setFields(const uint8_t *entries, uint16_t length, uint8_t *bad);
 };
 
 #endif /* SERIALCONSOLE_H_ */
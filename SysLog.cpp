@@ -0,0 +1,290 @@
+/*
+ * SysLog.cpp
+ *
+ * Persistent log of warnings and errors in the EE_SYS_LOG area of the EEPROM
+ *
+Copyright (c) 2013 Collin Kidder, Michael Neuweiler, Charles Galpin
+
+Permission is hereby granted, free of charge, to any person obtaining
+a copy of this software and associated documentation files (the
+"Software"), to deal in the Software without restriction, including
+without limitation the rights to use, copy, modify, merge, publish,
+distribute, sublicense, and/or sell copies of the Software, and to
+permit persons to whom the Software is furnished to do so, subject to
+the following conditions:
+
+The above copyright notice and this permission notice shall be included
+in all copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.
+IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY
+CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT,
+TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE
+SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+
+ */
+
+#include "SysLog.h"
+#include "TimeBase.h"
+
+SysLog *SysLog::sysLog = NULL;
+
+SysLog::SysLog() {
+	active = 0;
+	full[0] = full[1] = false;
+	dirty = false;
+	lastCommit = 0;
+	bootCount = 0;
+	generation = 0;
+	droppedCount = 0;
+	ready = false;
+	memset(pages, 0, sizeof(pages));
+	pageNumber[0] = pageNumber[1] = 1;
+}
+
+/*
+ * Get a singleton instance of the SysLog
+ */
+SysLog *SysLog::getInstance() {
+	if (sysLog == NULL) {
+		sysLog = new SysLog();
+	}
+	return sysLog;
+}
+
+/*
+ * Load the header (formatting the area if it isn't valid), find the newest page and
+ * start logging into the one after it. From then on the Logger hands over all
+ * warnings and errors.
+ */
+void SysLog::setup() {
+	SysLogHeader header;
+
+	TickHandler::getInstance()->detach(this);
+
+	memCache->Read(EE_SYS_LOG, &header, sizeof(header));
+	if (header.magic != SYSLOG_MAGIC || header.version != SYSLOG_VERSION || header.pages != SYSLOG_PAGES) {
+		Logger::info("Initializing system log");
+		format(&header);
+	}
+	header.bootCount++;
+	bootCount = header.bootCount;
+	generation = header.generation;
+	memCache->Write(EE_SYS_LOG, &header, sizeof(header));
+	memCache->FlushAddress(EE_SYS_LOG);
+
+	findHead();
+	ready = true;
+	Logger::info("System log boot %d, logging to page %d", bootCount, pageNumber[active]);
+	Logger::setSysLog(this);
+
+	TickHandler::getInstance()->attach(this, CFG_TICK_INTERVAL_SYSLOG);
+}
+
+/*
+ * Write pages which filled up and, every CFG_SYSLOG_COMMIT_INTERVAL, the page
+ * currently being filled.
+ */
+void SysLog::handleTick() {
+	for (int i = 0; i < 2; i++) {
+		if (full[i] && writePage(pageNumber[i], &pages[i]))
+			full[i] = false;
+	}
+	if (dirty && (millis() - lastCommit) >= CFG_SYSLOG_COMMIT_INTERVAL)
+		commit();
+}
+
+/*
+ * Write everything which is buffered in RAM to the cache (not waiting for the interval).
+ */
+void SysLog::commit() {
+	SysLogPage copy;
+	uint16_t number;
+
+	if (!ready)
+		return;
+	for (int i = 0; i < 2; i++) {
+		if (full[i] && writePage(pageNumber[i], &pages[i]))
+			full[i] = false;
+	}
+	noInterrupts();
+	number = pageNumber[active];
+	copy = pages[active]; // entries might be appended from an interrupt while the page is written
+	dirty = false;
+	interrupts();
+	if (!writePage(number, &copy))
+		dirty = true;
+	lastCommit = millis();
+}
+
+/*
+ * Add an entry to the RAM page. When it's full, continue with the other one and leave
+ * the full page to handleTick(). This doesn't touch the EEPROM so it's safe to call
+ * from an interrupt (e.g. through the Logger). Entries before setup() are ignored.
+ */
+void SysLog::append(Logger::LogLevel level, DeviceId deviceId, const char *text, uint16_t length) {
+	SysLogPage *page;
+	uint8_t entry[SYSLOG_ENTRY_HEADER];
+	uint16_t id = deviceId;
+	uint32_t time = TimeBase::getInstance()->getMillis(); // same clock as the text log
+	uint8_t next;
+
+	if (!ready)
+		return;
+	if (length > SYSLOG_TEXT_MAX)
+		length = SYSLOG_TEXT_MAX;
+	entry[0] = SYSLOG_ENTRY_HEADER + length;
+	entry[1] = level;
+	memcpy(entry + 2, &id, 2);
+	memcpy(entry + 4, &bootCount, 2);
+	memcpy(entry + 6, &time, 4);
+
+	noInterrupts();
+	page = &pages[active];
+	if (page->used + entry[0] > SYSLOG_DATA_SIZE) {
+		next = active ^ 1;
+		if (full[next]) { // the previous page still wasn't written
+			droppedCount++;
+			interrupts();
+			return;
+		}
+		full[active] = true;
+		pageNumber[next] = (pageNumber[active] % SYSLOG_PAGES) + 1;
+		pages[next].sequence = page->sequence + 1;
+		pages[next].used = 0;
+		active = next;
+		page = &pages[next];
+	}
+	memcpy(page->data + page->used, entry, SYSLOG_ENTRY_HEADER);
+	memcpy(page->data + page->used + SYSLOG_ENTRY_HEADER, text, length);
+	page->used += entry[0];
+	dirty = true;
+	interrupts();
+}
+
+/*
+ * Print all entries, oldest first.
+ */
+void SysLog::dump() {
+	SysLogPage page;
+	uint16_t number, used;
+	uint16_t id, boot;
+	uint32_t time;
+	uint8_t length;
+	char text[SYSLOG_TEXT_MAX + 1];
+
+	commit(); // so everything can be read back through the cache
+	number = pageNumber[active];
+	Logger::console("System log (boot %d, %l entries dropped):", bootCount, droppedCount);
+	for (int i = 0; i < SYSLOG_PAGES; i++) {
+		number = (number % SYSLOG_PAGES) + 1; // starts with the page after the head, ends with the head
+		if (!readPage(number, &page))
+			continue;
+		for (used = 0; used + SYSLOG_ENTRY_HEADER <= page.used; used += length) {
+			length = page.data[used];
+			if (length < SYSLOG_ENTRY_HEADER || used + length > page.used)
+				break;
+			memcpy(&id, page.data + used + 2, 2);
+			memcpy(&boot, page.data + used + 4, 2);
+			memcpy(&time, page.data + used + 6, 4);
+			memcpy(text, page.data + used + SYSLOG_ENTRY_HEADER, length - SYSLOG_ENTRY_HEADER);
+			text[length - SYSLOG_ENTRY_HEADER] = 0;
+			Logger::console("boot %d %lums %s %X: %s", boot, time, (page.data[used + 1] == Logger::Error ? "ERROR" : "WARNING"),
+					id, text);
+		}
+	}
+}
+
+uint32_t SysLog::getDroppedCount() {
+	return droppedCount;
+}
+
+uint32_t SysLog::pageAddress(uint16_t page) {
+	return EE_SYS_LOG + 256 * (uint32_t) page;
+}
+
+/*
+ * Fletcher-16 over the page header and the used data.
+ */
+uint16_t SysLog::checksum(SysLogPage *page) {
+	uint16_t sum1 = 0, sum2 = 0;
+	uint8_t *bytes = (uint8_t *) page;
+	int i;
+
+	for (i = 0; i < 8; i++) { // sequence, used and generation
+		sum1 = (sum1 + bytes[i]) % 255;
+		sum2 = (sum2 + sum1) % 255;
+	}
+	for (i = 0; i < page->used && i < SYSLOG_DATA_SIZE; i++) {
+		sum1 = (sum1 + page->data[i]) % 255;
+		sum2 = (sum2 + sum1) % 255;
+	}
+	return (sum2 << 8) | sum1;
+}
+
+/*
+ * Read a log page, returns false if it was never written or is corrupt.
+ */
+boolean SysLog::readPage(uint16_t number, SysLogPage *page) {
+	if (!memCache->Read(pageAddress(number), page, sizeof(SysLogPage)))
+		return false;
+	if (page->sequence == 0 || page->used > SYSLOG_DATA_SIZE || page->generation != generation)
+		return false;
+	return page->checksum == checksum(page);
+}
+
+/*
+ * Hand a whole page to the cache and queue it for writing.
+ */
+boolean SysLog::writePage(uint16_t number, SysLogPage *page) {
+	page->generation = generation;
+	page->checksum = checksum(page);
+	if (!memCache->Write(pageAddress(number), page, sizeof(SysLogPage)))
+		return false;
+	memCache->FlushAddress(pageAddress(number));
+	return true;
+}
+
+/*
+ * Start a new, empty generation of the log. The pages themselves aren't touched, whatever
+ * they hold belongs to an older generation (or isn't a log page at all) and reads as unused.
+ * The generation of an invalid header is just as good a starting point as any other.
+ */
+void SysLog::format(SysLogHeader *header) {
+	header->magic = SYSLOG_MAGIC;
+	header->version = SYSLOG_VERSION;
+	header->pages = SYSLOG_PAGES;
+	header->bootCount = 0;
+	header->generation++;
+}
+
+/*
+ * Pages 1 to head carry consecutive sequence numbers starting with the one of page 1,
+ * the pages after the head are older (or unused). So the head is the last page whose
+ * sequence isn't lower than that of page 1, which a binary search finds in a few reads.
+ */
+void SysLog::findHead() {
+	SysLogPage page;
+	uint32_t first;
+	uint16_t low = 1, high = SYSLOG_PAGES, mid;
+
+	if (!readPage(1, &page)) { // empty log
+		pageNumber[active] = 1;
+		pages[active].sequence = 1;
+		return;
+	}
+	first = page.sequence;
+	while (low < high) {
+		mid = (low + high + 1) / 2;
+		if (readPage(mid, &page) && page.sequence >= first)
+			low = mid;
+		else
+			high = mid - 1;
+	}
+	readPage(low, &page);
+	// continue on the page after the head
+	pageNumber[active] = (low % SYSLOG_PAGES) + 1;
+	pages[active].sequence = page.sequence + 1;
+}
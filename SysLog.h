@@ -0,0 +1,108 @@
+/*
+ * SysLog.h
+ *
+ * Persistent log of warnings and errors in the EE_SYS_LOG area of the EEPROM
+ *
+Copyright (c) 2013 Collin Kidder, Michael Neuweiler, Charles Galpin
+
+Permission is hereby granted, free of charge, to any person obtaining
+a copy of this software and associated documentation files (the
+"Software"), to deal in the Software without restriction, including
+without limitation the rights to use, copy, modify, merge, publish,
+distribute, sublicense, and/or sell copies of the Software, and to
+permit persons to whom the Software is furnished to do so, subject to
+the following conditions:
+
+The above copyright notice and this permission notice shall be included
+in all copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.
+IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY
+CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT,
+TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE
+SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+
+ */
+
+#ifndef SYSLOG_H_
+#define SYSLOG_H_
+
+#include <Arduino.h>
+#include "config.h"
+#include "Logger.h"
+#include "MemCache.h"
+#include "TickHandler.h"
+#include "eeprom_layout.h"
+
+extern MemCache *memCache;
+
+/*
+ * The first EEPROM page of the area holds a SysLogHeader, the remaining pages form a
+ * circular log. Every log page starts with a sequence number which grows by one per page,
+ * so the newest page (the head) can be found with a binary search at boot.
+ * Formatting only bumps the generation in the header, pages written in an older
+ * generation count as unused.
+ *
+ * Entries are packed one after the other into the page data:
+ * length (1 byte, whole entry), level (1), DeviceId (2), boot count (2), TimeBase milliseconds (4), text
+ */
+#define SYSLOG_MAGIC		0x534C4F47 // "SLOG"
+#define SYSLOG_VERSION		2
+#define SYSLOG_PAGES		((EE_SYS_LOG_SIZE / 256) - 1) // log pages, without the header
+#define SYSLOG_DATA_SIZE	246 // 256 bytes page minus page header
+#define SYSLOG_ENTRY_HEADER	10
+#define SYSLOG_TEXT_MAX		80 // longer messages are truncated
+
+struct SysLogHeader {
+	uint32_t magic;
+	uint8_t version;
+	uint8_t pages;
+	uint16_t bootCount; // incremented at every boot, stored with every entry
+	uint16_t generation; // incremented at every format, stored with every page
+};
+
+struct SysLogPage {
+	uint32_t sequence; // 0 if the page was never written
+	uint16_t used; // bytes of data in use
+	uint16_t generation; // generation of the log the page was written in
+	uint16_t checksum; // Fletcher-16 over sequence, used, generation and data
+	uint8_t data[SYSLOG_DATA_SIZE];
+};
+
+class SysLog: public TickObserver {
+public:
+	static SysLog *getInstance();
+	void setup();
+	void handleTick();
+	void append(Logger::LogLevel level, DeviceId deviceId, const char *text, uint16_t length);
+	void commit();
+	void dump();
+	uint32_t getDroppedCount();
+
+private:
+	SysLog();
+	static SysLog *sysLog;
+
+	// two RAM pages: one is filled while the other (if full) waits to be written
+	SysLogPage pages[2];
+	uint16_t pageNumber[2]; // log page (1 - SYSLOG_PAGES) each RAM page belongs to
+	volatile boolean full[2]; // page is full and waits for handleTick() to write it
+	volatile uint8_t active; // RAM page new entries are added to
+	volatile boolean dirty; // active page has entries which weren't written yet
+	uint32_t lastCommit; // millis() of the last write of the active page
+	uint16_t bootCount;
+	uint16_t generation; // pages of other generations are left over from before the last format
+	volatile uint32_t droppedCount; // entries which couldn't be stored because both RAM pages were full
+	boolean ready;
+
+	uint32_t pageAddress(uint16_t page);
+	uint16_t checksum(SysLogPage *page);
+	boolean readPage(uint16_t number, SysLogPage *page);
+	boolean writePage(uint16_t number, SysLogPage *page);
+	void format(SysLogHeader *header);
+	void findHead();
+};
+
+#endif /* SYSLOG_H_ */
@@ -0,0 +1,144 @@
+/*
+ * SystemLoad.cpp
+ *
+ * Idle handling of the main loop, CPU load and memory use
+ *
+Copyright (c) 2013 Collin Kidder, Michael Neuweiler, Charles Galpin
+
+Permission is hereby granted, free of charge, to any person obtaining
+a copy of this software and associated documentation files (the
+"Software"), to deal in the Software without restriction, including
+without limitation the rights to use, copy, modify, merge, publish,
+distribute, sublicense, and/or sell copies of the Software, and to
+permit persons to whom the Software is furnished to do so, subject to
+the following conditions:
+
+The above copyright notice and this permission notice shall be included
+in all copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.
+IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY
+CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT,
+TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE
+SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+
+ */
+
+#include "SystemLoad.h"
+#include <malloc.h>
+#include "TimeBase.h"
+#include "TickHandler.h"
+#include "Logger.h"
+#include "sys_io.h"
+#include "SerialConsole.h"
+#include "ichip_2128.h"
+
+extern "C" char *sbrk(int incr);
+extern char _sstack, _estack; // stack area of the linker script
+extern SerialConsole *serialConsole;
+extern Device *wifiDevice;
+
+SystemLoad *SystemLoad::systemLoad = NULL;
+
+SystemLoad::SystemLoad() {
+	idleCycles = 0;
+	windowStart = TimeBase::getInstance()->getMicros();
+}
+
+/*
+ * Get the instance of the SystemLoad (singleton pattern)
+ */
+SystemLoad *SystemLoad::getInstance() {
+	if (systemLoad == NULL)
+		systemLoad = new SystemLoad();
+	return systemLoad;
+}
+
+//paint the unused stack, as early as possible. The 64 bytes below the stack pointer are left to this call
+void SystemLoad::setup() {
+	uint32_t *word = (uint32_t *) &_sstack;
+	uint32_t *end = (uint32_t *) __get_MSP() - 16;
+
+	if (end > (uint32_t *) &_estack) // not running on the stack of the linker script, leave everything alone
+		return;
+	while (word < end)
+		*word++ = STACK_PAINT;
+}
+
+/*
+ * Sleep until the next interrupt if there is nothing to do. Interrupts are disabled while
+ * checking, WFI still wakes up on them and they run right after.
+ */
+void SystemLoad::idle() {
+#ifdef CFG_IDLE_SLEEP
+	if (isWorkPending())
+		return;
+	__disable_irq();
+	if (!isWorkPending())
+		idleCycles += TimeBase::getInstance()->sleep();
+	__enable_irq();
+#endif
+}
+
+/*
+ * CPU load in 0.1% since the last call. Without CFG_IDLE_SLEEP there is no idle time and
+ * this is always 1000.
+ */
+uint16_t SystemLoad::takeLoad() {
+	uint64_t now = TimeBase::getInstance()->getMicros();
+	uint32_t total = now - windowStart;
+	uint32_t idle = idleCycles / (SystemCoreClock / 1000000);
+
+	idleCycles = 0;
+	windowStart = now;
+	if (total == 0)
+		return 0;
+	if (idle > total)
+		idle = total;
+	return 1000 - (uint64_t) idle * 1000 / total;
+}
+
+//bytes of stack used at most so far
+uint32_t SystemLoad::getStackUsed() {
+	uint32_t *word = (uint32_t *) &_sstack;
+
+	while (word < (uint32_t *) &_estack && *word == STACK_PAINT)
+		word++;
+	return (char *) &_estack - (char *) word;
+}
+
+uint32_t SystemLoad::getStackSize() {
+	return &_estack - &_sstack;
+}
+
+/*
+ * Memory malloc() can still hand out: what was freed within the heap plus the space between
+ * the end of the heap and the stack (or the end of the RAM if the stack lies below the heap).
+ */
+uint32_t SystemLoad::getFreeHeap() {
+	struct mallinfo info = mallinfo();
+	char *end = sbrk(0);
+	char *limit = (end < &_sstack ? &_sstack : (char *) (IRAM_ADDR + IRAM_SIZE));
+
+	return info.fordblks + (limit > end ? limit - end : 0);
+}
+
+//anything for loop() to do?
+bool SystemLoad::isWorkPending() {
+#ifdef CFG_TIMER_USE_QUEUING
+	if (TickHandler::getInstance()->hasPending())
+		return true;
+#endif
+#ifdef CFG_LOG_BUFFERED
+	if (Logger::hasPending())
+		return true;
+#endif
+	if (getADCPendingBlocks() != 0)
+		return true;
+	//input only counts if somebody reads it, otherwise the first byte would keep us awake for good
+	if (serialConsole != NULL && SerialUSB.available())
+		return true;
+	return wifiDevice != NULL && wifiDevice->isEnabled() && ((ICHIPWIFI *) wifiDevice)->hasInput();
+}
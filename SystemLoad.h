@@ -0,0 +1,67 @@
+/*
+ * SystemLoad.h
+ *
+ * Idle handling of the main loop, CPU load and memory use
+ *
+Copyright (c) 2013 Collin Kidder, Michael Neuweiler, Charles Galpin
+
+Permission is hereby granted, free of charge, to any person obtaining
+a copy of this software and associated documentation files (the
+"Software"), to deal in the Software without restriction, including
+without limitation the rights to use, copy, modify, merge, publish,
+distribute, sublicense, and/or sell copies of the Software, and to
+permit persons to whom the Software is furnished to do so, subject to
+the following conditions:
+
+The above copyright notice and this permission notice shall be included
+in all copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.
+IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY
+CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT,
+TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE
+SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+
+ */
+
+#ifndef SYSTEMLOAD_H_
+#define SYSTEMLOAD_H_
+
+#include <Arduino.h>
+#include "config.h"
+
+#define STACK_PAINT		0xA5A5A5A5 // fill of the stack not used so far
+
+/*
+ * loop() calls idle() when it is done. If there are no queued ticks, log output,
+ * ADC blocks, console input (with a console to read it) or replies of the wifi module, the core
+ * sleeps until the next interrupt (at least the timer wheel wakes it every
+ * CFG_TIMER_WHEEL_RESOLUTION). The time asleep is what isn't load.
+ * Input which comes in between the check and WFI is handled after the next interrupt.
+ *
+ * setup() fills the stack below the current stack pointer with STACK_PAINT, the lowest
+ * word which changed is the stack high-water mark.
+ */
+class SystemLoad {
+public:
+	static SystemLoad *getInstance();
+	void setup();
+	void idle();
+	uint16_t takeLoad();
+	uint32_t getStackUsed();
+	uint32_t getStackSize();
+	uint32_t getFreeHeap();
+
+private:
+	SystemLoad();
+	static SystemLoad *systemLoad;
+
+	uint32_t idleCycles; // asleep since the last takeLoad()
+	uint64_t windowStart; // TimeBase microseconds of the last takeLoad()
+
+	bool isWorkPending();
+};
+
+#endif /* SYSTEMLOAD_H_ */
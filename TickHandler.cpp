@@ -3,8 +3,9 @@
  *
  * Class to which TickObserver objects can register to be triggered
  * on a certain interval.
- * TickObserver with the same interval are grouped to the same timer
- * and triggered in sequence per timer interrupt.
+ * All TickObservers share one hardware timer which drives a hierarchical
+ * timer wheel. Each observer gets its own interval and phase so observers with
+ * the same interval can be spread out instead of all firing in the same tick.
  *
  * NOTE: The initialize() method must be called before a observer is registered !
  *
@@ -32,18 +33,40 @@
  */
 
 #include "TickHandler.h"
+#include "TimeBase.h"
 
 TickHandler *TickHandler::tickHandler = NULL;
 
 TickHandler::TickHandler() {
-	for (int i = 0; i < NUM_TIMERS; i++) {
-		timerEntry[i].interval = 0;
-		for (int j = 0; j < CFG_TIMER_NUM_OBSERVERS; j++) {
-			timerEntry[i].observer[j] = NULL;
+	for (int i = 0; i < CFG_TIMER_NUM_OBSERVERS; i++) {
+		wheelEntry[i].observer = NULL;
+		wheelEntry[i].interval = 0;
+		wheelEntry[i].next = 0xFF;
+	}
+	for (int level = 0; level < WHEEL_LEVELS; level++) {
+		for (int slot = 0; slot < WHEEL_SLOTS; slot++) {
+			wheel[level][slot] = 0xFF;
 		}
 	}
+	wheelTime = 0;
+	dispatchTime = 0;
+	timerRunning = false;
 #ifdef CFG_TIMER_USE_QUEUING
 	bufferHead = bufferTail = 0;
+	for (int i = 0; i < CFG_TIMER_NUM_OBSERVERS; i++) {
+		pending[i] = false;
+	}
+#ifdef CFG_TIMER_COALESCE
+	coalescing = true;
+#else
+	coalescing = false;
+#endif
+	overrunCount = coalesceCount = 0;
+	maxQueueDepth = 0;
+#endif
+#ifdef CFG_TIMER_PROFILING
+	TimeBase::getInstance(); // the time base runs the DWT cycle counter, it must never be reset
+	resetProfile();
 #endif
 }
 
@@ -58,189 +81,371 @@ TickHandler *TickHandler::getInstance() {
 }
 
 /**
- * Register an observer to be triggered in a certain interval.
- * TickObservers with the same interval are grouped to one timer to save timers.
+ * Register an observer to be triggered in a certain interval (microseconds).
  * A TickObserver may be registered multiple times with different intervals.
  *
- * First a timer with the same interval is looked up. If none found, a free one is
- * used. Then a free TickObserver slot (of max CFG_MAX_TICK_OBSERVERS) is looked up. If all went
- * well, the timer is configured and (re)started.
- */
-void TickHandler::attach(TickObserver* observer, uint32_t interval) {
-	int timer = findTimer(interval);
-	if (timer == -1) {
-		timer = findTimer(0);	// no timer with given tick interval exist -> look for unused (interval == 0)
-		if (timer == -1) {
-			Logger::error("No free timer available for interval=%d", interval);
-			return;
+ * The interval is rounded to the wheel resolution (CFG_TIMER_WHEEL_RESOLUTION). The
+ * observer is triggered whenever the wheel time modulo the interval equals the phase
+ * (also in microseconds). If no phase is given, observers sharing an interval are
+ * staggered CFG_TIMER_STAGGER wheel ticks apart. The hardware timer is started with
+ * the first registration.
+ */
+void TickHandler::attach(TickObserver* observer, uint32_t interval, uint32_t phase) {
+	uint32_t ticks, now, expiry;
+	uint8_t entry = 0xFF;
+	int sameInterval = 0;
+
+	ticks = (interval + CFG_TIMER_WHEEL_RESOLUTION / 2) / CFG_TIMER_WHEEL_RESOLUTION;
+	if (ticks == 0)
+		ticks = 1;
+
+	for (int i = 0; i < CFG_TIMER_NUM_OBSERVERS; i++) {
+		if (wheelEntry[i].observer == NULL) {
+			if (entry == 0xFF)
+				entry = i;
+		} else if (wheelEntry[i].interval == ticks) {
+			sameInterval++;
 		}
-		timerEntry[timer].interval = interval;
 	}
-
-	int observerIndex = findObserver(timer, 0);
-	if (observerIndex == -1) {
-		Logger::error("No free observer slot for timer %d with interval %d", timer, timerEntry[timer].interval);
+	if (entry == 0xFF) {
+		Logger::error("No free observer slot for interval %d", interval);
 		return;
 	}
-	timerEntry[timer].observer[observerIndex] = observer;
-	Logger::debug("attached TickObserver (%X) as number %d to timer %d, %dus interval", observer, observerIndex, timer, interval);
-
-	switch (timer) { // restarting a timer which would already be running is no problem (see DueTimer.cpp)
-	case 0:
-		Timer0.setPeriod(interval).attachInterrupt(timer0Interrupt).start();
-		break;
-	case 1:
-		Timer1.setPeriod(interval).attachInterrupt(timer1Interrupt).start();
-		break;
-	case 2:
-		Timer2.setPeriod(interval).attachInterrupt(timer2Interrupt).start();
-		break;
-	case 3:
-		Timer3.setPeriod(interval).attachInterrupt(timer3Interrupt).start();
-		break;
-	case 4:
-		Timer4.setPeriod(interval).attachInterrupt(timer4Interrupt).start();
-		break;
-	case 5:
-		Timer5.setPeriod(interval).attachInterrupt(timer5Interrupt).start();
-		break;
-	case 6:
-		Timer6.setPeriod(interval).attachInterrupt(timer6Interrupt).start();
-		break;
-	case 7:
-		Timer7.setPeriod(interval).attachInterrupt(timer7Interrupt).start();
-		break;
-	case 8:
-		Timer8.setPeriod(interval).attachInterrupt(timer8Interrupt).start();
-		break;
+
+	if (phase == WHEEL_PHASE_AUTO)
+		phase = (sameInterval * CFG_TIMER_STAGGER) % ticks;
+	else
+		phase = (phase / CFG_TIMER_WHEEL_RESOLUTION) % ticks;
+
+	noInterrupts();
+	now = wheelTime;
+	expiry = now - (now % ticks) + phase;
+	if ((int32_t)(expiry - now) <= 0)
+		expiry += ticks;
+	wheelEntry[entry].observer = observer;
+	wheelEntry[entry].interval = ticks;
+	wheelEntry[entry].expiry = expiry;
+	insertEntry(entry);
+	interrupts();
+#ifdef CFG_TIMER_PROFILING
+	memset(&profile[entry], 0, sizeof(TickProfile));
+#endif
+
+	Logger::debug("attached TickObserver (%X) as number %d, %dus interval, phase %d ticks", observer, entry, interval, phase);
+
+	if (!timerRunning) {
+		Timer0.setPeriod(CFG_TIMER_WHEEL_RESOLUTION).attachInterrupt(timerInterrupt).start();
+		timerRunning = true;
 	}
 }
 
 /**
- * Remove an observer from all timers where it was registered.
+ * Remove an observer from all intervals where it was registered.
  */
 void TickHandler::detach(TickObserver* observer) {
-	for (int timer = 0; timer < NUM_TIMERS; timer++) {
-		for (int observerIndex = 0; observerIndex < CFG_TIMER_NUM_OBSERVERS; observerIndex++) {
-			if (timerEntry[timer].observer[observerIndex] == observer) {
-				Logger::debug("removing TickObserver (%X) as number %d from timer %d", observer, observerIndex, timer);
-				timerEntry[timer].observer[observerIndex] = NULL;
-			}
+	for (int i = 0; i < CFG_TIMER_NUM_OBSERVERS; i++) {
+		if (wheelEntry[i].observer == observer) {
+			Logger::debug("removing TickObserver (%X) as number %d", observer, i);
+			noInterrupts();
+			unlinkEntry(i);
+			wheelEntry[i].observer = NULL;
+			wheelEntry[i].interval = 0;
+			interrupts();
 		}
 	}
 }
 
-/**
- * Find a timer with a specified interval.
+/*
+ * Link an entry into the wheel according to how far away its expiry is.
+ * Must be called with interrupts disabled (or from the timer interrupt).
  */
-int TickHandler::findTimer(long interval) {
-	for (int i = 0; i < NUM_TIMERS; i++) {
-		if (timerEntry[i].interval == interval)
-			return i;
+void TickHandler::insertEntry(uint8_t entry) {
+	uint32_t expiry = wheelEntry[entry].expiry;
+	uint32_t delta = expiry - wheelTime;
+	uint8_t level, slot;
+
+	if (delta < (1UL << WHEEL_BITS)) {
+		level = 0;
+		slot = expiry & WHEEL_MASK;
+	} else if (delta < (1UL << (2 * WHEEL_BITS))) {
+		level = 1;
+		slot = (expiry >> WHEEL_BITS) & WHEEL_MASK;
+	} else if (delta < (1UL << (3 * WHEEL_BITS))) {
+		level = 2;
+		slot = (expiry >> (2 * WHEEL_BITS)) & WHEEL_MASK;
+	} else { // out of range, park it in the last slot to come around and sort it again from there
+		level = 2;
+		slot = ((wheelTime >> (2 * WHEEL_BITS)) + WHEEL_MASK) & WHEEL_MASK;
 	}
-	return -1;
+	wheelEntry[entry].level = level;
+	wheelEntry[entry].slot = slot;
+	wheelEntry[entry].next = wheel[level][slot];
+	wheel[level][slot] = entry;
 }
 
 /*
- * Find a TickObserver in the list of a specific timer.
+ * Remove an entry from the slot it is linked into (if it can be found there).
+ * Must be called with interrupts disabled.
  */
-int TickHandler::findObserver(int timer, TickObserver *observer) {
-	for (int i = 0; i < CFG_TIMER_NUM_OBSERVERS; i++) {
-		if (timerEntry[timer].observer[i] == observer)
-			return i;
+void TickHandler::unlinkEntry(uint8_t entry) {
+	uint8_t *link = &wheel[wheelEntry[entry].level][wheelEntry[entry].slot];
+	while (*link != 0xFF) {
+		if (*link == entry) {
+			*link = wheelEntry[entry].next;
+			wheelEntry[entry].next = 0xFF;
+			return;
+		}
+		link = &wheelEntry[*link].next;
 	}
-	return -1;
 }
 
-#ifdef CFG_TIMER_USE_QUEUING
 /*
- * Check if a tick is available, forward it to registered observers.
+ * Move all entries of the current slot of a wheel level down to the lower levels.
  */
-void TickHandler::process() {
-	while (bufferHead != bufferTail) {
-		tickBuffer[bufferTail]->handleTick();
-		bufferTail = (bufferTail + 1) % CFG_TIMER_BUFFER_SIZE;
-		//Logger::debug("process, bufferHead=%d bufferTail=%d", bufferHead, bufferTail);
+void TickHandler::cascade(uint8_t level) {
+	uint8_t slot = (wheelTime >> (level * WHEEL_BITS)) & WHEEL_MASK;
+	uint8_t entry = wheel[level][slot];
+	uint8_t next;
+
+	wheel[level][slot] = 0xFF;
+	while (entry != 0xFF) {
+		next = wheelEntry[entry].next;
+		insertEntry(entry);
+		entry = next;
 	}
 }
 
-void TickHandler::cleanBuffer() {
-	bufferHead = bufferTail = 0;
-}
+/*
+ * Hand a tick to an observer, either through the queue or by calling it directly.
+ * A full queue drops the tick (and counts it) rather than overwriting unprocessed ones.
+ */
+void TickHandler::trigger(uint8_t entry) {
+#ifdef CFG_TIMER_USE_QUEUING
+	uint16_t head, next, depth;
 
+	if (coalescing && pending[entry]) {
+		coalesceCount++;
+		return;
+	}
+	head = bufferHead;
+	next = (head + 1) % CFG_TIMER_BUFFER_SIZE;
+	if (next == bufferTail) {
+		overrunCount++;
+		return;
+	}
+	pending[entry] = true;
+	tickBuffer[head] = entry;
+	tickTime[head] = TimeBase::getInstance()->getStamp();
+#ifdef CFG_TIMER_PROFILING
+	tickStamp[head] = DWT->CYCCNT;
+#endif
+	__DMB(); // the entry must be in the buffer before the consumer can see the new head
+	bufferHead = next;
+	depth = (next + CFG_TIMER_BUFFER_SIZE - bufferTail) % CFG_TIMER_BUFFER_SIZE;
+	if (depth > maxQueueDepth) maxQueueDepth = depth;
+#else
+	dispatchTime = TimeBase::getInstance()->getStamp();
+#ifdef CFG_TIMER_PROFILING
+	uint32_t start = DWT->CYCCNT;
+	wheelEntry[entry].observer->handleTick();
+	profile[entry].count++;
+	record(profile[entry].latency, &profile[entry].latencyMax, 0); // called straight from the interrupt
+	record(profile[entry].exec, &profile[entry].execMax, DWT->CYCCNT - start);
+#else
+	wheelEntry[entry].observer->handleTick();
+#endif //CFG_TIMER_PROFILING
 #endif //CFG_TIMER_USE_QUEUING
+}
 
+#ifdef CFG_TIMER_USE_QUEUING
 /*
- * Handle the interrupt of any timer.
- * All the registered TickObservers of the timer are called.
+ * Check if a tick is available, forward it to registered observers.
+ * The pending flag is cleared before the observer runs so a tick which comes in
+ * while it is busy gets queued again.
  */
-void TickHandler::handleInterrupt(int timerNumber) {
-	for (int i = 0; i < CFG_TIMER_NUM_OBSERVERS; i++) {
-		if (timerEntry[timerNumber].observer[i] != NULL) {
-#ifdef CFG_TIMER_USE_QUEUING
-		tickBuffer[bufferHead] = timerEntry[timerNumber].observer[i];
-		bufferHead = (bufferHead + 1) % CFG_TIMER_BUFFER_SIZE;
-//Logger::debug("bufferHead=%d, bufferTail=%d, observer=%d", bufferHead, bufferTail, timerEntry[timerNumber].observer[i]);
+void TickHandler::process() {
+	uint16_t tail = bufferTail;
+	uint8_t entry;
+	TickObserver *observer;
+#ifdef CFG_TIMER_PROFILING
+	uint32_t stamp, start;
+#endif
+
+	while (tail != bufferHead) {
+		__DMB(); // read the entry only after seeing the head which published it
+		entry = tickBuffer[tail];
+		dispatchTime = tickTime[tail];
+#ifdef CFG_TIMER_PROFILING
+		stamp = tickStamp[tail];
+#endif
+		tail = (tail + 1) % CFG_TIMER_BUFFER_SIZE;
+		pending[entry] = false;
+		__DMB(); // done with the slot before handing it back to the producer
+		bufferTail = tail;
+		observer = wheelEntry[entry].observer;
+		if (observer != NULL) { // might have been detached while it was queued
+#ifdef CFG_TIMER_PROFILING
+			start = DWT->CYCCNT;
+			observer->handleTick();
+			profile[entry].count++;
+			record(profile[entry].latency, &profile[entry].latencyMax, start - stamp);
+			record(profile[entry].exec, &profile[entry].execMax, DWT->CYCCNT - start);
 #else
-			timerEntry[timerNumber].observer[i]->handleTick();
-#endif //CFG_TIMER_USE_QUEUING
+			observer->handleTick();
+#endif
 		}
+		//Logger::debug("process, bufferHead=%d bufferTail=%d", bufferHead, bufferTail);
 	}
 }
 
 /*
- * Interrupt function for Timer0
+ * Throw away all queued ticks. Only the consumer side moves so this is safe
+ * while the timer keeps running.
  */
-void timer0Interrupt() {
-	TickHandler::getInstance()->handleInterrupt(0);
+void TickHandler::cleanBuffer() {
+	uint16_t tail = bufferTail;
+	while (tail != bufferHead) {
+		__DMB();
+		pending[tickBuffer[tail]] = false;
+		tail = (tail + 1) % CFG_TIMER_BUFFER_SIZE;
+	}
+	__DMB();
+	bufferTail = tail;
 }
+
 /*
- * Interrupt function for Timer1
+ * Enable or disable coalescing. With coalescing a tick for an observer which still
+ * has one waiting in the queue is counted instead of being queued a second time.
  */
-void timer1Interrupt() {
-	TickHandler::getInstance()->handleInterrupt(1);
+void TickHandler::setCoalescing(bool coalesce) {
+	coalescing = coalesce;
+}
+
+uint32_t TickHandler::getOverrunCount() {
+	return overrunCount;
+}
+
+uint32_t TickHandler::getCoalesceCount() {
+	return coalesceCount;
 }
+
+uint16_t TickHandler::getMaxQueueDepth() {
+	return maxQueueDepth;
+}
+
+//ticks are waiting for process()
+bool TickHandler::hasPending() {
+	return bufferTail != bufferHead;
+}
+
+void TickHandler::resetCounters() {
+	overrunCount = coalesceCount = 0;
+	maxQueueDepth = 0;
+}
+
+#endif //CFG_TIMER_USE_QUEUING
+
 /*
- * Interrupt function for Timer2
+ * Get the observer registered as the given entry (NULL if unused).
  */
-void timer2Interrupt() {
-	TickHandler::getInstance()->handleInterrupt(2);
+TickObserver *TickHandler::getObserver(uint8_t entry) {
+	if (entry >= CFG_TIMER_NUM_OBSERVERS)
+		return NULL;
+	return wheelEntry[entry].observer;
 }
+
 /*
- * Interrupt function for Timer3
+ * Get the interval (in microseconds) of the given entry.
  */
-void timer3Interrupt() {
-	TickHandler::getInstance()->handleInterrupt(3);
+uint32_t TickHandler::getInterval(uint8_t entry) {
+	if (entry >= CFG_TIMER_NUM_OBSERVERS)
+		return 0;
+	return wheelEntry[entry].interval * CFG_TIMER_WHEEL_RESOLUTION;
 }
+
 /*
- * Interrupt function for Timer4
+ * TimeBase stamp of the timer interrupt which fired the tick currently being handled,
+ * so observers can stamp their work with when it was due rather than when it ran.
  */
-void timer4Interrupt() {
-	TickHandler::getInstance()->handleInterrupt(4);
+uint32_t TickHandler::getTickTime() {
+	return dispatchTime;
 }
+
+#ifdef CFG_TIMER_PROFILING
 /*
- * Interrupt function for Timer5
+ * Get the latency and execution time histograms of the given entry.
  */
-void timer5Interrupt() {
-	TickHandler::getInstance()->handleInterrupt(5);
+TickProfile *TickHandler::getProfile(uint8_t entry) {
+	if (entry >= CFG_TIMER_NUM_OBSERVERS)
+		return NULL;
+	return &profile[entry];
+}
+
+void TickHandler::resetProfile() {
+	memset(profile, 0, sizeof(profile));
+}
+
+uint32_t TickHandler::cyclesToMicros(uint32_t cycles) {
+	return cycles / (SystemCoreClock / 1000000);
 }
+
 /*
- * Interrupt function for Timer6
+ * Sort a measurement into its decade bucket and keep track of the worst case.
  */
-void timer6Interrupt() {
-	TickHandler::getInstance()->handleInterrupt(6);
+void TickHandler::record(uint32_t *histogram, uint32_t *worst, uint32_t cycles) {
+	uint32_t limit = 10 * (SystemCoreClock / 1000000); // 10us
+	uint8_t bucket = 0;
+
+	while (bucket < PROFILE_BUCKETS - 1 && cycles >= limit) {
+		limit *= 10;
+		bucket++;
+	}
+	histogram[bucket]++;
+	if (cycles > *worst)
+		*worst = cycles;
 }
+#endif //CFG_TIMER_PROFILING
+
 /*
- * Interrupt function for Timer7
+ * Handle the interrupt of the wheel timer.
+ * Advances the wheel by one tick, cascades the higher levels when a lower level
+ * wraps around and triggers all observers which are due in the current slot.
  */
-void timer7Interrupt() {
-	TickHandler::getInstance()->handleInterrupt(7);
+void TickHandler::handleInterrupt() {
+	uint32_t now = ++wheelTime;
+	uint8_t slot = now & WHEEL_MASK;
+	uint8_t entry, next;
+	TickObserver *observer;
+
+	if (slot == 0) {
+		if ((now & ((1UL << (2 * WHEEL_BITS)) - 1)) == 0)
+			cascade(2);
+		cascade(1);
+	}
+
+	entry = wheel[0][slot];
+	wheel[0][slot] = 0xFF;
+	while (entry != 0xFF) {
+		next = wheelEntry[entry].next;
+		observer = wheelEntry[entry].observer;
+		if (observer != NULL) {
+			if (wheelEntry[entry].expiry == now) {
+				wheelEntry[entry].expiry += wheelEntry[entry].interval;
+				insertEntry(entry);
+				trigger(entry);
+			} else {
+				insertEntry(entry);
+			}
+		}
+		entry = next;
+	}
 }
+
 /*
- * Interrupt function for Timer8
+ * Interrupt function for the wheel timer
  */
-void timer8Interrupt() {
-	TickHandler::getInstance()->handleInterrupt(8);
+void timerInterrupt() {
+	TickHandler::getInstance()->handleInterrupt();
 }
 
 /*
@@ -34,7 +34,33 @@ SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
 #include <DueTimer.h>
 #include "Logger.h"
 
-#define NUM_TIMERS 9
+/*
+ * All observers are driven from a single hardware timer which ticks a hierarchical
+ * timer wheel every CFG_TIMER_WHEEL_RESOLUTION microseconds. Each level has
+ * WHEEL_SLOTS slots, a slot on level n covers WHEEL_SLOTS^n wheel ticks.
+ * So with 1ms resolution level 0 covers 64ms, level 1 4.1s and level 2 262s.
+ * Longer intervals are parked on the last level and re-sorted when they come around.
+ */
+#define WHEEL_LEVELS	3
+#define WHEEL_BITS		6
+#define WHEEL_SLOTS		(1 << WHEEL_BITS)
+#define WHEEL_MASK		(WHEEL_SLOTS - 1)
+#define WHEEL_PHASE_AUTO	0xFFFFFFFF	// let attach() pick a phase which staggers observers with the same interval
+
+/*
+ * Profiling histograms have decade buckets: <10us, <100us, <1ms, <10ms, <100ms and
+ * everything above. Times are measured with the DWT cycle counter, so single
+ * measurements longer than ~51s (2^32 cycles at 84MHz) wrap.
+ */
+#define PROFILE_BUCKETS	6
+
+struct TickProfile {
+	uint32_t count; // number of handleTick() calls measured
+	uint32_t latency[PROFILE_BUCKETS]; // time from the timer interrupt to the dispatch in process()
+	uint32_t latencyMax; // worst case in cycles
+	uint32_t exec[PROFILE_BUCKETS]; // time spent in handleTick()
+	uint32_t execMax; // worst case in cycles
+};
 
 class TickObserver {
 public:
@@ -45,41 +71,77 @@ public:
 class TickHandler {
 public:
 	static TickHandler *getInstance();
-	void attach(TickObserver *observer, uint32_t interval);
+	void attach(TickObserver *observer, uint32_t interval, uint32_t phase = WHEEL_PHASE_AUTO);
 	void detach(TickObserver *observer);
-	void handleInterrupt(int timerNumber); // must be public when from the non-class functions
+	void handleInterrupt(); // must be public when from the non-class functions
 #ifdef CFG_TIMER_USE_QUEUING
 	void cleanBuffer();
 	void process();
+	void setCoalescing(bool coalesce);
+	uint32_t getOverrunCount();
+	uint32_t getCoalesceCount();
+	uint16_t getMaxQueueDepth();
+	bool hasPending();
+	void resetCounters();
+#endif
+	TickObserver *getObserver(uint8_t entry);
+	uint32_t getInterval(uint8_t entry);
+	uint32_t getTickTime();
+#ifdef CFG_TIMER_PROFILING
+	TickProfile *getProfile(uint8_t entry);
+	void resetProfile();
+	static uint32_t cyclesToMicros(uint32_t cycles);
 #endif
 
 protected:
 
 private:
-	struct TimerEntry {
-		long interval; // interval of timer
-		TickObserver *observer[CFG_TIMER_NUM_OBSERVERS]; // array of pointers to observers with this interval
+	struct WheelEntry {
+		TickObserver *observer; // NULL if the entry is unused
+		uint32_t interval; // interval in wheel ticks
+		uint32_t expiry; // wheel time the observer is triggered next
+		uint8_t level; // wheel level and slot the entry is linked into
+		uint8_t slot;
+		uint8_t next; // next entry in the same slot, 0xFF ends the list
 	};
-	TimerEntry timerEntry[NUM_TIMERS]; // array of timer entries (9 as there are 9 timers)
+	WheelEntry wheelEntry[CFG_TIMER_NUM_OBSERVERS];
+	uint8_t wheel[WHEEL_LEVELS][WHEEL_SLOTS]; // first entry of every slot (0xFF if empty)
+	volatile uint32_t wheelTime; // wheel ticks since the timer was started
+	bool timerRunning;
+	uint32_t dispatchTime; // TimeBase stamp of the tick being handled
 	static TickHandler *tickHandler;
 #ifdef CFG_TIMER_USE_QUEUING
-	TickObserver *tickBuffer[CFG_TIMER_BUFFER_SIZE];
+	/*
+	 * Single producer (timer interrupt) / single consumer (process() in loop()) ring of
+	 * wheel entry numbers. Only the interrupt writes bufferHead and only process() writes
+	 * bufferTail so no locking is needed, just memory barriers around the hand over.
+	 */
+	uint8_t tickBuffer[CFG_TIMER_BUFFER_SIZE];
 	volatile uint16_t bufferHead, bufferTail;
+	volatile bool pending[CFG_TIMER_NUM_OBSERVERS]; // entry is in the queue and hasn't been handled yet
+	bool coalescing; // don't queue an entry again while it is still pending
+	volatile uint32_t overrunCount; // ticks dropped because the queue was full
+	volatile uint32_t coalesceCount; // ticks folded into one which was still pending
+	volatile uint16_t maxQueueDepth; // most ticks waiting at once
+	uint32_t tickTime[CFG_TIMER_BUFFER_SIZE]; // TimeBase stamp when the tick was queued
+#ifdef CFG_TIMER_PROFILING
+	uint32_t tickStamp[CFG_TIMER_BUFFER_SIZE]; // cycle counter when the tick was queued
+#endif
+#endif
+#ifdef CFG_TIMER_PROFILING
+	TickProfile profile[CFG_TIMER_NUM_OBSERVERS];
 #endif
 
 	TickHandler();
-	int findTimer(long interval);
-	int findObserver(int timerNumber, TickObserver *observer);
+	void insertEntry(uint8_t entry);
+	void unlinkEntry(uint8_t entry);
+	void cascade(uint8_t level);
+	void trigger(uint8_t entry);
+#ifdef CFG_TIMER_PROFILING
+	void record(uint32_t *histogram, uint32_t *worst, uint32_t cycles);
+#endif
 };
 
-void timer0Interrupt();
-void timer1Interrupt();
-void timer2Interrupt();
-void timer3Interrupt();
-void timer4Interrupt();
-void timer5Interrupt();
-void timer6Interrupt();
-void timer7Interrupt();
-void timer8Interrupt();
+void timerInterrupt();
 
 #endif /* TICKHANDLER_H_ */
@@ -0,0 +1,160 @@
+/*
+ * TimeBase.cpp
+ *
+ * Microsecond time base for all time stamps
+ *
+Copyright (c) 2013 Collin Kidder, Michael Neuweiler, Charles Galpin
+
+Permission is hereby granted, free of charge, to any person obtaining
+a copy of this software and associated documentation files (the
+"Software"), to deal in the Software without restriction, including
+without limitation the rights to use, copy, modify, merge, publish,
+distribute, sublicense, and/or sell copies of the Software, and to
+permit persons to whom the Software is furnished to do so, subject to
+the following conditions:
+
+The above copyright notice and this permission notice shall be included
+in all copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.
+IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY
+CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT,
+TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE
+SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+
+ */
+
+#include "TimeBase.h"
+
+TimeBase *TimeBase::timeBase = NULL;
+
+//the counter starts right away, so whatever gets constructed first can stamp
+TimeBase::TimeBase() {
+	CoreDebug->DEMCR |= CoreDebug_DEMCR_TRCENA_Msk;
+	DWT->CTRL |= DWT_CTRL_CYCCNTENA_Msk;
+	cyclesPerMicro = SystemCoreClock / 1000000;
+	lastCycles = DWT->CYCCNT;
+	restCycles = 0;
+	micros = 0;
+	syncLocal = syncReference = 0;
+	driftLocal = driftReference = 0;
+	drift = 0;
+}
+
+/*
+ * Get the instance of the TimeBase (singleton pattern)
+ */
+TimeBase *TimeBase::getInstance() {
+	if (timeBase == NULL)
+		timeBase = new TimeBase();
+	return timeBase;
+}
+
+//keep the clock from missing a wrap of the cycle counter, needs the TickHandler
+void TimeBase::setup() {
+	TickHandler::getInstance()->detach(this);
+	TickHandler::getInstance()->attach(this, CFG_TICK_INTERVAL_TIMEBASE);
+}
+
+/*
+ * Microseconds since start up. Safe to call from interrupts.
+ */
+uint64_t TimeBase::getMicros() {
+	uint32_t primask = __get_PRIMASK();
+	uint32_t cycles, elapsed;
+	uint64_t result;
+
+	__disable_irq();
+	cycles = DWT->CYCCNT;
+	elapsed = cycles - lastCycles + restCycles;
+	lastCycles = cycles;
+	micros += elapsed / cyclesPerMicro;
+	restCycles = elapsed % cyclesPerMicro;
+	result = micros;
+	__set_PRIMASK(primask);
+	return result;
+}
+
+//32 bit time stamp in microseconds (what micros() used to be for)
+uint32_t TimeBase::getStamp() {
+	return (uint32_t)getMicros();
+}
+
+//milliseconds since start up, same time base
+uint32_t TimeBase::getMillis() {
+	return (uint32_t)(getMicros() / 1000);
+}
+
+void TimeBase::handleTick() {
+	getMicros();
+}
+
+/*
+ * A reference time from a wall clock arrived. The offset is taken over as it is, the rate is
+ * only corrected against a reference taken at least CFG_TIMEBASE_DRIFT_SPAN earlier so the
+ * resolution of the reference (one second for the RTC) doesn't spoil it.
+ */
+void TimeBase::discipline(uint64_t unixMicros) {
+	uint64_t local = getMicros();
+
+	if (driftReference == 0) {
+		driftLocal = local;
+		driftReference = unixMicros;
+	}
+	else if (local - driftLocal >= (uint64_t)CFG_TIMEBASE_DRIFT_SPAN * 1000000) {
+		int64_t localSpan = local - driftLocal;
+		int64_t error = (int64_t)(unixMicros - driftReference) - localSpan;
+		int64_t measured = error * 1000000000 / localSpan;
+		if (measured > CFG_TIMEBASE_MAX_DRIFT * 1000) measured = CFG_TIMEBASE_MAX_DRIFT * 1000;
+		if (measured < -CFG_TIMEBASE_MAX_DRIFT * 1000) measured = -CFG_TIMEBASE_MAX_DRIFT * 1000;
+		drift = (int32_t)measured;
+		driftLocal = local;
+		driftReference = unixMicros;
+		Logger::info("time base drift: %i ppb", drift);
+	}
+	syncLocal = local;
+	syncReference = unixMicros;
+}
+
+bool TimeBase::isDisciplined() {
+	return (syncReference != 0);
+}
+
+//wall clock time in microseconds since 1970, 0 as long as no reference was given
+uint64_t TimeBase::getUnixMicros() {
+	int64_t elapsed;
+
+	if (syncReference == 0) return 0;
+	elapsed = getMicros() - syncLocal;
+	return syncReference + elapsed + elapsed * drift / 1000000000;
+}
+
+//rate correction in ppb
+int32_t TimeBase::getDrift() {
+	return drift;
+}
+
+/*
+ * Sleep until the next interrupt, interrupts must be disabled (the one which wakes the core
+ * runs once they're enabled again). Depending on the chip the cycle counter stops while the
+ * core sleeps, so SysTick (which keeps counting down and wakes the core at least every
+ * millisecond) measures the time as well and whatever the cycle counter missed is added to
+ * the clock. Returns the cycles slept.
+ */
+uint32_t TimeBase::sleep() {
+	uint32_t reload = SysTick->LOAD + 1;
+	uint32_t cycles = DWT->CYCCNT;
+	uint32_t ticks = SysTick->VAL;
+	uint32_t counted, elapsed;
+
+	__WFI();
+	counted = DWT->CYCCNT - cycles;
+	elapsed = (ticks + reload - SysTick->VAL) % reload;
+	if (elapsed > counted + CFG_TIMEBASE_SLEEP_SLACK) {
+		restCycles += elapsed - counted;
+		return elapsed;
+	}
+	return counted;
+}
@@ -0,0 +1,77 @@
+/*
+ * TimeBase.h
+ *
+ * Microsecond time base for all time stamps
+ *
+Copyright (c) 2013 Collin Kidder, Michael Neuweiler, Charles Galpin
+
+Permission is hereby granted, free of charge, to any person obtaining
+a copy of this software and associated documentation files (the
+"Software"), to deal in the Software without restriction, including
+without limitation the rights to use, copy, modify, merge, publish,
+distribute, sublicense, and/or sell copies of the Software, and to
+permit persons to whom the Software is furnished to do so, subject to
+the following conditions:
+
+The above copyright notice and this permission notice shall be included
+in all copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.
+IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY
+CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT,
+TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE
+SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+
+ */
+
+#ifndef TIMEBASE_H_
+#define TIMEBASE_H_
+
+#include <Arduino.h>
+#include "config.h"
+#include "TickHandler.h"
+
+/*
+ * The DWT cycle counter runs at the core clock (84MHz) and wraps after 51s. Every read
+ * adds the cycles since the previous read to a 64 bit microsecond count, so the clock
+ * never wraps as long as it is read at least every 51s (the time base's own tick sees to
+ * that). It can be read from interrupts, all stamps (ADC blocks, ticks, TWI transfers,
+ * samples, log records) come from it so they can be compared down to the microsecond.
+ * 32 bit stamps are the low part of getMicros(), they wrap after 71 minutes.
+ *
+ * Optionally the time base follows a wall clock (RTC, NTP): each discipline() call with
+ * a reference time sets the offset, references more than CFG_TIMEBASE_DRIFT_SPAN apart
+ * also correct the rate of the crystal (within CFG_TIMEBASE_MAX_DRIFT).
+ */
+class TimeBase : public TickObserver {
+public:
+	static TimeBase *getInstance();
+	void setup();
+	uint64_t getMicros();
+	uint32_t getStamp();
+	uint32_t getMillis();
+	void discipline(uint64_t unixMicros);
+	bool isDisciplined();
+	uint64_t getUnixMicros();
+	int32_t getDrift();
+	uint32_t sleep();
+	void handleTick();
+
+private:
+	TimeBase();
+	static TimeBase *timeBase;
+
+	uint32_t cyclesPerMicro;
+	uint32_t lastCycles; // DWT->CYCCNT at the last read
+	uint32_t restCycles; // cycles of the last read which didn't make a full microsecond
+	uint64_t micros; // since the counter was started
+	uint64_t syncLocal; // getMicros() at the last discipline()
+	uint64_t syncReference; // wall clock (unix microseconds) at the last discipline(), 0 if never
+	uint64_t driftLocal; // getMicros() at the reference the drift was last measured against
+	uint64_t driftReference;
+	int32_t drift; // ppb the crystal runs slow (positive) or fast
+};
+
+#endif /* TIMEBASE_H_ */
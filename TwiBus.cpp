@@ -0,0 +1,268 @@
+/*
+ * TwiBus.cpp
+ *
+ * Shared, interrupt driven access to the TWI (I2C) bus
+ *
+Copyright (c) 2013 Collin Kidder, Michael Neuweiler, Charles Galpin
+
+Permission is hereby granted, free of charge, to any person obtaining
+a copy of this software and associated documentation files (the
+"Software"), to deal in the Software without restriction, including
+without limitation the rights to use, copy, modify, merge, publish,
+distribute, sublicense, and/or sell copies of the Software, and to
+permit persons to whom the Software is furnished to do so, subject to
+the following conditions:
+
+The above copyright notice and this permission notice shall be included
+in all copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.
+IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY
+CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT,
+TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE
+SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+
+ */
+
+#include "TwiBus.h"
+#include "TimeBase.h"
+
+TwiBus *TwiBus::twiBus = NULL;
+
+TwiBus::TwiBus() {
+	for (int i = 0; i < TWI_PRIORITY_COUNT; i++) queueHead[i] = queueTail[i] = NULL;
+	current = NULL;
+	chunk = 0;
+	clock = 100000;
+	memset(&stats, 0, sizeof(stats));
+}
+
+/*
+ * Get the instance of the TwiBus (singleton pattern)
+ */
+TwiBus *TwiBus::getInstance() {
+	if (twiBus == NULL)
+		twiBus = new TwiBus();
+	return twiBus;
+}
+
+/*
+ * Take over the TWI controller behind the SDA/SCL pins (what Wire.begin() used to do) and
+ * run it as master at the given clock (Hz).
+ */
+void TwiBus::setup(uint32_t clock) {
+	TickHandler::getInstance()->detach(this);
+	this->clock = clock;
+
+	pmc_enable_periph_clk(WIRE_INTERFACE_ID);
+	PIO_Configure(g_APinDescription[PIN_WIRE_SDA].pPort, g_APinDescription[PIN_WIRE_SDA].ulPinType,
+			g_APinDescription[PIN_WIRE_SDA].ulPin, g_APinDescription[PIN_WIRE_SDA].ulPinConfiguration);
+	PIO_Configure(g_APinDescription[PIN_WIRE_SCL].pPort, g_APinDescription[PIN_WIRE_SCL].ulPinType,
+			g_APinDescription[PIN_WIRE_SCL].ulPin, g_APinDescription[PIN_WIRE_SCL].ulPinConfiguration);
+	resetController();
+
+	NVIC_DisableIRQ(WIRE_ISR_ID);
+	NVIC_ClearPendingIRQ(WIRE_ISR_ID);
+	NVIC_SetPriority(WIRE_ISR_ID, 0);
+	NVIC_EnableIRQ(WIRE_ISR_ID);
+
+	TickHandler::getInstance()->attach(this, CFG_TICK_INTERVAL_TWI);
+}
+
+/*
+ * Queue a transaction. It is started right away if the bus is free.
+ * Returns false if it is still queued or active from an earlier submit or has no data.
+ * May be called from interrupts (e.g. a completion callback).
+ */
+bool TwiBus::submit(TwiTransaction *transaction) {
+	uint32_t primask;
+
+	if (transaction->length == 0 || transaction->priority >= TWI_PRIORITY_COUNT) return false;
+	primask = __get_PRIMASK();
+	__disable_irq();
+	if (transaction->status == TWI_QUEUED || transaction->status == TWI_ACTIVE) {
+		__set_PRIMASK(primask);
+		return false;
+	}
+	transaction->status = TWI_QUEUED;
+	transaction->done = 0;
+	transaction->next = NULL;
+	if (queueTail[transaction->priority]) queueTail[transaction->priority]->next = transaction;
+	else queueHead[transaction->priority] = transaction;
+	queueTail[transaction->priority] = transaction;
+	if (current == NULL) startNext();
+	__set_PRIMASK(primask);
+	return true;
+}
+
+/*
+ * Spin until the transaction is finished, true if it went through. Only for callers that
+ * can't go on without the data, the bus keeps serving more important transfers meanwhile.
+ */
+bool TwiBus::wait(TwiTransaction *transaction) {
+	while (!isFinished(transaction)) checkTimeout();
+	return (transaction->status == TWI_DONE);
+}
+
+//true once the transaction is neither queued nor on the bus
+bool TwiBus::isFinished(TwiTransaction *transaction) {
+	return (transaction->status != TWI_QUEUED && transaction->status != TWI_ACTIVE);
+}
+
+//make sure a hanging transfer doesn't block the bus forever, even if nobody waits for it
+void TwiBus::handleTick() {
+	checkTimeout();
+}
+
+TwiStats *TwiBus::getStats() {
+	return &stats;
+}
+
+//Take the most important queued transaction. Called with interrupts disabled or from the interrupt.
+void TwiBus::startNext() {
+	for (int i = 0; i < TWI_PRIORITY_COUNT; i++) {
+		TwiTransaction *transaction = queueHead[i];
+		if (transaction == NULL) continue;
+		queueHead[i] = transaction->next;
+		if (queueHead[i] == NULL) queueTail[i] = NULL;
+		current = transaction;
+		startTransfer(transaction);
+		return;
+	}
+	current = NULL;
+}
+
+/*
+ * Put the next chunk of a transaction on the bus. The PDC moves the data, the interrupt
+ * only sees the end of it:
+ * write: ENDTX (last byte in THR) -> TXRDY (last byte sent) set STOP -> TXCOMP
+ * read: ENDRX (all but the last byte) set STOP -> RXRDY (last byte) -> TXCOMP
+ * A single byte read needs START and STOP at once and goes straight to RXRDY.
+ */
+void TwiBus::startTransfer(TwiTransaction *transaction) {
+	Twi *twi = WIRE_INTERFACE;
+	uint8_t *data = transaction->data + transaction->done;
+
+	chunk = transaction->length - transaction->done;
+	if (transaction->read && transaction->chunkSize && chunk > transaction->chunkSize) chunk = transaction->chunkSize;
+	if (transaction->done == 0) transaction->started = TimeBase::getInstance()->getStamp();
+	transaction->status = TWI_ACTIVE;
+	chunkStarted = millis();
+
+	twi->TWI_PTCR = TWI_PTCR_RXTDIS | TWI_PTCR_TXTDIS;
+	twi->TWI_IDR = 0xFFFFFFFF;
+	twi->TWI_MMR = 0;
+	twi->TWI_MMR = TWI_MMR_DADR(transaction->device) | (transaction->read ? TWI_MMR_MREAD : 0)
+			| (transaction->commandSize << TWI_MMR_IADRSZ_Pos);
+	twi->TWI_IADR = TWI_IADR_IADR(transaction->command + (transaction->read ? transaction->done : 0));
+	twi->TWI_SR; //clear a NACK left over from the last transfer
+
+	if (!transaction->read) {
+		twi->TWI_TPR = (uint32_t)data;
+		twi->TWI_TCR = chunk;
+		twi->TWI_PTCR = TWI_PTCR_TXTEN; //the first byte in THR starts the transfer
+		twi->TWI_IER = TWI_IER_ENDTX | TWI_IER_NACK;
+	}
+	else if (chunk == 1) {
+		twi->TWI_CR = TWI_CR_START | TWI_CR_STOP;
+		twi->TWI_IER = TWI_IER_RXRDY | TWI_IER_NACK;
+	}
+	else {
+		twi->TWI_RPR = (uint32_t)data;
+		twi->TWI_RCR = chunk - 1;
+		twi->TWI_PTCR = TWI_PTCR_RXTEN;
+		twi->TWI_CR = TWI_CR_START;
+		twi->TWI_IER = TWI_IER_ENDRX | TWI_IER_NACK;
+	}
+}
+
+void TwiBus::handleInterrupt() {
+	Twi *twi = WIRE_INTERFACE;
+	uint32_t status = twi->TWI_SR;
+	uint32_t pending = status & twi->TWI_IMR;
+	TwiTransaction *transaction = current;
+
+	if (transaction == NULL) {
+		twi->TWI_IDR = 0xFFFFFFFF;
+		return;
+	}
+	if (status & TWI_SR_NACK) { //the controller sends the STOP itself
+		twi->TWI_PTCR = TWI_PTCR_RXTDIS | TWI_PTCR_TXTDIS;
+		twi->TWI_IDR = 0xFFFFFFFF;
+		finish(TWI_NACK);
+		return;
+	}
+	if (pending & TWI_SR_ENDTX) {
+		twi->TWI_IDR = TWI_IDR_ENDTX;
+		twi->TWI_IER = TWI_IER_TXRDY;
+	}
+	else if (pending & TWI_SR_TXRDY) {
+		twi->TWI_CR = TWI_CR_STOP;
+		twi->TWI_IDR = TWI_IDR_TXRDY;
+		twi->TWI_IER = TWI_IER_TXCOMP;
+	}
+	else if (pending & TWI_SR_ENDRX) { //the last byte is coming in, STOP goes out after it
+		twi->TWI_CR = TWI_CR_STOP;
+		twi->TWI_IDR = TWI_IDR_ENDRX;
+		twi->TWI_IER = TWI_IER_RXRDY;
+	}
+	else if (pending & TWI_SR_RXRDY) {
+		transaction->data[transaction->done + chunk - 1] = twi->TWI_RHR;
+		twi->TWI_IDR = TWI_IDR_RXRDY;
+		twi->TWI_IER = TWI_IER_TXCOMP;
+	}
+	else if (pending & TWI_SR_TXCOMP) {
+		twi->TWI_IDR = 0xFFFFFFFF;
+		twi->TWI_PTCR = TWI_PTCR_RXTDIS | TWI_PTCR_TXTDIS;
+		transaction->done += chunk;
+		if (transaction->done < transaction->length) { //next chunk, unless something more important came up
+			int priority = transaction->priority;
+			transaction->next = queueHead[priority];
+			queueHead[priority] = transaction;
+			if (queueTail[priority] == NULL) queueTail[priority] = transaction;
+			startNext();
+			if (current != transaction) stats.preemptions++;
+		}
+		else finish(TWI_DONE);
+	}
+}
+
+//The transfer on the bus is over. Hand it back to its owner and start the next one.
+void TwiBus::finish(TwiStatus status) {
+	TwiTransaction *transaction = current;
+
+	current = NULL;
+	stats.transactions++;
+	if (status == TWI_NACK) stats.nacks++;
+	transaction->duration = TimeBase::getInstance()->getStamp() - transaction->started;
+	transaction->status = status;
+	if (transaction->callback) transaction->callback(transaction);
+	if (current == NULL) startNext(); //unless the callback's submit already did
+}
+
+//Reset the controller if a transfer takes far longer than it can (device holding SCL low, lost interrupt)
+void TwiBus::checkTimeout() {
+	uint32_t primask = __get_PRIMASK();
+
+	__disable_irq();
+	if (current != NULL && millis() - chunkStarted > CFG_TWI_TIMEOUT) {
+		stats.errors++;
+		resetController();
+		finish(TWI_ERROR);
+	}
+	__set_PRIMASK(primask);
+}
+
+void TwiBus::resetController() {
+	Twi *twi = WIRE_INTERFACE;
+
+	twi->TWI_IDR = 0xFFFFFFFF;
+	twi->TWI_PTCR = TWI_PTCR_RXTDIS | TWI_PTCR_TXTDIS;
+	TWI_ConfigureMaster(twi, clock, VARIANT_MCK); //does a software reset first
+}
+
+void WIRE_ISR_HANDLER(void) {
+	TwiBus::getInstance()->handleInterrupt();
+}
@@ -0,0 +1,123 @@
+/*
+ * TwiBus.h
+ *
+ * Shared, interrupt driven access to the TWI (I2C) bus
+ *
+Copyright (c) 2013 Collin Kidder, Michael Neuweiler, Charles Galpin
+
+Permission is hereby granted, free of charge, to any person obtaining
+a copy of this software and associated documentation files (the
+"Software"), to deal in the Software without restriction, including
+without limitation the rights to use, copy, modify, merge, publish,
+distribute, sublicense, and/or sell copies of the Software, and to
+permit persons to whom the Software is furnished to do so, subject to
+the following conditions:
+
+The above copyright notice and this permission notice shall be included
+in all copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.
+IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY
+CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT,
+TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE
+SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+
+ */
+
+#ifndef TWIBUS_H_
+#define TWIBUS_H_
+
+#include <Arduino.h>
+#include "config.h"
+#include "TickHandler.h"
+
+enum TwiPriority {
+	TWI_PRIORITY_SENSOR, // sensor transfers with sample deadlines
+	TWI_PRIORITY_READ, // somebody is waiting for the data (EEPROM page reads)
+	TWI_PRIORITY_BACKGROUND, // EEPROM write-back and acknowledge polling
+	TWI_PRIORITY_COUNT
+};
+
+enum TwiStatus {
+	TWI_IDLE, // never submitted
+	TWI_QUEUED,
+	TWI_ACTIVE, // on the bus (or between two chunks)
+	TWI_DONE,
+	TWI_NACK, // the device didn't answer (not there, EEPROM busy with a write cycle)
+	TWI_ERROR // the transfer didn't finish within CFG_TWI_TIMEOUT, the controller was reset
+};
+
+struct TwiTransaction;
+typedef void (*TwiCallback)(TwiTransaction *transaction);
+
+/*
+ * One transfer on the bus. The owner keeps it (and the data) alive until it is finished,
+ * the bus only links it into its queue.
+ * The command bytes (memory address, sensor command) go out first, MSB first. A read then
+ * follows with a repeated start.
+ */
+struct TwiTransaction {
+	uint8_t device; // 7 bit address
+	bool read;
+	uint8_t commandSize; // 0 - 3 bytes
+	uint32_t command;
+	uint8_t *data;
+	uint16_t length; // at least 1
+	uint16_t chunkSize; // reads of memory devices: transfer at most this much at a time, the command is advanced by the bytes read. 0 = no split
+	TwiPriority priority;
+	TwiCallback callback; // called from the interrupt once finished, may submit. NULL to poll the status
+	void *context; // for the owner
+	volatile TwiStatus status;
+	uint32_t duration; // microseconds from the start of the transfer until it finished
+
+	uint16_t done; // bytes transferred so far (TwiBus internal)
+	uint32_t started;
+	TwiTransaction *next;
+};
+
+typedef struct {
+	uint32_t transactions; // finished ones, whatever the result
+	uint32_t nacks;
+	uint32_t errors; // controller resets
+	uint32_t preemptions; // a chunked read had to wait for a more important transfer
+} TwiStats;
+
+/*
+ * Transactions are queued by priority and run one after the other from the TWI interrupt,
+ * the data is moved by the PDC. A chunked read goes back to the head of its queue after
+ * each chunk so more important transfers only wait for one chunk.
+ * The controller is reset if a transfer hangs. wait() and the tick check for that.
+ */
+class TwiBus : public TickObserver {
+public:
+	static TwiBus *getInstance();
+	void setup(uint32_t clock);
+	bool submit(TwiTransaction *transaction);
+	bool wait(TwiTransaction *transaction);
+	static bool isFinished(TwiTransaction *transaction);
+	void handleTick();
+	void handleInterrupt();
+	TwiStats *getStats();
+
+private:
+	TwiBus();
+	static TwiBus *twiBus;
+
+	TwiTransaction *queueHead[TWI_PRIORITY_COUNT];
+	TwiTransaction *queueTail[TWI_PRIORITY_COUNT];
+	TwiTransaction * volatile current;
+	uint16_t chunk; // bytes in the transfer on the bus
+	uint32_t chunkStarted; // millis()
+	uint32_t clock;
+	TwiStats stats;
+
+	void startNext();
+	void startTransfer(TwiTransaction *transaction);
+	void finish(TwiStatus status);
+	void checkTimeout();
+	void resetController();
+};
+
+#endif /* TWIBUS_H_ */
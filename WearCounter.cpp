@@ -0,0 +1,142 @@
+/*
+ * WearCounter.cpp
+ *
+ * Monotonic counter kept in EEPROM, spreading the write cycles over several slots
+ *
+Copyright (c) 2013 Collin Kidder, Michael Neuweiler, Charles Galpin
+
+Permission is hereby granted, free of charge, to any person obtaining
+a copy of this software and associated documentation files (the
+"Software"), to deal in the Software without restriction, including
+without limitation the rights to use, copy, modify, merge, publish,
+distribute, sublicense, and/or sell copies of the Software, and to
+permit persons to whom the Software is furnished to do so, subject to
+the following conditions:
+
+The above copyright notice and this permission notice shall be included
+in all copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.
+IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY
+CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT,
+TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE
+SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+
+ */
+
+#include "WearCounter.h"
+
+/*
+ * address - first slot in EEPROM, slots * slotStride bytes are used
+ * slots - number of slots to rotate through (up to WEAR_COUNTER_MAX_SLOTS)
+ * slotStride - distance of the slots, WEAR_COUNTER_PAGE_STRIDE puts each on its own page
+ *              (a page aligned address is best then), 16 packs them back to back
+ * commitInterval - minimum time (ms) between two writes
+ */
+WearCounter::WearCounter(uint32_t address, uint8_t slots, uint16_t slotStride, uint32_t commitInterval) {
+	if (slots < 1)
+		slots = 1;
+	if (slots > WEAR_COUNTER_MAX_SLOTS)
+		slots = WEAR_COUNTER_MAX_SLOTS;
+	if (slotStride < sizeof(WearCounterSlot))
+		slotStride = sizeof(WearCounterSlot);
+	this->address = address;
+	this->slots = slots;
+	this->slotStride = slotStride;
+	this->commitInterval = commitInterval;
+	value = 0;
+	sequence = 0;
+	changed = false;
+	lastCommit = 0;
+}
+
+/*
+ * Read the region of all slots in one go and pick the newest valid slot. Pages which were
+ * only read for this are aged so they're the first to leave the cache again.
+ * The region is only buffered while loading (it's a few KB with page strided slots).
+ * Returns false if no slot is valid (value is 0 then).
+ */
+boolean WearCounter::load() {
+	WearCounterSlot slot;
+	uint16_t length = (uint16_t) slotStride * (slots - 1) + sizeof(slot); // nothing is needed after the last slot
+	uint8_t *region;
+	boolean found = false;
+
+	value = 0;
+	sequence = 0;
+	changed = false;
+	region = new uint8_t[length];
+	if (!memCache->Read(address, region, length)) {
+		delete[] region;
+		return false;
+	}
+	for (int i = 0; i < slots; i++) {
+		if (slotStride >= WEAR_COUNTER_PAGE_STRIDE)
+			memCache->AgeFullyAddress(slotAddress(i));
+		memcpy(&slot, region + (uint32_t) slotStride * i, sizeof(slot));
+		if (slot.checkSequence != ~slot.sequence || slot.checkValue != ~slot.value)
+			continue;
+		// compare with wrap around of the sequence number
+		if (!found || (int32_t) (slot.sequence - sequence) > 0) {
+			sequence = slot.sequence;
+			value = slot.value;
+			found = true;
+		}
+	}
+	delete[] region;
+	lastCommit = millis();
+	return found;
+}
+
+uint32_t WearCounter::get() {
+	return value;
+}
+
+void WearCounter::set(uint32_t newValue) {
+	if (newValue != value) {
+		value = newValue;
+		changed = true;
+	}
+}
+
+void WearCounter::add(uint32_t delta) {
+	set(value + delta);
+}
+
+/*
+ * Write the value if it changed and the commit interval is over.
+ */
+void WearCounter::poll() {
+	if (changed && (millis() - lastCommit) >= commitInterval)
+		commit();
+}
+
+/*
+ * Write the value to the next slot now (if it changed).
+ */
+boolean WearCounter::commit() {
+	WearCounterSlot slot;
+	uint32_t target;
+
+	if (!changed)
+		return true;
+	slot.sequence = sequence + 1;
+	slot.value = value;
+	slot.checkSequence = ~slot.sequence;
+	slot.checkValue = ~slot.value;
+	target = slotAddress(slot.sequence % slots);
+	lastCommit = millis();
+	if (!memCache->Write(target, &slot, sizeof(slot)))
+		return false;
+	memCache->FlushAddress(target);
+	sequence = slot.sequence;
+	changed = false;
+	return true;
+}
+
+//EEPROM address of a slot
+uint32_t WearCounter::slotAddress(uint8_t slot) {
+	return address + (uint32_t) slotStride * slot;
+}
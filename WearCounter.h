@@ -0,0 +1,83 @@
+/*
+ * WearCounter.h
+ *
+ * Monotonic counter kept in EEPROM, spreading the write cycles over several slots
+ *
+Copyright (c) 2013 Collin Kidder, Michael Neuweiler, Charles Galpin
+
+Permission is hereby granted, free of charge, to any person obtaining
+a copy of this software and associated documentation files (the
+"Software"), to deal in the Software without restriction, including
+without limitation the rights to use, copy, modify, merge, publish,
+distribute, sublicense, and/or sell copies of the Software, and to
+permit persons to whom the Software is furnished to do so, subject to
+the following conditions:
+
+The above copyright notice and this permission notice shall be included
+in all copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.
+IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY
+CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT,
+TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE
+SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+
+ */
+
+#ifndef WEARCOUNTER_H_
+#define WEARCOUNTER_H_
+
+#include <Arduino.h>
+#include "config.h"
+#include "MemCache.h"
+
+extern MemCache *memCache;
+
+/*
+ * Each commit goes into the next of a number of slots. The EEPROM wears out per page
+ * write, so the slots have to be on different pages to spread the write cycles: with a
+ * slot stride of 256 every slot sits on its own page and N slots last N times as long.
+ * (Slots which share a page level nothing.) Slots are 16 bytes (the cache's dirty chunk
+ * size) and are read with one bulk read at start up, the slot with the highest valid
+ * sequence number holds the current value.
+ * Changes are only written when the commit interval has passed (or on commit()).
+ *
+ * Usage: call load() once at start up, then set()/add() whenever the value changes
+ * and poll() regularly (e.g. from handleTick()).
+ */
+#define WEAR_COUNTER_MAX_SLOTS	16
+#define WEAR_COUNTER_PAGE_STRIDE	256 // one slot per EEPROM page
+
+struct WearCounterSlot {
+	uint32_t sequence;
+	uint32_t value;
+	uint32_t checkSequence; // ~sequence
+	uint32_t checkValue; // ~value
+};
+
+class WearCounter {
+public:
+	WearCounter(uint32_t address, uint8_t slots, uint16_t slotStride, uint32_t commitInterval);
+	boolean load();
+	uint32_t get();
+	void set(uint32_t value);
+	void add(uint32_t delta);
+	void poll();
+	boolean commit();
+
+private:
+	uint32_t address; // EEPROM address of the first slot
+	uint8_t slots; // number of slots
+	uint16_t slotStride; // bytes from one slot to the next
+	uint32_t commitInterval; // ms between two writes
+	uint32_t value; // current value
+	uint32_t sequence; // sequence number of the last written slot
+	boolean changed; // value differs from the last written one
+	uint32_t lastCommit; // millis() of the last write
+
+	uint32_t slotAddress(uint8_t slot);
+};
+
+#endif /* WEARCOUNTER_H_ */
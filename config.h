@@ -45,6 +45,20 @@ SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
 #define CFG_SERIAL_SPEED 115200
 //#define SerialUSB Serial // re-route serial-usb output to programming port ;) comment if output should go to std usb
 
+/*
+ * LOGGER CONFIGURATION
+ *
+ * With CFG_LOG_BUFFERED log messages are formatted into a RAM ring and written to SerialUSB
+ * by Logger::process() from loop(). If the ring fills up the oldest messages are dropped.
+ * Console output (Logger::console) is always written directly, after the ring was flushed.
+ */
+#define CFG_LOG_BUFFERED
+#define CFG_LOG_BUFFER_SIZE		2048 // size of the ring in bytes
+#define CFG_LOG_LINE_SIZE		160 // longest message (incl. time stamp and level), longer ones are truncated (max 255)
+#define CFG_LOG_DRAIN_CHUNK		64 // bytes handed to SerialUSB per write (one USB packet)
+#define CFG_LOG_DRAIN_CHUNKS	4 // max number of chunks written per call to Logger::process()
+#define CFG_SYSLOG_COMMIT_INTERVAL	10000 // ms after which a partly filled system log page is written to EEPROM
+
 
 //The defines that used to be here to configure devices are gone now.
 //The EEPROM stores which devices to bring up at start up and all
@@ -54,12 +68,17 @@ SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
  * TIMER INTERVALS
  *
  * specify the intervals (microseconds) at which each device type should be "ticked"
- * try to use the same numbers for several devices because then they will share
- * the same timer (out of a limited number of 9 timers).
+ * all of them are multiplexed onto one hardware timer (see TickHandler) so any
+ * interval is fine as long as it is a multiple of CFG_TIMER_WHEEL_RESOLUTION.
  */
 #define CFG_TICK_INTERVAL_HEARTBEAT			200000
 #define CFG_TICK_INTERVAL_MEM_CACHE			40000
 #define CFG_TICK_INTERVAL_WIFI				200000
+#define CFG_TICK_INTERVAL_SYSLOG			100000
+#define CFG_TICK_INTERVAL_TWI				100000
+#define CFG_TICK_INTERVAL_SENSORS			10000 // one SensorScheduler cycle, the fastest sensors are read every cycle
+#define CFG_TICK_INTERVAL_SAMPLESTORE		1000000
+#define CFG_TICK_INTERVAL_TIMEBASE			1000000 // must be well below the 51s the DWT cycle counter takes to wrap
 
 
 /*
@@ -136,11 +155,49 @@ SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
  * These values should normally not be changed.
  */
 #define CFG_DEV_MGR_MAX_DEVICES 20 // the maximum number of devices supported by the DeviceManager
+#define CFG_SAMPLE_BUS_DEPTH	4 // samples kept per SampleBus topic (at least 3)
+#define CFG_SAMPLE_BUS_OBSERVERS	4 // observers per SampleBus topic
+#define CFG_TWI_CLOCK			100000 // TWI (I2C) bus clock in Hz
+#define CFG_TWI_CHUNK_SIZE		32 // longest piece of a chunked TWI read, about 3ms at 100kHz. Sensor transfers wait for one at most
+#define CFG_TWI_TIMEOUT			10 // ms a TWI transfer may take before the controller is reset
+#define CFG_SENSOR_MAX			4 // sensors the SensorScheduler can read
+#define CFG_SENSOR_MAX_FAILURES	10 // failed reads in a row until a sensor gets a fault and is restarted
+#define CFG_WIFI_CMD_QUEUE_SIZE	32 // number of commands the iChip driver can queue while the module is busy
+#define CFG_WIFI_CMD_LENGTH		100 // longest iChip command without the "AT+i" prefix and CR (incl. terminating zero)
+#define CFG_WIFI_CMD_TIMEOUT	1000 // ms to wait for the reply to an iChip command before it is sent again
+#define CFG_WIFI_CMD_RETRIES	2 // number of times a command without reply is repeated before it is given up
+#define CFG_WIFI_PARAM_CACHE_SIZE	32 // number of web parameters whose last sent value is remembered
+#define CFG_WIFI_PARAMS_PER_TICK	2 // max changed web parameters sent per wifi tick (CFG_TICK_INTERVAL_WIFI)
+#define CFG_TELEMETRY_PORT		2000 // TCP port of the binary telemetry stream (see ichip_2128.h)
+#define CFG_TELEMETRY_RING_SIZE	128 // samples buffered for the telemetry clients (power of 2)
+#define CFG_TELEMETRY_BATCH_RECORDS	16 // max samples per SSND, every client has CFG_TELEMETRY_CREDIT frames of that size
+#define CFG_TELEMETRY_CREDIT		2 // batches (SSND commands) per client which may wait for the module at a time
+#define CFG_TELEMETRY_MAX_DELAY	50 // ms a sample may wait for a batch to fill up
+#define CFG_TELEMETRY_ADC_INTERVAL	50 // ms between two ADC samples put into the stream
+#define CFG_SAMPLESTORE_TOPICS	0x0F // bit mask of the SampleTopics kept in the sample store (ADC and sensors, faults have their own log)
+#define CFG_SAMPLESTORE_INTERVAL	1000 // ms between two stored samples of a topic
+#define CFG_SAMPLESTORE_COMMIT_INTERVAL	60000 // max ms stored samples stay in RAM before they are handed to the EEPROM cache
+#define CFG_SAMPLESTORE_REPLAY_PER_TICK	4 // stored samples put into the telemetry stream per wifi tick while replaying
+#define CFG_ADC_CAPTURE_MIN_SPACE	64 // bytes SerialUSB must have free before a capture frame is started, less means the host doesn't keep up
+#define CFG_CONSOLE_FRAME_TIMEOUT	500 // ms a binary console frame may take to come in completely
 #define CFG_CAN_NUM_OBSERVERS	5 // maximum number of device subscriptions per CAN bus
-#define CFG_TIMER_NUM_OBSERVERS	9 // the maximum number of supported observers per timer
+#define CFG_TIMER_NUM_OBSERVERS	32 // the maximum number of observer registrations (max 255)
+#define CFG_TIMER_WHEEL_RESOLUTION	1000 // microseconds per tick of the timer wheel which drives all observers
+#define CFG_TIMER_STAGGER	3 // wheel ticks between observers which share the same interval
 #define CFG_TIMER_USE_QUEUING	// if defined, TickHandler uses a queuing buffer instead of direct calls from interrupts
 #define CFG_TIMER_BUFFER_SIZE	100 // the size of the queuing buffer for TickHandler
+#define CFG_TIMER_COALESCE		// if defined, an observer which still has a tick queued is not queued again (counted instead)
+#define CFG_TIMER_PROFILING		// if defined, TickHandler measures queue latency and execution time of every observer
+#define CFG_TIMEBASE_DRIFT_SPAN	600 // min seconds between two wall clock references to correct the rate of the time base
+#define CFG_TIMEBASE_SLEEP_SLACK	16 // cycles the cycle counter and SysTick may differ by over a sleep before the counter is taken as stopped
+#define CFG_TIMEBASE_MAX_DRIFT	200 // max rate correction in ppm, more than a crystal can be off means a bad reference
+#define CFG_IDLE_SLEEP			// if defined, loop() sleeps (WFI) until the next interrupt when there is nothing to do
+#define CFG_HEARTBEAT_REPORT_INTERVAL	10000 // ms between two load and memory reports of the heartbeat
 #define CFG_FAULT_HISTORY_SIZE	50 //number of faults to store in eeprom. A circular buffer so the last 50 faults are always stored.
+#define CFG_FAULT_COMMIT_LATENCY	1000 //max ms a fault change stays in RAM before it is handed to the EEPROM cache
+#define CFG_FAULT_RUNTIME_SLOTS		8 //number of slots (EEPROM pages) the run time counter rotates through, up to 16
+#define CFG_FAULT_RUNTIME_INTERVAL	60000 //ms between two writes of the run time counter
+#define CFG_PREFS_RAM_IMAGE	// if defined, every PrefHandler keeps a RAM copy of its EEPROM section (EE_DEVICE_SIZE bytes each)
 
 /*
  * PIN ASSIGNMENT
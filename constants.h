@@ -98,6 +98,10 @@ namespace Constants {
 	static const char* coolFan = "coolFan";
 	static const char* coolOn = "coolOn";
 	static const char* coolOff = "coolOff";
+	static const char* humidity = "humidity";
+	static const char* temperature = "temperature";
+	static const char* diffPressure = "diffPressure";
+	static const char* massFlow = "massFlow";
    	static const char* validChecksum = "Valid checksum, using stored config values";
 	static const char* invalidChecksum = "Invalid checksum, using hard coded config values";
 	static const char* valueOutOfRange = "value out of range: %l";
@@ -52,12 +52,17 @@ First device entry is 0xDEAD if valid - otherwise table is initialized
 #define EE_MAIN_OFFSET          0 //offset from start of EEPROM where main config is
 #define EE_LKG_OFFSET           34816  //start EEPROM addr where last known good config is
 
-//start EEPROM addr where the system log starts. <SYS LOG YET TO BE DEFINED>
+//start EEPROM addr where the system log starts. Warnings and errors are kept there (see SysLog.h)
 #define EE_SYS_LOG              69632
+#define EE_SYS_LOG_SIZE         32768 //up to the fault log
 
 //start EEPROM addr for fault log (Used by fault_handler)
 #define EE_FAULT_LOG            102400
 
+//start EEPROM addr of the compressed sample history (see SampleStore.h)
+#define EE_SAMPLE_STORE         131072
+#define EE_SAMPLE_STORE_SIZE    131072 //up to the end of the 256KB EEPROM
+
 /*Now, all devices also have a default list of things that WILL be stored in EEPROM. Each actual
 implementation for a given device can store it's own custom info as well. This data must come after
 the end of the stardard data. The below numbers are offsets from the device's eeprom section
@@ -66,6 +71,8 @@ the end of the stardard data. The below numbers are offsets from the device's ee
 //first, things in common to all devices - leave 20 bytes for this
 #define EE_CHECKSUM 		0 //1 byte - checksum for this section of EEPROM to makesure it is valid
 #define EE_DEVICE_ID		1 //2 bytes - the value of the ENUM DEVID of this device.
+#define EE_CRC			3 //2 bytes - CRC-16 of bytes EE_CRC_START to EE_DEVICE_SIZE - 1, supersedes EE_CHECKSUM
+#define EE_CRC_START		5 //first byte covered by EE_CRC
 
 //Motor controller data
 #define EEMC_MAX_RPM			20 //2 bytes, unsigned int for maximum allowable RPM
@@ -109,7 +116,7 @@ the end of the stardard data. The below numbers are offsets from the device's ee
 #define EETH_ADC_1				53 //1 byte - which ADC port to use for first throttle input
 #define EETH_ADC_2				54 //1 byte - which ADC port to use for second throttle input
 
-//System Data
+//System Data - widths, defaults and valid ranges of these fields are listed in PrefLayout.h
 #define EESYS_SYSTEM_TYPE        10  //1 byte - 1 = Old school protoboards 2 = GEVCU2/DUED 3 = GEVCU3 - Defaults to 2 if invalid or not set up
 #define EESYS_RAWADC			 20  //1 byte - if not zero then use raw ADC mode (no preconditioning or buffering or differential).
 #define EESYS_ADC0_GAIN          30  //2 bytes - ADC gain centered at 1024 being 1 to 1 gain, thus 512 is 0.5 gain, 2048 is double, etc
@@ -120,6 +127,18 @@ the end of the stardard data. The below numbers are offsets from the device's ee
 #define EESYS_ADC2_OFFSET        40  //2 bytes - ADC offset from zero - ADC reads 12 bit so the offset will be [0,4095] - Offset is subtracted from read ADC value
 #define EESYS_ADC3_GAIN          42  //2 bytes - ADC gain centered at 1024 being 1 to 1 gain, thus 512 is 0.5 gain, 2048 is double, etc
 #define EESYS_ADC3_OFFSET        44  //2 bytes - ADC offset from zero - ADC reads 12 bit so the offset will be [0,4095] - Offset is subtracted from read ADC value
+#define EESYS_ADC0_FILTER        46  //1 byte - smoothing filter applied after gain/offset: 0 = none, 1 = boxcar, 2 = IIR (see ADCFilter.h)
+#define EESYS_ADC0_FILTPARAM     47  //1 byte - boxcar length [1, 64] or IIR shift [1, 15] (new = old + (input - old) / 2^shift)
+#define EESYS_ADC0_MEDIAN        48  //1 byte - size of the median spike filter run before the smoothing filter (3, 5 or 7, 0 = off)
+#define EESYS_ADC1_FILTER        50  //1 byte - same as above for ADC1, the entries are 4 bytes apart like gain/offset
+#define EESYS_ADC1_FILTPARAM     51  //1 byte
+#define EESYS_ADC1_MEDIAN        52  //1 byte
+#define EESYS_ADC2_FILTER        54  //1 byte
+#define EESYS_ADC2_FILTPARAM     55  //1 byte
+#define EESYS_ADC2_MEDIAN        56  //1 byte
+#define EESYS_ADC3_FILTER        58  //1 byte
+#define EESYS_ADC3_FILTPARAM     59  //1 byte
+#define EESYS_ADC3_MEDIAN        60  //1 byte
 
 #define EESYS_CAN0_BAUD          100 //2 bytes - Baud rate of CAN0 in 1000's of baud. So a value of 500 = 500k baud. Set to 0 to disable CAN0
 #define EESYS_CAN1_BAUD          102 //2 bytes - Baud rate of CAN1 in 1000's of baud. So a value of 500 = 500k baud. Set to 0 to disable CAN1
@@ -170,32 +189,30 @@ the end of the stardard data. The below numbers are offsets from the device's ee
 #define EESYS_WIFI1_IPADDR       435 //4 bytes - IP address to use if DHCP is off
 #define EESYS_WIFI1_KEY          439 //40 bytes - the security key (13 bytes for WEP, 8 - 83 for WPA but only up to 40 here
 
-#define EESYS_WIFI2_SSID		500 //32 bytes - the SSID to create or use (prefixed with ! if create ad-hoc)
-#define EESYS_WIFI2_CHAN		532 //1 byte - the wifi channel (1 - 11) to use
-#define EESYS_WIFI2_DHCP		533 //1 byte - DHCP mode, 0 = off, 1 = server, 2 = client
-#define EESYS_WIFI2_MODE		534 //1 byte - 0 = B, 1 = G
-#define EESYS_WIFI2_IPADDR		535 //4 bytes - IP address to use if DHCP is off
-#define EESYS_WIFI2_KEY			539 //40 bytes - the security key (13 bytes for WEP, 8 - 83 for WPA but only up to 40 here
+//The adhoc network (WIFIX) and a few more fields used to sit beyond offset 500 and so past
+//the end of the system section (EE_DEVICE_SIZE) where they could never be stored. They now
+//fill gaps further down. There is no room left for a third network (WIFI2).
 
 //If the above networks can't be joined then try to form our own adhoc network
 //with the below parameters.
-#define EESYS_WIFIX_SSID		579 //32 bytes - the SSID to create or use (prefixed with ! if create ad-hoc)
-#define EESYS_WIFIX_CHAN		611 //1 byte - the wifi channel (1 - 11) to use
-#define EESYS_WIFIX_DHCP		612 //1 byte - DHCP mode, 0 = off, 1 = server, 2 = client
-#define EESYS_WIFIX_MODE        613 //1 byte - 0 = B, 1 = G
-#define EESYS_WIFIX_IPADDR      614 //4 bytes - IP address to use if DHCP is off
-#define EESYS_WIFIX_KEY         618 //40 bytes - the security key (13 bytes for WEP, 8 - 83 for WPA but only up to 40 here
-
-#define EESYS_LOG_LEVEL         658 //1 byte - the log level
-#define EESYS_AMPHOURS			659 //1 byte - ???
-#define EESYS_BRAKELIGHT		660 //1 byte - 
-#define EESYS_xxxx				661 //1 byte -
+#define EESYS_WIFIX_SSID		256 //32 bytes - the SSID to create or use (prefixed with ! if create ad-hoc)
+#define EESYS_WIFIX_CHAN		288 //1 byte - the wifi channel (1 - 11) to use
+#define EESYS_WIFIX_DHCP		289 //1 byte - DHCP mode, 0 = off, 1 = server, 2 = client
+#define EESYS_WIFIX_MODE        290 //1 byte - 0 = B, 1 = G
+#define EESYS_WIFIX_IPADDR      291 //4 bytes - IP address to use if DHCP is off
+#define EESYS_WIFIX_KEY         110 //40 bytes - the security key (13 bytes for WEP, 8 - 83 for WPA but only up to 40 here
+
+#define EESYS_LOG_LEVEL         62 //1 byte - the log level
+#define EESYS_AMPHOURS			63 //1 byte - ???
+#define EESYS_BRAKELIGHT		64 //1 byte - 
+#define EESYS_xxxx				65 //1 byte -
 
 #define EEFAULT_VALID			0 //1 byte - Set to value of 0xB2 if fault data has been initialized
 #define EEFAULT_READPTR			1 //2 bytes - index where reading should start (first unacknowledged fault)
 #define EEFAULT_WRITEPTR		3 //2 bytes - index where writing should occur for new faults
 #define EEFAULT_RUNTIME			5 //4 bytes - stores the number of seconds (in tenths) that the system has been turned on for - total time ever
 #define EEFAULT_FAULTS_START	10 //a bunch of faults stored one after the other start at this location
+#define EEFAULT_RUNTIME_SLOTS	1024 //up to 4096 bytes - wear levelled version of EEFAULT_RUNTIME, one 16 byte slot at the start of each 256 byte page (CFG_FAULT_RUNTIME_SLOTS pages, see WearCounter.h)
 
 
 #endif
@@ -0,0 +1,364 @@
+/*
+ * HostBenchmark.cpp
+ *
+ * Brings the firmware modules up on the simulated HAL the way setup() does, runs the
+ * on-target suite (Benchmark.cpp) and then measures what needs the simulation: the cache
+ * against the 24LC model (bus time, write cycles, acknowledge polling, wear), the tick queue
+ * latency with observers loading the main loop, the ADC block processing fed by the
+ * simulated DMA, raising and committing faults and the cost of a log record.
+ * All times are simulated time: the host's own time for the code plus the simulated waits
+ * (bus transfers, EEPROM write cycles, observer load), see mock/HostHal.h. So CPU bound
+ * numbers are host numbers and only comparable between runs on the same machine.
+ *
+Copyright (c) 2013 Collin Kidder, Michael Neuweiler, Charles Galpin
+
+Permission is hereby granted, free of charge, to any person obtaining
+a copy of this software and associated documentation files (the
+"Software"), to deal in the Software without restriction, including
+without limitation the rights to use, copy, modify, merge, publish,
+distribute, sublicense, and/or sell copies of the Software, and to
+permit persons to whom the Software is furnished to do so, subject to
+the following conditions:
+
+The above copyright notice and this permission notice shall be included
+in all copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.
+IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY
+CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT,
+TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE
+SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+
+ */
+
+#include <Arduino.h>
+#include "config.h"
+#include "eeprom_layout.h"
+#include "TwiBus.h"
+#include "MemCache.h"
+#include "TickHandler.h"
+#include "TimeBase.h"
+#include "Logger.h"
+#include "SysLog.h"
+#include "PrefHandler.h"
+#include "PrefLayout.h"
+#include "sys_io.h"
+#include "FaultHandler.h"
+#include "Benchmark.h"
+
+#define HOST_RUNS			1000 // repetitions of the cheap operations
+#define HOST_SLOW_RUNS		16 // repetitions of the ones which go to the EEPROM
+#define HOST_LOAD_TIME		5000000 // us the loaded main loop runs
+#define HOST_LOOP_WORK		200 // us every other pass through the main loop takes
+#define HOST_SETTLE_TIME	2000000 // us the main loop runs after setup before the benchmarks
+#define HOST_FAULT_BURST	8 // faults raised together before one commit
+
+MemCache *memCache;
+PrefHandler *sysPrefs;
+
+struct HostResult {
+	uint64_t best;
+	uint64_t total;
+	uint32_t runs;
+};
+
+static void resultStart(HostResult *result) {
+	result->best = ~0ull;
+	result->total = 0;
+	result->runs = 0;
+}
+
+static void resultAdd(HostResult *result, uint64_t nanos) {
+	if (nanos < result->best) result->best = nanos;
+	result->total += nanos;
+	result->runs++;
+}
+
+static void resultPrint(const char *name, HostResult *result) {
+	printf("  %-44s best %10.2f mean %10.2f us (%u runs)\n", name, result->best / 1000.0,
+			result->total / 1000.0 / result->runs, result->runs);
+}
+
+//an observer whose tick keeps the main loop busy for a while
+class LoadObserver : public TickObserver {
+public:
+	LoadObserver(uint32_t cost) : cost(cost) {}
+	void handleTick() {
+		hostAdvance((uint64_t) cost * 1000);
+	}
+	uint32_t cost; // us
+};
+
+static LoadObserver loadObservers[] = { LoadObserver(20), LoadObserver(20), LoadObserver(150), LoadObserver(150),
+		LoadObserver(400), LoadObserver(2500) };
+static const uint32_t loadIntervals[] = { 1000, 2000, 10000, 10000, 50000, 100000 };
+#define LOAD_OBSERVERS	(sizeof(loadIntervals) / sizeof(loadIntervals[0]))
+
+static uint16_t adcSample(uint32_t index) {
+	return 2048 + (index * 37) % 512;
+}
+
+static void initSysEEPROM() {
+	prefLoadDefaults(sysPrefs, sysPrefLayout, SYSPREF_COUNT);
+	sysPrefs->saveChecksum();
+}
+
+//what setup() in Sensirion.ino does for the modules of the host build, on a blank EEPROM
+static void hostSetup() {
+	uint8_t loglevel;
+
+	hostEepromReset(0xFF);
+	TwiBus::getInstance()->setup(CFG_TWI_CLOCK);
+	memCache = new MemCache();
+	memCache->setup();
+	SysLog::getInstance()->setup();
+	sysPrefs = new PrefHandler(SYSTEM);
+	if (!sysPrefs->checksumValid()) initSysEEPROM();
+	prefGet<SYSPREF_LOG_LEVEL>(sysPrefs, &loglevel);
+	Logger::setLoglevel((Logger::LogLevel) loglevel);
+	sys_early_setup();
+	TimeBase::getInstance()->setup();
+	faultHandler.setup();
+	setup_sys_io();
+}
+
+//the main loop: ticks, log output and other work in between
+static void hostLoop(uint32_t micros) {
+	uint64_t end = hostNanos() + (uint64_t) micros * 1000;
+
+	while (hostNanos() < end) {
+		hostRunInterrupts();
+		TickHandler::getInstance()->process();
+		Logger::process();
+		hostAdvance(HOST_LOOP_WORK * 1000);
+	}
+}
+
+static void benchmarkCache() {
+	HostEepromStats *eeprom = hostEepromStats();
+	HostResult result;
+	uint8_t page[256];
+	uint32_t value, address, writes, nacks;
+	uint64_t start, busNanos;
+
+	printf("Cache (24LC model at %d Hz):\n", CFG_TWI_CLOCK);
+
+	resultStart(&result);
+	memCache->Read(EE_LKG_OFFSET + EE_SYSTEM_START, &value);
+	for (int i = 0; i < HOST_RUNS; i++) {
+		start = hostNanos();
+		memCache->Read(EE_LKG_OFFSET + EE_SYSTEM_START, &value);
+		resultAdd(&result, hostNanos() - start);
+	}
+	resultPrint("hit, 4 bytes", &result);
+
+	resultStart(&result);
+	for (int i = 0; i < HOST_RUNS; i++) {
+		start = hostNanos();
+		memCache->Read(EE_LKG_OFFSET + EE_SYSTEM_START, page, sizeof(page));
+		resultAdd(&result, hostNanos() - start);
+	}
+	resultPrint("hit, 256 bytes", &result);
+
+	resultStart(&result);
+	busNanos = eeprom->busNanos;
+	for (int i = 0; i < HOST_SLOW_RUNS; i++) {
+		address = EE_LKG_OFFSET + EE_SYSTEM_START + 256 * (i % 2);
+		memCache->InvalidateAddress(address);
+		start = hostNanos();
+		memCache->Read(address, &value);
+		resultAdd(&result, hostNanos() - start);
+	}
+	resultPrint("miss (page read over TWI)", &result);
+	printf("  %-44s %10.2f us per miss\n", "bus time", (eeprom->busNanos - busNanos) / 1000.0 / HOST_SLOW_RUNS);
+
+	//scattered small writes, each page needs its own write cycle. The sample store isn't part of the host build
+	resultStart(&result);
+	writes = eeprom->writes;
+	nacks = eeprom->busyNacks;
+	for (int i = 0; i < HOST_SLOW_RUNS; i++) {
+		start = hostNanos();
+		for (int p = 0; p < NUM_CACHED_PAGES; p++) memCache->Write(EE_SAMPLE_STORE + p * 256 + i * 4, (uint32_t) i);
+		memCache->FlushAllPages();
+		memCache->WaitForWrites();
+		resultAdd(&result, hostNanos() - start);
+	}
+	resultPrint("write-back of 16 dirty pages", &result);
+	printf("  %-44s %10.2f per flush, %.2f acknowledge polls NACKed per write\n", "EEPROM write cycles",
+			(eeprom->writes - writes) / (double) HOST_SLOW_RUNS,
+			(eeprom->busyNacks - nacks) / (double) (eeprom->writes - writes));
+
+	uint32_t maxWrites = 0, pages = 0;
+	for (int p = 0; p < HOST_EEPROM_SIZE / HOST_EEPROM_PAGE; p++) {
+		if (eeprom->pageWrites[p]) pages++;
+		if (eeprom->pageWrites[p] > maxWrites) maxWrites = eeprom->pageWrites[p];
+	}
+	printf("  %-44s %u pages written, most worn one %u times\n", "wear since start", pages, maxWrites);
+}
+
+static const char *observerName(TickObserver *observer) {
+	if (observer == memCache) return "MemCache";
+	if (observer == TimeBase::getInstance()) return "TimeBase";
+	if (observer == SysLog::getInstance()) return "SysLog";
+	if (observer == &faultHandler) return "FaultHandler";
+	for (uint32_t i = 0; i < LOAD_OBSERVERS; i++) {
+		if (observer == &loadObservers[i]) {
+			static char name[24];
+			snprintf(name, sizeof(name), "load %u us", loadObservers[i].cost);
+			return name;
+		}
+	}
+	return "?";
+}
+
+/*
+ * The main loop of the firmware with observers which take their time and other work in
+ * between, reports the queue latency and execution time of every observer.
+ */
+static void benchmarkTicks() {
+	TickHandler *tickHandler = TickHandler::getInstance();
+
+	printf("Tick queue under load (%d us main loop work, %d s):\n", HOST_LOOP_WORK, HOST_LOAD_TIME / 1000000);
+	for (uint32_t i = 0; i < LOAD_OBSERVERS; i++) tickHandler->attach(&loadObservers[i], loadIntervals[i]);
+	tickHandler->process();
+	tickHandler->resetCounters();
+	tickHandler->resetProfile();
+
+	hostLoop(HOST_LOAD_TIME);
+
+	printf("  %-16s %9s %7s %10s %10s   latency <10us/<100us/<1ms/<10ms/<100ms/more\n",
+			"observer", "interval", "ticks", "lat max", "exec max");
+	for (uint8_t entry = 0; entry < CFG_TIMER_NUM_OBSERVERS; entry++) {
+		TickObserver *observer = tickHandler->getObserver(entry);
+		TickProfile *profile = tickHandler->getProfile(entry);
+		if (observer == NULL || profile->count == 0) continue;
+		printf("  %-16s %7u us %7u %7u us %7u us  ", observerName(observer), tickHandler->getInterval(entry),
+				profile->count, TickHandler::cyclesToMicros(profile->latencyMax),
+				TickHandler::cyclesToMicros(profile->execMax));
+		for (int b = 0; b < PROFILE_BUCKETS; b++) printf(" %u", profile->latency[b]);
+		printf("\n");
+	}
+	printf("  overruns %u, coalesced %u, deepest queue %u\n", tickHandler->getOverrunCount(),
+			tickHandler->getCoalesceCount(), tickHandler->getMaxQueueDepth());
+
+	for (uint32_t i = 0; i < LOAD_OBSERVERS; i++) tickHandler->detach(&loadObservers[i]);
+	tickHandler->process();
+}
+
+static void benchmarkADC() {
+	HostResult result, measured;
+	uint32_t dropped;
+
+	printf("ADC blocks (simulated DMA, %d samples each):\n", 256);
+	resultStart(&result);
+	resultStart(&measured);
+	for (int i = 0; i < HOST_RUNS; i++) {
+		hostAdcBlock(adcSample);
+		uint64_t start = hostNanos();
+		sys_io_adc_poll();
+		resultAdd(&result, hostNanos() - start);
+		resultAdd(&measured, (uint64_t) measureADCBlock() * 1000 / (SystemCoreClock / 1000000));
+	}
+	resultPrint("sys_io_adc_poll() of one block", &result);
+	resultPrint("measureADCBlock() (sum + filter)", &measured);
+
+	dropped = getADCDroppedBuffers();
+	for (int i = 0; i < 5; i++) hostAdcBlock(adcSample);
+	sys_io_adc_poll();
+	printf("  %-44s %u of 5 dropped\n", "poll after 5 blocks", getADCDroppedBuffers() - dropped);
+}
+
+/*
+ * raiseFault() only stages the record in RAM, commit() hands the changed records and the
+ * pointers to the cache in one go. A burst of faults should cost about one write cycle
+ * per page touched, not one per fault.
+ */
+static void benchmarkFaults() {
+	HostEepromStats *eeprom = hostEepromStats();
+	HostResult raise, repeat, commit;
+	uint32_t writes;
+	uint16_t code = 0;
+
+	printf("Faults (%d per burst):\n", HOST_FAULT_BURST);
+	faultHandler.commit();
+	memCache->WaitForWrites();
+	resultStart(&raise);
+	resultStart(&repeat);
+	resultStart(&commit);
+	writes = eeprom->writes;
+	for (int i = 0; i < HOST_SLOW_RUNS; i++) {
+		for (int f = 0; f < HOST_FAULT_BURST; f++) {
+			uint64_t start = hostNanos();
+			uint16_t fault = faultHandler.raiseFault(SYSTEM, ++code);
+			resultAdd(&raise, hostNanos() - start);
+			start = hostNanos();
+			faultHandler.raiseFault(SYSTEM, code);
+			resultAdd(&repeat, hostNanos() - start);
+			faultHandler.setFaultACK(fault);
+		}
+		uint64_t start = hostNanos();
+		faultHandler.commit();
+		memCache->WaitForWrites();
+		resultAdd(&commit, hostNanos() - start);
+	}
+	resultPrint("raiseFault(), new record", &raise);
+	resultPrint("raiseFault(), same fault again", &repeat);
+	resultPrint("commit() of a burst (incl. write-back)", &commit);
+	printf("  %-44s %10.2f per burst\n", "EEPROM write cycles", (eeprom->writes - writes) / (double) HOST_SLOW_RUNS);
+}
+
+static void benchmarkLog(const char *name, Logger::LogLevel level, boolean binary) {
+	HostResult call, drain;
+	uint32_t bytes = hostSerialBytes();
+
+	Logger::setLoglevel(level);
+	Logger::setBinary(binary);
+	resultStart(&call);
+	resultStart(&drain);
+	for (int i = 0; i < HOST_RUNS; i++) {
+		uint64_t start = hostNanos();
+		Logger::debug(MEMCACHE, "benchmark %i %X %s %f", i, 0xBEEF, "formatted", 1.5f);
+		resultAdd(&call, hostNanos() - start);
+		start = hostNanos();
+		Logger::process();
+		resultAdd(&drain, hostNanos() - start);
+	}
+	resultPrint(name, &call);
+	printf("  %-44s %10.2f us per record, %.1f bytes\n", "  written by process()", drain.total / 1000.0 / drain.runs,
+			(hostSerialBytes() - bytes) / (double) HOST_RUNS);
+}
+
+static void benchmarkLogging() {
+	Logger::LogLevel level = Logger::getLogLevel();
+
+	printf("Logging:\n");
+	Logger::flush();
+	hostSerialEcho(false);
+	benchmarkLog("text record (format + queue)", Logger::Debug, false);
+	benchmarkLog("binary record (queue)", Logger::Debug, true);
+	benchmarkLog("below the log level", Logger::Info, false);
+	Logger::flush();
+	hostSerialEcho(true);
+	Logger::setBinary(false);
+	Logger::setLoglevel(level);
+}
+
+int main() {
+	setvbuf(stdout, NULL, _IOFBF, 65536);
+	hostSetup();
+	hostLoop(HOST_SETTLE_TIME); // the cache ages its pages and writes the defaults back
+
+	runBenchmarks();
+	Logger::flush();
+	memCache->WaitForWrites();
+	printf("\n");
+
+	benchmarkCache();
+	benchmarkTicks();
+	benchmarkADC();
+	benchmarkFaults();
+	benchmarkLogging();
+	return 0;
+}
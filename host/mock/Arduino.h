@@ -0,0 +1,129 @@
+/*
+ * Arduino.h
+ *
+ * Host (x86) stand-in for the Arduino Due core, just enough of it for the modules the host
+ * build compiles. Timing and the peripherals are simulated, see HostHal.h.
+ *
+Copyright (c) 2013 Collin Kidder, Michael Neuweiler, Charles Galpin
+
+Permission is hereby granted, free of charge, to any person obtaining
+a copy of this software and associated documentation files (the
+"Software"), to deal in the Software without restriction, including
+without limitation the rights to use, copy, modify, merge, publish,
+distribute, sublicense, and/or sell copies of the Software, and to
+permit persons to whom the Software is furnished to do so, subject to
+the following conditions:
+
+The above copyright notice and this permission notice shall be included
+in all copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.
+IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY
+CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT,
+TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE
+SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+
+ */
+
+#ifndef ARDUINO_H_
+#define ARDUINO_H_
+
+#include <stdint.h>
+#include <stdarg.h>
+#include <stddef.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+
+typedef bool boolean;
+typedef uint8_t byte;
+
+#define HIGH 1
+#define LOW 0
+#define INPUT 0
+#define OUTPUT 1
+#define DEC 10
+#define HEX 16
+#define OCT 8
+#define BIN 2
+
+class __FlashStringHelper;
+#define F(x) (reinterpret_cast<const __FlashStringHelper *>(x))
+
+class Print {
+public:
+	virtual ~Print() {}
+	virtual size_t write(uint8_t) = 0;
+	virtual size_t write(const uint8_t *buffer, size_t size);
+	size_t write(const char *str) { return (str == NULL ? 0 : write((const uint8_t *)str, strlen(str))); }
+	size_t print(const char *);
+	size_t print(char);
+	size_t print(const __FlashStringHelper *);
+	size_t print(int, int = DEC);
+	size_t print(unsigned int, int = DEC);
+	size_t print(long, int = DEC);
+	size_t print(unsigned long, int = DEC);
+	size_t print(double, int = 2);
+	size_t println(const char *);
+	size_t println(char);
+	size_t println(int, int = DEC);
+	size_t println(unsigned int, int = DEC);
+	size_t println(long, int = DEC);
+	size_t println(unsigned long, int = DEC);
+	size_t println(double, int = 2);
+	size_t println();
+
+private:
+	size_t printNumber(unsigned long, uint8_t);
+	size_t printFloat(double, uint8_t);
+};
+
+class Stream : public Print {
+public:
+	virtual int available() { return 0; }
+	virtual int read() { return -1; }
+	virtual int peek() { return -1; }
+	virtual void flush() {}
+};
+
+//SerialUSB goes to stdout, nothing ever comes in
+class Serial_ : public Stream {
+public:
+	void begin(uint32_t) {}
+	size_t write(uint8_t);
+	size_t write(const uint8_t *buffer, size_t size);
+	using Print::write;
+	int availableForWrite() { return 512; }
+	operator bool() { return true; }
+};
+
+class UARTClass : public Stream {
+public:
+	void begin(uint32_t) {}
+	size_t write(uint8_t) { return 1; }
+	using Print::write;
+};
+class USARTClass : public UARTClass {};
+
+extern Serial_ SerialUSB;
+extern USARTClass Serial2, Serial3;
+
+void noInterrupts();
+void interrupts();
+uint32_t millis();
+uint32_t micros();
+void delay(uint32_t ms);
+void delayMicroseconds(uint32_t us);
+void pinMode(uint32_t pin, uint32_t mode);
+void digitalWrite(uint32_t pin, uint32_t value);
+int digitalRead(uint32_t pin);
+
+template<class T> T min(T a, T b) { return a < b ? a : b; }
+template<class T> T max(T a, T b) { return a > b ? a : b; }
+
+#include "HostHal.h"
+
+#endif /* ARDUINO_H_ */
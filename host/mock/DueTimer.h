@@ -0,0 +1,63 @@
+/*
+ * DueTimer.h
+ *
+ * Host stand-in for the DueTimer library. The timers run on the simulated clock and fire
+ * from hostRunInterrupts(), see HostHal.h.
+ *
+Copyright (c) 2013 Collin Kidder, Michael Neuweiler, Charles Galpin
+
+Permission is hereby granted, free of charge, to any person obtaining
+a copy of this software and associated documentation files (the
+"Software"), to deal in the Software without restriction, including
+without limitation the rights to use, copy, modify, merge, publish,
+distribute, sublicense, and/or sell copies of the Software, and to
+permit persons to whom the Software is furnished to do so, subject to
+the following conditions:
+
+The above copyright notice and this permission notice shall be included
+in all copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.
+IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY
+CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT,
+TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE
+SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+
+ */
+
+#ifndef DUETIMER_H_
+#define DUETIMER_H_
+
+#include <Arduino.h>
+
+#define HOST_TIMERS	2
+
+class DueTimer {
+public:
+	DueTimer() : callback(NULL), period(1000000), next(0), running(false) {}
+	DueTimer &attachInterrupt(void (*isr)()) { callback = isr; return *this; }
+	DueTimer &detachInterrupt() { stop(); callback = NULL; return *this; }
+	DueTimer &setPeriod(unsigned long microseconds) { period = (uint64_t) microseconds * 1000; return *this; }
+	DueTimer &setFrequency(double frequency) { period = (uint64_t) (1e9 / frequency); return *this; }
+	DueTimer &start(long microseconds = -1) {
+		if (microseconds > 0) setPeriod(microseconds);
+		next = hostNanos() + period;
+		running = true;
+		return *this;
+	}
+	DueTimer &stop() { running = false; return *this; }
+	long getPeriod() { return (long) (period / 1000); }
+	double getFrequency() { return 1e9 / period; }
+
+	void (*callback)();
+	uint64_t period; // ns
+	uint64_t next; // simulated time of the next interrupt
+	bool running;
+};
+
+extern DueTimer Timer0, Timer1;
+extern DueTimer *hostTimers[HOST_TIMERS];
+
+#endif /* DUETIMER_H_ */
@@ -0,0 +1,240 @@
+/*
+ * HostHal.cpp
+ *
+ * The simulated clock, registers and Arduino functions of the host build
+ *
+Copyright (c) 2013 Collin Kidder, Michael Neuweiler, Charles Galpin
+
+Permission is hereby granted, free of charge, to any person obtaining
+a copy of this software and associated documentation files (the
+"Software"), to deal in the Software without restriction, including
+without limitation the rights to use, copy, modify, merge, publish,
+distribute, sublicense, and/or sell copies of the Software, and to
+permit persons to whom the Software is furnished to do so, subject to
+the following conditions:
+
+The above copyright notice and this permission notice shall be included
+in all copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.
+IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY
+CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT,
+TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE
+SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+
+ */
+
+#include <time.h>
+#include <Arduino.h>
+#include <DueTimer.h>
+
+uint32_t SystemCoreClock = 84000000;
+
+static DWT_Type dwt;
+static CoreDebug_Type coreDebug;
+static SysTick_Type sysTick = { 7, 83999 };
+static Adc adc;
+DWT_Type *DWT = &dwt;
+CoreDebug_Type *CoreDebug = &coreDebug;
+SysTick_Type *SysTick = &sysTick;
+Adc *ADC = &adc;
+
+Serial_ SerialUSB;
+USARTClass Serial2, Serial3;
+DueTimer Timer0, Timer1;
+DueTimer *hostTimers[HOST_TIMERS] = { &Timer0, &Timer1 };
+
+static uint64_t hostStart; // host clock at the first call
+static uint64_t waited; // simulated waits so far
+static bool inInterrupt;
+static bool serialEcho = true;
+static uint32_t serialBytes;
+
+static uint64_t hostClock() {
+	struct timespec now;
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	return (uint64_t) now.tv_sec * 1000000000ull + now.tv_nsec;
+}
+
+uint64_t hostNanos() {
+	if (hostStart == 0) hostStart = hostClock();
+	return hostClock() - hostStart + waited;
+}
+
+//step to every timer interrupt on the way so it fires (and stamps its tick) right on time
+void hostAdvance(uint64_t nanos) {
+	while (nanos > 0) {
+		uint64_t now = hostNanos(), step = nanos;
+		for (int i = 0; i < HOST_TIMERS && !inInterrupt; i++) {
+			DueTimer *timer = hostTimers[i];
+			if (timer->running && timer->callback && timer->next > now && timer->next - now < step)
+				step = timer->next - now;
+		}
+		waited += step;
+		nanos -= step;
+		hostRunInterrupts();
+	}
+}
+
+//fire every timer period which passed since the last call. Interrupts don't nest.
+void hostRunInterrupts() {
+	if (inInterrupt) return;
+	inInterrupt = true;
+	for (int i = 0; i < HOST_TIMERS; i++) {
+		DueTimer *timer = hostTimers[i];
+		while (timer->running && timer->callback && timer->next <= hostNanos()) {
+			timer->next += timer->period;
+			timer->callback();
+		}
+	}
+	inInterrupt = false;
+}
+
+/*
+ * What the PDC does at the end of a block: the samples are in the buffer RPR points to,
+ * the next buffer becomes the current one and the RX end interrupt fires.
+ * Samples come out in channel order as with ADC_CHER.
+ */
+void hostAdcBlock(uint16_t (*sample)(uint32_t index)) {
+	uint16_t *buffer = (uint16_t *) (uintptr_t) ADC->ADC_RPR;
+
+	if (buffer == NULL || ADC->ADC_RCR == 0) return;
+	for (uint32_t i = 0; i < ADC->ADC_RCR; i++) buffer[i] = sample(i);
+	ADC->ADC_RPR = ADC->ADC_RNPR;
+	ADC->ADC_RCR = ADC->ADC_RNCR;
+	ADC->ADC_RNCR = 0;
+	ADC->ADC_ISR |= (1 << 27);
+	if (ADC->ADC_IER & (1 << 27)) ADC_Handler(); // the mock doesn't keep IMR, IER is never written otherwise
+	ADC->ADC_ISR &= ~(1 << 27);
+}
+
+void hostSerialEcho(bool echo) {
+	serialEcho = echo;
+}
+
+uint32_t hostSerialBytes() {
+	return serialBytes;
+}
+
+HostCycleCounter::operator uint32_t() const {
+	return (uint32_t) (hostNanos() * (SystemCoreClock / 1000000) / 1000);
+}
+
+HostCycleCounter &HostCycleCounter::operator=(uint32_t) {
+	return *this;
+}
+
+//counts down from LOAD to 0 once per millisecond like the Arduino core sets it up
+HostSysTickValue::operator uint32_t() const {
+	uint32_t reload = SysTick->LOAD + 1;
+	return reload - 1 - (uint32_t) (hostNanos() * (SystemCoreClock / 1000000) / 1000) % reload;
+}
+
+void NVIC_EnableIRQ(IRQn_Type) {}
+void NVIC_DisableIRQ(IRQn_Type) {}
+void pmc_enable_periph_clk(uint32_t) {}
+
+uint32_t adc_init(Adc *adc, uint32_t, uint32_t, uint8_t) {
+	memset(adc, 0, sizeof(*adc));
+	return 0;
+}
+
+void noInterrupts() {}
+void interrupts() {}
+
+uint32_t millis() {
+	return (uint32_t) (hostNanos() / 1000000);
+}
+
+uint32_t micros() {
+	return (uint32_t) (hostNanos() / 1000);
+}
+
+void delay(uint32_t ms) {
+	hostAdvance((uint64_t) ms * 1000000);
+}
+
+void delayMicroseconds(uint32_t us) {
+	hostAdvance((uint64_t) us * 1000);
+}
+
+static uint8_t pins[128];
+
+void pinMode(uint32_t, uint32_t) {}
+
+void digitalWrite(uint32_t pin, uint32_t value) {
+	if (pin < sizeof(pins)) pins[pin] = (value ? HIGH : LOW);
+}
+
+int digitalRead(uint32_t pin) {
+	return (pin < sizeof(pins) ? pins[pin] : LOW);
+}
+
+size_t Serial_::write(uint8_t c) {
+	return write(&c, 1);
+}
+
+size_t Serial_::write(const uint8_t *buffer, size_t size) {
+	serialBytes += size;
+	if (serialEcho) fwrite(buffer, 1, size, stdout);
+	return size;
+}
+
+/*
+ * Print, same output as the Arduino core. long is 32 bit on the Due, so numbers are printed
+ * as 32 bit values (a negative int in hex is 0xFFFFFFFF, not 16 Fs).
+ */
+size_t Print::write(const uint8_t *buffer, size_t size) {
+	size_t n = 0;
+	while (size--) n += write(*buffer++);
+	return n;
+}
+
+size_t Print::print(const char *str) { return write(str); }
+size_t Print::print(char c) { return write((uint8_t) c); }
+size_t Print::print(const __FlashStringHelper *str) { return write((const char *) str); }
+size_t Print::print(int n, int base) { return print((long) n, base); }
+size_t Print::print(unsigned int n, int base) { return print((unsigned long) n, base); }
+
+size_t Print::print(long n, int base) {
+	if (base == 10 && (int32_t) n < 0) return print('-') + printNumber(-(uint32_t) n, 10);
+	if (base == 0) return write((uint8_t) n);
+	return printNumber((uint32_t) n, base);
+}
+
+size_t Print::print(unsigned long n, int base) {
+	if (base == 0) return write((uint8_t) n);
+	return printNumber((uint32_t) n, base);
+}
+
+size_t Print::print(double n, int digits) { return printFloat(n, digits); }
+size_t Print::println() { return write("\r\n"); }
+size_t Print::println(const char *str) { return print(str) + println(); }
+size_t Print::println(char c) { return print(c) + println(); }
+size_t Print::println(int n, int base) { return print(n, base) + println(); }
+size_t Print::println(unsigned int n, int base) { return print(n, base) + println(); }
+size_t Print::println(long n, int base) { return print(n, base) + println(); }
+size_t Print::println(unsigned long n, int base) { return print(n, base) + println(); }
+size_t Print::println(double n, int digits) { return print(n, digits) + println(); }
+
+size_t Print::printNumber(unsigned long n, uint8_t base) {
+	char buf[8 * sizeof(long) + 1];
+	char *str = &buf[sizeof(buf) - 1];
+
+	*str = '\0';
+	if (base < 2) base = 10;
+	do {
+		char c = n % base;
+		n /= base;
+		*--str = c < 10 ? c + '0' : c + 'A' - 10;
+	} while (n);
+	return write(str);
+}
+
+size_t Print::printFloat(double number, uint8_t digits) {
+	char buf[48];
+	snprintf(buf, sizeof(buf), "%.*f", digits, number);
+	return write(buf);
+}
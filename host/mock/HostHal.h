@@ -0,0 +1,152 @@
+/*
+ * HostHal.h
+ *
+ * Simulated SAM3X peripherals for the host build and the hooks the host programs use to
+ * drive them.
+ *
+ * Time: the simulated clock is the host's monotonic clock plus everything the simulation
+ * spent waiting (delay(), TWI transfers). So CPU bound code costs what it costs on the host
+ * while bus transfers cost what they would cost on the bus. DWT->CYCCNT and SysTick run at
+ * SystemCoreClock off that clock.
+ *
+ * Interrupts only run at defined points: whenever simulated time passes (delay(), TWI
+ * transfers, hostAdvance()) every timer fires at the instant it is due, hostRunInterrupts()
+ * catches up on the host time which passed (one call per period, like the hardware would).
+ * Interrupts don't nest, noInterrupts() / interrupts() don't need to do anything then.
+ *
+ * The ADC DMA is simulated by hostAdcBlock(), see HostHal.cpp. The TWI bus with a 24LC EEPROM
+ * on it is simulated by MockTwiBus.cpp.
+ *
+Copyright (c) 2013 Collin Kidder, Michael Neuweiler, Charles Galpin
+
+Permission is hereby granted, free of charge, to any person obtaining
+a copy of this software and associated documentation files (the
+"Software"), to deal in the Software without restriction, including
+without limitation the rights to use, copy, modify, merge, publish,
+distribute, sublicense, and/or sell copies of the Software, and to
+permit persons to whom the Software is furnished to do so, subject to
+the following conditions:
+
+The above copyright notice and this permission notice shall be included
+in all copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.
+IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY
+CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT,
+TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE
+SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+
+ */
+
+#ifndef HOSTHAL_H_
+#define HOSTHAL_H_
+
+#include <stdint.h>
+
+#define __IO volatile
+
+typedef uint8_t U8;
+typedef uint16_t U16;
+typedef uint32_t U32;
+typedef int8_t S8;
+typedef int16_t S16;
+typedef int32_t S32;
+
+extern uint32_t SystemCoreClock;
+
+//registers whose value comes from the simulated clock
+struct HostCycleCounter {
+	operator uint32_t() const;
+	HostCycleCounter &operator=(uint32_t); // ignored, the firmware must never reset it
+};
+struct HostSysTickValue {
+	operator uint32_t() const;
+	HostSysTickValue &operator=(uint32_t) { return *this; }
+};
+
+typedef struct {
+	__IO uint32_t CTRL;
+	HostCycleCounter CYCCNT;
+} DWT_Type;
+
+typedef struct {
+	__IO uint32_t DEMCR;
+} CoreDebug_Type;
+
+typedef struct {
+	__IO uint32_t CTRL;
+	__IO uint32_t LOAD;
+	HostSysTickValue VAL;
+} SysTick_Type;
+
+typedef struct {
+	__IO uint32_t ADC_CR, ADC_MR, ADC_CHER, ADC_CHDR, ADC_IER, ADC_IDR, ADC_IMR, ADC_ISR;
+	__IO uint32_t ADC_RPR, ADC_RCR, ADC_RNPR, ADC_RNCR, ADC_PTCR;
+} Adc;
+
+extern DWT_Type *DWT;
+extern CoreDebug_Type *CoreDebug;
+extern SysTick_Type *SysTick;
+extern Adc *ADC;
+
+#define CoreDebug_DEMCR_TRCENA_Msk	(1u << 24)
+#define DWT_CTRL_CYCCNTENA_Msk		(1u)
+
+typedef enum { ADC_IRQn = 37 } IRQn_Type;
+#define ID_ADC				37
+#define ADC_FREQ_MAX		20000000
+#define ADC_STARTUP_FAST	12
+
+//the SRAM of the SAM3X, only used for the free memory report
+#define IRAM_ADDR	0x20070000u
+#define IRAM_SIZE	0x18000u
+
+inline void __DMB() {}
+inline void __DSB() {}
+inline void __ISB() {}
+inline void __WFI() {}
+inline void __disable_irq() {}
+inline void __enable_irq() {}
+inline uint32_t __get_PRIMASK() { return 0; }
+inline void __set_PRIMASK(uint32_t) {}
+inline uint32_t __get_MSP() { return 0; }
+
+void NVIC_EnableIRQ(IRQn_Type);
+void NVIC_DisableIRQ(IRQn_Type);
+void pmc_enable_periph_clk(uint32_t);
+uint32_t adc_init(Adc *, uint32_t, uint32_t, uint8_t);
+extern "C" void ADC_Handler(); // sys_io.cpp
+
+/*
+ * Hooks for the host programs
+ */
+uint64_t hostNanos(); // simulated time since start
+void hostAdvance(uint64_t nanos); // let simulated time pass without using host time, the timers fire meanwhile
+void hostRunInterrupts(); // run the timer interrupts which are due
+void hostAdcBlock(uint16_t (*sample)(uint32_t index)); // DMA fills the current ADC buffer, then the ADC interrupt runs
+void hostSerialEcho(bool echo); // SerialUSB output to stdout (default) or just counted
+uint32_t hostSerialBytes(); // bytes written to SerialUSB so far
+
+/*
+ * The 24LC EEPROM on the simulated TWI bus (256KB, 256 byte pages), see MockTwiBus.cpp
+ */
+#define HOST_EEPROM_SIZE		262144
+#define HOST_EEPROM_PAGE		256
+#define HOST_EEPROM_WRITE_CYCLE	5000000 // ns the chip is busy (NACKs) after a page write
+
+struct HostEepromStats {
+	uint32_t pageWrites[HOST_EEPROM_SIZE / HOST_EEPROM_PAGE]; // write cycles per page (wear)
+	uint32_t writes; // write cycles
+	uint32_t reads; // read transfers
+	uint32_t busyNacks; // transfers refused during a write cycle
+	uint64_t busNanos; // simulated time spent on the bus
+	uint32_t bytes; // bytes on the bus, addresses included
+};
+
+uint8_t *hostEeprom(); // the memory of the chip
+HostEepromStats *hostEepromStats();
+void hostEepromReset(uint8_t fill); // erase and clear the stats
+
+#endif /* HOSTHAL_H_ */
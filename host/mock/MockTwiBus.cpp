@@ -0,0 +1,232 @@
+/*
+ * MockTwiBus.cpp
+ *
+ * TwiBus for the host build: the same queue as on the board but the transfers are carried
+ * out right away against a simulated 24LC EEPROM (0x50 - 0x53, 256KB, 256 byte pages).
+ * Every transfer adds its bus time (9 clocks per byte incl. the ACK, start and stop) to the
+ * simulated clock, the timer interrupts which fall into it run meanwhile.
+ * After a page write the chip is busy for HOST_EEPROM_WRITE_CYCLE and NACKs its address,
+ * exactly what the acknowledge polling of MemCache has to deal with. A write of only the
+ * address bytes (the acknowledge poll) doesn't start a write cycle.
+ * Other devices don't answer.
+ *
+Copyright (c) 2013 Collin Kidder, Michael Neuweiler, Charles Galpin
+
+Permission is hereby granted, free of charge, to any person obtaining
+a copy of this software and associated documentation files (the
+"Software"), to deal in the Software without restriction, including
+without limitation the rights to use, copy, modify, merge, publish,
+distribute, sublicense, and/or sell copies of the Software, and to
+permit persons to whom the Software is furnished to do so, subject to
+the following conditions:
+
+The above copyright notice and this permission notice shall be included
+in all copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.
+IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY
+CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT,
+TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE
+SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+
+ */
+
+#include "TwiBus.h"
+#include "TimeBase.h"
+
+#define EEPROM_DEVICE	0x50 // 0x50 - 0x53, the two lower bits are address bits 16 and 17
+
+static uint8_t eeprom[HOST_EEPROM_SIZE];
+static HostEepromStats eepromStats;
+static uint64_t eepromBusyUntil; // simulated time the write cycle in progress ends
+static uint32_t eepromPointer; // internal address counter of the chip
+
+uint8_t *hostEeprom() {
+	return eeprom;
+}
+
+HostEepromStats *hostEepromStats() {
+	return &eepromStats;
+}
+
+void hostEepromReset(uint8_t fill) {
+	memset(eeprom, fill, sizeof(eeprom));
+	memset(&eepromStats, 0, sizeof(eepromStats));
+	eepromBusyUntil = 0;
+	eepromPointer = 0;
+}
+
+//let the bus clock out the given number of bytes (each with its ACK) plus start and stop
+static void busTime(uint32_t clock, uint32_t bytes) {
+	uint64_t nanos = (uint64_t) (bytes * 9 + 2) * 1000000000ull / clock;
+	eepromStats.busNanos += nanos;
+	eepromStats.bytes += bytes;
+	hostAdvance(nanos);
+}
+
+/*
+ * One transfer (or chunk of a read) with the EEPROM. Returns the status it ends with.
+ */
+static TwiStatus eepromTransfer(uint32_t clock, TwiTransaction *transaction, uint16_t offset, uint16_t length) {
+	uint32_t address;
+
+	if ((transaction->device & 0xFC) != EEPROM_DEVICE) {
+		busTime(clock, 1);
+		return TWI_NACK;
+	}
+	if (hostNanos() < eepromBusyUntil) {
+		busTime(clock, 1);
+		eepromStats.busyNacks++;
+		return TWI_NACK;
+	}
+
+	if (transaction->commandSize == 2)
+		eepromPointer = ((transaction->device & 3) << 16) | ((transaction->command + offset) & 0xFFFF);
+	else if (transaction->commandSize == 1) // high address byte only, the low one is the first data byte
+		eepromPointer = ((transaction->device & 3) << 16) | ((transaction->command & 0xFF) << 8);
+	address = eepromPointer;
+
+	if (transaction->read) {
+		busTime(clock, 1 + transaction->commandSize + (transaction->commandSize ? 1 : 0) + length);
+		for (uint16_t i = 0; i < length; i++) {
+			transaction->data[offset + i] = eeprom[address];
+			address = (address + 1) % HOST_EEPROM_SIZE;
+		}
+		eepromPointer = address;
+		eepromStats.reads++;
+		return TWI_DONE;
+	}
+
+	busTime(clock, 1 + transaction->commandSize + length);
+	const uint8_t *data = transaction->data + offset;
+	if (transaction->commandSize == 1) {
+		address |= *data++;
+		length--;
+	}
+	if (length == 0) { // nothing to program, the address is just set
+		eepromPointer = address;
+		return TWI_DONE;
+	}
+	//a page write wraps around within the page
+	for (uint16_t i = 0; i < length; i++)
+		eeprom[(address & ~(HOST_EEPROM_PAGE - 1)) | ((address + i) & (HOST_EEPROM_PAGE - 1))] = data[i];
+	eepromStats.pageWrites[address / HOST_EEPROM_PAGE]++;
+	eepromStats.writes++;
+	eepromBusyUntil = hostNanos() + HOST_EEPROM_WRITE_CYCLE;
+	return TWI_DONE;
+}
+
+TwiBus *TwiBus::twiBus = NULL;
+
+TwiBus::TwiBus() {
+	for (int i = 0; i < TWI_PRIORITY_COUNT; i++) queueHead[i] = queueTail[i] = NULL;
+	current = NULL;
+	chunk = 0;
+	clock = 100000;
+	memset(&stats, 0, sizeof(stats));
+}
+
+TwiBus *TwiBus::getInstance() {
+	if (twiBus == NULL)
+		twiBus = new TwiBus();
+	return twiBus;
+}
+
+void TwiBus::setup(uint32_t clock) {
+	this->clock = clock;
+}
+
+/*
+ * Queue a transaction. If the bus is free it runs (and everything queued meanwhile, e.g.
+ * by the callbacks) before this returns.
+ */
+bool TwiBus::submit(TwiTransaction *transaction) {
+	if (transaction->length == 0 || transaction->priority >= TWI_PRIORITY_COUNT) return false;
+	if (transaction->status == TWI_QUEUED || transaction->status == TWI_ACTIVE) return false;
+	transaction->status = TWI_QUEUED;
+	transaction->done = 0;
+	transaction->next = NULL;
+	if (queueTail[transaction->priority]) queueTail[transaction->priority]->next = transaction;
+	else queueHead[transaction->priority] = transaction;
+	queueTail[transaction->priority] = transaction;
+	if (current == NULL) {
+		startNext();
+		while (current != NULL) handleInterrupt();
+	}
+	return true;
+}
+
+bool TwiBus::wait(TwiTransaction *transaction) {
+	while (!isFinished(transaction));
+	return (transaction->status == TWI_DONE);
+}
+
+bool TwiBus::isFinished(TwiTransaction *transaction) {
+	return (transaction->status != TWI_QUEUED && transaction->status != TWI_ACTIVE);
+}
+
+void TwiBus::handleTick() {
+}
+
+TwiStats *TwiBus::getStats() {
+	return &stats;
+}
+
+void TwiBus::startNext() {
+	for (int i = 0; i < TWI_PRIORITY_COUNT; i++) {
+		TwiTransaction *transaction = queueHead[i];
+		if (transaction == NULL) continue;
+		queueHead[i] = transaction->next;
+		if (queueHead[i] == NULL) queueTail[i] = NULL;
+		current = transaction;
+		startTransfer(transaction);
+		return;
+	}
+	current = NULL;
+}
+
+void TwiBus::startTransfer(TwiTransaction *transaction) {
+	transaction->status = TWI_ACTIVE;
+	if (transaction->done == 0) transaction->started = TimeBase::getInstance()->getStamp();
+	chunk = transaction->length - transaction->done;
+	if (transaction->read && transaction->chunkSize && chunk > transaction->chunkSize) chunk = transaction->chunkSize;
+	chunkStarted = millis();
+}
+
+//the transfer on the bus is over: carry it out, then take the next one (a chunked read goes back to its queue)
+void TwiBus::handleInterrupt() {
+	TwiTransaction *transaction = current;
+	TwiStatus status = eepromTransfer(clock, transaction, transaction->done, chunk);
+
+	if (status == TWI_DONE) {
+		transaction->done += chunk;
+		if (transaction->done < transaction->length) {
+			transaction->status = TWI_QUEUED;
+			transaction->next = queueHead[transaction->priority];
+			queueHead[transaction->priority] = transaction;
+			if (queueTail[transaction->priority] == NULL) queueTail[transaction->priority] = transaction;
+			startNext();
+			return;
+		}
+	}
+	finish(status);
+}
+
+void TwiBus::finish(TwiStatus status) {
+	TwiTransaction *transaction = current;
+
+	transaction->duration = TimeBase::getInstance()->getStamp() - transaction->started;
+	stats.transactions++;
+	if (status == TWI_NACK) stats.nacks++;
+	transaction->status = status;
+	startNext();
+	if (transaction->callback) transaction->callback(transaction);
+}
+
+void TwiBus::checkTimeout() {
+}
+
+void TwiBus::resetController() {
+}
@@ -27,6 +27,7 @@
  */
 
 #include "ichip_2128.h"
+#include "TimeBase.h"
 
 /*
  * Constructor. Assign serial interface to use for ichip communication
@@ -73,11 +74,17 @@ void ICHIPWIFI::setup() {
 	ibWritePtr = 0;
 	psWritePtr = 0;
 	psReadPtr = 0;
+	cmdDropped = 0;
+	cmdTimeouts = 0;
+	retries = 0;
 	listeningSocket = 0;
 
-	lastSentTime = millis();
+	lastSentTime = TimeBase::getInstance()->getMillis();
 	lastSentState = IDLE;
-	lastSentCmd = String("");
+	lastSentCmd[0] = 0;
+	lastSentLength = 0;
+	lastSentData = NULL;
+	lastSentDataLength = 0;
 
 	activeSockets[0] = -1;
 	activeSockets[1] = -1;
@@ -89,6 +96,19 @@ void ICHIPWIFI::setup() {
 	didParamLoad = false;
 	didTCPListener = false;
 
+	memset(paramCache, 0, sizeof(paramCache));
+	paramSyncPos = 0;
+
+	telemetryHead = 0;
+	lastADCTelemetry = 0;
+	numTelemetryClients = 0;
+	for (int i = 0; i < TELEMETRY_MAX_CLIENTS; i++) {
+		telemetryClients[i].socket = -1;
+		telemetryClients[i].credit = CFG_TELEMETRY_CREDIT;
+		telemetryClients[i].nextFrame = 0;
+	}
+	for (int i = 0; i < TOPIC_COUNT; i++) SampleBus::getInstance()->subscribe((SampleTopic)i, this);
+
 	serialInterface->begin(115200);
 
 	
@@ -98,7 +118,7 @@ void ICHIPWIFI::setup() {
 }
 
 //A version of sendCmd that defaults to SET_PARAM which is what most of the code used to assume.
-void ICHIPWIFI::sendCmd(String cmd) {
+void ICHIPWIFI::sendCmd(const char *cmd) {
 	sendCmd(cmd, SET_PARAM);
 }
 
@@ -106,49 +126,388 @@ void ICHIPWIFI::sendCmd(String cmd) {
  * Send a command to ichip. The "AT+i" part will be added.
  * If the comm channel is busy it buffers the command
  */
-void ICHIPWIFI::sendCmd(String cmd, ICHIP_COMM_STATE cmdstate) {
-	if (state != IDLE) { //if the comm is tied up then buffer this parameter for sending later
-		sendingBuffer[psWritePtr].cmd = cmd;
+void ICHIPWIFI::sendCmd(const char *cmd, ICHIP_COMM_STATE cmdstate) {
+	char *slot = claimCmd();
+	if (slot == NULL) return;
+	commitCmd(slot, snprintf(slot, CFG_WIFI_CMD_LENGTH, "%s", cmd), cmdstate);
+}
+
+/*
+ * Where to format the next command: if the comm channel is free (and nothing is queued)
+ * it goes out right away and lastSentCmd keeps it, otherwise it's the free slot of the
+ * command ring. NULL if the ring is full. New commands are refused (and counted) rather
+ * than overwriting queued ones, so the order of what reaches the ichip is kept.
+ */
+char *ICHIPWIFI::claimCmd() {
+	if (state == IDLE && psReadPtr == psWritePtr) return lastSentCmd;
+	if (((psWritePtr + 1) % CFG_WIFI_CMD_QUEUE_SIZE) == psReadPtr) {
+		if (cmdDropped++ == 0) Logger::error(ICHIP2128, "command queue full, dropping commands");
+		return NULL;
+	}
+	return sendingBuffer[psWritePtr].cmd;
+}
+
+/*
+ * Take the command formatted into the buffer returned by claimCmd(), length is what snprintf
+ * returned (or the number of bytes written for binary data). Queued commands only need the
+ * slot to be taken. Returns false if the command was refused.
+ */
+bool ICHIPWIFI::commitCmd(char *cmd, int length, ICHIP_COMM_STATE cmdstate) {
+	return commitCmd(cmd, length, cmdstate, NULL, 0);
+}
+
+/*
+ * Like above, dataLength bytes at data follow the command. They aren't copied, the caller
+ * must leave them alone until the command is done (e.g. until the SSND reply came).
+ */
+bool ICHIPWIFI::commitCmd(char *cmd, int length, ICHIP_COMM_STATE cmdstate, const uint8_t *data, uint16_t dataLength) {
+	if (length < 0 || length >= CFG_WIFI_CMD_LENGTH) { //don't send half a command
+		cmdDropped++;
+		Logger::error(ICHIP2128, "command too long: %s", cmd);
+		if (cmd == lastSentCmd) lastSentCmd[0] = 0;
+		return false;
+	}
+	cmd[length] = 0;
+	if (cmd != lastSentCmd) { //if the comm is tied up then buffer this parameter for sending later
+		sendingBuffer[psWritePtr].length = length;
 		sendingBuffer[psWritePtr].state = cmdstate;
-		psWritePtr = (psWritePtr + 1) & 63;
-		if (Logger::isDebug()) {
-			String temp = "Buffer cmd: " + cmd;
-			Logger::debug(ICHIP2128, (char *)temp.c_str());
-		}
+		sendingBuffer[psWritePtr].data = data;
+		sendingBuffer[psWritePtr].dataLength = dataLength;
+		psWritePtr = (psWritePtr + 1) % CFG_WIFI_CMD_QUEUE_SIZE;
+		if (cmdstate != SEND_SOCKET) Logger::debug(ICHIP2128, "Buffer cmd: %s", cmd);
 	}
 	else { //otherwise, go ahead and blast away
-		serialInterface->write(Constants::ichipCommandPrefix);
-		serialInterface->print(cmd);
-		serialInterface->write(13);
-		state = cmdstate;
-		lastSentTime = millis();
-		lastSentCmd = String(cmd);
-		lastSentState = cmdstate;
-
-		if (Logger::isDebug()) {
-			String temp = "Send to ichip cmd: " + cmd;
-			Logger::debug(ICHIP2128, (char *)temp.c_str());
-		}
+		lastSentLength = length;
+		lastSentData = data;
+		lastSentDataLength = dataLength;
+		retries = 0;
+		transmit(cmdstate);
 	}
+	return true;
+}
+
+//number of commands waiting in the ring
+int ICHIPWIFI::queuedCmds() {
+	return (psWritePtr - psReadPtr + CFG_WIFI_CMD_QUEUE_SIZE) % CFG_WIFI_CMD_QUEUE_SIZE;
+}
+
+//send the command in lastSentCmd, the reply is picked up by loop()
+void ICHIPWIFI::transmit(ICHIP_COMM_STATE cmdstate) {
+	serialInterface->write(Constants::ichipCommandPrefix);
+	serialInterface->write((const uint8_t *)lastSentCmd, lastSentLength);
+	if (lastSentData != NULL) serialInterface->write(lastSentData, lastSentDataLength);
+	serialInterface->write(13);
+	state = cmdstate;
+	lastSentTime = TimeBase::getInstance()->getMillis();
+	lastSentState = cmdstate;
+
+	if (cmdstate == SEND_SOCKET) Logger::debug(ICHIP2128, "Send to ichip: %i bytes of socket data", lastSentLength + (lastSentData != NULL ? lastSentDataLength : 0));
+	else Logger::debug(ICHIP2128, "Send to ichip cmd: %s", lastSentCmd);
+}
+
+//the previous command is done, send the oldest queued one (if any)
+void ICHIPWIFI::sendNextCmd() {
+	ICHIP_COMM_STATE cmdstate;
+
+	if (state != IDLE || psReadPtr == psWritePtr) return;
+	memcpy(lastSentCmd, sendingBuffer[psReadPtr].cmd, CFG_WIFI_CMD_LENGTH);
+	lastSentLength = sendingBuffer[psReadPtr].length;
+	lastSentData = sendingBuffer[psReadPtr].data;
+	lastSentDataLength = sendingBuffer[psReadPtr].dataLength;
+	cmdstate = sendingBuffer[psReadPtr].state;
+	psReadPtr = (psReadPtr + 1) % CFG_WIFI_CMD_QUEUE_SIZE;
+	retries = 0;
+	transmit(cmdstate);
+}
+
+//number of commands which were refused since setup()
+uint32_t ICHIPWIFI::getDroppedCommands() {
+	return cmdDropped;
+}
+
+//number of commands which never got a reply
+uint32_t ICHIPWIFI::getCommandTimeouts() {
+	return cmdTimeouts;
+}
+
+bool ICHIPWIFI::sendToSocket(int socket, const char *data) {
+	return sendToSocket(socket, (const uint8_t *)data, strlen(data));
+}
+
+/*
+ * Send binary data to a socket (AT+iSSND%:<socket>,<size>:<data>).
+ * Returns false if the command queue couldn't take it.
+ */
+bool ICHIPWIFI::sendToSocket(int socket, const uint8_t *data, uint16_t length) {
+	char *slot = claimCmd();
+	int header;
+
+	if (slot == NULL) return false;
+	header = snprintf(slot, CFG_WIFI_CMD_LENGTH, "SSND%%:%03i,%i:", socket, length);
+	if (header + length < CFG_WIFI_CMD_LENGTH) memcpy(slot + header, data, length);
+	return commitCmd(slot, header + length, SEND_SOCKET);
 }
 
-void ICHIPWIFI::sendToSocket(int socket, String data) {
-	char buff[6];
-	sprintf(buff, "%03i", socket);
-	String temp = "SSND%%:" + String(buff);
-	sprintf(buff, ",%i:", data.length());
-	temp = temp + String(buff) + data;
-	sendCmd(temp, SEND_SOCKET);
+/*
+ * Send binary data to a socket without copying it into a command slot, so it may be longer
+ * than a command. The data must stay untouched until the SSND is done (telemetrySent()).
+ * Returns false if the command queue couldn't take it.
+ */
+bool ICHIPWIFI::sendBufferToSocket(int socket, const uint8_t *data, uint16_t length) {
+	char *slot = claimCmd();
+
+	if (slot == NULL) return false;
+	return commitCmd(slot, snprintf(slot, CFG_WIFI_CMD_LENGTH, "SSND%%:%03i,%i:", socket, length), SEND_SOCKET, data, length);
 }
 
 /*
  * Periodic updates of parameters to ichip RAM.
  * Also query for changed parameters of the config page.
+ * The ichip can't take many setParam commands in a row, so values only go into the param
+ * cache here and syncParams() sends the ones that changed, a few per tick.
  */
-//TODO: See the processing function below for a more detailed explanation - can't send so many setParam commands in a row
 void ICHIPWIFI::handleTick() {
- 
-	
+	SampleBus *bus = SampleBus::getInstance();
+	const Sample *sample;
+
+	updateParam(Constants::timeRunning, getTimeRunning());
+	if ((sample = bus->getLatest(TOPIC_HUMIDITY)) != NULL) {
+		updateParam(Constants::humidity, sample->value[0], 2);
+		updateParam(Constants::temperature, sample->value[1], 2);
+	}
+	if ((sample = bus->getLatest(TOPIC_DIFF_PRES)) != NULL)
+		updateParam(Constants::diffPressure, sample->value[0], 2);
+	if ((sample = bus->getLatest(TOPIC_MASS_FLOW)) != NULL)
+		updateParam(Constants::massFlow, sample->value[0], 3);
+
+	syncParams();
+
+	//open the telemetry port once the ichip answers, then look for clients now and then
+	tickCounter++;
+	if (!didTCPListener) {
+		if (tickCounter % 10 == 0) {
+			char *slot = claimCmd();
+			if (slot) commitCmd(slot, snprintf(slot, CFG_WIFI_CMD_LENGTH, "LTCP:%i,%i", CFG_TELEMETRY_PORT, TELEMETRY_MAX_CLIENTS), START_TCP_LISTENER);
+		}
+	}
+	else if (tickCounter % 5 == 0) {
+		char *slot = claimCmd();
+		if (slot) commitCmd(slot, snprintf(slot, CFG_WIFI_CMD_LENGTH, "LSST:%i", listeningSocket), GET_ACTIVE_SOCKETS);
+	}
+	replayTelemetry();
+}
+
+/*
+ * Set the value of a web parameter. It is sent by syncParams() if it differs from what was
+ * sent last. Params which don't fit the cache are sent right away.
+ */
+void ICHIPWIFI::updateParam(const char *name, const char *value) {
+	int i, free = -1;
+
+	for (i = 0; i < CFG_WIFI_PARAM_CACHE_SIZE; i++) {
+		if (paramCache[i].name[0] == 0) {
+			if (free == -1) free = i;
+		}
+		else if (strcmp(paramCache[i].name, name) == 0) break;
+	}
+	if (strlen(value) >= WIFI_PARAM_VALUE_LENGTH || (i == CFG_WIFI_PARAM_CACHE_SIZE && (free == -1 || strlen(name) >= WIFI_PARAM_NAME_LENGTH))) {
+		setParam(name, value);
+		return;
+	}
+	if (i == CFG_WIFI_PARAM_CACHE_SIZE) { //first time we see this one
+		i = free;
+		strcpy(paramCache[i].name, name);
+	}
+	else if (strcmp(paramCache[i].value, value) == 0) return; //unchanged
+	strcpy(paramCache[i].value, value);
+	paramCache[i].dirty = true;
+}
+
+//set a web parameter to a fixed point value, e.g. 2345 with 2 decimals is sent as "23.45"
+void ICHIPWIFI::updateParam(const char *name, int32_t value, uint8_t decimals) {
+	char text[16];
+	uint32_t divisor = 1, magnitude = (value < 0 ? 0 - (uint32_t)value : value);
+
+	for (uint8_t i = 0; i < decimals; i++) divisor *= 10;
+	if (decimals == 0) sprintf(text, "%ld", (long)value);
+	else sprintf(text, "%s%lu.%0*lu", (value < 0 ? "-" : ""), (unsigned long)(magnitude / divisor), decimals, (unsigned long)(magnitude % divisor));
+	updateParam(name, text);
+}
+
+/*
+ * Send up to CFG_WIFI_PARAMS_PER_TICK changed params, continuing where the last call stopped
+ * so every param gets its turn. Nothing is sent while anything of the previous batch is still
+ * in the command queue, values changing in the meantime simply replace the cached ones. So a
+ * slow module gets the latest values instead of a backlog of stale ones.
+ */
+void ICHIPWIFI::syncParams() {
+	int sent = 0;
+
+	if (queuedCmds() != 0) return;
+	for (int n = 0; n < CFG_WIFI_PARAM_CACHE_SIZE && sent < CFG_WIFI_PARAMS_PER_TICK; n++) {
+		ParamCache *param = &paramCache[paramSyncPos];
+		paramSyncPos = (paramSyncPos + 1) % CFG_WIFI_PARAM_CACHE_SIZE;
+		if (!param->dirty) continue;
+		param->dirty = false;
+		setParam(param->name, param->value);
+		sent++;
+	}
+}
+
+/*
+ * Put a published sample into the telemetry ring. ADC blocks come far more often than
+ * anybody can watch them, they are thinned out to one every CFG_TELEMETRY_ADC_INTERVAL ms.
+ */
+void ICHIPWIFI::handleSample(SampleTopic topic, const Sample *sample) {
+	if (numTelemetryClients == 0) return;
+	if (topic == TOPIC_ADC) {
+		uint32_t now = TimeBase::getInstance()->getMillis();
+		if (now - lastADCTelemetry < CFG_TELEMETRY_ADC_INTERVAL) return;
+		lastADCTelemetry = now;
+	}
+
+	queueTelemetry(topic, sample->sequence, sample->timestamp, sample);
+}
+
+void ICHIPWIFI::queueTelemetry(uint8_t topic, uint16_t sequence, uint32_t timestamp, const Sample *sample) {
+	TelemetryRecord *record = &telemetryRing[telemetryHead % CFG_TELEMETRY_RING_SIZE];
+	record->topic = topic;
+	record->decimation = 1;
+	record->sequence = sequence;
+	record->timestamp = timestamp;
+	for (int i = 0; i < SAMPLE_MAX_VALUES; i++) record->value[i] = (i < sample->count ? sample->value[i] : 0);
+	telemetryHead++;
+}
+
+/*
+ * Mix up to CFG_SAMPLESTORE_REPLAY_PER_TICK stored samples into the ring, but only while
+ * every client is less than half a ring behind so the history doesn't push out live samples.
+ */
+void ICHIPWIFI::replayTelemetry() {
+	SampleStore *store = SampleStore::getInstance();
+	SampleTopic topic;
+	uint16_t boot;
+	uint32_t time;
+	Sample sample;
+
+	if (numTelemetryClients == 0 || !store->isReplaying()) return;
+	for (int i = 0; i < TELEMETRY_MAX_CLIENTS; i++) {
+		if (telemetryClients[i].socket != -1 && telemetryHead - telemetryClients[i].cursor >= CFG_TELEMETRY_RING_SIZE / 2) return;
+	}
+	for (int n = 0; n < CFG_SAMPLESTORE_REPLAY_PER_TICK && store->replayNext(&topic, &boot, &time, &sample); n++)
+		queueTelemetry(topic | TELEMETRY_HISTORY, boot, time, &sample);
+}
+
+/*
+ * Match the telemetry clients with the sockets reported by LSST. New clients start with
+ * the next sample and full credit, clients whose socket is gone are removed.
+ */
+void ICHIPWIFI::updateTelemetryClients() {
+	int i, j;
+	int previous = numTelemetryClients;
+
+	for (i = 0; i < TELEMETRY_MAX_CLIENTS; i++) {
+		TelemetryClient *client = &telemetryClients[i];
+		if (client->socket == -1) continue;
+		for (j = 0; j < 4 && activeSockets[j] != client->socket; j++);
+		if (j == 4) {
+			Logger::info(ICHIP2128, "telemetry client on socket %i disconnected", client->socket);
+			client->socket = -1;
+			numTelemetryClients--;
+		}
+	}
+	for (j = 0; j < 4; j++) {
+		int free = -1;
+		if (activeSockets[j] == -1) continue;
+		for (i = 0; i < TELEMETRY_MAX_CLIENTS && telemetryClients[i].socket != activeSockets[j]; i++) {
+			if (free == -1 && telemetryClients[i].socket == -1) free = i;
+		}
+		if (i < TELEMETRY_MAX_CLIENTS || free == -1) continue;
+
+		TelemetryClient *client = &telemetryClients[free];
+		client->socket = activeSockets[j];
+		client->cursor = telemetryHead;
+		//credit stays as it is, SSNDs of a previous client of this slot may still be queued
+		client->decimation = 1;
+		client->phase = 0;
+		client->dropped = 0;
+		numTelemetryClients++;
+		Logger::info(ICHIP2128, "telemetry client on socket %i", client->socket);
+	}
+	if (previous == 0 && numTelemetryClients > 0) SampleStore::getInstance()->startReplay();
+	else if (previous > 0 && numTelemetryClients == 0) SampleStore::getInstance()->linkDown();
+}
+
+/*
+ * Hand a batch to every client which has credit and enough records waiting (or records
+ * older than CFG_TELEMETRY_MAX_DELAY). A client which has run out of credit while the ring
+ * overtook it loses the overwritten records and gets only every second sample from then on
+ * (up to TELEMETRY_MAX_DECIMATION), telemetrySent() lowers the decimation again once the
+ * client keeps up. Half of the command queue is left for everything else.
+ * A batch is assembled in the client's next frame. With credit left that frame isn't in the
+ * command queue any more, as SSNDs complete in order and there is one frame per credit.
+ */
+void ICHIPWIFI::sendTelemetry() {
+	for (int c = 0; c < TELEMETRY_MAX_CLIENTS && numTelemetryClients > 0; c++) {
+		TelemetryClient *client = &telemetryClients[c];
+		uint8_t *frame = client->frame[client->nextFrame];
+		uint32_t head = telemetryHead;
+		uint8_t records = 0;
+
+		if (client->socket == -1) continue;
+		if (head - client->cursor > CFG_TELEMETRY_RING_SIZE) {
+			client->dropped += head - client->cursor - CFG_TELEMETRY_RING_SIZE;
+			client->cursor = head - CFG_TELEMETRY_RING_SIZE;
+			if (client->decimation < TELEMETRY_MAX_DECIMATION) client->decimation *= 2;
+		}
+		if (client->credit == 0 || client->cursor == head || queuedCmds() >= CFG_WIFI_CMD_QUEUE_SIZE / 2) continue;
+		if (head - client->cursor < TELEMETRY_BATCH_RECORDS
+				&& (telemetryRing[client->cursor % CFG_TELEMETRY_RING_SIZE].topic & TELEMETRY_HISTORY) == 0
+				&& TimeBase::getInstance()->getStamp() - telemetryRing[client->cursor % CFG_TELEMETRY_RING_SIZE].timestamp < CFG_TELEMETRY_MAX_DELAY * 1000) continue;
+
+		while (client->cursor != head && records < TELEMETRY_BATCH_RECORDS) {
+			uint8_t *record = frame + TELEMETRY_HEADER_SIZE + records * TELEMETRY_RECORD_SIZE;
+			const TelemetryRecord *next = &telemetryRing[client->cursor++ % CFG_TELEMETRY_RING_SIZE];
+			if (next->topic != TOPIC_FAULT && (client->phase++ % client->decimation) != 0) continue;
+			memcpy(record, next, TELEMETRY_RECORD_SIZE); //frame isn't aligned
+			record[1] = client->decimation;
+			records++;
+		}
+		if (records == 0) continue;
+
+		frame[0] = TELEMETRY_MAGIC & 0xFF;
+		frame[1] = TELEMETRY_MAGIC >> 8;
+		frame[2] = records;
+		frame[3] = (client->dropped > 255 ? 255 : client->dropped);
+		if (sendBufferToSocket(client->socket, frame, TELEMETRY_HEADER_SIZE + records * TELEMETRY_RECORD_SIZE)) {
+			client->nextFrame = (client->nextFrame + 1) % CFG_TELEMETRY_CREDIT;
+			client->credit--;
+			client->dropped = 0;
+		}
+		else client->dropped += records;
+	}
+}
+
+/*
+ * A SSND is done, give the credit (and frame) back to its client. If it failed the socket is
+ * most likely closed, the client is removed (LSST will bring it back if it's still there).
+ * The frame tells whose batch it was, the socket may belong to a new client by now.
+ */
+void ICHIPWIFI::telemetrySent(bool success) {
+	int socket = atoi(lastSentCmd + 6); //SSND%:<socket>,...
+
+	for (int i = 0; i < TELEMETRY_MAX_CLIENTS; i++) {
+		TelemetryClient *client = &telemetryClients[i];
+		if (lastSentData < client->frame[0] || lastSentData >= client->frame[CFG_TELEMETRY_CREDIT]) continue;
+		if (client->credit < CFG_TELEMETRY_CREDIT) client->credit++;
+		if (client->socket != socket) return;
+		if (!success) {
+			client->socket = -1;
+			if (--numTelemetryClients == 0) SampleStore::getInstance()->linkDown();
+		}
+		else if (client->credit == CFG_TELEMETRY_CREDIT && client->decimation > 1 && client->cursor == telemetryHead) client->decimation /= 2;
+		return;
+	}
 }
 
 /*
@@ -157,7 +516,7 @@ void ICHIPWIFI::handleTick() {
    Of course, the sprintf is only good to 99 hours so that's a bit less time.
  */
 char *ICHIPWIFI::getTimeRunning() {
-	uint32_t ms = millis();
+	uint32_t ms = TimeBase::getInstance()->getMillis();
 	int seconds = (int) (ms / 1000) % 60;
 	int minutes = (int) ((ms / (1000 * 60)) % 60);
 	int hours = (int) ((ms / (1000 * 3600)) % 24);
@@ -183,7 +542,7 @@ void ICHIPWIFI::handleMessage(uint32_t messageType, void* message) {
 	case MSG_SET_PARAM:{   //Sets a single parameter to a single value
   	        char **params = (char **)message;  //recast message as a two element array (params)		
               // Logger::console("Received Device: %s value %s",params[0], params[1]);
-		setParam((char *)params[0], (char *)params[1]);
+		updateParam((char *)params[0], (char *)params[1]);
 		break;
 	}
 	case MSG_CONFIG_CHANGE:{  //Loads all parameters to web site
@@ -208,64 +567,81 @@ void ICHIPWIFI::getNextParam() {
 /*
  * Try to retrieve the value of the given parameter.
  */
-void ICHIPWIFI::getParamById(String paramName) {
-	sendCmd(paramName + "?", GET_PARAM);
+void ICHIPWIFI::getParamById(const char *paramName) {
+	char *slot = claimCmd();
+	if (slot == NULL) return;
+	commitCmd(slot, snprintf(slot, CFG_WIFI_CMD_LENGTH, "%s?", paramName), GET_PARAM);
 }
 
 /*
  * Set a parameter to the given string value
  */
-void ICHIPWIFI::setParam(String paramName, String value) {
-      sendCmd(paramName + "=\"" + value + "\"", SET_PARAM);
+void ICHIPWIFI::setParam(const char *paramName, const char *value) {
+	char *slot = claimCmd();
+	if (slot == NULL) return;
+	commitCmd(slot, snprintf(slot, CFG_WIFI_CMD_LENGTH, "%s=\"%s\"", paramName, value), SET_PARAM);
+}
+
+/*
+ * Set a parameter whose name is kept in flash (F("...")). On the SAM3X flash is memory
+ * mapped so the name can be read like any other string.
+ */
+void ICHIPWIFI::setParam(const __FlashStringHelper *paramName, const char *value) {
+	setParam((const char *)paramName, value);
 }
 
 /*
  * Set a parameter to the given int32 value
  */
-void ICHIPWIFI::setParam(String paramName, int32_t value) {
-	sprintf(buffer, "%l", value);
-	setParam(paramName, buffer);
+void ICHIPWIFI::setParam(const char *paramName, int32_t value) {
+	char *slot = claimCmd();
+	if (slot == NULL) return;
+	commitCmd(slot, snprintf(slot, CFG_WIFI_CMD_LENGTH, "%s=\"%ld\"", paramName, (long)value), SET_PARAM);
 }
 
 /*
  * Set a parameter to the given uint32 value
  */
-void ICHIPWIFI::setParam(String paramName, uint32_t value) {
-	sprintf(buffer, "%lu", value);
-	setParam(paramName, buffer);
+void ICHIPWIFI::setParam(const char *paramName, uint32_t value) {
+	char *slot = claimCmd();
+	if (slot == NULL) return;
+	commitCmd(slot, snprintf(slot, CFG_WIFI_CMD_LENGTH, "%s=\"%lu\"", paramName, (unsigned long)value), SET_PARAM);
 }
 
 /*
  * Set a parameter to the given sint16 value
  */
-void ICHIPWIFI::setParam(String paramName, int16_t value) {
-	sprintf(buffer, "%d", value);
-	setParam(paramName, buffer);
+void ICHIPWIFI::setParam(const char *paramName, int16_t value) {
+	char *slot = claimCmd();
+	if (slot == NULL) return;
+	commitCmd(slot, snprintf(slot, CFG_WIFI_CMD_LENGTH, "%s=\"%d\"", paramName, value), SET_PARAM);
 }
 
 /*
  * Set a parameter to the given uint16 value
  */
-void ICHIPWIFI::setParam(String paramName, uint16_t value) {
-	sprintf(buffer, "%d", value);
-	setParam(paramName, buffer);
+void ICHIPWIFI::setParam(const char *paramName, uint16_t value) {
+	char *slot = claimCmd();
+	if (slot == NULL) return;
+	commitCmd(slot, snprintf(slot, CFG_WIFI_CMD_LENGTH, "%s=\"%d\"", paramName, value), SET_PARAM);
 }
 
 /*
  * Set a parameter to the given uint8 value
  */
-void ICHIPWIFI::setParam(String paramName, uint8_t value) {
-	sprintf(buffer, "%d", value);
-	setParam(paramName, buffer);
+void ICHIPWIFI::setParam(const char *paramName, uint8_t value) {
+	char *slot = claimCmd();
+	if (slot == NULL) return;
+	commitCmd(slot, snprintf(slot, CFG_WIFI_CMD_LENGTH, "%s=\"%d\"", paramName, value), SET_PARAM);
 }
+
 /*
  * Set a parameter to the given float value
  */
-void ICHIPWIFI::setParam(String paramName, float value, int precision) {
-	char format[10];
-	sprintf(format, "%%.%df", precision);
-	sprintf(buffer, format, value);
-	setParam(paramName, buffer);
+void ICHIPWIFI::setParam(const char *paramName, float value, int precision) {
+	char *slot = claimCmd();
+	if (slot == NULL) return;
+	commitCmd(slot, snprintf(slot, CFG_WIFI_CMD_LENGTH, "%s=\"%.*f\"", paramName, precision, value), SET_PARAM);
 }
 
 /*
@@ -276,25 +652,131 @@ void ICHIPWIFI::setParam(String paramName, float value, int precision) {
  */
 
 void ICHIPWIFI::loop() {
-	
+	int incoming;
+
+	//the core's USART interrupt collects the input in its ring buffer, take all it has
+	while ((incoming = serialInterface->read()) != -1) {
+		if (incoming == 13) {
+			incomingBuffer[ibWritePtr] = 0;
+			processLine();
+			ibWritePtr = 0;
+		}
+		else if (incoming != 10 && ibWritePtr < (int)sizeof(incomingBuffer) - 1) { //drop LF, cut overlong lines
+			incomingBuffer[ibWritePtr++] = (char)incoming;
+		}
+	}
+
+	//no reply in time, send the command again or give up on it
+	if (state != IDLE && TimeBase::getInstance()->getMillis() - lastSentTime > CFG_WIFI_CMD_TIMEOUT) {
+		if (retries < CFG_WIFI_CMD_RETRIES) {
+			retries++;
+			Logger::warn(ICHIP2128, "no reply to %s, retrying", lastSentCmd);
+			transmit(lastSentState);
+		}
+		else {
+			cmdTimeouts++;
+			Logger::error(ICHIP2128, "no reply to %s, giving up", lastSentCmd);
+			if (lastSentState == SEND_SOCKET) telemetrySent(true); //don't starve the client, the data is lost though
+			state = IDLE;
+			sendNextCmd();
+		}
+	}
+
+	sendTelemetry();
+}
+
+//true if the module sent something loop() hasn't read yet
+bool ICHIPWIFI::hasInput() {
+	return serialInterface->available() > 0;
+}
+
+/*
+ * Handle one line received from the ichip. Status replies start with "I/" (I/OK, I/ERROR (nn),
+ * I/DONE, I/<data>) and end the command in flight, a GET_PARAM is answered with the value itself.
+ * Once the command is done the next queued one is sent.
+ */
+void ICHIPWIFI::processLine() {
+	char *line = incomingBuffer;
+	bool reply, error, done;
+
+	if (line[0] == 0) return;
+	Logger::debug(ICHIP2128, "Received: %s", line);
+	if (state == IDLE) return; //nothing asked, e.g. I/ONLINE after a reset
+
+	reply = (line[0] == 'I' && line[1] == '/');
+	error = (strncmp(line, Constants::ichipErrorString, strlen(Constants::ichipErrorString)) == 0);
+	if (error) Logger::error(ICHIP2128, "%s failed: %s", lastSentCmd, line);
+
+	switch (state) {
+	case GET_PARAM:
+		if (!error) processParameterChange(line);
+		done = true;
+		break;
+	case START_TCP_LISTENER: //I/<socket>
+		if (reply && !error) {
+			listeningSocket = atoi(line + 2);
+			didTCPListener = true;
+			Logger::info(ICHIP2128, "telemetry on port %i (socket %i)", CFG_TELEMETRY_PORT, listeningSocket);
+		}
+		done = reply;
+		break;
+	case GET_ACTIVE_SOCKETS: //I/(<socket>,<socket>,...)
+		if (reply && !error) {
+			char *p = line + 2;
+			for (int i = 0; i < 4; i++) {
+				while (*p && (*p < '0' || *p > '9')) p++;
+				activeSockets[i] = (*p ? strtol(p, &p, 10) : -1);
+			}
+			updateTelemetryClients();
+		}
+		else if (error) didTCPListener = false; //listener is gone, open it again
+		done = reply;
+		break;
+	case SEND_SOCKET:
+		if (reply) telemetrySent(!error);
+		done = reply;
+		break;
+	default:
+		done = reply;
+		break;
+	}
+
+	if (done) {
+		state = IDLE;
+		sendNextCmd();
+	}
 }
 
 /*
  * Process the parameter update from ichip we received as a response to AT+iWNXT.
  * The response usually looks like this : key="value", so the key can be isolated
  * by looking for the '=' sign and the leading/trailing '"' have to be ignored.
+ * I/DONE means there are no more changes, otherwise the next one is requested.
  */
 void ICHIPWIFI::processParameterChange(char *key) {
-	
-	
+	char *value = strchr(key, '=');
+
+	if (strcmp(key, "I/DONE") == 0 || value == NULL) return;
+	*value++ = 0;
+	if (*value == '"') value++;
+	int length = strlen(value);
+	if (length > 0 && value[length - 1] == '"') value[length - 1] = 0;
+
+	Logger::info(ICHIP2128, "parameter changed: %s = %s", key, value);
+	getNextParam();
 }
 
 /*
  * Get parameters from devices and forward them to ichip.
  * This is required to initially set-up the ichip
+ * Everything in the param cache is sent again (metered by syncParams()), devices refresh
+ * theirs through MSG_SET_PARAM.
  */
 void ICHIPWIFI::loadParameters() {
-	
+	for (int i = 0; i < CFG_WIFI_PARAM_CACHE_SIZE; i++) {
+		if (paramCache[i].name[0] != 0) paramCache[i].dirty = true;
+	}
+	didParamLoad = true;
 }
 
 DeviceType ICHIPWIFI::getType() {
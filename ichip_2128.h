@@ -49,6 +49,24 @@
  * <param>=<value> 	 set 
  * <param>?		get
  * 
+ * Telemetry stream
+ * Clients connecting to TCP port CFG_TELEMETRY_PORT get the published samples (see SampleBus.h)
+ * as binary batches, one per SSND. All values are little endian:
+ * 	uint16_t	TELEMETRY_MAGIC
+ * 	uint8_t		number of records in the batch
+ * 	uint8_t		records this client lost since the previous batch (stops at 255)
+ * followed by the records, TELEMETRY_RECORD_SIZE bytes each:
+ * 	uint8_t		topic (SampleTopic)
+ * 	uint8_t		decimation the client is on (1 = every sample, 2 = every second, ...)
+ * 	uint16_t	low 16 bits of the sample's sequence number
+ * 	uint32_t	TimeBase stamp (microseconds) of the sample
+ * 	int32_t		value[SAMPLE_MAX_VALUES], unused ones are 0
+ * A client which doesn't keep up is decimated, faults are always sent.
+ * When the first client connects, the history kept while nobody was connected (see
+ * SampleStore.h) is sent along with the live samples. Those records have TELEMETRY_HISTORY
+ * set in the topic, the boot count in place of the sequence and TimeBase milliseconds of
+ * that boot as time stamp.
+ * 
 
  Copyright (c) 2013 Collin Kidder, Michael Neuweiler, Charles Galpin
 
@@ -83,6 +101,8 @@ SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
 
 #include "Sys_Messages.h"
 #include "DeviceTypes.h"
+#include "SampleBus.h"
+#include "SampleStore.h"
 
 //#include "sys_io.h"
 
@@ -98,29 +118,60 @@ class WifiConfiguration : public DeviceConfiguration {
 public:
 };
 
+#define WIFI_PARAM_NAME_LENGTH	20
+#define WIFI_PARAM_VALUE_LENGTH	24
+
 /**
  * Cache of param values to avoid sending an update unless changed
  */
 struct ParamCache {
-	uint32_t timeRunning;
-	
-	uint32_t bitfield1;
-	uint32_t bitfield2;
-	uint32_t bitfield3;
-	uint32_t bitfield4;
-	bool running;
-	bool faulted;
-	bool warning;
-	
-	
+	char name[WIFI_PARAM_NAME_LENGTH]; //empty if the entry is unused
+	char value[WIFI_PARAM_VALUE_LENGTH]; //latest value, sent unless dirty
+	bool dirty; //value changed since it was last sent
 };
 
+//one slot of the command ring, commands are formatted straight into it
 struct SendBuff {
-	String cmd;
+	char cmd[CFG_WIFI_CMD_LENGTH];
+	uint8_t length; //SSND data may contain zeros
 	ICHIP_COMM_STATE state; 
+	const uint8_t *data; //sent right after cmd if not NULL, it's not copied (see commitCmd)
+	uint16_t dataLength;
+};
+static_assert(CFG_WIFI_CMD_LENGTH <= 256, "CFG_WIFI_CMD_LENGTH doesn't fit SendBuff::length");
+
+#define TELEMETRY_MAGIC	0x7E1E
+#define TELEMETRY_HEADER_SIZE	4
+#define TELEMETRY_RECORD_SIZE	(8 + 4 * SAMPLE_MAX_VALUES)
+#define TELEMETRY_MAX_DECIMATION	8
+#define TELEMETRY_HISTORY	0x80 //topic flag of replayed records
+#define TELEMETRY_MAX_CLIENTS	4 //as many as activeSockets holds
+//batches are sent from the client's frames, only "SSND%:nnn,nnn:" goes into the command slot
+#define TELEMETRY_BATCH_RECORDS	CFG_TELEMETRY_BATCH_RECORDS
+#define TELEMETRY_FRAME_SIZE	(TELEMETRY_HEADER_SIZE + TELEMETRY_BATCH_RECORDS * TELEMETRY_RECORD_SIZE)
+
+//a record as it goes over the wire
+struct TelemetryRecord {
+	uint8_t topic;
+	uint8_t decimation;
+	uint16_t sequence;
+	uint32_t timestamp;
+	int32_t value[SAMPLE_MAX_VALUES];
+};
+static_assert(sizeof(TelemetryRecord) == TELEMETRY_RECORD_SIZE, "TelemetryRecord must not be padded");
+
+struct TelemetryClient {
+	int socket; //-1 if unused
+	uint32_t cursor; //next record of the telemetry ring to send
+	uint8_t credit; //batches which may still be handed to the ichip
+	uint8_t decimation;
+	uint8_t phase; //counts the records skipped for decimation
+	uint32_t dropped; //records lost since the last batch
+	uint8_t nextFrame; //frame the next batch is assembled in
+	uint8_t frame[CFG_TELEMETRY_CREDIT][TELEMETRY_FRAME_SIZE]; //one per credit, so a frame stays untouched until its SSND is done
 };
 
-class ICHIPWIFI : public Device {
+class ICHIPWIFI : public Device, public SampleObserver {
     public:
     
     ICHIPWIFI();
@@ -128,10 +179,14 @@ class ICHIPWIFI : public Device {
     void setup(); //initialization on start up
     void handleTick(); //periodic processes
     void handleMessage(uint32_t messageType, void* message);
+    void handleSample(SampleTopic topic, const Sample *sample);
 	DeviceType getType();
     DeviceId getId();
     void loop();
+    bool hasInput();
     char *getTimeRunning();
+    uint32_t getDroppedCommands();
+    uint32_t getCommandTimeouts();
 	
 
 	void loadConfiguration();
@@ -144,34 +199,64 @@ class ICHIPWIFI : public Device {
     USARTClass* serialInterface; //Allows for retargetting which serial port we use
     char incomingBuffer[128]; //storage for one incoming line
     int ibWritePtr; //write position into above buffer
-	SendBuff sendingBuffer[64];
+	SendBuff sendingBuffer[CFG_WIFI_CMD_QUEUE_SIZE];
 	int psWritePtr;
 	int psReadPtr;
+	uint32_t cmdDropped; //commands refused because the queue was full or they were too long
+	uint32_t cmdTimeouts; //commands given up after CFG_WIFI_CMD_RETRIES repetitions without reply
+	uint8_t retries; //repetitions of the command in flight
 	int tickCounter;
 	int currReply;
 	char buffer[30]; // a buffer for various string conversions
-	ParamCache paramCache;
+	ParamCache paramCache[CFG_WIFI_PARAM_CACHE_SIZE];
+	int paramSyncPos; //where the next search for changed params starts
 	ICHIP_COMM_STATE state;
 	bool didParamLoad;
 	bool didTCPListener;
 	int listeningSocket;
 	int activeSockets[4]; //support for four sockets. Lowest byte is socket #, next byte is size of data waiting in that socket
-	uint32_t lastSentTime;
-	String lastSentCmd;
+	uint32_t lastSentTime; //TimeBase milliseconds the command in flight was (last) sent
+	char lastSentCmd[CFG_WIFI_CMD_LENGTH];
+	uint8_t lastSentLength;
+	const uint8_t *lastSentData; //sent after lastSentCmd, NULL if none
+	uint16_t lastSentDataLength;
 	ICHIP_COMM_STATE lastSentState;
+	TelemetryRecord telemetryRing[CFG_TELEMETRY_RING_SIZE];
+	uint32_t telemetryHead; //number of records put into the ring so far
+	uint32_t lastADCTelemetry; //TimeBase milliseconds of the last ADC sample put into the ring
+	TelemetryClient telemetryClients[TELEMETRY_MAX_CLIENTS];
+	int numTelemetryClients;
 
     void getNextParam(); //get next changed parameter
-    void getParamById(String paramName); //try to retrieve the value of the given parameter
-    void setParam(String paramName, String value); //set the given parameter with the given string
-    void setParam(String paramName, int32_t value);
-    void setParam(String paramName, int16_t value);
-    void setParam(String paramName, uint32_t value);
-    void setParam(String paramName, uint16_t value);
-    void setParam(String paramName, uint8_t value);
-    void setParam(String paramName, float value, int precision);
-    void sendCmd(String cmd);
-	void sendCmd(String cmd, ICHIP_COMM_STATE cmdstate);
-	void sendToSocket(int socket, String data);
+    void getParamById(const char *paramName); //try to retrieve the value of the given parameter
+    void setParam(const char *paramName, const char *value); //set the given parameter with the given string
+    void setParam(const char *paramName, int32_t value);
+    void setParam(const char *paramName, int16_t value);
+    void setParam(const char *paramName, uint32_t value);
+    void setParam(const char *paramName, uint16_t value);
+    void setParam(const char *paramName, uint8_t value);
+    void setParam(const char *paramName, float value, int precision);
+    void setParam(const __FlashStringHelper *paramName, const char *value);
+    void sendCmd(const char *cmd);
+	void sendCmd(const char *cmd, ICHIP_COMM_STATE cmdstate);
+	bool sendToSocket(int socket, const char *data);
+	bool sendToSocket(int socket, const uint8_t *data, uint16_t length);
+	bool sendBufferToSocket(int socket, const uint8_t *data, uint16_t length);
+	char *claimCmd();
+	bool commitCmd(char *cmd, int length, ICHIP_COMM_STATE cmdstate);
+	bool commitCmd(char *cmd, int length, ICHIP_COMM_STATE cmdstate, const uint8_t *data, uint16_t dataLength);
+	int queuedCmds();
+	void transmit(ICHIP_COMM_STATE cmdstate);
+	void sendNextCmd();
+	void processLine();
+	void updateParam(const char *name, const char *value);
+	void updateParam(const char *name, int32_t value, uint8_t decimals);
+	void syncParams();
+	void queueTelemetry(uint8_t topic, uint16_t sequence, uint32_t timestamp, const Sample *sample);
+	void replayTelemetry();
+	void updateTelemetryClients();
+	void sendTelemetry();
+	void telemetrySent(bool success);
     void processParameterChange(char *response);
 
     
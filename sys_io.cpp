@@ -31,6 +31,7 @@ by stimmer
 */ 
 
 #include "sys_io.h"
+#include "TimeBase.h"
 
 #undef HID_ENABLED
 
@@ -38,18 +39,22 @@ uint8_t dig[NUM_DIGITAL];
 uint8_t adc[NUM_ANALOG][2];
 uint8_t out[NUM_OUTPUT];
 
-volatile int bufn,obufn;
-volatile uint16_t adc_buf[NUM_ANALOG][256];   // 4 buffers of 256 readings
+volatile int bufn; // buffer DMA is filling right now
+volatile uint32_t adc_blocks; // number of buffers DMA completed, block n is in adc_buf[n & 3]
+volatile uint32_t adc_stamp[4]; // TimeBase stamp when DMA completed block n, in adc_stamp[n & 3]
+uint32_t adc_blocks_read; // number of buffers sys_io_adc_poll processed (or skipped)
+uint32_t adc_dropped; // completed buffers which were overwritten before they could be processed
+bool adc_capture = false; // stream the raw buffers to SerialUSB
+uint32_t adc_capture_dropped; // buffers which couldn't be streamed
+uint32_t adc_capture_full; // of those, buffers dropped because SerialUSB had no room for them
+uint8_t adc_capture_flags; // flags for the next capture frame
+volatile uint16_t adc_buf[NUM_ANALOG][256] __attribute__((aligned(4)));   // 4 buffers of 256 readings
 uint16_t adc_values[NUM_ANALOG * 2];
 uint16_t adc_out_vals[NUM_ANALOG];
 
 
-
-int NumADCSamples;
-
-//the ADC values fluctuate a lot so smoothing is required. 
-uint16_t adc_buffer[NUM_ANALOG][64];
-uint8_t adc_pointer[NUM_ANALOG]; //pointer to next position to use
+//the ADC values fluctuate a lot so smoothing is required. Each channel gets its own filter stage
+ADCFilter adc_filter[NUM_ANALOG];
 
 extern PrefHandler *sysPrefs;
 
@@ -65,17 +70,15 @@ void sys_early_setup() {
 	//the pin tables.
 
 	uint8_t rawadc;
-	sysPrefs->read(EESYS_RAWADC, &rawadc);
+	prefGet<SYSPREF_RAWADC>(sysPrefs, &rawadc);
 	if (rawadc != 0) {
 		useRawADC = true;
 		Logger::info("Using raw ADC mode");
 	}
 	else useRawADC = false;
 
-	NumADCSamples = 64;
-
 	uint8_t sys_type;
-	sysPrefs->read(EESYS_SYSTEM_TYPE, &sys_type);
+	prefGet<SYSPREF_SYSTEM_TYPE>(sysPrefs, &sys_type);
 	if (sys_type == 2) {
 		Logger::info("Running on GEVCU2/DUED hardware.");
 		dig[0]=9; dig[1]=11; dig[2]=12; dig[3]=13;
@@ -85,7 +88,6 @@ void sys_early_setup() {
 		adc[3][0] = 7; adc[3][1] = 6;
 		out[0] = 52; out[1] = 22; out[2] = 48; out[3] = 32;
 		out[4] = 255; out[5] = 255; out[6] = 255; out[7] = 255;
-		NumADCSamples = 32;
 	} else if (sys_type == 3) {
 		Logger::info("Running on GEVCU3 hardware");
 		dig[0]=48; dig[1]=49; dig[2]=50; dig[3]=51;
@@ -115,7 +117,6 @@ void sys_early_setup() {
 		adc[3][0] = 7; adc[3][1] = 6;
 		out[0] = 52; out[1] = 22; out[2] = 48; out[3] = 32;
 		out[4] = 255; out[5] = 255; out[6] = 255; out[7] = 255;
-		NumADCSamples = 32;
 	}
 	
 	for (i = 0; i < NUM_DIGITAL; i++) pinMode(dig[i], INPUT);
@@ -129,10 +130,11 @@ void sys_early_setup() {
 }
 
 /*
-Initialize DMA driven ADC and read in gain/offset for each channel
+Initialize DMA driven ADC and read in gain/offset and the filter settings for each channel
 */
 void setup_sys_io() {
   int i;
+  uint8_t filterType, filterParam, medianSize;
   
   setupFastADC();
 
@@ -141,8 +143,11 @@ void setup_sys_io() {
     sysPrefs->read(EESYS_ADC0_GAIN + 4*i, &adc_comp[i].gain);
     sysPrefs->read(EESYS_ADC0_OFFSET + 4*i, &adc_comp[i].offset);
 	//Logger::debug("ADC:%d GAIN: %d Offset: %d", i, adc_comp[i].gain, adc_comp[i].offset);
-    for (int j = 0; j < NumADCSamples; j++) adc_buffer[i][j] = 0;
-    adc_pointer[i] = 0;
+    sysPrefs->read(EESYS_ADC0_FILTER + 4*i, &filterType);
+    sysPrefs->read(EESYS_ADC0_FILTPARAM + 4*i, &filterParam);
+    sysPrefs->read(EESYS_ADC0_MEDIAN + 4*i, &medianSize);
+    adc_filter[i].setup(filterType, filterParam, medianSize);
+	Logger::debug("ADC:%d filter: %d param: %d median: %d", i, adc_filter[i].getType(), adc_filter[i].getParam(), adc_filter[i].getMedianSize());
     adc_values[i] = 0;
 	adc_out_vals[i] = 0;
   }
@@ -207,22 +212,11 @@ uint16_t getRawADC(uint8_t which) {
 }
 
 /*
-Adds a new ADC reading to the buffer for a channel. The buffer is NumADCSamples large (either 32 or 64) and rolling
-*/
-void addNewADCVal(uint8_t which, uint16_t val) {
-  adc_buffer[which][adc_pointer[which]] = val;
-  adc_pointer[which] = (adc_pointer[which] + 1) % NumADCSamples;
-}
-
-/*
-Take the arithmetic average of the readings in the buffer for each channel. This smooths out the ADC readings
+Get the filter stage of one of the analog inputs, e.g. to change its settings at run time
 */
-uint16_t getADCAvg(uint8_t which) {
-  uint32_t sum;
-  sum = 0;
-  for (int j = 0; j < NumADCSamples; j++) sum += adc_buffer[which][j];
-  sum = sum / NumADCSamples;
-  return ((uint16_t)sum);
+ADCFilter *getADCFilter(uint8_t which) {
+  if (which >= NUM_ANALOG) which = 0;
+  return &adc_filter[which];
 }
 
 /*
@@ -277,9 +271,12 @@ minimal CPU overhead.
 void ADC_Handler(){     // move DMA pointers to next buffer
   int f=ADC->ADC_ISR;
   if (f & (1<<27)){ //receive counter end of buffer
+   //DMA just moved on to the next buffer, queue the one after it
+   adc_stamp[adc_blocks & 3]=TimeBase::getInstance()->getStamp();
    bufn=(bufn+1)&3;
-   ADC->ADC_RNPR=(uint32_t)adc_buf[bufn];
+   ADC->ADC_RNPR=(uintptr_t)adc_buf[(bufn+1)&3];
    ADC->ADC_RNCR=256;  
+   adc_blocks++;
   } 
 }
 
@@ -318,77 +315,197 @@ void setupFastADC(){
   NVIC_EnableIRQ(ADC_IRQn);
   ADC->ADC_IDR=~(1<<27); //dont disable the ADC interrupt for rx end
   ADC->ADC_IER=1<<27; //do enable it
-  ADC->ADC_RPR=(uint32_t)adc_buf[0];   // DMA buffer
+  ADC->ADC_RPR=(uintptr_t)adc_buf[0];   // DMA buffer
   ADC->ADC_RCR=256; //# of samples to take
-  ADC->ADC_RNPR=(uint32_t)adc_buf[1]; // next DMA buffer
+  ADC->ADC_RNPR=(uintptr_t)adc_buf[1]; // next DMA buffer
   ADC->ADC_RNCR=256; //# of samples to take
-  bufn=obufn=0;
+  bufn=0;
+  adc_blocks=adc_blocks_read=adc_dropped=0;
   ADC->ADC_PTCR=1; //enable dma mode
   ADC->ADC_CR=2; //start conversions
 
   Logger::debug("Fast ADC Mode Enabled");
 }
 
+/*
+Sum up the interleaved channels of one DMA buffer, sums[n] gets every sample at position n of
+each round of "channels" samples. The buffer is read as 32 bit words holding two samples each and
+each word is added up as a whole, the two 16 bit lanes can't carry into each other as long as
+no more than 16 12-bit samples are summed per lane. So the packed sums are split every 16 rounds.
+*/
+static void adc_accumulate(volatile uint16_t *buf, uint32_t *sums, uint8_t channels) {
+	const volatile uint32_t *src = (const volatile uint32_t *)buf;
+	uint8_t pairs = channels / 2;
+	uint32_t acc[4];
+
+	for (int block = 0; block < 256 / (channels * 16); block++) {
+		for (int p = 0; p < pairs; p++) acc[p] = 0;
+		for (int round = 0; round < 16; round++) {
+			for (int p = 0; p < pairs; p++) acc[p] += *src++;
+		}
+		for (int p = 0; p < pairs; p++) {
+			sums[2 * p] += acc[p] & 0xFFFF; //lower half word is the earlier sample
+			sums[2 * p + 1] += acc[p] >> 16;
+		}
+	}
+}
+
+/*
+Send one DMA buffer as a capture frame (see sys_io.h for the format). The samples go straight
+from the DMA buffer to SerialUSB, nothing is copied. A frame the USB port didn't take (e.g.
+not connected) is counted as dropped. So is a frame for which the port has less than
+CFG_ADC_CAPTURE_MIN_SPACE free: it is dropped as a whole instead of stalling the poll or
+leaving half a frame in the stream.
+(SerialUSB's bool operator isn't used to check the connection as it delays 10ms on every call)
+*/
+static void adc_capture_block(uint32_t block, uint8_t channels) {
+	ADC_CAPTURE_HEADER header;
+
+	header.magic = ADC_CAPTURE_MAGIC;
+	header.flags = adc_capture_flags;
+	header.channels = channels;
+	header.sequence = block;
+	header.dropped = adc_dropped + adc_capture_dropped;
+	//samples are stored in ascending ADC channel order, 4 channel mode uses AD4 - AD7
+	for (int i = 0; i < 8; i++) {
+		if (i < channels) header.channelMap[i] = (channels == 4 ? i + 4 : i);
+		else header.channelMap[i] = 0xFF;
+	}
+	header.length = sizeof(adc_buf[0]);
+
+	if (SerialUSB.availableForWrite() < CFG_ADC_CAPTURE_MIN_SPACE) {
+		adc_capture_dropped++;
+		adc_capture_full++;
+		adc_capture_flags |= ADC_CAPTURE_FLAG_GAP;
+		return;
+	}
+	adc_capture_flags = 0;
+
+	if (SerialUSB.write((const uint8_t *)&header, sizeof(header)) != sizeof(header)
+			|| SerialUSB.write((const uint8_t *)adc_buf[block & 3], sizeof(adc_buf[0])) != sizeof(adc_buf[0])) {
+		adc_capture_dropped++;
+		adc_capture_flags |= ADC_CAPTURE_FLAG_GAP;
+	}
+}
+
+/*
+Start or stop streaming the raw ADC buffers to SerialUSB
+*/
+void setADCCapture(bool enable) {
+	if (enable && !adc_capture) {
+		adc_capture_dropped = adc_capture_full = 0;
+		adc_capture_flags = ADC_CAPTURE_FLAG_START;
+	}
+	adc_capture = enable;
+}
+
+bool isADCCapturing() {
+	return adc_capture;
+}
+
+//number of buffers which couldn't be streamed since the capture was started (not counting getADCDroppedBuffers)
+uint32_t getADCCaptureDropped() {
+	return adc_capture_dropped;
+}
+
+//number of buffers which were dropped because SerialUSB had no room for them (included in getADCCaptureDropped)
+uint32_t getADCCaptureFull() {
+	return adc_capture_full;
+}
+
 //polls	for the end of an adc conversion event. Then processe buffer to extract the averaged
-//value. It takes this value and averages it with the existing value in an 8 position buffer
+//value. It takes this value and passes it through the channel's filter into a buffer
 //which serves as a super fast place for other code to retrieve ADC values
+//Every buffer DMA completed since the last poll is processed in order, buffers which were
+//already overwritten are counted (see getADCDroppedBuffers)
 // This is only used when RAWADC is not defined
 void sys_io_adc_poll() {
-	if (obufn != bufn) {
+	uint8_t channels = (useRawADC ? 4 : 8);
+
+	while (adc_blocks_read != adc_blocks) {
 		uint32_t tempbuff[8] = {0,0,0,0,0,0,0,0}; //make sure its zero'd
-	
-		//the eight or four enabled adcs are interleaved in the buffer
-		//this is a somewhat unrolled for loop with no incrementer. it's odd but it works
-		if (useRawADC) {
-			for (int i = 0; i < 256;) {	   
-				tempbuff[3] += adc_buf[obufn][i++];
-				tempbuff[2] += adc_buf[obufn][i++];
-				tempbuff[1] += adc_buf[obufn][i++];
-				tempbuff[0] += adc_buf[obufn][i++];
-			}
-		}	
-		else {
-			for (int i = 0; i < 256;) {	   
-				tempbuff[7] += adc_buf[obufn][i++];
-				tempbuff[6] += adc_buf[obufn][i++];
-				tempbuff[5] += adc_buf[obufn][i++];
-				tempbuff[4] += adc_buf[obufn][i++];
-				tempbuff[3] += adc_buf[obufn][i++];
-				tempbuff[2] += adc_buf[obufn][i++];
-				tempbuff[1] += adc_buf[obufn][i++];
-				tempbuff[0] += adc_buf[obufn][i++];
-			}
+		uint32_t sums[8] = {0,0,0,0,0,0,0,0};
+		uint32_t stamp;
+
+		//only the two buffers before the one DMA is filling are safe, older ones were overwritten
+		if (adc_blocks - adc_blocks_read > 2) {
+			adc_dropped += adc_blocks - adc_blocks_read - 2;
+			adc_blocks_read = adc_blocks - 2;
+			adc_capture_flags |= ADC_CAPTURE_FLAG_GAP;
 		}
 
-		//for (int i = 0; i < 256;i++) Logger::debug("%i - %i", i, adc_buf[obufn][i]);
+		if (adc_capture) adc_capture_block(adc_blocks_read, channels);
+		stamp = adc_stamp[adc_blocks_read & 3];
+		adc_accumulate(adc_buf[adc_blocks_read & 3], sums, channels);
+
+		//if DMA moved on into this buffer while we were reading it the sums are garbage
+		if (adc_blocks - adc_blocks_read > 2) {
+			adc_dropped++;
+			adc_blocks_read++;
+			if (adc_capture) adc_capture_flags |= ADC_CAPTURE_FLAG_TORN;
+			continue;
+		}
+		adc_blocks_read++;
+
+		//the eight or four enabled adcs are interleaved in the buffer, highest first
+		for (int j = 0; j < channels; j++) tempbuff[j] = sums[channels - 1 - j];
+
+		//for (int i = 0; i < 256;i++) Logger::debug("%i - %i", i, adc_buf[(adc_blocks_read - 1) & 3][i]);
 
 		//now, all of the ADC values are summed over 32/64 readings. So, divide by 32/64 (shift by 5/6) to get the average
-		//then add that to the old value we had stored and divide by two to average those. Lots of averaging going on.
 		if (useRawADC) {
-			for (int j = 0; j < 4; j++) {
-				adc_values[j] += (tempbuff[j] >> 6);
-				adc_values[j] = adc_values[j] >> 1;
-			}
+			for (int j = 0; j < 4; j++) adc_values[j] = tempbuff[j] >> 6;
 		}
 		else {
 			for (int j = 0; j < 8; j++) {
-				adc_values[j] += (tempbuff[j] >> 5);
-				adc_values[j] = adc_values[j] >> 1;
+				adc_values[j] = tempbuff[j] >> 5;
 				//Logger::debug("A%i: %i", j, adc_values[j]);
 			}
 		}
-    
+
+		//then correct gain/offset and run the result of every buffer through the channel's filter
 		for (int i = 0; i < NUM_ANALOG; i++) {
 			int val;
 			if (useRawADC) val = getRawADC(i); 
 				else val = getDiffADC(i);
-//			addNewADCVal(i, val);
-//			adc_out_vals[i] = getADCAvg(i);
-			adc_out_vals[i] = val;
+			adc_out_vals[i] = adc_filter[i].process(val);
 		}
 
-		obufn = bufn;    
+		Sample *sample = SampleBus::getInstance()->claim(TOPIC_ADC);
+		for (int i = 0; i < NUM_ANALOG; i++) sample->value[i] = adc_out_vals[i];
+		sample->count = NUM_ANALOG;
+		//stamped with the time DMA completed this buffer, not with the time of the poll
+		SampleBus::getInstance()->publish(TOPIC_ADC, SYSTEM, stamp);
 	}
 }
 
+//number of completed DMA buffers which were overwritten before sys_io_adc_poll got to them
+uint32_t getADCDroppedBuffers() {
+	return adc_dropped;
+}
+
+//number of DMA buffers completed since setupFastADC
+uint32_t getADCBlockCount() {
+	return adc_blocks;
+}
+
+//number of completed DMA buffers sys_io_adc_poll hasn't processed yet
+uint32_t getADCPendingBlocks() {
+	return adc_blocks - adc_blocks_read;
+}
+
+//cycles sys_io_adc_poll spends on one DMA buffer: summing it up and filtering (copies of) the channels
+uint32_t measureADCBlock() {
+	uint8_t channels = (useRawADC ? 4 : 8);
+	uint32_t sums[8] = {0,0,0,0,0,0,0,0};
+	ADCFilter filters[NUM_ANALOG];
+	uint32_t start;
+
+	for (int i = 0; i < NUM_ANALOG; i++) filters[i] = adc_filter[i];
+	start = DWT->CYCCNT;
+	adc_accumulate(adc_buf[(adc_blocks - 1) & 3], sums, channels);
+	for (int i = 0; i < NUM_ANALOG; i++) filters[i].process(sums[i] >> 5);
+	return DWT->CYCCNT - start;
+}
+
 
@@ -34,12 +34,45 @@ SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
 #include "config.h"
 #include "eeprom_layout.h"
 #include "PrefHandler.h"
+#include "PrefLayout.h"
+#include "ADCFilter.h"
+#include "SampleBus.h"
 
 typedef struct {
   uint16_t offset;
   uint16_t gain;
 } ADC_COMP;
 
+/*
+Raw ADC capture frames as sent to SerialUSB by setADCCapture(true). All fields are little endian:
+
+  magic       2 bytes  0xAD 0xC5 (ADC_CAPTURE_MAGIC), resync on it as console output may be mixed in
+  flags       1 byte   ADC_CAPTURE_FLAG_* bits
+  channels    1 byte   number of interleaved channels (4 or 8)
+  sequence    4 bytes  DMA block number, increments by one per block, gaps mean dropped blocks
+  dropped     4 bytes  total blocks dropped so far (overrun before processing + not streamed)
+  channelMap  8 bytes  ADC channel number of each sample position in a round, 0xFF if unused
+  length      2 bytes  payload length in bytes (512)
+  payload              length / 2 16-bit samples, positions 0..channels-1 repeating
+
+Each block holds 256 samples taken back to back (~12us apart, see setupFastADC).
+tools/adc_capture.py decodes, records and plots the stream.
+*/
+#define ADC_CAPTURE_MAGIC		0xC5AD
+#define ADC_CAPTURE_FLAG_START	0x01 // first frame after the capture was started
+#define ADC_CAPTURE_FLAG_GAP	0x02 // blocks were dropped right before this one
+#define ADC_CAPTURE_FLAG_TORN	0x04 // DMA overwrote the previous frame's samples while it was being sent
+
+typedef struct {
+  uint16_t magic;
+  uint8_t flags;
+  uint8_t channels;
+  uint32_t sequence;
+  uint32_t dropped;
+  uint8_t channelMap[8];
+  uint16_t length;
+} __attribute__((packed)) ADC_CAPTURE_HEADER;
+
 void setup_sys_io();
 uint16_t getAnalog(uint8_t which); //get value of one of the 4 analog inputs
 uint16_t getDiffADC(uint8_t which);
@@ -49,6 +82,15 @@ void setOutput(uint8_t which, boolean active); //set output high or not
 boolean getOutput(uint8_t which); //get current value of output state (high?)
 void setupFastADC();
 void sys_io_adc_poll();
+uint32_t getADCDroppedBuffers();
+uint32_t getADCBlockCount();
+uint32_t getADCPendingBlocks();
+uint32_t measureADCBlock();
+ADCFilter *getADCFilter(uint8_t which);
+void setADCCapture(bool enable);
+bool isADCCapturing();
+uint32_t getADCCaptureDropped();
+uint32_t getADCCaptureFull();
 void sys_early_setup();
 
 
@@ -0,0 +1,204 @@
+#!/usr/bin/env python3
+"""
+adc_capture.py
+
+Decode (and optionally plot) the raw ADC capture stream which the firmware sends to
+SerialUSB after the console command 'a' (see setADCCapture() and ADC_CAPTURE_HEADER
+in sys_io.h for the frame format).
+
+  adc_capture.py /dev/ttyACM0 --start --csv capture.csv
+  adc_capture.py capture.bin --plot
+
+The input is either a serial port (needs pyserial) or a file holding a recorded stream.
+Console output mixed into the stream is skipped (or shown with --text) by resyncing on
+the frame magic.
+
+Copyright (c) 2013 Collin Kidder, Michael Neuweiler, Charles Galpin
+
+Permission is hereby granted, free of charge, to any person obtaining
+a copy of this software and associated documentation files (the
+"Software"), to deal in the Software without restriction, including
+without limitation the rights to use, copy, modify, merge, publish,
+distribute, sublicense, and/or sell copies of the Software, and to
+permit persons to whom the Software is furnished to do so, subject to
+the following conditions:
+
+The above copyright notice and this permission notice shall be included
+in all copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.
+IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY
+CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT,
+TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE
+SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+"""
+
+import argparse
+import os
+import struct
+import sys
+
+# must match sys_io.h
+MAGIC = b'\xad\xc5'  # ADC_CAPTURE_MAGIC 0xC5AD, little endian
+HEADER = struct.Struct('<HBBII8sH')  # magic, flags, channels, sequence, dropped, channelMap, length
+FLAG_START = 0x01
+FLAG_GAP = 0x02
+FLAG_TORN = 0x04
+MAX_LENGTH = 4096  # anything longer is not a frame but text which happened to look like the magic
+SAMPLE_PERIOD = 12e-6  # about 12us between two samples of a block, see setupFastADC()
+
+
+class Frame(object):
+    def __init__(self, flags, channels, sequence, dropped, channel_map, samples):
+        self.flags = flags
+        self.channels = channels
+        self.sequence = sequence
+        self.dropped = dropped
+        self.channel_map = [c for c in channel_map[:channels]]
+        self.samples = samples
+
+    def channel(self, position):
+        """samples of one position of the interleaved rounds"""
+        return self.samples[position::self.channels]
+
+
+class Decoder(object):
+    """Feed raw bytes, get complete frames. Bytes which aren't part of a frame go to text."""
+
+    def __init__(self, text=None):
+        self.buffer = bytearray()
+        self.text = text
+
+    def _skip(self, count):
+        if self.text is not None and count > 0:
+            self.text(bytes(self.buffer[:count]))
+        del self.buffer[:count]
+
+    def feed(self, data):
+        self.buffer += data
+        frames = []
+        while True:
+            start = self.buffer.find(MAGIC)
+            if start < 0:
+                # keep a trailing first magic byte, the second one may still come
+                self._skip(len(self.buffer) - (1 if self.buffer.endswith(MAGIC[:1]) else 0))
+                return frames
+            self._skip(start)
+            if len(self.buffer) < HEADER.size:
+                return frames
+            magic, flags, channels, sequence, dropped, channel_map, length = HEADER.unpack_from(self.buffer)
+            if channels not in (4, 8) or length == 0 or length % 2 or length > MAX_LENGTH:
+                self._skip(1)  # false magic, resync past it
+                continue
+            if len(self.buffer) < HEADER.size + length:
+                return frames
+            samples = struct.unpack_from('<%dH' % (length // 2), self.buffer, HEADER.size)
+            del self.buffer[:HEADER.size + length]
+            frames.append(Frame(flags, channels, sequence, dropped, bytearray(channel_map), samples))
+
+
+class Stats(object):
+    def __init__(self):
+        self.frames = 0
+        self.missing = 0
+        self.torn = 0
+        self.last = None
+        self.dropped = 0
+
+    def add(self, frame):
+        if frame.flags & FLAG_START:
+            self.last = None
+        if self.last is not None and frame.sequence != (self.last + 1) & 0xFFFFFFFF:
+            self.missing += (frame.sequence - self.last - 1) & 0xFFFFFFFF
+        if frame.flags & FLAG_TORN:
+            self.torn += 1
+        self.last = frame.sequence
+        self.dropped = frame.dropped
+        self.frames += 1
+
+    def __str__(self):
+        return '%d frames, %d blocks missing in the sequence, %d torn, firmware dropped %d' % (
+            self.frames, self.missing, self.torn, self.dropped)
+
+
+def open_input(name, start):
+    if os.path.exists(name) and not name.startswith('/dev/') and not name.upper().startswith('COM'):
+        return open(name, 'rb'), None
+    import serial  # pyserial, only needed for a live capture
+    port = serial.Serial(name, 115200, timeout=0.5)
+    if start:
+        port.write(b'a\n')
+    return port, port
+
+
+def main():
+    parser = argparse.ArgumentParser(description='Decode the raw ADC capture stream of the firmware')
+    parser.add_argument('input', help='serial port or recorded stream')
+    parser.add_argument('--start', action='store_true', help='toggle the capture on (and off again at the end)')
+    parser.add_argument('--frames', type=int, default=0, help='stop after this many frames')
+    parser.add_argument('--raw', help='also record the undecoded stream to this file')
+    parser.add_argument('--csv', help='write "sequence,position,adc channel,sample" lines to this file')
+    parser.add_argument('--plot', action='store_true', help='plot every channel (needs matplotlib)')
+    parser.add_argument('--text', action='store_true', help='show console output found between frames')
+    args = parser.parse_args()
+
+    text = (lambda data: sys.stderr.write(data.decode('ascii', 'replace'))) if args.text else None
+    decoder = Decoder(text)
+    stats = Stats()
+    source, port = open_input(args.input, args.start)
+    raw = open(args.raw, 'wb') if args.raw else None
+    csv = open(args.csv, 'w') if args.csv else None
+    series = {}
+
+    try:
+        while not args.frames or stats.frames < args.frames:
+            data = source.read(4096)
+            if not data:
+                if port is None:
+                    break
+                continue
+            if raw:
+                raw.write(data)
+            for frame in decoder.feed(data):
+                if frame.flags & (FLAG_GAP | FLAG_TORN) and stats.frames:
+                    sys.stderr.write('sequence %d: %s\n' % (frame.sequence,
+                            'torn' if frame.flags & FLAG_TORN else 'gap before'))
+                stats.add(frame)
+                for position in range(frame.channels):
+                    values = frame.channel(position)
+                    if csv:
+                        for value in values:
+                            csv.write('%d,%d,%d,%d\n' % (frame.sequence, position, frame.channel_map[position], value))
+                    if args.plot:
+                        series.setdefault(frame.channel_map[position], []).append((frame.sequence, values))
+                if args.frames and stats.frames >= args.frames:
+                    break
+    except KeyboardInterrupt:
+        pass
+    finally:
+        if port is not None and args.start:
+            port.write(b'a\n')
+
+    sys.stderr.write('%s\n' % stats)
+
+    if args.plot and series:
+        import matplotlib.pyplot as plt
+        for channel, blocks in sorted(series.items()):
+            first = blocks[0][0]
+            xs, ys = [], []
+            for sequence, values in blocks:
+                # blocks are placed by their sequence number so dropped ones show up as gaps
+                base = ((sequence - first) & 0xFFFFFFFF) * len(values)
+                xs.extend((base + n) * SAMPLE_PERIOD * len(series) for n in range(len(values)))
+                ys.extend(values)
+            plt.plot(xs, ys, '.', markersize=1, label='AD%d' % channel)
+        plt.xlabel('s')
+        plt.ylabel('raw 12 bit')
+        plt.legend()
+        plt.show()
+
+
+if __name__ == '__main__':
+    main()
@@ -0,0 +1,227 @@
+#!/usr/bin/env python3
+"""
+log_decode.py
+
+Turn the binary log records of the firmware (LOGBINARY=1, see the record format in
+Logger.h) back into the text lines Logger would have printed. The format strings are
+looked up by their flash address in the ELF file the firmware was built from, so it
+must be exactly the build which is running on the board.
+
+  log_decode.py Sensirion.ino.elf /dev/ttyACM0
+  log_decode.py Sensirion.ino.elf recorded.bin > recorded.txt
+
+The input is a serial port (needs pyserial), a file or '-' for stdin. Text output and
+console lines in between the records are passed through unchanged.
+
+Copyright (c) 2013 Collin Kidder, Michael Neuweiler, Charles Galpin
+
+Permission is hereby granted, free of charge, to any person obtaining
+a copy of this software and associated documentation files (the
+"Software"), to deal in the Software without restriction, including
+without limitation the rights to use, copy, modify, merge, publish,
+distribute, sublicense, and/or sell copies of the Software, and to
+permit persons to whom the Software is furnished to do so, subject to
+the following conditions:
+
+The above copyright notice and this permission notice shall be included
+in all copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.
+IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY
+CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT,
+TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE
+SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+"""
+
+import argparse
+import os
+import struct
+import sys
+
+# must match Logger.h
+MARKER = 0xB5  # LOG_BINARY_MARKER
+TRUNCATED = 0x80  # LOG_BINARY_TRUNCATED
+HEADER = struct.Struct('<BHII')  # flags, DeviceId, time stamp, format address
+FLASH_END = 0x20000000  # LOG_BINARY_FLASH_END
+INT_FORMATS = 'dixXbBlctT'  # 4 byte arguments
+
+LEVELS = ['DEBUG', 'INFO', 'WARNING', 'ERROR']
+
+# must match Logger::printDeviceName(), others are shown by their number
+DEVICE_NAMES = {
+    0x1040: 'ICHIP',
+    0x5000: 'SYSTEM',
+    0x5001: 'HEARTBEAT',
+    0x5002: 'MEMCACHE',
+}
+
+SHT_PROGBITS = 1
+SHF_ALLOC = 0x2
+
+
+class StringTable(object):
+    """
+    The initialised, allocated sections of an ELF32 little endian file. The Due linker
+    script puts .rodata into the .text output section, the lookup only cares about the
+    address so either is fine.
+    """
+
+    def __init__(self, path):
+        with open(path, 'rb') as f:
+            data = f.read()
+        if data[:4] != b'\x7fELF' or data[4] != 1 or data[5] != 1:
+            raise ValueError('%s is not a little endian ELF32 file' % path)
+        shoff, = struct.unpack_from('<I', data, 0x20)
+        shentsize, shnum = struct.unpack_from('<HH', data, 0x2E)
+        self.sections = []
+        for n in range(shnum):
+            name, kind, flags, addr, offset, size = struct.unpack_from('<IIIIII', data, shoff + n * shentsize)
+            if kind == SHT_PROGBITS and flags & SHF_ALLOC and addr < FLASH_END and size:
+                self.sections.append((addr, data[offset:offset + size]))
+
+    def lookup(self, address):
+        for start, content in self.sections:
+            if start <= address < start + len(content):
+                end = content.find(b'\0', address - start)
+                if end < 0:
+                    end = len(content)
+                return content[address - start:end].decode('latin-1')
+        return None
+
+
+def to_signed(value):
+    return value - (1 << 32) if value & 0x80000000 else value
+
+
+def format_message(fmt, args):
+    """
+    Format like Logger::logMessage(). args is the argument part of the record, returns the
+    text and whether all arguments were there.
+    """
+    out = []
+    pos = 0
+    n = 0
+    while n < len(fmt):
+        c = fmt[n]
+        n += 1
+        if c != '%':
+            out.append(c)
+            continue
+        if n >= len(fmt):
+            break
+        c = fmt[n]
+        n += 1
+        if c == '%':
+            out.append('%')
+            continue
+        if c in INT_FORMATS or c == 'f':
+            if pos + 4 > len(args):
+                return ''.join(out), False
+            raw = args[pos:pos + 4]
+            pos += 4
+            value, = struct.unpack('<I', raw)
+            if c in 'dil':
+                out.append('%d' % to_signed(value))
+            elif c == 'c':
+                out.append('%d' % to_signed(value))  # Logger prints %c as a number, so does this
+            elif c in 'xX':
+                out.append(('0x' if c == 'X' else '') + '%X' % value)
+            elif c in 'bB':
+                out.append(('0b' if c == 'B' else '') + bin(value)[2:])
+            elif c == 't':
+                out.append('T' if value == 1 else 'F')
+            elif c == 'T':
+                out.append('true' if value == 1 else 'false')
+            else:
+                out.append('%.2f' % struct.unpack('<f', raw)[0])
+            continue
+        if c == 's':
+            if pos + 1 > len(args) or pos + 1 + args[pos] > len(args):
+                return ''.join(out), False
+            length = args[pos]
+            out.append(args[pos + 1:pos + 1 + length].decode('latin-1'))
+            pos += 1 + length
+            continue
+        out.append(c)  # unknown conversions print the character, like Logger
+    return ''.join(out), True
+
+
+def decode_record(strings, body):
+    flags, device, stamp, address = HEADER.unpack_from(body)
+    level = flags & 0x07
+    line = '%d - %s: ' % (stamp, LEVELS[level] if level < len(LEVELS) else 'LEVEL%d' % level)
+    if device:
+        line += '%s - ' % DEVICE_NAMES.get(device, '0x%04X' % device)
+    fmt = strings.lookup(address)
+    if fmt is None:
+        return line + '<unknown format 0x%08X, wrong ELF file?>' % address
+    text, complete = format_message(fmt, body[HEADER.size:])
+    if flags & TRUNCATED or not complete:
+        text += ' <truncated>'
+    return line + text
+
+
+def decode(strings, source, out):
+    buffer = bytearray()
+    while True:
+        data = source.read(256)
+        if not data:
+            if not getattr(source, 'is_serial', False):
+                break
+            continue
+        buffer += data
+        while buffer:
+            start = buffer.find(bytes([MARKER]))
+            if start < 0:
+                start = len(buffer)
+            if start:
+                out.write(buffer[:start].decode('latin-1'))
+                del buffer[:start]
+                continue
+            if len(buffer) < 2 or len(buffer) < 2 + buffer[1]:
+                break  # record not complete yet
+            length = buffer[1]
+            if length < HEADER.size:
+                out.write(buffer[:1].decode('latin-1'))
+                del buffer[:1]
+                continue
+            out.write(decode_record(strings, bytes(buffer[2:2 + length])) + '\n')
+            del buffer[:2 + length]
+        out.flush()
+    out.write(buffer.decode('latin-1'))
+
+
+class SerialSource(object):
+    is_serial = True
+
+    def __init__(self, name):
+        import serial  # pyserial, only needed to read a live port
+        self.port = serial.Serial(name, 115200, timeout=0.5)
+
+    def read(self, count):
+        return self.port.read(count)
+
+
+def main():
+    parser = argparse.ArgumentParser(description='Decode the binary log records of the firmware')
+    parser.add_argument('elf', help='ELF file of the running firmware')
+    parser.add_argument('input', nargs='?', default='-', help='serial port, recorded stream or - for stdin')
+    args = parser.parse_args()
+
+    strings = StringTable(args.elf)
+    if args.input == '-':
+        source = sys.stdin.buffer
+    elif os.path.exists(args.input) and not args.input.startswith('/dev/'):
+        source = open(args.input, 'rb')
+    else:
+        source = SerialSource(args.input)
+    try:
+        decode(strings, source, sys.stdout)
+    except KeyboardInterrupt:
+        pass
+
+
+if __name__ == '__main__':
+    main()